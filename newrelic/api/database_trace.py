@@ -236,7 +236,7 @@ class DatabaseTrace(TimeTrace):
             host=self.host,
             port_path_or_id=self.port_path_or_id,
             database_name=self.database_name,
-            guid=self.guid,
+            guid=self._guid,
             agent_attributes=self.agent_attributes,
             user_attributes=self.user_attributes,
         )
@@ -60,7 +60,7 @@ class ExternalTrace(CatHeaderMixin, TimeTrace):
             duration=self.duration,
             exclusive=self.exclusive,
             params=self.params,
-            guid=self.guid,
+            guid=self._guid,
             agent_attributes=self.agent_attributes,
             user_attributes=self.user_attributes,
         )
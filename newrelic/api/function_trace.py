@@ -83,7 +83,7 @@ class FunctionTrace(TimeTrace):
             label=self.label,
             params=self.params,
             rollup=self.rollup,
-            guid=self.guid,
+            guid=self._guid,
             agent_attributes=self.agent_attributes,
             user_attributes=self.user_attributes,
         )
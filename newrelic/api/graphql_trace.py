@@ -83,7 +83,7 @@ class GraphQLOperationTrace(TimeTrace):
             end_time=self.end_time,
             duration=self.duration,
             exclusive=self.exclusive,
-            guid=self.guid,
+            guid=self._guid,
             agent_attributes=self.agent_attributes,
             user_attributes=self.user_attributes,
             operation_name=self.operation_name,
@@ -175,7 +175,7 @@ class GraphQLResolverTrace(TimeTrace):
             end_time=self.end_time,
             duration=self.duration,
             exclusive=self.exclusive,
-            guid=self.guid,
+            guid=self._guid,
             agent_attributes=self.agent_attributes,
             user_attributes=self.user_attributes,
             product=self.product,
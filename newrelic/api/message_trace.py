@@ -84,7 +84,7 @@ class MessageTrace(CatHeaderMixin, TimeTrace):
             destination_name=self.destination_name,
             destination_type=self.destination_type,
             params=self.params,
-            guid=self.guid,
+            guid=self._guid,
             agent_attributes=self.agent_attributes,
             user_attributes=self.user_attributes,
         )
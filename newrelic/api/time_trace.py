@@ -13,13 +13,13 @@
 # limitations under the License.
 
 import logging
-import random
 import sys
 import time
 import traceback
 import warnings
 
 from newrelic.api.settings import STRIP_EXCEPTION_MESSAGE
+from newrelic.common.encoding_utils import generate_span_id
 from newrelic.common.object_names import parse_exc_info
 from newrelic.core.attribute import MAX_NUM_USER_ATTRIBUTES, process_user_attribute
 from newrelic.core.config import is_expected_error, should_ignore_error
@@ -28,7 +28,22 @@ from newrelic.core.trace_cache import trace_cache
 _logger = logging.getLogger(__name__)
 
 
-class TimeTrace(object):
+def _log_exit_before_enter(trace):
+    _logger.error(
+        "Runtime instrumentation error. The __exit__() "
+        "method of %r was called prior to __enter__() being "
+        "called. Report this issue to New Relic support.\n%s",
+        trace,
+        "".join(traceback.format_stack()[:-1]),
+    )
+
+
+class _TimeTraceBase(object):
+    """Pure Python implementation of the trace state and context manager
+    protocol, which is also provided by the optional C extension.
+
+    """
+
     def __init__(self, parent=None):
         self.parent = parent
         self.root = None
@@ -46,25 +61,22 @@ class TimeTrace(object):
         self.min_child_start_time = float("inf")
         self.exc_data = (None, None, None)
         self.should_record_segment_params = False
-        # 16-digit random hex. Padded with zeros in the front.
-        self.guid = "%016x" % random.getrandbits(64)
+        self._guid = None
         self.agent_attributes = {}
         self.user_attributes = {}
 
     @property
-    def transaction(self):
-        return self.root and self.root.transaction
-
-    @property
-    def settings(self):
-        transaction = self.transaction
-        return transaction and transaction.settings
-
-    def _is_leaf(self):
-        return self.child_count == len(self.children)
-
-    def __repr__(self):
-        return "<%s object at 0x%x %s>" % (self.__class__.__name__, id(self), dict(name=getattr(self, "name", None)))
+    def guid(self):
+        # The guid is only generated when first needed. Where it has not
+        # been used by the time the trace completes, the node is passed
+        # None and generates one only if a span event is created.
+        if self._guid is None:
+            self._guid = generate_span_id()
+        return self._guid
+
+    @guid.setter
+    def guid(self, value):
+        self._guid = value
 
     def __enter__(self):
         self.parent = parent = self.parent or current_trace()
@@ -121,14 +133,7 @@ class TimeTrace(object):
         # __exit__() is called before __enter__().
 
         if not self.activated:
-            _logger.error(
-                "Runtime instrumentation error. The __exit__() "
-                "method of %r was called prior to __enter__() being "
-                "called. Report this issue to New Relic support.\n%s",
-                self,
-                "".join(traceback.format_stack()[:-1]),
-            )
-
+            _log_exit_before_enter(self)
             return
 
         transaction = self.root.transaction
@@ -178,6 +183,56 @@ class TimeTrace(object):
             # we may have children still running if we're async
             trace_cache().pop_current(self)
 
+    def has_outstanding_children(self):
+        return len(self.children) != self.child_count
+
+    def _ready_to_complete(self):
+        # we shouldn't continue if we're still running
+        if not self.exited:
+            return False
+
+        # defer node completion until all children have exited
+        if self.has_outstanding_children():
+            return False
+
+        return True
+
+    def increment_child_count(self):
+        self.child_count += 1
+
+        # if there's more than 1 child node outstanding
+        # then the children are async w.r.t each other
+        if (self.child_count - len(self.children)) > 1:
+            self.has_async_children = True
+        # else, the current trace that's being scheduled is not going to be
+        # async. note that this implies that all previous traces have
+        # completed
+        else:
+            self.has_async_children = False
+
+
+try:
+    from newrelic.core._time_trace import TimeTrace as TimeTraceBase
+except ImportError:
+    TimeTraceBase = _TimeTraceBase
+
+
+class TimeTrace(TimeTraceBase):
+    @property
+    def transaction(self):
+        return self.root and self.root.transaction
+
+    @property
+    def settings(self):
+        transaction = self.transaction
+        return transaction and transaction.settings
+
+    def _is_leaf(self):
+        return self.child_count == len(self.children)
+
+    def __repr__(self):
+        return "<%s object at 0x%x %s>" % (self.__class__.__name__, id(self), dict(name=getattr(self, "name", None)))
+
     def add_custom_attribute(self, key, value):
         settings = self.settings
         if not settings:
@@ -369,20 +424,6 @@ class TimeTrace(object):
     def _add_agent_attribute(self, key, value):
         self.agent_attributes[key] = value
 
-    def has_outstanding_children(self):
-        return len(self.children) != self.child_count
-
-    def _ready_to_complete(self):
-        # we shouldn't continue if we're still running
-        if not self.exited:
-            return False
-
-        # defer node completion until all children have exited
-        if self.has_outstanding_children():
-            return False
-
-        return True
-
     def complete_trace(self):
         # This function is called only by children in the case that the node
         # creation has been deferred. _ready_to_complete should only return
@@ -515,19 +556,6 @@ class TimeTrace(object):
         else:
             self.exclusive -= node.duration
 
-    def increment_child_count(self):
-        self.child_count += 1
-
-        # if there's more than 1 child node outstanding
-        # then the children are async w.r.t each other
-        if (self.child_count - len(self.children)) > 1:
-            self.has_async_children = True
-        # else, the current trace that's being scheduled is not going to be
-        # async. note that this implies that all previous traces have
-        # completed
-        else:
-            self.has_async_children = False
-
     def get_linking_metadata(self):
         metadata = {
             "entity.type": "SERVICE",
@@ -40,7 +40,9 @@ from newrelic.common.encoding_utils import (
     convert_to_cat_metadata_value,
     deobfuscate,
     ensure_str,
+    format_trace_context,
     generate_path_hash,
+    generate_trace_id,
     json_decode,
     json_encode,
     obfuscate,
@@ -259,7 +261,7 @@ class Transaction(object):
 
         self.rum_token = None
 
-        trace_id = "%032x" % random.getrandbits(128)
+        trace_id = generate_trace_id()
 
         # 16-digit random hex. Padded with zeros in the front.
         self.guid = trace_id[:16]
@@ -363,7 +365,7 @@ class Transaction(object):
         # For now we only do this if we know it is an
         # actual thread and not a greenlet.
 
-        if not hasattr(sys, "_current_frames") or self.thread_id in sys._current_frames():
+        if not hasattr(sys, "_current_frames") or trace_cache().is_thread(self.thread_id):
             try:
                 thread_instance = threading.current_thread()
             except TypeError:
@@ -1062,12 +1064,8 @@ class Transaction(object):
             data = data or self._create_distributed_trace_data()
             if data:
 
-                traceparent = W3CTraceParent(data).text()
+                traceparent, tracestate = format_trace_context(data, self.tracestate)
                 yield ("traceparent", traceparent)
-
-                tracestate = NrTraceState(data).text()
-                if self.tracestate:
-                    tracestate += "," + self.tracestate
                 yield ("tracestate", tracestate)
 
                 self._record_supportability("Supportability/TraceContext/Create/Success")
@@ -1253,11 +1251,10 @@ class Transaction(object):
             if tracestate:
                 tracestate = ensure_str(tracestate)
                 try:
-                    vendors = W3CTraceState.decode(tracestate)
                     tk = self._settings.trusted_account_key
-                    payload = vendors.pop(tk + "@nr", "")
-                    self.tracing_vendors = ",".join(vendors.keys())
-                    self.tracestate = vendors.text(limit=31)
+                    payload, self.tracing_vendors, self.tracestate = W3CTraceState.split_entry(
+                        tracestate, tk + "@nr"
+                    )
                 except:
                     self._record_supportability("Supportability/TraceContext/TraceState/Parse/Exception")
                 else:
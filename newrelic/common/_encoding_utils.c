@@ -0,0 +1,2134 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native JSON encoder producing exactly the same output as json_encode()
+ * in encoding_utils.py does through json.dumps(), that is, with compact
+ * separators, all non ASCII characters escaped, byte strings interpreted
+ * as Latin-1, and generators and other iterables encoded as lists. The
+ * output is written incrementally into a single growable buffer, with no
+ * calls back into Python for any of the types found in payloads. When a
+ * write callable is supplied, the buffer is instead passed to it in chunks
+ * as it fills, so the complete output is never held in memory at once.
+ *
+ * The parsing and formatting of W3C trace context headers, which is done
+ * for every request in a distributed trace, is also implemented here, as
+ * is the XOR cipher used to obfuscate cross application tracing headers.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#include <float.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    char *data;
+    Py_ssize_t length;
+    Py_ssize_t capacity;
+
+    /*
+     * Containers currently being encoded, used to detect circular
+     * references in the same way as the markers used by json.dumps().
+     */
+
+    PyObject **active;
+    Py_ssize_t depth;
+    Py_ssize_t active_capacity;
+
+    /*
+     * Callable to which the output is passed once at least chunk_size
+     * bytes have been written, or NULL if it is to be returned whole.
+     */
+
+    PyObject *write;
+    Py_ssize_t chunk_size;
+} NRJSONEncoder;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* ------------------------------------------------------------------------- */
+
+static int NRJSONEncoder_init(NRJSONEncoder *self)
+{
+    self->capacity = 1024;
+    self->length = 0;
+    self->data = PyMem_Malloc(self->capacity);
+
+    self->active = NULL;
+    self->depth = 0;
+    self->active_capacity = 0;
+
+    self->write = NULL;
+    self->chunk_size = 0;
+
+    if (!self->data) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    return 0;
+}
+
+static void NRJSONEncoder_free(NRJSONEncoder *self)
+{
+    PyMem_Free(self->data);
+    PyMem_Free(self->active);
+
+    self->data = NULL;
+    self->active = NULL;
+}
+
+static int NRJSONEncoder_reserve(NRJSONEncoder *self, Py_ssize_t size)
+{
+    Py_ssize_t capacity;
+    char *data;
+
+    if (self->length + size <= self->capacity)
+        return 0;
+
+    capacity = self->capacity * 2;
+
+    if (capacity < self->length + size)
+        capacity = self->length + size;
+
+    data = PyMem_Realloc(self->data, capacity);
+
+    if (!data) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    self->data = data;
+    self->capacity = capacity;
+
+    return 0;
+}
+
+static int NRJSONEncoder_write(NRJSONEncoder *self, const char *data,
+        Py_ssize_t size)
+{
+    if (NRJSONEncoder_reserve(self, size) < 0)
+        return -1;
+
+    memcpy(self->data + self->length, data, size);
+    self->length += size;
+
+    return 0;
+}
+
+static int NRJSONEncoder_write_char(NRJSONEncoder *self, char c)
+{
+    if (self->length == self->capacity &&
+            NRJSONEncoder_reserve(self, 1) < 0) {
+        return -1;
+    }
+
+    self->data[self->length++] = c;
+
+    return 0;
+}
+
+/*
+ * Passes what has been written so far to the write callable, if there is
+ * one and either at least chunk_size bytes are waiting or force is set.
+ * This is only done between the items of a list, so that the buffer is
+ * never passed on while part of a string is still to be written, and so
+ * that no Python code is run while iterating over a dictionary.
+ */
+
+static int NRJSONEncoder_flush(NRJSONEncoder *self, int force)
+{
+    PyObject *chunk;
+    PyObject *result;
+
+    if (!self->write || !self->length)
+        return 0;
+
+    if (!force && self->length < self->chunk_size)
+        return 0;
+
+    chunk = PyBytes_FromStringAndSize(self->data, self->length);
+
+    if (!chunk)
+        return -1;
+
+    self->length = 0;
+
+    result = PyObject_CallFunctionObjArgs(self->write, chunk, NULL);
+
+    Py_DECREF(chunk);
+
+    if (!result)
+        return -1;
+
+    Py_DECREF(result);
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int NRJSONEncoder_enter(NRJSONEncoder *self, PyObject *container)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->depth; i++) {
+        if (self->active[i] == container) {
+            PyErr_SetString(PyExc_ValueError, "Circular reference detected");
+            return -1;
+        }
+    }
+
+    if (self->depth == self->active_capacity) {
+        Py_ssize_t capacity = self->active_capacity ?
+                self->active_capacity * 2 : 16;
+        PyObject **active;
+
+        active = PyMem_Realloc(self->active, capacity * sizeof(PyObject *));
+
+        if (!active) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        self->active = active;
+        self->active_capacity = capacity;
+    }
+
+    if (Py_EnterRecursiveCall(" while encoding a JSON object"))
+        return -1;
+
+    self->active[self->depth++] = container;
+
+    return 0;
+}
+
+static void NRJSONEncoder_leave(NRJSONEncoder *self)
+{
+    self->depth--;
+
+    Py_LeaveRecursiveCall();
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Writes one character of a string, escaped as done when ensure_ascii is
+ * enabled for json.dumps().
+ */
+
+static void NRJSONEncoder_escape(char *output, Py_ssize_t *length,
+        Py_UCS4 c)
+{
+    char *p = output + *length;
+
+    if (c >= ' ' && c <= '~' && c != '\\' && c != '"') {
+        *p++ = (char)c;
+    }
+    else {
+        *p++ = '\\';
+
+        switch (c) {
+            case '\\': *p++ = '\\'; break;
+            case '"': *p++ = '"'; break;
+            case '\b': *p++ = 'b'; break;
+            case '\f': *p++ = 'f'; break;
+            case '\n': *p++ = 'n'; break;
+            case '\r': *p++ = 'r'; break;
+            case '\t': *p++ = 't'; break;
+            default:
+                if (c >= 0x10000) {
+                    Py_UCS4 v = c - 0x10000;
+
+                    c = 0xd800 | ((v >> 10) & 0x3ff);
+
+                    *p++ = 'u';
+                    *p++ = hex_digits[(c >> 12) & 0xf];
+                    *p++ = hex_digits[(c >> 8) & 0xf];
+                    *p++ = hex_digits[(c >> 4) & 0xf];
+                    *p++ = hex_digits[c & 0xf];
+
+                    c = 0xdc00 | (v & 0x3ff);
+
+                    *p++ = '\\';
+                }
+
+                *p++ = 'u';
+                *p++ = hex_digits[(c >> 12) & 0xf];
+                *p++ = hex_digits[(c >> 8) & 0xf];
+                *p++ = hex_digits[(c >> 4) & 0xf];
+                *p++ = hex_digits[c & 0xf];
+                break;
+        }
+    }
+
+    *length = p - output;
+}
+
+static int NRJSONEncoder_unicode(NRJSONEncoder *self, PyObject *text)
+{
+    Py_ssize_t count;
+    Py_ssize_t i;
+    Py_ssize_t expansion;
+
+#if PY_MAJOR_VERSION >= 3
+    int kind;
+    const void *data;
+
+    if (PyUnicode_READY(text) < 0)
+        return -1;
+
+    count = PyUnicode_GET_LENGTH(text);
+    kind = PyUnicode_KIND(text);
+    data = PyUnicode_DATA(text);
+#else
+    const Py_UNICODE *data;
+
+    count = PyUnicode_GET_SIZE(text);
+    data = PyUnicode_AS_UNICODE(text);
+#endif
+
+    /*
+     * Each character expands to at most 6 bytes, or 12 bytes where it is
+     * outside the basic multilingual plane, plus the quotes.
+     */
+
+#if PY_MAJOR_VERSION >= 3
+    expansion = kind == PyUnicode_4BYTE_KIND ? 12 : 6;
+#else
+    expansion = sizeof(Py_UNICODE) == 4 ? 12 : 6;
+#endif
+
+    if (count > (PY_SSIZE_T_MAX - 2) / expansion) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (NRJSONEncoder_reserve(self, expansion * count + 2) < 0)
+        return -1;
+
+    self->data[self->length++] = '"';
+
+    for (i = 0; i < count; i++) {
+#if PY_MAJOR_VERSION >= 3
+        NRJSONEncoder_escape(self->data, &self->length,
+                PyUnicode_READ(kind, data, i));
+#else
+        NRJSONEncoder_escape(self->data, &self->length, data[i]);
+#endif
+    }
+
+    self->data[self->length++] = '"';
+
+    return 0;
+}
+
+static int NRJSONEncoder_latin1(NRJSONEncoder *self, PyObject *bytes)
+{
+    const unsigned char *data;
+    Py_ssize_t count;
+    Py_ssize_t i;
+
+    data = (const unsigned char *)PyBytes_AS_STRING(bytes);
+    count = PyBytes_GET_SIZE(bytes);
+
+    if (count > (PY_SSIZE_T_MAX - 2) / 6) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    if (NRJSONEncoder_reserve(self, 6 * count + 2) < 0)
+        return -1;
+
+    self->data[self->length++] = '"';
+
+    for (i = 0; i < count; i++)
+        NRJSONEncoder_escape(self->data, &self->length, data[i]);
+
+    self->data[self->length++] = '"';
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/* Writes the ASCII text of a str object, such as from repr(). */
+
+static int NRJSONEncoder_text(NRJSONEncoder *self, PyObject *text)
+{
+    int result;
+
+    if (!text)
+        return -1;
+
+#if PY_MAJOR_VERSION >= 3
+    {
+        const char *data;
+        Py_ssize_t size;
+
+        data = PyUnicode_AsUTF8AndSize(text, &size);
+
+        result = data ? NRJSONEncoder_write(self, data, size) : -1;
+    }
+#else
+    result = NRJSONEncoder_write(self, PyString_AS_STRING(text),
+            PyString_GET_SIZE(text));
+#endif
+
+    Py_DECREF(text);
+
+    return result;
+}
+
+static int NRJSONEncoder_long(NRJSONEncoder *self, PyObject *value)
+{
+    PY_LONG_LONG number;
+    int overflow = 0;
+
+    char buffer[32];
+    int size;
+
+    number = PyLong_AsLongLongAndOverflow(value, &overflow);
+
+    if (number == -1 && PyErr_Occurred())
+        return -1;
+
+    if (overflow) {
+#if PY_MAJOR_VERSION >= 3
+        return NRJSONEncoder_text(self, PyLong_Type.tp_repr(value));
+#else
+        return NRJSONEncoder_text(self, PyObject_Str(value));
+#endif
+    }
+
+    size = PyOS_snprintf(buffer, sizeof(buffer), "%lld", number);
+
+    return NRJSONEncoder_write(self, buffer, size);
+}
+
+static int NRJSONEncoder_float(NRJSONEncoder *self, PyObject *value)
+{
+    double number = PyFloat_AS_DOUBLE(value);
+
+    char *text;
+    int result;
+
+    if (Py_IS_NAN(number))
+        return NRJSONEncoder_write(self, "NaN", 3);
+
+    if (Py_IS_INFINITY(number)) {
+        if (number > 0)
+            return NRJSONEncoder_write(self, "Infinity", 8);
+
+        return NRJSONEncoder_write(self, "-Infinity", 9);
+    }
+
+#if PY_MAJOR_VERSION < 3
+    if (!PyFloat_CheckExact(value))
+        return NRJSONEncoder_text(self, PyObject_Repr(value));
+#endif
+
+    /* Equivalent of float.__repr__(). */
+
+    text = PyOS_double_to_string(number, 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+
+    if (!text) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    result = NRJSONEncoder_write(self, text, strlen(text));
+
+    PyMem_Free(text);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int NRJSONEncoder_encode(NRJSONEncoder *self, PyObject *value);
+
+static int NRJSONEncoder_key(NRJSONEncoder *self, PyObject *key)
+{
+    if (PyUnicode_Check(key))
+        return NRJSONEncoder_unicode(self, key);
+
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(key))
+        return NRJSONEncoder_latin1(self, key);
+#endif
+
+    if (NRJSONEncoder_write_char(self, '"') < 0)
+        return -1;
+
+    if (PyFloat_Check(key)) {
+        if (NRJSONEncoder_float(self, key) < 0)
+            return -1;
+    }
+    else if (key == Py_True) {
+        if (NRJSONEncoder_write(self, "true", 4) < 0)
+            return -1;
+    }
+    else if (key == Py_False) {
+        if (NRJSONEncoder_write(self, "false", 5) < 0)
+            return -1;
+    }
+    else if (key == Py_None) {
+        if (NRJSONEncoder_write(self, "null", 4) < 0)
+            return -1;
+    }
+#if PY_MAJOR_VERSION < 3
+    else if (PyInt_Check(key)) {
+        if (NRJSONEncoder_text(self, PyObject_Str(key)) < 0)
+            return -1;
+    }
+#endif
+    else if (PyLong_Check(key)) {
+        if (NRJSONEncoder_long(self, key) < 0)
+            return -1;
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "keys must be str, int, float, "
+                "bool or None, not %.100s", Py_TYPE(key)->tp_name);
+        return -1;
+    }
+
+    return NRJSONEncoder_write_char(self, '"');
+}
+
+static int NRJSONEncoder_item(NRJSONEncoder *self, PyObject *key,
+        PyObject *value, int first)
+{
+    int result = -1;
+
+    Py_INCREF(key);
+    Py_INCREF(value);
+
+    if (!first && NRJSONEncoder_write_char(self, ',') < 0)
+        goto done;
+
+    if (NRJSONEncoder_key(self, key) < 0)
+        goto done;
+
+    if (NRJSONEncoder_write_char(self, ':') < 0)
+        goto done;
+
+    result = NRJSONEncoder_encode(self, value);
+
+done:
+    Py_DECREF(key);
+    Py_DECREF(value);
+
+    return result;
+}
+
+static int NRJSONEncoder_dict(NRJSONEncoder *self, PyObject *dict)
+{
+    int result = -1;
+
+    if (NRJSONEncoder_enter(self, dict) < 0)
+        return -1;
+
+    if (NRJSONEncoder_write_char(self, '{') < 0)
+        goto done;
+
+    if (PyDict_CheckExact(dict)) {
+        PyObject *key;
+        PyObject *value;
+        Py_ssize_t pos = 0;
+        int first = 1;
+
+        while (PyDict_Next(dict, &pos, &key, &value)) {
+            if (NRJSONEncoder_item(self, key, value, first) < 0)
+                goto done;
+
+            first = 0;
+        }
+    }
+    else {
+        /* Subclasses are encoded from items() as done by json.dumps(). */
+
+        PyObject *items;
+        Py_ssize_t i;
+
+        items = PyMapping_Items(dict);
+
+        if (!items)
+            goto done;
+
+        for (i = 0; i < PyList_GET_SIZE(items); i++) {
+            PyObject *item = PyList_GET_ITEM(items, i);
+
+            if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 2) {
+                PyErr_SetString(PyExc_ValueError,
+                        "items must return 2-tuples");
+                Py_DECREF(items);
+                goto done;
+            }
+
+            if (NRJSONEncoder_item(self, PyTuple_GET_ITEM(item, 0),
+                    PyTuple_GET_ITEM(item, 1), i == 0) < 0) {
+                Py_DECREF(items);
+                goto done;
+            }
+        }
+
+        Py_DECREF(items);
+    }
+
+    result = NRJSONEncoder_write_char(self, '}');
+
+done:
+    NRJSONEncoder_leave(self);
+
+    return result;
+}
+
+static int NRJSONEncoder_sequence(NRJSONEncoder *self, PyObject *sequence)
+{
+    Py_ssize_t i;
+    int result = -1;
+
+    if (NRJSONEncoder_enter(self, sequence) < 0)
+        return -1;
+
+    if (NRJSONEncoder_write_char(self, '[') < 0)
+        goto done;
+
+    /*
+     * The size is checked on each pass, and a reference held on each
+     * item, as encoding an item could change the list.
+     */
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(sequence); i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(sequence, i);
+        int encoded;
+
+        if (i && NRJSONEncoder_write_char(self, ',') < 0)
+            goto done;
+
+        Py_INCREF(item);
+        encoded = NRJSONEncoder_encode(self, item);
+        Py_DECREF(item);
+
+        if (encoded < 0 || NRJSONEncoder_flush(self, 0) < 0)
+            goto done;
+    }
+
+    result = NRJSONEncoder_write_char(self, ']');
+
+done:
+    NRJSONEncoder_leave(self);
+
+    return result;
+}
+
+static int NRJSONEncoder_iterable(NRJSONEncoder *self, PyObject *iterable)
+{
+    PyObject *items;
+    int result = -1;
+
+    /*
+     * The iterable is consumed in full before any of the items are
+     * encoded, as is done by the fallback encoder. Encoding the items as
+     * they are produced could change the order in which nested
+     * generators with side effects run.
+     */
+
+    if (NRJSONEncoder_enter(self, iterable) < 0)
+        return -1;
+
+    items = PySequence_List(iterable);
+
+    if (items) {
+        result = NRJSONEncoder_sequence(self, items);
+        Py_DECREF(items);
+    }
+
+    NRJSONEncoder_leave(self);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int NRJSONEncoder_encode(NRJSONEncoder *self, PyObject *value)
+{
+    int iterable;
+
+    if (value == Py_None)
+        return NRJSONEncoder_write(self, "null", 4);
+
+    if (value == Py_True)
+        return NRJSONEncoder_write(self, "true", 4);
+
+    if (value == Py_False)
+        return NRJSONEncoder_write(self, "false", 5);
+
+    if (PyUnicode_Check(value))
+        return NRJSONEncoder_unicode(self, value);
+
+    /*
+     * Byte strings are handled by the json module under Python 2 when
+     * given the Latin-1 encoding, and by the fallback encoder under
+     * Python 3, with the same result either way.
+     */
+
+    if (PyBytes_Check(value))
+        return NRJSONEncoder_latin1(self, value);
+
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_Check(value))
+        return NRJSONEncoder_text(self, PyObject_Str(value));
+
+    if (PyLong_Check(value))
+        return NRJSONEncoder_text(self, PyObject_Str(value));
+#else
+    if (PyLong_Check(value))
+        return NRJSONEncoder_long(self, value);
+#endif
+
+    if (PyFloat_Check(value))
+        return NRJSONEncoder_float(self, value);
+
+    if (PyList_Check(value) || PyTuple_Check(value))
+        return NRJSONEncoder_sequence(self, value);
+
+    if (PyDict_Check(value))
+        return NRJSONEncoder_dict(self, value);
+
+    /* What remains is left to the fallback encoder of json_encode(). */
+
+    if (PyGen_Check(value))
+        return NRJSONEncoder_iterable(self, value);
+
+    iterable = PyObject_HasAttrString(value, "__iter__");
+
+    if (iterable)
+        return NRJSONEncoder_iterable(self, value);
+
+    {
+        PyObject *repr = PyObject_Repr(value);
+
+        if (!repr)
+            return -1;
+
+#if PY_MAJOR_VERSION >= 3
+        PyErr_Format(PyExc_TypeError, "%U is not JSON serializable", repr);
+#else
+        PyErr_Format(PyExc_TypeError, "%s is not JSON serializable",
+                PyString_AsString(repr));
+#endif
+
+        Py_DECREF(repr);
+    }
+
+    return -1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *json_encode(PyObject *self, PyObject *args)
+{
+    PyObject *value = NULL;
+
+    NRJSONEncoder encoder;
+    PyObject *result = NULL;
+
+    if (!PyArg_ParseTuple(args, "O:json_encode", &value))
+        return NULL;
+
+    if (NRJSONEncoder_init(&encoder) < 0)
+        return NULL;
+
+    if (NRJSONEncoder_encode(&encoder, value) == 0) {
+#if PY_MAJOR_VERSION >= 3
+        result = PyUnicode_DecodeASCII(encoder.data, encoder.length, NULL);
+#else
+        result = PyString_FromStringAndSize(encoder.data, encoder.length);
+#endif
+    }
+
+    NRJSONEncoder_free(&encoder);
+
+    return result;
+}
+
+static PyObject *json_encode_chunks(PyObject *self, PyObject *args)
+{
+    PyObject *value = NULL;
+    PyObject *write = NULL;
+    Py_ssize_t chunk_size = 0;
+
+    NRJSONEncoder encoder;
+    int result;
+
+    if (!PyArg_ParseTuple(args, "OOn:json_encode_chunks", &value, &write,
+            &chunk_size)) {
+        return NULL;
+    }
+
+    if (NRJSONEncoder_init(&encoder) < 0)
+        return NULL;
+
+    encoder.write = write;
+    encoder.chunk_size = chunk_size;
+
+    result = NRJSONEncoder_encode(&encoder, value);
+
+    if (result == 0)
+        result = NRJSONEncoder_flush(&encoder, 1);
+
+    NRJSONEncoder_free(&encoder);
+
+    if (result < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Parsing and formatting of the W3C trace context headers. These produce
+ * the same results as W3CTraceParent, W3CTraceState and NrTraceState in
+ * encoding_utils.py. Where a value is of a type for which the result could
+ * differ, None is returned so the caller can use those classes instead.
+ */
+
+#define NR_TRACESTATE_MAX_ENTRIES 64
+
+typedef struct {
+    const char *data;
+    Py_ssize_t size;
+} NRTextPart;
+
+static PyObject *parent_types[3];
+
+static const char zeros[] = "00000000000000000000000000000000";
+
+/*
+ * Returns the characters of an exact str which is all ASCII, or NULL with
+ * no exception set if the object is anything else.
+ */
+
+static const char *NRText_AsASCII(PyObject *text, Py_ssize_t *size)
+{
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_CheckExact(text))
+        return NULL;
+
+    if (PyUnicode_READY(text) < 0) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    if (!PyUnicode_IS_ASCII(text))
+        return NULL;
+
+    *size = PyUnicode_GET_LENGTH(text);
+
+    return (const char *)PyUnicode_DATA(text);
+#else
+    if (!PyString_CheckExact(text))
+        return NULL;
+
+    *size = PyString_GET_SIZE(text);
+
+    return PyString_AS_STRING(text);
+#endif
+}
+
+static PyObject *NRText_Join(const NRTextPart *parts, Py_ssize_t count)
+{
+    PyObject *text;
+    Py_ssize_t size = 0;
+    Py_ssize_t i;
+    char *p;
+
+    for (i = 0; i < count; i++)
+        size += parts[i].size;
+
+#if PY_MAJOR_VERSION >= 3
+    text = PyUnicode_New(size, 127);
+
+    if (!text)
+        return NULL;
+
+    p = (char *)PyUnicode_1BYTE_DATA(text);
+#else
+    text = PyString_FromStringAndSize(NULL, size);
+
+    if (!text)
+        return NULL;
+
+    p = PyString_AS_STRING(text);
+#endif
+
+    for (i = 0; i < count; i++) {
+        memcpy(p, parts[i].data, parts[i].size);
+        p += parts[i].size;
+    }
+
+    return text;
+}
+
+/*
+ * Copies up to size characters from the start of a string, with any
+ * which are not ASCII replaced by 0xff, and returns the full length.
+ */
+
+static Py_ssize_t NRText_Head(PyObject *text, unsigned char *head,
+        Py_ssize_t size)
+{
+    Py_ssize_t length;
+    Py_ssize_t i;
+
+#if PY_MAJOR_VERSION >= 3
+    int kind;
+    const void *data;
+
+    if (!PyUnicode_Check(text)) {
+        PyErr_Format(PyExc_TypeError, "expected str, not %.100s",
+                Py_TYPE(text)->tp_name);
+        return -1;
+    }
+
+    if (PyUnicode_READY(text) < 0)
+        return -1;
+
+    length = PyUnicode_GET_LENGTH(text);
+    kind = PyUnicode_KIND(text);
+    data = PyUnicode_DATA(text);
+
+    for (i = 0; i < length && i < size; i++) {
+        Py_UCS4 c = PyUnicode_READ(kind, data, i);
+        head[i] = c < 0x80 ? (unsigned char)c : 0xff;
+    }
+#else
+    if (PyString_Check(text)) {
+        length = PyString_GET_SIZE(text);
+        memcpy(head, PyString_AS_STRING(text), length < size ? length : size);
+    }
+    else if (PyUnicode_Check(text)) {
+        const Py_UNICODE *data = PyUnicode_AS_UNICODE(text);
+
+        length = PyUnicode_GET_SIZE(text);
+
+        for (i = 0; i < length && i < size; i++)
+            head[i] = data[i] < 0x80 ? (unsigned char)data[i] : 0xff;
+    }
+    else {
+        PyErr_Format(PyExc_TypeError, "expected str, not %.100s",
+                Py_TYPE(text)->tp_name);
+        return -1;
+    }
+#endif
+
+    return length;
+}
+
+/*
+ * Returns the single character of a string of length one, or -1.
+ */
+
+static int NRText_Char(PyObject *text)
+{
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_Check(text) && PyUnicode_READY(text) == 0 &&
+            PyUnicode_GET_LENGTH(text) == 1) {
+        Py_UCS4 c = PyUnicode_READ_CHAR(text, 0);
+        return c < 0x80 ? (int)c : -1;
+    }
+#else
+    if (PyString_Check(text) && PyString_GET_SIZE(text) == 1)
+        return (unsigned char)PyString_AS_STRING(text)[0];
+
+    if (PyUnicode_Check(text) && PyUnicode_GET_SIZE(text) == 1) {
+        Py_UNICODE c = PyUnicode_AS_UNICODE(text)[0];
+        return c < 0x80 ? (int)c : -1;
+    }
+#endif
+
+    return -1;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Checks for lower case hex digits without branching on each character,
+ * so that the loop can be vectorized. As the regular expression used by
+ * W3CTraceParent matches before a trailing newline, so does this.
+ */
+
+static int NRHex_valid(const unsigned char *data, Py_ssize_t size)
+{
+    unsigned int valid = 1;
+    unsigned char c;
+    Py_ssize_t i;
+
+    for (i = 0; i < size - 1; i++) {
+        c = data[i];
+        valid &= ((unsigned char)(c - '0') < 10) |
+                ((unsigned char)(c - 'a') < 6);
+    }
+
+    c = data[size - 1];
+
+    return valid & (((unsigned char)(c - '0') < 10) |
+            ((unsigned char)(c - 'a') < 6) | (c == '\n'));
+}
+
+static PyObject *NRTraceParent_field(PyObject *payload,
+        const unsigned char *data, Py_ssize_t size)
+{
+    NRTextPart part;
+
+#if PY_MAJOR_VERSION < 3
+    if (PyUnicode_Check(payload))
+        return PyUnicode_FromStringAndSize((const char *)data, size);
+#endif
+
+    part.data = (const char *)data;
+    part.size = size;
+
+    return NRText_Join(&part, 1);
+}
+
+static PyObject *decode_traceparent(PyObject *self, PyObject *payload)
+{
+    unsigned char head[56];
+    Py_ssize_t length;
+
+    PyObject *trace_id;
+    PyObject *parent_id;
+    PyObject *result;
+
+    length = NRText_Head(payload, head, sizeof(head));
+
+    if (length < 0)
+        return NULL;
+
+    /*
+     * The version, trace id, parent id and flags are 2, 32, 16 and 2
+     * characters long, so the dashes between them are at fixed positions.
+     * Only a version other than 00 may be followed by further fields.
+     */
+
+    if (length < 55 || head[2] != '-' || head[35] != '-' || head[52] != '-')
+        Py_RETURN_NONE;
+
+    if (length > 55 && (head[55] != '-' || (head[0] == '0' &&
+            head[1] == '0'))) {
+        Py_RETURN_NONE;
+    }
+
+    if (head[0] == 'f' && head[1] == 'f')
+        Py_RETURN_NONE;
+
+    if (!(NRHex_valid(head, 2) & NRHex_valid(head + 3, 32) &
+            NRHex_valid(head + 36, 16) & NRHex_valid(head + 53, 2))) {
+        Py_RETURN_NONE;
+    }
+
+    if (!memcmp(head + 3, zeros, 32) || !memcmp(head + 36, zeros, 16))
+        Py_RETURN_NONE;
+
+    trace_id = NRTraceParent_field(payload, head + 3, 32);
+
+    if (!trace_id)
+        return NULL;
+
+    parent_id = NRTraceParent_field(payload, head + 36, 16);
+
+    if (!parent_id) {
+        Py_DECREF(trace_id);
+        return NULL;
+    }
+
+    result = PyTuple_Pack(2, trace_id, parent_id);
+
+    Py_DECREF(trace_id);
+    Py_DECREF(parent_id);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    const char *name;
+    Py_ssize_t name_size;
+    const char *value;
+    Py_ssize_t value_size;
+} NRTraceStateEntry;
+
+static int NRTraceState_space(char c)
+{
+#if PY_MAJOR_VERSION >= 3
+    return c == ' ' || (c >= '\t' && c <= '\r') || (c >= '\x1c' && c <= '\x1f');
+#else
+    return c == ' ' || (c >= '\t' && c <= '\r');
+#endif
+}
+
+static void NRTraceState_add(NRTraceStateEntry *entries, Py_ssize_t *count,
+        const char *entry, Py_ssize_t size)
+{
+    const char *equals;
+    Py_ssize_t i;
+
+    /* Each entry must be a name and value separated by a single '='. */
+
+    equals = memchr(entry, '=', size);
+
+    if (!equals || memchr(equals + 1, '=', entry + size - equals - 1))
+        return;
+
+    if (equals - entry > 256 || entry + size - equals - 1 > 256)
+        return;
+
+    /*
+     * A name which has been seen before keeps its position but takes the
+     * later value, as when the entries are added to an OrderedDict.
+     */
+
+    for (i = 0; i < *count; i++) {
+        if (entries[i].name_size == equals - entry &&
+                !memcmp(entries[i].name, entry, equals - entry)) {
+            break;
+        }
+    }
+
+    entries[i].name = entry;
+    entries[i].name_size = equals - entry;
+    entries[i].value = equals + 1;
+    entries[i].value_size = entry + size - equals - 1;
+
+    if (i == *count)
+        *count += 1;
+}
+
+static PyObject *split_tracestate(PyObject *self, PyObject *args)
+{
+    PyObject *tracestate = NULL;
+    PyObject *key = NULL;
+
+    const char *data;
+    const char *name;
+    Py_ssize_t length;
+    Py_ssize_t name_size;
+    Py_ssize_t start = 0;
+
+    NRTraceStateEntry entries[NR_TRACESTATE_MAX_ENTRIES + 1];
+    NRTextPart parts[4 * NR_TRACESTATE_MAX_ENTRIES];
+    NRTextPart value = { "", 0 };
+    Py_ssize_t count = 0;
+    Py_ssize_t nparts;
+    Py_ssize_t kept;
+    Py_ssize_t i;
+
+    PyObject *vendors;
+    PyObject *text;
+    PyObject *result;
+
+    if (!PyArg_ParseTuple(args, "OO:split_tracestate", &tracestate, &key))
+        return NULL;
+
+    data = NRText_AsASCII(tracestate, &length);
+    name = NRText_AsASCII(key, &name_size);
+
+    if (!data || !name)
+        Py_RETURN_NONE;
+
+    while (length && NRTraceState_space(data[length - 1]))
+        length--;
+
+    /*
+     * Entries are separated by a comma and any spaces or tabs either side
+     * of it. There are no more than 32 entries in a valid header, so it
+     * is left to W3CTraceState where there are many more than that.
+     */
+
+    while (1) {
+        const char *comma = memchr(data + start, ',', length - start);
+        Py_ssize_t end = comma ? comma - data : length;
+        Py_ssize_t stop = end;
+
+        while (stop > start && (data[stop - 1] == ' ' ||
+                data[stop - 1] == '\t')) {
+            stop--;
+        }
+
+        NRTraceState_add(entries, &count, data + start, stop - start);
+
+        if (count > NR_TRACESTATE_MAX_ENTRIES)
+            Py_RETURN_NONE;
+
+        if (!comma)
+            break;
+
+        start = end + 1;
+
+        while (start < length && (data[start] == ' ' || data[start] == '\t'))
+            start++;
+    }
+
+    /* The entry for the key is taken out and the rest are rejoined. */
+
+    for (i = 0; i < count; i++) {
+        if (entries[i].name_size == name_size &&
+                !memcmp(entries[i].name, name, name_size)) {
+            value.data = entries[i].value;
+            value.size = entries[i].value_size;
+            memmove(entries + i, entries + i + 1,
+                    (count - i - 1) * sizeof(NRTraceStateEntry));
+            count--;
+            break;
+        }
+    }
+
+    for (i = 0, nparts = 0; i < count; i++) {
+        if (i) {
+            parts[nparts].data = ",";
+            parts[nparts++].size = 1;
+        }
+
+        parts[nparts].data = entries[i].name;
+        parts[nparts++].size = entries[i].name_size;
+    }
+
+    vendors = NRText_Join(parts, nparts);
+
+    if (!vendors)
+        return NULL;
+
+    kept = count < 31 ? count : 31;
+
+    for (i = 0, nparts = 0; i < kept; i++) {
+        if (i) {
+            parts[nparts].data = ",";
+            parts[nparts++].size = 1;
+        }
+
+        parts[nparts].data = entries[i].name;
+        parts[nparts++].size = entries[i].name_size;
+        parts[nparts].data = "=";
+        parts[nparts++].size = 1;
+        parts[nparts].data = entries[i].value;
+        parts[nparts++].size = entries[i].value_size;
+    }
+
+    text = NRText_Join(parts, nparts);
+
+    if (!text) {
+        Py_DECREF(vendors);
+        return NULL;
+    }
+
+    result = NRText_Join(&value, 1);
+
+    if (result) {
+        PyObject *payload = result;
+
+        result = PyTuple_Pack(3, payload, vendors, text);
+
+        Py_DECREF(payload);
+    }
+
+    Py_DECREF(vendors);
+    Py_DECREF(text);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *decode_nr_tracestate(PyObject *self, PyObject *args)
+{
+    static const char *names[] = { "ty", "ac", "ap", "id", "tx", "sa", "pr" };
+
+    PyObject *type = NULL;
+    PyObject *payload = NULL;
+    PyObject *tk = NULL;
+
+    PyObject *fields;
+    PyObject *data = NULL;
+    PyObject *ti;
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "OOO:decode_nr_tracestate", &type, &payload,
+            &tk)) {
+        return NULL;
+    }
+
+    fields = PyObject_CallMethod(payload, "split", "si", "-", 9);
+
+    if (!fields)
+        return NULL;
+
+    if (!PyList_Check(fields)) {
+        PyErr_SetString(PyExc_TypeError, "split() must return a list");
+        goto error;
+    }
+
+    if (PyList_GET_SIZE(fields) < 9)
+        goto invalid;
+
+    for (i = 0; i < 9; i++) {
+        int truth;
+
+        if (i > 3 && i < 8)
+            continue;
+
+        truth = PyObject_IsTrue(PyList_GET_ITEM(fields, i));
+
+        if (truth < 0)
+            goto error;
+
+        if (!truth)
+            goto invalid;
+    }
+
+    data = PyObject_CallObject(type, NULL);
+
+    if (!data || PyMapping_SetItemString(data, "tk", tk) < 0)
+        goto error;
+
+#if PY_MAJOR_VERSION >= 3
+    ti = PyNumber_Long(PyList_GET_ITEM(fields, 8));
+#else
+    ti = PyNumber_Int(PyList_GET_ITEM(fields, 8));
+#endif
+
+    if (!ti) {
+        PyErr_Clear();
+        goto invalid;
+    }
+
+    if (PyMapping_SetItemString(data, "ti", ti) < 0) {
+        Py_DECREF(ti);
+        goto error;
+    }
+
+    Py_DECREF(ti);
+
+    for (i = 0; i < 7; i++) {
+        PyObject *value = PyList_GET_ITEM(fields, i + 1);
+        int truth;
+        int c;
+
+        truth = PyObject_IsTrue(value);
+
+        if (truth < 0)
+            goto error;
+
+        if (!truth)
+            continue;
+
+        Py_INCREF(value);
+
+        if (i == 0) {
+            c = NRText_Char(value);
+            Py_DECREF(value);
+
+            if (c < '0' || c > '2')
+                goto invalid;
+
+            value = parent_types[c - '0'];
+            Py_INCREF(value);
+        }
+        else if (i == 5) {
+            c = NRText_Char(value);
+            Py_DECREF(value);
+
+            value = c == '1' ? Py_True : c == '0' ? Py_False : Py_None;
+            Py_INCREF(value);
+        }
+        else if (i == 6) {
+            PyObject *priority = PyNumber_Float(value);
+
+            Py_DECREF(value);
+
+            if (!priority) {
+                PyErr_Clear();
+                Py_INCREF(Py_None);
+                priority = Py_None;
+            }
+
+            value = priority;
+        }
+
+        if (PyMapping_SetItemString(data, (char *)names[i], value) < 0) {
+            Py_DECREF(value);
+            goto error;
+        }
+
+        Py_DECREF(value);
+    }
+
+    Py_DECREF(fields);
+
+    return data;
+
+invalid:
+    Py_DECREF(fields);
+    Py_XDECREF(data);
+
+    Py_RETURN_NONE;
+
+error:
+    Py_DECREF(fields);
+    Py_XDECREF(data);
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Looks up a key which must hold an exact ASCII str. Returns 1 if it does,
+ * 0 if the key is missing and missing is not NULL, in which case missing is
+ * used instead, and -1 for anything else.
+ */
+
+static int NRTraceContext_text(PyObject *data, const char *key,
+        const char *missing, NRTextPart *part)
+{
+    PyObject *value = PyDict_GetItemString(data, key);
+
+    if (!value) {
+        if (!missing)
+            return -1;
+
+        part->data = missing;
+        part->size = strlen(missing);
+
+        return 0;
+    }
+
+    part->data = NRText_AsASCII(value, &part->size);
+
+    return part->data ? 1 : -1;
+}
+
+static PyObject *format_trace_context(PyObject *self, PyObject *args)
+{
+    PyObject *data = NULL;
+    PyObject *tracestate = NULL;
+    PyObject *generate_span_id = NULL;
+
+    PyObject *sa;
+    PyObject *pr;
+    PyObject *ti;
+    PyObject *guid = NULL;
+    PyObject *traceparent = NULL;
+    PyObject *nr_tracestate;
+    PyObject *result = NULL;
+
+    NRTextPart tr, ac, ap, id, tx, tk, ts, ti_text, parent;
+    NRTextPart parts[15];
+    char trace_id[32];
+    char *priority = NULL;
+    Py_ssize_t priority_size = 0;
+    Py_ssize_t i;
+    int has_id;
+    int has_tk;
+    int truth;
+
+    if (!PyArg_ParseTuple(args, "O!OO:format_trace_context", &PyDict_Type,
+            &data, &tracestate, &generate_span_id)) {
+        return NULL;
+    }
+
+    /*
+     * Everything which could lead to the Python implementation being used
+     * instead is checked before any span id is generated.
+     */
+
+    if (NRTraceContext_text(data, "tr", NULL, &tr) < 0 ||
+            NRTraceContext_text(data, "ac", NULL, &ac) < 0 ||
+            NRTraceContext_text(data, "ap", NULL, &ap) < 0 ||
+            (has_id = NRTraceContext_text(data, "id", "", &id)) < 0 ||
+            NRTraceContext_text(data, "tx", "", &tx) < 0 ||
+            (has_tk = NRTraceContext_text(data, "tk", "", &tk)) < 0) {
+        Py_RETURN_NONE;
+    }
+
+    if (!has_tk)
+        tk = ac;
+
+    /* A sign would be kept ahead of the padding by zfill(). */
+
+    if (tr.size > 32 || (tr.size && (tr.data[0] == '+' ||
+            tr.data[0] == '-'))) {
+        Py_RETURN_NONE;
+    }
+
+    sa = PyDict_GetItemString(data, "sa");
+
+    if (sa && sa != Py_True && sa != Py_False)
+        Py_RETURN_NONE;
+
+    /* A priority of zero is not replaced by a string, and fails to join. */
+
+    pr = PyDict_GetItemString(data, "pr");
+
+    if (pr && (!PyFloat_CheckExact(pr) || PyFloat_AS_DOUBLE(pr) == 0.0))
+        Py_RETURN_NONE;
+
+    truth = PyObject_IsTrue(tracestate);
+
+    if (truth < 0)
+        return NULL;
+
+    ts.data = "";
+    ts.size = 0;
+
+    if (truth && !(ts.data = NRText_AsASCII(tracestate, &ts.size)))
+        Py_RETURN_NONE;
+
+    ti = PyDict_GetItemString(data, "ti");
+
+    if (!ti)
+        Py_RETURN_NONE;
+
+    ti = PyObject_Str(ti);
+
+    if (!ti)
+        return NULL;
+
+    if (!(ti_text.data = NRText_AsASCII(ti, &ti_text.size))) {
+        Py_DECREF(ti);
+        Py_RETURN_NONE;
+    }
+
+    if (has_id) {
+        parent = id;
+    }
+    else {
+        guid = PyObject_CallObject(generate_span_id, NULL);
+
+        if (!guid)
+            goto done;
+
+        if (!(parent.data = NRText_AsASCII(guid, &parent.size))) {
+            PyErr_SetString(PyExc_TypeError,
+                    "generate_span_id() must return a str");
+            goto done;
+        }
+    }
+
+    /* The trace id is lower cased and padded with leading zeros. */
+
+    memset(trace_id, '0', 32 - tr.size);
+
+    for (i = 0; i < tr.size; i++) {
+        char c = tr.data[i];
+        trace_id[32 - tr.size + i] = (c >= 'A' && c <= 'Z') ? c + 32 : c;
+    }
+
+    parts[0].data = "00-";
+    parts[0].size = 3;
+    parts[1].data = trace_id;
+    parts[1].size = 32;
+    parts[2].data = "-";
+    parts[2].size = 1;
+    parts[3] = parent;
+    parts[4].data = sa == Py_True ? "-01" : "-00";
+    parts[4].size = 3;
+
+    traceparent = NRText_Join(parts, 5);
+
+    if (!traceparent)
+        goto done;
+
+    /* The priority is formatted as '%.6f' with trailing zeros removed. */
+
+    if (pr) {
+        priority = PyOS_double_to_string(PyFloat_AS_DOUBLE(pr), 'f', 6, 0,
+                NULL);
+
+        if (!priority)
+            goto done;
+
+        priority_size = strlen(priority);
+
+        while (priority_size && priority[priority_size - 1] == '0')
+            priority_size--;
+
+        while (priority_size && priority[priority_size - 1] == '.')
+            priority_size--;
+    }
+
+    parts[0] = tk;
+    parts[1].data = "@nr=0-0-";
+    parts[1].size = 8;
+    parts[2] = ac;
+    parts[3].data = "-";
+    parts[3].size = 1;
+    parts[4] = ap;
+    parts[5] = parts[3];
+    parts[6] = id;
+    parts[7] = parts[3];
+    parts[8] = tx;
+    parts[9].data = sa == Py_True ? "-1-" : "-0-";
+    parts[9].size = 3;
+    parts[10].data = priority ? priority : "";
+    parts[10].size = priority_size;
+    parts[11] = parts[3];
+    parts[12] = ti_text;
+    parts[13].data = ",";
+    parts[13].size = ts.size ? 1 : 0;
+    parts[14] = ts;
+
+    nr_tracestate = NRText_Join(parts, 15);
+
+    if (nr_tracestate) {
+        result = PyTuple_Pack(2, traceparent, nr_tracestate);
+        Py_DECREF(nr_tracestate);
+    }
+
+done:
+    if (priority)
+        PyMem_Free(priority);
+
+    Py_XDECREF(traceparent);
+    Py_XDECREF(guid);
+    Py_DECREF(ti);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * The XOR cipher combined with base64 encoding, used to obfuscate the
+ * cross application tracing headers and browser monitoring data. The
+ * results are the same as xor_cipher_encrypt_base64() and
+ * xor_cipher_decrypt_base64() in encoding_utils.py. The text is handled in
+ * blocks small enough to stay in cache, each being XORed with the key and
+ * then encoded, or decoded and then XORed, before moving on to the next.
+ * None is returned for anything which is left to those functions, such as
+ * keys which are empty and base64 input which is not strictly formed.
+ */
+
+#define NR_XOR_BLOCK 48
+
+static const char base64_alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static signed char base64_values[256];
+
+static void NRBase64_init(void)
+{
+    int i;
+
+    memset(base64_values, -1, sizeof(base64_values));
+
+    for (i = 0; i < 64; i++)
+        base64_values[(unsigned char)base64_alphabet[i]] = (signed char)i;
+}
+
+static void NRBase64_encode(const unsigned char *input, Py_ssize_t size,
+        char *output)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i + 3 <= size; i += 3) {
+        *output++ = base64_alphabet[input[i] >> 2];
+        *output++ = base64_alphabet[((input[i] & 0x03) << 4) |
+                (input[i + 1] >> 4)];
+        *output++ = base64_alphabet[((input[i + 1] & 0x0f) << 2) |
+                (input[i + 2] >> 6)];
+        *output++ = base64_alphabet[input[i + 2] & 0x3f];
+    }
+
+    if (size - i == 1) {
+        *output++ = base64_alphabet[input[i] >> 2];
+        *output++ = base64_alphabet[(input[i] & 0x03) << 4];
+        *output++ = '=';
+        *output++ = '=';
+    }
+    else if (size - i == 2) {
+        *output++ = base64_alphabet[input[i] >> 2];
+        *output++ = base64_alphabet[((input[i] & 0x03) << 4) |
+                (input[i + 1] >> 4)];
+        *output++ = base64_alphabet[(input[i + 1] & 0x0f) << 2];
+        *output++ = '=';
+    }
+}
+
+/*
+ * Decodes groups of four characters which are known to be valid, into
+ * three bytes each, or fewer for a final group with padding.
+ */
+
+static void NRBase64_decode(const unsigned char *input, Py_ssize_t size,
+        Py_ssize_t padding, unsigned char *output)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < size; i += 4) {
+        unsigned int group = (base64_values[input[i]] << 18) |
+                (base64_values[input[i + 1]] << 12);
+
+        if (i + 4 == size && padding) {
+            if (padding == 1)
+                group |= base64_values[input[i + 2]] << 6;
+
+            *output++ = (unsigned char)(group >> 16);
+
+            if (padding == 1)
+                *output++ = (unsigned char)(group >> 8);
+
+            break;
+        }
+
+        group |= (base64_values[input[i + 2]] << 6) |
+                base64_values[input[i + 3]];
+
+        *output++ = (unsigned char)(group >> 16);
+        *output++ = (unsigned char)(group >> 8);
+        *output++ = (unsigned char)group;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    /* The key repeated to fill size + NR_XOR_BLOCK bytes. */
+
+    unsigned char *stream;
+    Py_ssize_t size;
+    Py_ssize_t offset;
+} NRXorKey;
+
+/*
+ * Returns 1 if the key could be set up, 0 if it is a key which is left to
+ * the Python implementation, and -1 on an error.
+ */
+
+static int NRXorKey_init(NRXorKey *self, PyObject *key)
+{
+    const unsigned char *data = NULL;
+    Py_ssize_t size;
+    Py_ssize_t i;
+
+    self->stream = NULL;
+    self->size = 0;
+    self->offset = 0;
+
+    if (PyByteArray_Check(key)) {
+        data = (const unsigned char *)PyByteArray_AS_STRING(key);
+        size = PyByteArray_GET_SIZE(key);
+    }
+    else if (PyUnicode_Check(key)) {
+#if PY_MAJOR_VERSION >= 3
+        if (PyUnicode_READY(key) < 0) {
+            PyErr_Clear();
+            return 0;
+        }
+
+        if (!PyUnicode_IS_ASCII(key))
+            return 0;
+
+        data = (const unsigned char *)PyUnicode_DATA(key);
+        size = PyUnicode_GET_LENGTH(key);
+#else
+        size = PyUnicode_GET_SIZE(key);
+
+        for (i = 0; i < size; i++) {
+            if (PyUnicode_AS_UNICODE(key)[i] >= 0x80)
+                return 0;
+        }
+#endif
+    }
+    else {
+        return 0;
+    }
+
+    if (!size)
+        return 0;
+
+    self->stream = PyMem_Malloc(size + NR_XOR_BLOCK);
+
+    if (!self->stream) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i = 0; i < size; i++) {
+#if PY_MAJOR_VERSION < 3
+        if (!data) {
+            self->stream[i] = (unsigned char)PyUnicode_AS_UNICODE(key)[i];
+            continue;
+        }
+#endif
+        self->stream[i] = data[i];
+    }
+
+    for (i = size; i < size + NR_XOR_BLOCK; i++)
+        self->stream[i] = self->stream[i - size];
+
+    self->size = size;
+
+    return 1;
+}
+
+static void NRXorKey_free(NRXorKey *self)
+{
+    PyMem_Free(self->stream);
+
+    self->stream = NULL;
+}
+
+/*
+ * XORs up to NR_XOR_BLOCK bytes with the key, carrying on from where the
+ * last block left off. As the key is laid out repeated, there is no wrap
+ * around within a block and the loop can be vectorized.
+ */
+
+static void NRXorKey_apply(NRXorKey *self, const unsigned char *input,
+        unsigned char *output, Py_ssize_t size)
+{
+    const unsigned char *stream = self->stream + self->offset;
+    Py_ssize_t i;
+
+    for (i = 0; i < size; i++)
+        output[i] = input[i] ^ stream[i];
+
+    self->offset = (self->offset + size) % self->size;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *xor_cipher_encrypt_base64(PyObject *self, PyObject *args)
+{
+    PyObject *text = NULL;
+    PyObject *key = NULL;
+
+    NRXorKey cipher;
+    PyObject *encoded = NULL;
+    unsigned char *expanded = NULL;
+    const unsigned char *data = NULL;
+    Py_ssize_t size = 0;
+
+    unsigned char block[NR_XOR_BLOCK];
+    PyObject *result = NULL;
+    char *output;
+    Py_ssize_t i;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "OO:xor_cipher_encrypt_base64", &text,
+            &key)) {
+        return NULL;
+    }
+
+    status = NRXorKey_init(&cipher, key);
+
+    if (status <= 0)
+        return status < 0 ? NULL : (Py_INCREF(Py_None), Py_None);
+
+    /*
+     * The text is encrypted as UTF-8, with byte strings being taken to be
+     * Latin-1, so any bytes outside of ASCII become two byte sequences.
+     */
+
+    if (PyBytes_Check(text)) {
+        const unsigned char *bytes;
+        Py_ssize_t count = PyBytes_GET_SIZE(text);
+        Py_ssize_t high = 0;
+
+        bytes = (const unsigned char *)PyBytes_AS_STRING(text);
+
+        for (i = 0; i < count; i++)
+            high += bytes[i] >> 7;
+
+        data = bytes;
+        size = count;
+
+        if (high) {
+            unsigned char *p;
+
+            expanded = PyMem_Malloc(count + high);
+
+            if (!expanded) {
+                PyErr_NoMemory();
+                goto done;
+            }
+
+            for (i = 0, p = expanded; i < count; i++) {
+                if (bytes[i] < 0x80) {
+                    *p++ = bytes[i];
+                }
+                else {
+                    *p++ = 0xc0 | (bytes[i] >> 6);
+                    *p++ = 0x80 | (bytes[i] & 0x3f);
+                }
+            }
+
+            data = expanded;
+            size = count + high;
+        }
+    }
+    else if (PyUnicode_Check(text)) {
+#if PY_MAJOR_VERSION >= 3
+        if (PyUnicode_READY(text) == 0 && PyUnicode_IS_ASCII(text)) {
+            data = (const unsigned char *)PyUnicode_DATA(text);
+            size = PyUnicode_GET_LENGTH(text);
+        }
+#endif
+
+        if (!data) {
+            encoded = PyUnicode_AsUTF8String(text);
+
+            /* Lone surrogates are left to fail in the same way as before. */
+
+            if (!encoded) {
+                PyErr_Clear();
+                Py_INCREF(Py_None);
+                result = Py_None;
+                goto done;
+            }
+
+            data = (const unsigned char *)PyBytes_AS_STRING(encoded);
+            size = PyBytes_GET_SIZE(encoded);
+        }
+    }
+    else {
+        Py_INCREF(Py_None);
+        result = Py_None;
+        goto done;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    result = PyUnicode_New((size + 2) / 3 * 4, 127);
+
+    if (!result)
+        goto done;
+
+    output = (char *)PyUnicode_1BYTE_DATA(result);
+#else
+    result = PyString_FromStringAndSize(NULL, (size + 2) / 3 * 4);
+
+    if (!result)
+        goto done;
+
+    output = PyString_AS_STRING(result);
+#endif
+
+    for (i = 0; i < size; i += NR_XOR_BLOCK) {
+        Py_ssize_t count = size - i < NR_XOR_BLOCK ? size - i : NR_XOR_BLOCK;
+
+        NRXorKey_apply(&cipher, data + i, block, count);
+        NRBase64_encode(block, count, output + i / 3 * 4);
+    }
+
+done:
+    NRXorKey_free(&cipher);
+    PyMem_Free(expanded);
+    Py_XDECREF(encoded);
+
+    return result;
+}
+
+static PyObject *xor_cipher_decrypt_base64(PyObject *self, PyObject *args)
+{
+    PyObject *text = NULL;
+    PyObject *key = NULL;
+
+    NRXorKey cipher;
+    const unsigned char *data = NULL;
+    Py_ssize_t size = 0;
+    Py_ssize_t padding = 0;
+    Py_ssize_t length;
+
+    unsigned char block[NR_XOR_BLOCK];
+    unsigned char *decrypted = NULL;
+    PyObject *result = NULL;
+    Py_ssize_t i;
+    int status;
+
+    if (!PyArg_ParseTuple(args, "OO:xor_cipher_decrypt_base64", &text,
+            &key)) {
+        return NULL;
+    }
+
+    if (PyBytes_Check(text)) {
+        data = (const unsigned char *)PyBytes_AS_STRING(text);
+        size = PyBytes_GET_SIZE(text);
+    }
+#if PY_MAJOR_VERSION >= 3
+    else if (PyUnicode_Check(text) && PyUnicode_READY(text) == 0 &&
+            PyUnicode_IS_ASCII(text)) {
+        data = (const unsigned char *)PyUnicode_DATA(text);
+        size = PyUnicode_GET_LENGTH(text);
+    }
+#endif
+
+    /*
+     * Only input made up of complete groups of characters from the base64
+     * alphabet, with any padding at the end, is decoded here. Anything
+     * else is left to base64.b64decode(), which discards characters not in
+     * the alphabet and has its own rules about where padding may appear.
+     */
+
+    if (!data || size % 4)
+        Py_RETURN_NONE;
+
+    while (padding < 2 && padding < size && data[size - padding - 1] == '=')
+        padding++;
+
+    for (i = 0; i < size - padding; i++) {
+        if (base64_values[data[i]] < 0)
+            Py_RETURN_NONE;
+    }
+
+    status = NRXorKey_init(&cipher, key);
+
+    if (status <= 0)
+        return status < 0 ? NULL : (Py_INCREF(Py_None), Py_None);
+
+    length = size / 4 * 3 - padding;
+
+    decrypted = PyMem_Malloc(length ? length : 1);
+
+    if (!decrypted) {
+        PyErr_NoMemory();
+        goto done;
+    }
+
+    for (i = 0; i < size; i += NR_XOR_BLOCK / 3 * 4) {
+        Py_ssize_t count = size - i < NR_XOR_BLOCK / 3 * 4 ?
+                size - i : NR_XOR_BLOCK / 3 * 4;
+        Py_ssize_t offset = i / 4 * 3;
+        Py_ssize_t decoded = count / 4 * 3;
+
+        if (i + count == size)
+            decoded -= padding;
+
+        NRBase64_decode(data + i, count, i + count == size ? padding : 0,
+                block);
+        NRXorKey_apply(&cipher, block, decrypted + offset, decoded);
+    }
+
+    result = PyUnicode_DecodeUTF8((const char *)decrypted, length, NULL);
+
+    /* Invalid UTF-8 is left to fail in the same way as before. */
+
+    if (!result) {
+        PyErr_Clear();
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+
+done:
+    NRXorKey_free(&cipher);
+    PyMem_Free(decrypted);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyMethodDef encoding_utils_methods[] = {
+    { "json_encode",        json_encode,
+                            METH_VARARGS, 0 },
+    { "json_encode_chunks", json_encode_chunks,
+                            METH_VARARGS, 0 },
+    { "decode_traceparent", decode_traceparent,
+                            METH_O, 0 },
+    { "split_tracestate",   split_tracestate,
+                            METH_VARARGS, 0 },
+    { "decode_nr_tracestate", decode_nr_tracestate,
+                            METH_VARARGS, 0 },
+    { "format_trace_context", format_trace_context,
+                            METH_VARARGS, 0 },
+    { "xor_cipher_encrypt_base64", xor_cipher_encrypt_base64,
+                            METH_VARARGS, 0 },
+    { "xor_cipher_decrypt_base64", xor_cipher_decrypt_base64,
+                            METH_VARARGS, 0 },
+    { NULL, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_encoding_utils",      /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    encoding_utils_methods, /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_encoding_utils", encoding_utils_methods, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+#if PY_MAJOR_VERSION >= 3
+    parent_types[0] = PyUnicode_InternFromString("App");
+    parent_types[1] = PyUnicode_InternFromString("Browser");
+    parent_types[2] = PyUnicode_InternFromString("Mobile");
+#else
+    parent_types[0] = PyString_InternFromString("App");
+    parent_types[1] = PyString_InternFromString("Browser");
+    parent_types[2] = PyString_InternFromString("Mobile");
+#endif
+
+    if (!parent_types[0] || !parent_types[1] || !parent_types[2])
+        return NULL;
+
+    NRBase64_init();
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_encoding_utils(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__encoding_utils(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
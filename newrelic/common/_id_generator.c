@@ -0,0 +1,373 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Generator for the random identifiers used as span guids and trace ids.
+ * Each thread has its own xoshiro256** generator state, seeded from a
+ * process wide seed which is taken from the operating system entropy
+ * source when the module is loaded. The seed is perturbed in a child
+ * process after a fork, so the parent and child, or two children, do
+ * not go on to produce the same identifiers. Results are formatted as
+ * zero padded lower case hex directly into the new string object, a
+ * byte at a time, using a lookup table. The identifiers are not suitable
+ * for any cryptographic purpose.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#include <pythread.h>
+
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+#if defined(_MSC_VER)
+#define NR_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__) || defined(__clang__)
+#define NR_THREAD_LOCAL __thread
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+typedef unsigned long long nr_uint64_t;
+
+typedef struct {
+    nr_uint64_t s[4];
+    unsigned long generation;
+} NRRandomState;
+
+/*
+ * Where the compiler does not support thread local storage all threads
+ * share the one generator state, which is still safe as the GIL is held
+ * whenever an identifier is generated.
+ */
+
+#if defined(NR_THREAD_LOCAL)
+static NR_THREAD_LOCAL NRRandomState thread_state;
+#else
+static NRRandomState thread_state;
+#endif
+
+static nr_uint64_t process_seed = 0;
+
+/*
+ * Incremented whenever the process seed changes. Thread state with an
+ * older generation, including that left over from a thread which called
+ * fork(), is reseeded before next being used. Zero is never a valid
+ * generation so that state which has never been seeded is detected.
+ */
+
+static volatile unsigned long process_generation = 1;
+
+static char hex_pairs[512];
+
+/* ------------------------------------------------------------------------- */
+
+static nr_uint64_t splitmix64(nr_uint64_t *x)
+{
+    nr_uint64_t z;
+
+    z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+static nr_uint64_t rotl(nr_uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static void NRRandom_seed(NRRandomState *state)
+{
+    nr_uint64_t x;
+
+    /*
+     * Each thread draws its seed from the process wide sequence, which
+     * is only advanced while the GIL is held, and mixes in its own
+     * identity so threads which seed at the same time still diverge.
+     */
+
+    x = splitmix64(&process_seed);
+    x ^= (nr_uint64_t)PyThread_get_thread_ident() * 0xd1342543de82ef95ULL;
+    x ^= (nr_uint64_t)(Py_uintptr_t)state;
+
+    do {
+        state->s[0] = splitmix64(&x);
+        state->s[1] = splitmix64(&x);
+        state->s[2] = splitmix64(&x);
+        state->s[3] = splitmix64(&x);
+    } while (!(state->s[0] | state->s[1] | state->s[2] | state->s[3]));
+
+    state->generation = process_generation;
+}
+
+static nr_uint64_t NRRandom_next(void)
+{
+    NRRandomState *state = &thread_state;
+    nr_uint64_t *s = state->s;
+    nr_uint64_t result;
+    nr_uint64_t t;
+
+    if (state->generation != process_generation)
+        NRRandom_seed(state);
+
+    /* xoshiro256** 1.0 */
+
+    result = rotl(s[1] * 5, 7) * 9;
+    t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+
+    s[2] ^= t;
+
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+static nr_uint64_t NRRandom_next_nonzero(void)
+{
+    nr_uint64_t value;
+
+    /*
+     * An all zero span id or trace id is invalid under W3C trace
+     * context, so never generate one.
+     */
+
+    do {
+        value = NRRandom_next();
+    } while (!value);
+
+    return value;
+}
+
+static nr_uint64_t NRRandom_clock(void)
+{
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return (nr_uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+
+    return (nr_uint64_t)time(NULL) ^ (nr_uint64_t)clock();
+}
+
+#if !defined(_WIN32)
+static void NRRandom_after_fork_child(void)
+{
+    /*
+     * Only async signal safe operations are permitted here, so rather
+     * than reading the entropy source again the seed is perturbed using
+     * the process ID and clock of the child.
+     */
+
+    process_seed ^= ((nr_uint64_t)getpid() << 32) ^ NRRandom_clock();
+
+    process_generation += 1;
+
+    if (!process_generation)
+        process_generation = 1;
+}
+#endif
+
+static int NRRandom_initialize(void)
+{
+    PyObject *module;
+    PyObject *bytes;
+    nr_uint64_t seed = 0;
+
+    Py_ssize_t i;
+
+    module = PyImport_ImportModule("os");
+
+    if (!module)
+        return -1;
+
+    bytes = PyObject_CallMethod(module, "urandom", "i", 8);
+
+    Py_DECREF(module);
+
+    if (bytes && PyBytes_Check(bytes) && PyBytes_GET_SIZE(bytes) == 8) {
+        for (i = 0; i < 8; i++) {
+            seed = (seed << 8) |
+                    (unsigned char)PyBytes_AS_STRING(bytes)[i];
+        }
+    }
+    else
+        PyErr_Clear();
+
+    Py_XDECREF(bytes);
+
+#if !defined(_WIN32)
+    seed ^= (nr_uint64_t)getpid() << 32;
+#endif
+
+    process_seed = seed ^ NRRandom_clock();
+
+#if !defined(_WIN32)
+    pthread_atfork(NULL, NULL, NRRandom_after_fork_child);
+#endif
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void NRHex_write(char *output, nr_uint64_t value)
+{
+    int i;
+
+    for (i = 7; i >= 0; i--) {
+        memcpy(output + i * 2, hex_pairs + (value & 0xff) * 2, 2);
+        value >>= 8;
+    }
+}
+
+static PyObject *NRHex_string(Py_ssize_t length, char **data)
+{
+    PyObject *result;
+
+#if PY_MAJOR_VERSION >= 3
+    result = PyUnicode_New(length, 127);
+
+    if (result)
+        *data = (char *)PyUnicode_1BYTE_DATA(result);
+#else
+    result = PyString_FromStringAndSize(NULL, length);
+
+    if (result)
+        *data = PyString_AS_STRING(result);
+#endif
+
+    return result;
+}
+
+static PyObject *span_id(PyObject *self, PyObject *args)
+{
+    PyObject *result;
+    char *data;
+
+    result = NRHex_string(16, &data);
+
+    if (result)
+        NRHex_write(data, NRRandom_next_nonzero());
+
+    return result;
+}
+
+static PyObject *trace_id(PyObject *self, PyObject *args)
+{
+    PyObject *result;
+    char *data;
+
+    nr_uint64_t high;
+    nr_uint64_t low;
+
+    result = NRHex_string(32, &data);
+
+    if (!result)
+        return NULL;
+
+    high = NRRandom_next();
+    low = high ? NRRandom_next() : NRRandom_next_nonzero();
+
+    NRHex_write(data, high);
+    NRHex_write(data + 16, low);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyMethodDef id_generator_methods[] = {
+    { "span_id",            span_id,
+                            METH_NOARGS, 0 },
+    { "trace_id",           trace_id,
+                            METH_NOARGS, 0 },
+    { NULL, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_id_generator",        /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    id_generator_methods,   /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+    static const char digits[] = "0123456789abcdef";
+    int i;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_id_generator", id_generator_methods, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    for (i = 0; i < 256; i++) {
+        hex_pairs[i * 2] = digits[i >> 4];
+        hex_pairs[i * 2 + 1] = digits[i & 0xf];
+    }
+
+    if (NRRandom_initialize() < 0)
+        return NULL;
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_id_generator(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__id_generator(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
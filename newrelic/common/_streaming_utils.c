@@ -0,0 +1,815 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native encoder for the com.newrelic.trace.v1.Span message sent to the
+ * trace observer for infinite tracing. The protobuf wire format is written
+ * directly from the dictionaries of span attributes, with the values being
+ * converted the same way as SpanProtoAttrs.get_attribute_value() does, and
+ * without creating any of the generated message objects. Anything which
+ * would fail to convert is left to the Python implementation, so that the
+ * same errors are raised.
+ *
+ * The queue which holds spans until the thread sending them to the trace
+ * observer takes them is also implemented here.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#include <string.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+/* Field numbers of the Span and AttributeValue messages. */
+
+#define NR_SPAN_TRACE_ID 1
+#define NR_SPAN_INTRINSICS 2
+#define NR_SPAN_USER_ATTRIBUTES 3
+#define NR_SPAN_AGENT_ATTRIBUTES 4
+
+#define NR_VALUE_STRING 1
+#define NR_VALUE_BOOL 2
+#define NR_VALUE_INT 3
+#define NR_VALUE_DOUBLE 4
+
+#define NR_WIRE_VARINT 0
+#define NR_WIRE_FIXED64 1
+#define NR_WIRE_LENGTH 2
+
+#define NR_TAG(field, wire) (((field) << 3) | (wire))
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    unsigned char *data;
+    Py_ssize_t size;
+    Py_ssize_t allocated;
+} NRBuffer;
+
+static int NRBuffer_reserve(NRBuffer *self, Py_ssize_t size)
+{
+    unsigned char *data;
+    Py_ssize_t allocated;
+
+    if (self->size + size <= self->allocated)
+        return 0;
+
+    allocated = self->allocated ? self->allocated : 256;
+
+    while (allocated < self->size + size)
+        allocated *= 2;
+
+    data = PyMem_Realloc(self->data, allocated);
+
+    if (!data) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    self->data = data;
+    self->allocated = allocated;
+
+    return 0;
+}
+
+static void NRBuffer_free(NRBuffer *self)
+{
+    PyMem_Free(self->data);
+
+    self->data = NULL;
+}
+
+/*
+ * The write functions below assume that space has been reserved, with a
+ * varint never needing more than 10 bytes.
+ */
+
+static void NRBuffer_write_varint(NRBuffer *self, unsigned long long value)
+{
+    while (value >= 0x80) {
+        self->data[self->size++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+
+    self->data[self->size++] = (unsigned char)value;
+}
+
+static void NRBuffer_write(NRBuffer *self, const char *data, Py_ssize_t size)
+{
+    memcpy(self->data + self->size, data, size);
+    self->size += size;
+}
+
+static void NRBuffer_write_fixed64(NRBuffer *self, unsigned long long value)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        self->data[self->size++] = (unsigned char)(value >> (8 * i));
+}
+
+static Py_ssize_t NRVarint_size(unsigned long long value)
+{
+    Py_ssize_t size = 1;
+
+    while (value >= 0x80) {
+        value >>= 7;
+        size++;
+    }
+
+    return size;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns the UTF-8 encoding of a string, held by a new reference to an
+ * object which must be released once the data is no longer needed. Returns
+ * NULL without an exception set where the protobuf implementation would
+ * reject the string, or where it isn't a string at all.
+ */
+
+static PyObject *NRString_AsUTF8(PyObject *value, const char **data,
+        Py_ssize_t *size)
+{
+#if PY_MAJOR_VERSION >= 3
+    if (!PyUnicode_Check(value))
+        return NULL;
+
+    *data = PyUnicode_AsUTF8AndSize(value, size);
+
+    if (!*data) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    Py_INCREF(value);
+
+    return value;
+#else
+    PyObject *encoded;
+
+    if (PyUnicode_Check(value)) {
+        encoded = PyUnicode_AsUTF8String(value);
+
+        if (!encoded) {
+            PyErr_Clear();
+            return NULL;
+        }
+    }
+    else if (PyString_Check(value)) {
+        PyObject *decoded;
+
+        /* Byte strings are only accepted if they are valid UTF-8. */
+
+        decoded = PyUnicode_DecodeUTF8(PyString_AS_STRING(value),
+                PyString_GET_SIZE(value), NULL);
+
+        if (!decoded) {
+            PyErr_Clear();
+            return NULL;
+        }
+
+        Py_DECREF(decoded);
+
+        Py_INCREF(value);
+        encoded = value;
+    }
+    else {
+        return NULL;
+    }
+
+    *data = PyString_AS_STRING(encoded);
+    *size = PyString_GET_SIZE(encoded);
+
+    return encoded;
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    int field;
+    unsigned long long number;
+    const char *data;
+    Py_ssize_t size;
+    PyObject *owner;
+} NRAttributeValue;
+
+/*
+ * Converts a value the same way as SpanProtoAttrs.get_attribute_value(),
+ * returning 0 on success and -1 if it is left to the Python code, in which
+ * case any exception raised has been cleared.
+ */
+
+static int NRAttributeValue_init(NRAttributeValue *self, PyObject *value)
+{
+    PyObject *text;
+
+    self->owner = NULL;
+
+    if (PyBool_Check(value)) {
+        self->field = NR_VALUE_BOOL;
+        self->number = value == Py_True;
+
+        return 0;
+    }
+
+    if (PyFloat_Check(value)) {
+        double real = PyFloat_AsDouble(value);
+
+        self->field = NR_VALUE_DOUBLE;
+        memcpy(&self->number, &real, sizeof(real));
+
+        return 0;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyLong_Check(value)) {
+#else
+    if (PyInt_Check(value) || PyLong_Check(value)) {
+#endif
+        int overflow = 0;
+        long long number;
+
+        number = PyLong_AsLongLongAndOverflow(value, &overflow);
+
+        if (overflow || (number == -1 && PyErr_Occurred())) {
+            PyErr_Clear();
+            return -1;
+        }
+
+        self->field = NR_VALUE_INT;
+        self->number = (unsigned long long)number;
+
+        return 0;
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_CheckExact(value)) {
+#else
+    if (PyString_CheckExact(value) || PyUnicode_CheckExact(value)) {
+#endif
+        Py_INCREF(value);
+        text = value;
+    }
+    else {
+        text = PyObject_Str(value);
+
+        if (!text) {
+            PyErr_Clear();
+            return -1;
+        }
+    }
+
+    self->field = NR_VALUE_STRING;
+    self->owner = NRString_AsUTF8(text, &self->data, &self->size);
+
+    Py_DECREF(text);
+
+    return self->owner ? 0 : -1;
+}
+
+static Py_ssize_t NRAttributeValue_size(NRAttributeValue *self)
+{
+    switch (self->field) {
+        case NR_VALUE_STRING:
+            return 1 + NRVarint_size(self->size) + self->size;
+        case NR_VALUE_DOUBLE:
+            return 1 + 8;
+        default:
+            return 1 + NRVarint_size(self->number);
+    }
+}
+
+static void NRAttributeValue_write(NRAttributeValue *self, NRBuffer *buffer)
+{
+    switch (self->field) {
+        case NR_VALUE_STRING:
+            NRBuffer_write_varint(buffer,
+                    NR_TAG(NR_VALUE_STRING, NR_WIRE_LENGTH));
+            NRBuffer_write_varint(buffer, self->size);
+            NRBuffer_write(buffer, self->data, self->size);
+            break;
+        case NR_VALUE_DOUBLE:
+            NRBuffer_write_varint(buffer,
+                    NR_TAG(NR_VALUE_DOUBLE, NR_WIRE_FIXED64));
+            NRBuffer_write_fixed64(buffer, self->number);
+            break;
+        default:
+            NRBuffer_write_varint(buffer,
+                    NR_TAG(self->field, NR_WIRE_VARINT));
+            NRBuffer_write_varint(buffer, self->number);
+            break;
+    }
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Writes each item of the dictionary as an entry of the map field, which
+ * is a message with the key as field 1, omitted if empty as for any proto3
+ * string, and the AttributeValue as field 2. Returns 0 on success and -1 if
+ * the span is left to the Python code, with an exception set only where it
+ * is an error from running out of memory.
+ */
+
+static int NRSpan_write_attributes(NRBuffer *buffer, int field,
+        PyObject *attributes)
+{
+    PyObject *key;
+    PyObject *value;
+    Py_ssize_t pos = 0;
+
+    if (!PyDict_Check(attributes))
+        return -1;
+
+    while (PyDict_Next(attributes, &pos, &key, &value)) {
+        NRAttributeValue attribute;
+        PyObject *owner;
+
+        const char *data = NULL;
+        Py_ssize_t size = 0;
+        Py_ssize_t value_size;
+        Py_ssize_t entry_size;
+
+        owner = NRString_AsUTF8(key, &data, &size);
+
+        if (!owner)
+            return -1;
+
+        if (NRAttributeValue_init(&attribute, value) < 0) {
+            Py_DECREF(owner);
+            return -1;
+        }
+
+        value_size = NRAttributeValue_size(&attribute);
+
+        entry_size = 1 + NRVarint_size(value_size) + value_size;
+
+        if (size)
+            entry_size += 1 + NRVarint_size(size) + size;
+
+        if (NRBuffer_reserve(buffer, 1 + 10 + entry_size) < 0) {
+            Py_XDECREF(attribute.owner);
+            Py_DECREF(owner);
+            return -1;
+        }
+
+        NRBuffer_write_varint(buffer, NR_TAG(field, NR_WIRE_LENGTH));
+        NRBuffer_write_varint(buffer, entry_size);
+
+        if (size) {
+            NRBuffer_write_varint(buffer, NR_TAG(1, NR_WIRE_LENGTH));
+            NRBuffer_write_varint(buffer, size);
+            NRBuffer_write(buffer, data, size);
+        }
+
+        NRBuffer_write_varint(buffer, NR_TAG(2, NR_WIRE_LENGTH));
+        NRBuffer_write_varint(buffer, value_size);
+        NRAttributeValue_write(&attribute, buffer);
+
+        Py_XDECREF(attribute.owner);
+        Py_DECREF(owner);
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns the serialized Span message as a byte string, or None if the span
+ * is left to the Python implementation.
+ */
+
+static PyObject *encode_span(PyObject *self, PyObject *args)
+{
+    PyObject *trace_id = NULL;
+    PyObject *intrinsics = NULL;
+    PyObject *user_attributes = NULL;
+    PyObject *agent_attributes = NULL;
+
+    NRBuffer buffer = { NULL, 0, 0 };
+    PyObject *result = NULL;
+
+    if (!PyArg_ParseTuple(args, "OOOO:encode_span", &trace_id, &intrinsics,
+            &user_attributes, &agent_attributes)) {
+        return NULL;
+    }
+
+    if (trace_id != Py_None) {
+        PyObject *owner;
+        const char *data = NULL;
+        Py_ssize_t size = 0;
+
+        owner = NRString_AsUTF8(trace_id, &data, &size);
+
+        if (!owner)
+            goto fallback;
+
+        if (size) {
+            if (NRBuffer_reserve(&buffer, 1 + 10 + size) < 0) {
+                Py_DECREF(owner);
+                goto done;
+            }
+
+            NRBuffer_write_varint(&buffer,
+                    NR_TAG(NR_SPAN_TRACE_ID, NR_WIRE_LENGTH));
+            NRBuffer_write_varint(&buffer, size);
+            NRBuffer_write(&buffer, data, size);
+        }
+
+        Py_DECREF(owner);
+    }
+
+    if (NRSpan_write_attributes(&buffer, NR_SPAN_INTRINSICS,
+            intrinsics) < 0 ||
+            NRSpan_write_attributes(&buffer, NR_SPAN_USER_ATTRIBUTES,
+            user_attributes) < 0 ||
+            NRSpan_write_attributes(&buffer, NR_SPAN_AGENT_ATTRIBUTES,
+            agent_attributes) < 0) {
+        if (PyErr_Occurred())
+            goto done;
+
+        goto fallback;
+    }
+
+    result = PyBytes_FromStringAndSize((const char *)buffer.data,
+            buffer.size);
+
+    goto done;
+
+fallback:
+    Py_INCREF(Py_None);
+    result = Py_None;
+
+done:
+    NRBuffer_free(&buffer);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Bounded queue holding the spans waiting to be sent to the trace observer.
+ * Items are held in a fixed size ring buffer, with the oldest item being
+ * dropped when the queue is full, as for a deque with a maximum length. As
+ * with the queue used by the transaction recorder, all access happens with
+ * the GIL held, so adding a span takes no lock. The thread sending spans
+ * takes them in batches, with StreamBuffer in streaming_utils.py only
+ * using a condition variable where that thread has found the queue empty.
+ */
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject **items;
+    Py_ssize_t maxlen;
+    Py_ssize_t head;
+    Py_ssize_t length;
+
+    Py_ssize_t seen;
+    Py_ssize_t dropped;
+} NRStreamQueueObject;
+
+extern PyTypeObject NRStreamQueue_Type;
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRStreamQueue_pop(NRStreamQueueObject *self)
+{
+    PyObject *item;
+
+    item = self->items[self->head];
+    self->items[self->head] = NULL;
+
+    self->head = (self->head + 1) % self->maxlen;
+    self->length--;
+
+    return item;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRStreamQueue_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    NRStreamQueueObject *self;
+
+    self = (NRStreamQueueObject *)type->tp_alloc(type, 0);
+
+    if (!self)
+        return NULL;
+
+    self->items = NULL;
+    self->maxlen = -1;
+    self->head = 0;
+    self->length = 0;
+
+    self->seen = 0;
+    self->dropped = 0;
+
+    return (PyObject *)self;
+}
+
+static int NRStreamQueue_init(NRStreamQueueObject *self,
+        PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t maxlen;
+
+    static char *kwlist[] = { "maxlen", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n:StreamQueue",
+            kwlist, &maxlen)) {
+        return -1;
+    }
+
+    if (self->maxlen >= 0) {
+        PyErr_SetString(PyExc_TypeError, "queue is already initialized");
+        return -1;
+    }
+
+    if (maxlen < 0) {
+        PyErr_SetString(PyExc_ValueError, "maxlen must be non-negative");
+        return -1;
+    }
+
+    /* A queue with no space for items counts every item as dropped. */
+
+    if (maxlen) {
+        self->items = PyMem_New(PyObject *, maxlen);
+
+        if (!self->items) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        memset(self->items, 0, sizeof(PyObject *) * maxlen);
+    }
+
+    self->maxlen = maxlen;
+
+    return 0;
+}
+
+static int NRStreamQueue_clear(NRStreamQueueObject *self)
+{
+    PyObject *item;
+
+    while (self->length) {
+        item = NRStreamQueue_pop(self);
+        Py_DECREF(item);
+    }
+
+    return 0;
+}
+
+static int NRStreamQueue_traverse(NRStreamQueueObject *self,
+        visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->length; i++)
+        Py_VISIT(self->items[(self->head + i) % self->maxlen]);
+
+    return 0;
+}
+
+static void NRStreamQueue_dealloc(NRStreamQueueObject *self)
+{
+    PyObject_GC_UnTrack(self);
+
+    NRStreamQueue_clear(self);
+    PyMem_Free(self->items);
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t NRStreamQueue_length(NRStreamQueueObject *self)
+{
+    return self->length;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRStreamQueue_put(NRStreamQueueObject *self,
+        PyObject *item)
+{
+    PyObject *oldest;
+
+    if (self->maxlen < 0) {
+        PyErr_SetString(PyExc_TypeError, "queue is not initialized");
+        return NULL;
+    }
+
+    self->seen++;
+
+    if (self->length == self->maxlen) {
+        self->dropped++;
+
+        if (!self->maxlen)
+            Py_RETURN_NONE;
+
+        oldest = NRStreamQueue_pop(self);
+        Py_DECREF(oldest);
+    }
+
+    Py_INCREF(item);
+    self->items[(self->head + self->length) % self->maxlen] = item;
+    self->length++;
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *NRStreamQueue_drain(NRStreamQueueObject *self,
+        PyObject *args)
+{
+    Py_ssize_t maxcount;
+    Py_ssize_t count;
+    Py_ssize_t i;
+
+    PyObject *result;
+
+    if (!PyArg_ParseTuple(args, "n:drain", &maxcount))
+        return NULL;
+
+    count = self->length < maxcount ? self->length : maxcount;
+
+    if (count < 0)
+        count = 0;
+
+    result = PyList_New(count);
+
+    if (!result)
+        return NULL;
+
+    for (i = 0; i < count; i++)
+        PyList_SET_ITEM(result, i, NRStreamQueue_pop(self));
+
+    return result;
+}
+
+static PyObject *NRStreamQueue_stats(NRStreamQueueObject *self,
+        PyObject *args)
+{
+    PyObject *result;
+
+    result = Py_BuildValue("(nn)", self->seen, self->dropped);
+
+    if (result) {
+        self->seen = 0;
+        self->dropped = 0;
+    }
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PySequenceMethods NRStreamQueue_as_sequence = {
+    (lenfunc)NRStreamQueue_length, /*sq_length*/
+    0,                      /*sq_concat*/
+    0,                      /*sq_repeat*/
+    0,                      /*sq_item*/
+    0,                      /*sq_slice*/
+    0,                      /*sq_ass_item*/
+    0,                      /*sq_ass_slice*/
+    0,                      /*sq_contains*/
+};
+
+static PyMethodDef NRStreamQueue_methods[] = {
+    { "put",                (PyCFunction)NRStreamQueue_put,
+                            METH_O, 0 },
+    { "drain",              (PyCFunction)NRStreamQueue_drain,
+                            METH_VARARGS, 0 },
+    { "stats",              (PyCFunction)NRStreamQueue_stats,
+                            METH_NOARGS, 0 },
+    { NULL, NULL }
+};
+
+PyTypeObject NRStreamQueue_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_streaming_utils.StreamQueue", /*tp_name*/
+    sizeof(NRStreamQueueObject), /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)NRStreamQueue_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    &NRStreamQueue_as_sequence, /*tp_as_sequence*/
+    0,                      /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,     /*tp_flags*/
+    0,                      /*tp_doc*/
+    (traverseproc)NRStreamQueue_traverse, /*tp_traverse*/
+    (inquiry)NRStreamQueue_clear, /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    0,                      /*tp_iter*/
+    0,                      /*tp_iternext*/
+    NRStreamQueue_methods,  /*tp_methods*/
+    0,                      /*tp_members*/
+    0,                      /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    (initproc)NRStreamQueue_init, /*tp_init*/
+    0,                      /*tp_alloc*/
+    NRStreamQueue_new,      /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------- */
+
+static PyMethodDef streaming_utils_methods[] = {
+    { "encode_span",        encode_span,
+                            METH_VARARGS, 0 },
+    { NULL, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_streaming_utils",     /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    streaming_utils_methods, /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_streaming_utils", streaming_utils_methods,
+            NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    if (PyType_Ready(&NRStreamQueue_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&NRStreamQueue_Type);
+    PyModule_AddObject(module, "StreamQueue",
+            (PyObject *)&NRStreamQueue_Type);
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_streaming_utils(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__streaming_utils(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
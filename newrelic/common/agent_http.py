@@ -23,7 +23,11 @@ from pprint import pprint
 import newrelic.packages.urllib3 as urllib3
 from newrelic import version
 from newrelic.common import certs
-from newrelic.common.encoding_utils import json_decode, json_encode
+from newrelic.common.encoding_utils import (
+    json_decode,
+    json_encode,
+    json_encode_chunks,
+)
 from newrelic.common.object_names import callable_name
 from newrelic.common.object_wrapper import patch_function_wrapper
 from newrelic.core.internal_metrics import internal_count_metric, internal_metric
@@ -72,6 +76,78 @@ def _urllib3_ssl_recursion_workaround(wrapped, instance, args, kwargs):
         return wrapped(*args, **kwargs)
 
 
+class EncodedPayload(object):
+    """A JSON payload built up from chunks of its encoding as they are
+    produced. The chunks are held as they are until their total size exceeds
+    the compression threshold, after which each is compressed as soon as it
+    is written, so that the complete uncompressed payload is never held in
+    memory. The length is that of the uncompressed payload.
+    """
+
+    def __init__(
+        self, compression_threshold, compression_method="gzip", compression_level=None
+    ):
+        self._compression_threshold = compression_threshold
+        self._compression_method = compression_method
+        self._compression_level = compression_level or zlib.Z_DEFAULT_COMPRESSION
+        self._compressor = None
+        self._chunks = []
+        self._length = 0
+        self.compression_time = None
+        self.body = None
+
+    def __len__(self):
+        return self._length
+
+    @property
+    def content_encoding(self):
+        if self._compressor is None:
+            return "Identity"
+        return self._compression_method
+
+    def _compress(self, chunk, flush=False):
+        compression_start = time.time()
+
+        if self._compressor is None:
+            wbits = 31 if self._compression_method == "gzip" else 15
+            self._compressor = zlib.compressobj(
+                self._compression_level, zlib.DEFLATED, wbits
+            )
+            self.compression_time = 0.0
+
+        data = self._compressor.compress(chunk)
+        if flush:
+            data += self._compressor.flush()
+
+        self.compression_time += (
+            max(time.time(), compression_start) - compression_start
+        )
+
+        if data:
+            self._chunks.append(data)
+
+    def write(self, chunk):
+        self._length += len(chunk)
+
+        if self._compressor is not None:
+            self._compress(chunk)
+        elif self._length > self._compression_threshold:
+            chunks, self._chunks = self._chunks, []
+            chunks.append(chunk)
+            self._compress(b"".join(chunks))
+        else:
+            self._chunks.append(chunk)
+
+    def close(self):
+        if self._compressor is not None:
+            self._compress(b"", flush=True)
+
+        self.body = b"".join(self._chunks)
+        self._chunks = None
+
+        return self.body
+
+
 class BaseClient(object):
     AUDIT_LOG_ID = 0
 
@@ -107,6 +183,9 @@ class BaseClient(object):
     def finalize(self):
         pass
 
+    def encode_payload(self, payload):
+        return json_encode(payload).encode("utf-8")
+
     @staticmethod
     def _supportability_request(params, payload, body, compression_time):
         pass
@@ -378,19 +457,25 @@ class HttpClient(BaseClient):
             fp, method, url, params, payload, headers, body, compression_time
         )
 
-    @staticmethod
-    def _compress(data, method="gzip", level=None):
-        compression_start = time.time()
-        level = level or zlib.Z_DEFAULT_COMPRESSION
-        wbits = 31 if method == "gzip" else 15
+    def _encoded_payload(self):
+        return EncodedPayload(
+            self._compression_threshold,
+            self._compression_method,
+            self._compression_level,
+        )
 
-        compressor = zlib.compressobj(level, zlib.DEFLATED, wbits)
-        data = compressor.compress(data)
-        data += compressor.flush()
+    def encode_payload(self, payload):
+        # The audit log records the uncompressed payload, so it must still
+        # be encoded in full when audit logging is enabled.
 
-        compression_time = max(time.time(), compression_start) - compression_start
+        if self._audit_log_fp:
+            return super(HttpClient, self).encode_payload(payload)
 
-        return data, compression_time
+        encoded = self._encoded_payload()
+        json_encode_chunks(payload, encoded.write)
+        encoded.close()
+
+        return encoded
 
     def send_request(
         self,
@@ -413,17 +498,15 @@ class HttpClient(BaseClient):
         body = payload
         compression_time = None
         if payload is not None:
-            if len(payload) > self._compression_threshold:
-                body, compression_time = self._compress(
-                    payload,
-                    method=self._compression_method,
-                    level=self._compression_level,
-                )
-                content_encoding = self._compression_method
-            else:
-                content_encoding = "Identity"
-
-            merged_headers["Content-Encoding"] = content_encoding
+            encoded = payload
+            if not isinstance(encoded, EncodedPayload):
+                encoded = self._encoded_payload()
+                encoded.write(payload)
+                encoded.close()
+
+            body = encoded.body
+            compression_time = encoded.compression_time
+            merged_headers["Content-Encoding"] = encoded.content_encoding
 
         request_id = self.log_request(
             self._audit_log_fp,
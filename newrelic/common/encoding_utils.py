@@ -41,6 +41,67 @@ PARENT_TYPE = {
 BASE64_DECODE_STR = getattr(base64, 'decodestring', None)
 
 
+# Functions for generating span guids and trace ids. The optional C
+# extension keeps separate generator state for each thread and formats
+# the result without going through string formatting.
+
+try:
+    from newrelic.common._id_generator import span_id as generate_span_id
+    from newrelic.common._id_generator import trace_id as generate_trace_id
+
+except ImportError:
+    def generate_span_id():
+        """Returns a random 16 digit hex string, padded with zeros."""
+        return '%016x' % random.getrandbits(64)
+
+    def generate_trace_id():
+        """Returns a random 32 digit hex string, padded with zeros."""
+        return '%032x' % random.getrandbits(128)
+
+
+# The optional C extension produces the same output as json_encode() below
+# does when no additional arguments are supplied.
+
+try:
+    from newrelic.common._encoding_utils import (
+            json_encode as _native_json_encode,
+            json_encode_chunks as _native_json_encode_chunks)
+except ImportError:
+    _native_json_encode = None
+    _native_json_encode_chunks = None
+
+
+# The optional C extension also parses and formats the W3C trace context
+# headers. Where the result of formatting could differ, it returns None
+# and the classes below are used instead.
+
+try:
+    from newrelic.common._encoding_utils import (
+            decode_traceparent as _native_decode_traceparent,
+            split_tracestate as _native_split_tracestate,
+            decode_nr_tracestate as _native_decode_nr_tracestate,
+            format_trace_context as _native_format_trace_context)
+except ImportError:
+    _native_decode_traceparent = None
+    _native_split_tracestate = None
+    _native_decode_nr_tracestate = None
+    _native_format_trace_context = None
+
+
+# The optional C extension also implements the XOR cipher combined with
+# base64 encoding used for obfuscation. Where the input is of a type or
+# form it does not handle, or the result would be an error, it returns
+# None and the functions below do the work instead.
+
+try:
+    from newrelic.common._encoding_utils import (
+            xor_cipher_encrypt_base64 as _native_xor_cipher_encrypt_base64,
+            xor_cipher_decrypt_base64 as _native_xor_cipher_decrypt_base64)
+except ImportError:
+    _native_xor_cipher_encrypt_base64 = None
+    _native_xor_cipher_decrypt_base64 = None
+
+
 # Functions for encoding/decoding JSON. These wrappers are used in order
 # to hide the differences between Python 2 and Python 3 implementations
 # of the json module functions as well as instigate some better defaults
@@ -49,6 +110,9 @@ BASE64_DECODE_STR = getattr(base64, 'decodestring', None)
 # defaults.
 
 def json_encode(obj, **kwargs):
+    if _native_json_encode is not None and not kwargs:
+        return _native_json_encode(obj)
+
     _kwargs = {}
 
     # This wrapper function needs to deal with a few issues.
@@ -105,6 +169,18 @@ def json_encode(obj, **kwargs):
     return json.dumps(obj, **_kwargs)
 
 
+def json_encode_chunks(obj, write, chunk_size=64 * 1024):
+    # Passes the output of json_encode() as UTF-8 encoded byte strings to
+    # write() as it is produced, in chunks of at least chunk_size bytes but
+    # for the last. The C extension does this without ever holding the
+    # complete output in memory. Otherwise it is passed as one chunk.
+
+    if _native_json_encode_chunks is not None:
+        return _native_json_encode_chunks(obj, write, chunk_size)
+
+    write(json_encode(obj).encode('utf-8'))
+
+
 def json_decode(s, **kwargs):
     # Nothing special to do here at this point but use a wrapper to be
     # consistent with encoding and allow for changes later.
@@ -173,6 +249,11 @@ def xor_cipher_encrypt_base64(text, key):
 
     """
 
+    if _native_xor_cipher_encrypt_base64 is not None:
+        result = _native_xor_cipher_encrypt_base64(text, key)
+        if result is not None:
+            return result
+
     if not isinstance(key, bytearray):
         key = xor_cipher_genkey(key)
 
@@ -218,6 +299,11 @@ def xor_cipher_decrypt_base64(text, key):
 
     """
 
+    if _native_xor_cipher_decrypt_base64 is not None:
+        result = _native_xor_cipher_decrypt_base64(text, key)
+        if result is not None:
+            return result
+
     if not isinstance(key, bytearray):
         key = xor_cipher_genkey(key)
 
@@ -442,7 +528,7 @@ class W3CTraceParent(dict):
         if 'id' in self:
             guid = self['id']
         else:
-            guid = '{:016x}'.format(random.getrandbits(64))
+            guid = generate_span_id()
 
         return '00-{}-{}-{:02x}'.format(
             self['tr'].lower().zfill(32),
@@ -452,6 +538,12 @@ class W3CTraceParent(dict):
 
     @classmethod
     def decode(cls, payload):
+        if _native_decode_traceparent is not None:
+            fields = _native_decode_traceparent(payload)
+            if fields is None:
+                return None
+            return cls(tr=fields[0], id=fields[1])
+
         # Only traceparent with at least 55 chars should be parsed
         if len(payload) < 55:
             return None
@@ -512,6 +604,21 @@ class W3CTraceState(OrderedDict):
 
         return vendors
 
+    @classmethod
+    def split_entry(cls, tracestate, key):
+        # Returns the value of the entry for key, or an empty string if
+        # there is none, along with the names of the other vendors and the
+        # text of the remaining entries.
+
+        if _native_split_tracestate is not None:
+            result = _native_split_tracestate(tracestate, key)
+            if result is not None:
+                return result
+
+        vendors = cls.decode(tracestate)
+        value = vendors.pop(key, '')
+        return value, ','.join(vendors.keys()), vendors.text(limit=31)
+
 
 class NrTraceState(dict):
     FIELDS = ('ty', 'ac', 'ap', 'id', 'tx', 'sa', 'pr')
@@ -538,6 +645,9 @@ class NrTraceState(dict):
 
     @classmethod
     def decode(cls, payload, tk):
+        if _native_decode_nr_tracestate is not None:
+            return _native_decode_nr_tracestate(cls, payload, tk)
+
         fields = payload.split('-', 9)
         if len(fields) >= 9 and all(fields[:4]) and fields[8]:
             data = cls(tk=tk)
@@ -571,3 +681,22 @@ class NrTraceState(dict):
                     data['pr'] = None
 
             return data
+
+
+def format_trace_context(data, tracestate=''):
+    # Returns the traceparent and tracestate headers for the distributed
+    # trace data, with any tracestate received from other vendors appended.
+
+    if _native_format_trace_context is not None:
+        headers = _native_format_trace_context(
+                data, tracestate, generate_span_id)
+        if headers is not None:
+            return headers
+
+    traceparent = W3CTraceParent(data).text()
+
+    nr_tracestate = NrTraceState(data).text()
+    if tracestate:
+        nr_tracestate += ',' + tracestate
+
+    return traceparent, nr_tracestate
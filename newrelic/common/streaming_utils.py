@@ -14,22 +14,94 @@
 
 import collections
 import threading
+import time
+
+import newrelic.packages.six as six
 
 try:
-    from newrelic.core.infinite_tracing_pb2 import AttributeValue
+    from newrelic.core.infinite_tracing_pb2 import AttributeValue, Span
 except:
     AttributeValue = None
+    Span = None
 
+# The optional C extension serializes spans straight to the protobuf wire
+# format. Where a span holds values it does not handle, it returns None and
+# the generated message classes are used instead.
 
-class StreamBuffer(object):
+try:
+    from newrelic.common._streaming_utils import (
+            encode_span as _native_encode_span)
+except ImportError:
+    _native_encode_span = None
+
+
+class _StreamQueue(object):
+
+    """Pure Python implementation of the bounded queue holding spans until
+    they are taken by the thread sending them. When the queue is full, the
+    oldest span in the queue is dropped.
+
+    """
 
     def __init__(self, maxlen):
         self._queue = collections.deque(maxlen=maxlen)
-        self._notify = self.condition()
-        self._shutdown = False
+        self._lock = threading.Lock()
         self._seen = 0
         self._dropped = 0
 
+    def __len__(self):
+        return len(self._queue)
+
+    def put(self, item):
+        with self._lock:
+            self._seen += 1
+
+            if len(self._queue) >= self._queue.maxlen:
+                self._dropped += 1
+
+            self._queue.append(item)
+
+    def drain(self, maxcount):
+        with self._lock:
+            count = min(maxcount, len(self._queue))
+            return [self._queue.popleft() for _ in range(count)]
+
+    def stats(self):
+        with self._lock:
+            seen, dropped = self._seen, self._dropped
+            self._seen, self._dropped = 0, 0
+
+        return seen, dropped
+
+
+try:
+    from newrelic.common._streaming_utils import StreamQueue
+except ImportError:
+    StreamQueue = _StreamQueue
+
+
+class StreamBuffer(object):
+
+    # The number of spans the thread sending them takes from the queue at
+    # a time. Spans taken are no longer subject to being dropped.
+
+    BATCH_SIZE = 100
+
+    def __init__(self, maxlen):
+        self._queue = StreamQueue(maxlen)
+        self._batch = []
+        self._requeued = []
+        self._notify = self.condition()
+        self._shutdown = False
+        self._waiting = False
+        self._lingering = 0
+
+        # The thread sending spans is the only consumer, except briefly
+        # where the stream is reestablished while the request thread of
+        # the previous call is still waiting for a span.
+
+        self._consumer = threading.Lock()
+
     @staticmethod
     def condition(*args, **kwargs):
         return threading.Condition(*args, **kwargs)
@@ -40,49 +112,186 @@ class StreamBuffer(object):
             self._notify.notify_all()
 
     def put(self, item):
+        if self._shutdown:
+            return
+
+        self._queue.put(item)
+
+        # The condition is only used where the thread sending spans found
+        # the queue empty and is waiting. It sets the flag while holding
+        # the condition and before checking the queue again, so any span
+        # added after that check will see the flag and wake it. The flag is
+        # cleared by whichever thread wakes it so that it is woken once.
+
+        if self._waiting:
+            with self._notify:
+                if self._waiting:
+                    self._waiting = False
+                    self._notify.notify_all()
+
+        # Where the thread sending spans is waiting for a batch to fill,
+        # it is only woken once the queue holds enough spans to fill it.
+
+        elif self._lingering and len(self._queue) >= self._lingering:
+            with self._notify:
+                if self._lingering:
+                    self._lingering = 0
+                    self._notify.notify_all()
+
+    def requeue(self, spans):
+        """Puts spans back which were taken from the buffer but could not
+        be sent, so that they are sent before any others.
+
+        """
+
+        # The spans are not added to those held by the consumer directly,
+        # as a request thread of a previous call may still be waiting
+        # for a span while holding the consumer lock.
+
         with self._notify:
-            if self._shutdown:
-                return
+            self._requeued = list(spans) + self._requeued
 
-            self._seen += 1
+    def _take_requeued(self):
+        # Must be called with the consumer lock held.
 
-            # NOTE: dropped can be over-counted as the queue approaches
-            # capacity while data is still being transmitted.
-            #
-            # This is because the length of the queue can be changing as it's
-            # being measured.
-            if len(self._queue) >= self._queue.maxlen:
-                self._dropped += 1
+        with self._notify:
+            spans = self._requeued
+            self._requeued = []
 
-            self._queue.append(item)
-            self._notify.notify_all()
+        self._batch.extend(reversed(spans))
 
     def stats(self):
+        return self._queue.stats()
+
+    def _wait(self):
         with self._notify:
-            seen, dropped = self._seen, self._dropped
-            self._seen, self._dropped = 0, 0
+            self._waiting = True
 
-        return seen, dropped
+            if not self._shutdown and not len(self._queue):
+                self._notify.wait()
+
+            self._waiting = False
 
     def __next__(self):
-        while True:
-            if self._shutdown:
-                raise StopIteration
+        with self._consumer:
+            if self._requeued:
+                self._take_requeued()
 
-            try:
-                return self._queue.popleft()
-            except IndexError:
-                pass
+            while True:
+                if self._shutdown:
+                    raise StopIteration
 
-            with self._notify:
-                if not self._shutdown and not self._queue:
-                    self._notify.wait()
+                if self._batch:
+                    return self._batch.pop()
+
+                batch = self._queue.drain(self.BATCH_SIZE)
+
+                if batch:
+                    batch.reverse()
+                    self._batch = batch
+                    continue
+
+                self._wait()
+
+    next = __next__
+
+    def __iter__(self):
+        return self
+
+    def next_batch(self, batch_size, batch_latency):
+        """Returns a list of up to batch_size spans, oldest first. Once
+        there is at least one span, waits up to batch_latency seconds for
+        the batch to fill before returning it as it is.
+
+        """
+
+        with self._consumer:
+            if self._requeued:
+                self._take_requeued()
+
+            # Spans already taken from the queue by __next__() are held in
+            # reverse order and are sent first.
+
+            if len(self._batch) > batch_size:
+                batch = self._batch[:-batch_size - 1:-1]
+                del self._batch[-batch_size:]
+                return batch
+
+            batch = self._batch[::-1]
+            self._batch = []
+
+            deadline = None
+
+            while True:
+                if self._shutdown:
+                    raise StopIteration
+
+                if len(batch) < batch_size:
+                    batch.extend(self._queue.drain(batch_size - len(batch)))
+
+                if len(batch) >= batch_size:
+                    return batch
+
+                if not batch:
+                    self._wait()
+                    continue
+
+                if deadline is None:
+                    deadline = time.time() + batch_latency
+
+                timeout = deadline - time.time()
+
+                if timeout <= 0:
+                    return batch
+
+                # As with waiting for the queue to be non empty, the flag
+                # is set before checking the queue again, so a producer
+                # filling the batch after that check will wake the thread.
+
+                with self._notify:
+                    self._lingering = batch_size - len(batch)
+
+                    if not self._shutdown and len(self._queue) < self._lingering:
+                        self._notify.wait(timeout)
+
+                    self._lingering = 0
+
+    def batches(self, batch_size, batch_latency):
+        return StreamBatchIterator(self, batch_size, batch_latency)
+
+
+class StreamBatchIterator(object):
+
+    """Iterates over the spans put on a stream buffer in batches, for
+    sending as SpanBatch messages rather than as a message per span.
+
+    """
+
+    def __init__(self, stream_buffer, batch_size, batch_latency):
+        self.stream_buffer = stream_buffer
+        self.batch_size = max(batch_size, 1)
+        self.batch_latency = max(batch_latency, 0.0)
+        self.batch = None
+
+    def __next__(self):
+        self.batch = self.stream_buffer.next_batch(self.batch_size,
+                self.batch_latency)
+        return self.batch
 
     next = __next__
 
     def __iter__(self):
         return self
 
+    def requeue(self):
+        # Puts the spans of the last batch back on the stream buffer,
+        # where the call it was sent on failed.
+
+        batch, self.batch = self.batch, None
+
+        if batch:
+            self.stream_buffer.requeue(batch)
+
 
 class SpanProtoAttrs(dict):
     def __init__(self, *args, **kwargs):
@@ -118,7 +327,27 @@ class SpanProtoAttrs(dict):
             return AttributeValue(bool_value=value)
         elif isinstance(value, float):
             return AttributeValue(double_value=value)
-        elif isinstance(value, int):
+        elif isinstance(value, six.integer_types):
             return AttributeValue(int_value=value)
         else:
             return AttributeValue(string_value=str(value))
+
+
+def span_proto(trace_id, intrinsics, user_attributes, agent_attributes):
+    """Returns the span for sending to the trace observer, either already
+    serialized as a byte string, or as a Span message where it could not be
+    encoded natively. Both can be put on the stream buffer, as the streaming
+    RPC sends byte strings as they are.
+
+    """
+
+    if _native_encode_span is not None:
+        span = _native_encode_span(trace_id, intrinsics, user_attributes,
+                agent_attributes)
+        if span is not None:
+            return span
+
+    return Span(trace_id=trace_id,
+            intrinsics=SpanProtoAttrs(intrinsics),
+            user_attributes=SpanProtoAttrs(user_attributes),
+            agent_attributes=SpanProtoAttrs(agent_attributes))
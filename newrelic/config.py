@@ -518,6 +518,11 @@ def _process_configuration(section):
     _process_setting(section, "apdex_t", "getfloat", None)
     _process_setting(section, "event_loop_visibility.enabled", "getboolean", None)
     _process_setting(section, "event_loop_visibility.blocking_threshold", "getfloat", None)
+    _process_setting(section, "trace_cache.backend", "get", None)
+    _process_setting(section, "transaction_recording.sharded_stats", "getboolean", None)
+    _process_setting(section, "transaction_recording.asynchronous", "getboolean", None)
+    _process_setting(section, "transaction_recording.queue_size", "getint", None)
+    _process_setting(section, "transaction_recording.drop_policy", "get", None)
     _process_setting(
         section,
         "event_harvest_config.harvest_limits.analytic_event_data",
@@ -530,6 +535,9 @@ def _process_configuration(section):
     _process_setting(section, "infinite_tracing.trace_observer_host", "get", None)
     _process_setting(section, "infinite_tracing.trace_observer_port", "getint", None)
     _process_setting(section, "infinite_tracing.span_queue_size", "getint", None)
+    _process_setting(section, "infinite_tracing.batching", "getboolean", None)
+    _process_setting(section, "infinite_tracing.span_batch_size", "getint", None)
+    _process_setting(section, "infinite_tracing.span_batch_latency", "getfloat", None)
 
 
 # Loading of configuration from specified file and for specified
@@ -1976,6 +1984,8 @@ GREENLET_HOOK = ("greenlet", "newrelic.core.trace_cache", "greenlet_loaded")
 
 
 def _process_trace_cache_import_hooks():
+    trace_cache.use_trace_cache_backend(_settings.trace_cache.backend)
+
     _process_module_definition(*GREENLET_HOOK)
 
     if GREENLET_HOOK not in _module_import_hook_results:
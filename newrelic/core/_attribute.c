@@ -0,0 +1,475 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native implementation of the processing of attributes done for every
+ * user and agent attribute in attribute.py. Only attributes which pass all
+ * the checks unchanged are handled here. Anything which would be dropped,
+ * cast to a string or truncated is passed back to the Python implementation
+ * so that the same checks are made and the same messages are logged.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns the length in bytes of the UTF-8 encoding of a unicode string,
+ * and sets cut to the number of characters whose encoding fits within
+ * maxsize bytes. Returns -1 if the string contains a surrogate, as lone
+ * surrogates cannot be encoded, and surrogate pairs in narrow Python 2
+ * builds are left to the codec to deal with.
+ */
+
+static Py_ssize_t NRUnicode_UTF8Length(PyObject *text, Py_ssize_t maxsize,
+        Py_ssize_t *cut)
+{
+    Py_ssize_t length = 0;
+    Py_ssize_t count;
+    Py_ssize_t i;
+
+    Py_UCS4 c;
+
+#if PY_MAJOR_VERSION >= 3
+    int kind;
+    const void *data;
+
+    if (PyUnicode_READY(text) < 0)
+        return -1;
+
+    count = PyUnicode_GET_LENGTH(text);
+
+    if (PyUnicode_IS_ASCII(text)) {
+        *cut = count < maxsize ? count : maxsize;
+        return count;
+    }
+
+    kind = PyUnicode_KIND(text);
+    data = PyUnicode_DATA(text);
+#else
+    const Py_UNICODE *data;
+
+    count = PyUnicode_GET_SIZE(text);
+    data = PyUnicode_AS_UNICODE(text);
+#endif
+
+    *cut = count;
+
+    for (i = 0; i < count; i++) {
+#if PY_MAJOR_VERSION >= 3
+        c = PyUnicode_READ(kind, data, i);
+#else
+        c = data[i];
+#endif
+
+        if (c < 0x80)
+            length += 1;
+        else if (c < 0x800)
+            length += 2;
+        else if (c >= 0xd800 && c <= 0xdfff)
+            return -1;
+        else if (c < 0x10000)
+            length += 3;
+        else
+            length += 4;
+
+        if (length > maxsize && *cut == count)
+            *cut = i;
+    }
+
+    return length;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRUnicode_Substring(PyObject *text, Py_ssize_t length)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_Substring(text, 0, length);
+#else
+    if (PyUnicode_CheckExact(text) && length == PyUnicode_GET_SIZE(text)) {
+        Py_INCREF(text);
+        return text;
+    }
+
+    return PyUnicode_FromUnicode(PyUnicode_AS_UNICODE(text), length);
+#endif
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Equivalent of text.encode('utf-8')[:maxsize].decode('utf-8', 'ignore'),
+ * which is what is done where the string cannot be measured.
+ */
+
+static PyObject *NRUnicode_TruncateEncoded(PyObject *text,
+        Py_ssize_t maxsize)
+{
+    PyObject *encoded;
+    PyObject *result;
+
+    Py_ssize_t length;
+
+    encoded = PyUnicode_AsUTF8String(text);
+
+    if (!encoded)
+        return NULL;
+
+    length = PyBytes_GET_SIZE(encoded);
+
+    if (length > maxsize)
+        length = maxsize;
+
+    result = PyUnicode_DecodeUTF8(PyBytes_AS_STRING(encoded), length,
+            "ignore");
+
+    Py_DECREF(encoded);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *truncate_unicode(PyObject *self, PyObject *args)
+{
+    PyObject *text = NULL;
+    Py_ssize_t maxsize = 0;
+
+    Py_ssize_t length;
+    Py_ssize_t cut = 0;
+
+    if (!PyArg_ParseTuple(args, "O!n:truncate_unicode", &PyUnicode_Type,
+            &text, &maxsize)) {
+        return NULL;
+    }
+
+    if (maxsize < 0) {
+        PyErr_SetString(PyExc_ValueError, "maxsize must not be negative");
+        return NULL;
+    }
+
+    length = NRUnicode_UTF8Length(text, maxsize, &cut);
+
+    if (length < 0) {
+        if (PyErr_Occurred())
+            return NULL;
+
+        return NRUnicode_TruncateEncoded(text, maxsize);
+    }
+
+    return NRUnicode_Substring(text, cut);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns whether a name passes the checks made by process_user_attribute()
+ * without needing to be changed.
+ */
+
+static int NRAttribute_valid_name(PyObject *name, Py_ssize_t max_length)
+{
+    Py_ssize_t cut;
+
+    if (PyUnicode_Check(name)) {
+        Py_ssize_t length = NRUnicode_UTF8Length(name, max_length, &cut);
+
+        if (length < 0)
+            PyErr_Clear();
+
+        return length >= 0 && length <= max_length;
+    }
+
+    if (PyBytes_Check(name))
+        return PyBytes_GET_SIZE(name) <= max_length;
+
+    return 0;
+}
+
+/*
+ * Returns whether a value passes the checks made by process_user_attribute()
+ * without needing to be cast to a string or truncated. Subclasses of str and
+ * bytes are left to the Python implementation, as truncating them returns
+ * an instance of the base type.
+ */
+
+static int NRAttribute_valid_value(PyObject *value, Py_ssize_t max_length)
+{
+    Py_ssize_t cut;
+
+    if (PyUnicode_CheckExact(value)) {
+        Py_ssize_t length = NRUnicode_UTF8Length(value, max_length, &cut);
+
+        if (length < 0)
+            PyErr_Clear();
+
+        return length >= 0 && length <= max_length;
+    }
+
+    if (PyBytes_CheckExact(value))
+        return PyBytes_GET_SIZE(value) <= max_length;
+
+    if (PyFloat_Check(value) || PyBool_Check(value))
+        return 1;
+
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_CheckExact(value))
+        return 1;
+#endif
+
+    /*
+     * Subclasses of int are left to the Python implementation as they
+     * could override the comparison against the maximum value.
+     */
+
+    if (PyLong_CheckExact(value)) {
+        int overflow = 0;
+
+        PyLong_AsLongLongAndOverflow(value, &overflow);
+
+        if (PyErr_Occurred()) {
+            PyErr_Clear();
+            return 0;
+        }
+
+        return overflow <= 0;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *process_user_attributes(PyObject *self, PyObject *args)
+{
+    PyObject *attributes = NULL;
+    Py_ssize_t name_max_length = 0;
+    Py_ssize_t value_max_length = 0;
+    PyObject *process = NULL;
+
+    PyObject *result;
+
+    PyObject *name;
+    PyObject *value;
+    Py_ssize_t pos = 0;
+
+    if (!PyArg_ParseTuple(args, "O!nnO:process_user_attributes",
+            &PyDict_Type, &attributes, &name_max_length, &value_max_length,
+            &process)) {
+        return NULL;
+    }
+
+    result = PyDict_New();
+
+    if (!result)
+        return NULL;
+
+    while (PyDict_Next(attributes, &pos, &name, &value)) {
+        PyObject *processed;
+
+        if (NRAttribute_valid_name(name, name_max_length) &&
+                NRAttribute_valid_value(value, value_max_length)) {
+            if (PyDict_SetItem(result, name, value) < 0)
+                goto error;
+
+            continue;
+        }
+
+        /*
+         * Hold references as the call could modify the dictionary. If it
+         * does, PyDict_Next() will still be safe, but may skip items.
+         */
+
+        Py_INCREF(name);
+        Py_INCREF(value);
+
+        processed = PyObject_CallFunctionObjArgs(process, name, value, NULL);
+
+        Py_DECREF(name);
+        Py_DECREF(value);
+
+        if (!processed)
+            goto error;
+
+        if (!PyTuple_Check(processed) || PyTuple_GET_SIZE(processed) != 2) {
+            PyErr_SetString(PyExc_TypeError,
+                    "process must return a (name, value) tuple");
+            Py_DECREF(processed);
+            goto error;
+        }
+
+        if (PyTuple_GET_ITEM(processed, 0) != Py_None) {
+            if (PyDict_SetItem(result, PyTuple_GET_ITEM(processed, 0),
+                    PyTuple_GET_ITEM(processed, 1)) < 0) {
+                Py_DECREF(processed);
+                goto error;
+            }
+        }
+
+        Py_DECREF(processed);
+    }
+
+    return result;
+
+error:
+    Py_DECREF(result);
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *resolve_attributes(PyObject *self, PyObject *args)
+{
+    PyObject *attributes = NULL;
+    PyObject *apply = NULL;
+    PyObject *destinations = NULL;
+    PyObject *event_names = NULL;
+    PyObject *event_destinations = NULL;
+    long target = 0;
+    PyObject *result = NULL;
+
+    PyObject *name;
+    PyObject *value;
+    Py_ssize_t pos = 0;
+
+    if (!PyArg_ParseTuple(args, "O!OOOOlO:resolve_attributes", &PyDict_Type,
+            &attributes, &apply, &destinations, &event_names,
+            &event_destinations, &target, &result)) {
+        return NULL;
+    }
+
+    if (event_names != Py_None && !PyAnySet_Check(event_names)) {
+        PyErr_SetString(PyExc_TypeError, "event_names must be a set");
+        return NULL;
+    }
+
+    while (PyDict_Next(attributes, &pos, &name, &value)) {
+        PyObject *default_destinations = destinations;
+        PyObject *resolved;
+
+        long dest;
+
+        if (value == Py_None)
+            continue;
+
+        if (event_names != Py_None) {
+            int contains = PySet_Contains(event_names, name);
+
+            if (contains < 0)
+                return NULL;
+
+            if (contains)
+                default_destinations = event_destinations;
+        }
+
+        Py_INCREF(name);
+        Py_INCREF(value);
+
+        resolved = PyObject_CallFunctionObjArgs(apply, name,
+                default_destinations, NULL);
+
+        if (!resolved)
+            goto error;
+
+        dest = PyLong_AsLong(resolved);
+
+        Py_DECREF(resolved);
+
+        if (dest == -1 && PyErr_Occurred())
+            goto error;
+
+        if ((dest & target) && PyObject_SetItem(result, name, value) < 0)
+            goto error;
+
+        Py_DECREF(name);
+        Py_DECREF(value);
+    }
+
+    Py_INCREF(result);
+
+    return result;
+
+error:
+    Py_DECREF(name);
+    Py_DECREF(value);
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyMethodDef attribute_methods[] = {
+    { "truncate_unicode",   truncate_unicode,
+                            METH_VARARGS, 0 },
+    { "process_user_attributes", process_user_attributes,
+                            METH_VARARGS, 0 },
+    { "resolve_attributes", resolve_attributes,
+                            METH_VARARGS, 0 },
+    { NULL, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_attribute",           /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    attribute_methods,      /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_attribute", attribute_methods, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_attribute(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__attribute(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
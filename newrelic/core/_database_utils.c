@@ -0,0 +1,1526 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native implementation of the SQL obfuscation, comment removal,
+ * normalization and operation and target parsing done by the regular
+ * expressions in database_utils.py. The results must always be identical
+ * to those produced by the regular expressions, so the rules below mirror
+ * those expressions exactly, including where they do not strictly follow
+ * SQL syntax.
+ *
+ * For obfuscation, the regular expressions first replace quoted strings,
+ * then replace literals in what remains, and finally look for any quote
+ * characters left behind. Literals never contain a character which can
+ * start a quoted string, so both replacements are done in one scan, with
+ * the literal rules seeing a replaced quoted string as the '?' it becomes.
+ * A quote which cannot be matched would be found by the final check, so
+ * it ends the scan immediately.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+#if PY_MAJOR_VERSION >= 3
+typedef Py_UCS4 NRChar;
+#else
+typedef Py_UNICODE NRChar;
+#endif
+
+enum {
+    NR_QUOTES_SINGLE,
+    NR_QUOTES_SINGLE_DOUBLE,
+    NR_QUOTES_SINGLE_DOLLAR,
+    NR_QUOTES_SINGLE_ORACLE,
+    NR_QUOTES_COUNT
+};
+
+static const char *quoting_style_names[NR_QUOTES_COUNT] = {
+    "single",
+    "single+double",
+    "single+dollar",
+    "single+oracle",
+};
+
+static PyObject *quoting_styles[NR_QUOTES_COUNT];
+
+enum {
+    NR_OPERATION_SELECT,
+    NR_OPERATION_DELETE,
+    NR_OPERATION_INSERT,
+    NR_OPERATION_UPDATE,
+    NR_OPERATION_CALL,
+    NR_OPERATION_COUNT
+};
+
+/*
+ * The operations for which _operation_table has a function to parse out
+ * the target. Any other operation has no target.
+ */
+
+static const char *operation_names[NR_OPERATION_COUNT] = {
+    "select",
+    "delete",
+    "insert",
+    "update",
+    "call",
+};
+
+static PyObject *operations[NR_OPERATION_COUNT];
+
+static PyObject *obfuscated_malformed = NULL;
+
+typedef struct {
+#if PY_MAJOR_VERSION >= 3
+    int kind;
+    const void *data;
+#else
+    const Py_UNICODE *data;
+#endif
+    Py_ssize_t length;
+    int style;
+} NRSQLScanner;
+
+#if PY_MAJOR_VERSION >= 3
+#define NR_CHAR(scanner, i) \
+    PyUnicode_READ((scanner)->kind, (scanner)->data, (i))
+#else
+#define NR_CHAR(scanner, i) ((scanner)->data[(i)])
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Character classes as used by the regular expressions. Under Python 3
+ * the patterns are unicode aware, so '\w', '\b', '\d' and '\s' apply to
+ * any unicode word character, decimal digit or white space. The explicit
+ * ranges such as [0-9] only ever match ASCII.
+ */
+
+static int NRChar_is_word(NRChar c)
+{
+    if (c < 128) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+                (c >= '0' && c <= '9') || c == '_';
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    return Py_UNICODE_ISALNUM(c);
+#else
+    return 0;
+#endif
+}
+
+static int NRChar_is_decimal(NRChar c)
+{
+    if (c < 128)
+        return c >= '0' && c <= '9';
+
+#if PY_MAJOR_VERSION >= 3
+    return Py_UNICODE_ISDECIMAL(c);
+#else
+    return 0;
+#endif
+}
+
+static int NRChar_is_space(NRChar c)
+{
+#if PY_MAJOR_VERSION >= 3
+    return Py_UNICODE_ISSPACE(c);
+#else
+    return c == ' ' || (c >= '\t' && c <= '\r');
+#endif
+}
+
+static int NRChar_is_strip_space(NRChar c)
+{
+    /* What str.strip() removes, which is not always the same as '\s'. */
+
+    return Py_UNICODE_ISSPACE(c);
+}
+
+static int NRChar_is_digit(NRChar c)
+{
+    return c >= '0' && c <= '9';
+}
+
+static int NRChar_is_hex(NRChar c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+            (c >= 'A' && c <= 'F');
+}
+
+static NRChar NRChar_lower(NRChar c)
+{
+    /*
+     * Only needs to be correct for the ASCII letters which appear in the
+     * patterns. Under Python 3 case insensitive matching also treats
+     * some other characters as equivalent to an ASCII letter.
+     */
+
+    if (c >= 'A' && c <= 'Z')
+        return c + ('a' - 'A');
+
+#if PY_MAJOR_VERSION >= 3
+    switch (c) {
+        case 0x130:
+        case 0x131:
+            return 'i';
+        case 0x17f:
+            return 's';
+        case 0x212a:
+            return 'k';
+    }
+#endif
+
+    return c;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Each of the quote and literal functions below attempts a match at the
+ * given position, returning the position the match ends at, or -1 if
+ * there is no match.
+ */
+
+static Py_ssize_t NRSQLScanner_quoted(NRSQLScanner *self, Py_ssize_t i,
+        NRChar quote)
+{
+    /*
+     * '(?:[^']|'')*?(?:\\'.*|'(?!')) and the equivalent for double
+     * quotes. A backslash escaped quote ends the match at the end of
+     * the line, as '.' does not match a newline.
+     */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p = i + 1;
+
+    NRChar c;
+
+    while (p < n) {
+        c = NR_CHAR(self, p);
+
+        if (c == '\\' && p + 1 < n && NR_CHAR(self, p + 1) == quote) {
+            p += 2;
+
+            while (p < n && NR_CHAR(self, p) != '\n')
+                p++;
+
+            return p;
+        }
+
+        if (c == quote) {
+            if (p + 1 < n && NR_CHAR(self, p + 1) == quote)
+                p += 2;
+            else
+                return p + 1;
+        }
+        else
+            p++;
+    }
+
+    return -1;
+}
+
+static Py_ssize_t NRSQLScanner_dollar_quoted(NRSQLScanner *self,
+        Py_ssize_t i)
+{
+    /*
+     * (\$(?!\d)[^$]*?\$).*?(?:\1|$) where the tag can span lines, but
+     * the quoted string cannot, other than for it being terminated by
+     * the end of the string or a newline at the end of the string.
+     */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t tag_end;
+    Py_ssize_t tag_length;
+    Py_ssize_t p;
+    Py_ssize_t k;
+
+    NRChar c;
+
+    if (i + 1 < n && NRChar_is_decimal(NR_CHAR(self, i + 1)))
+        return -1;
+
+    tag_end = i + 1;
+
+    while (tag_end < n && NR_CHAR(self, tag_end) != '$')
+        tag_end++;
+
+    if (tag_end == n)
+        return -1;
+
+    tag_end++;
+    tag_length = tag_end - i;
+
+    for (p = tag_end; p < n; p++) {
+        c = NR_CHAR(self, p);
+
+        if (c == '$' && p + tag_length <= n) {
+            for (k = 1; k < tag_length; k++) {
+                if (NR_CHAR(self, p + k) != NR_CHAR(self, i + k))
+                    break;
+            }
+
+            if (k == tag_length)
+                return p + tag_length;
+        }
+
+        if (c == '\n')
+            return p == n - 1 ? p : -1;
+    }
+
+    return n;
+}
+
+static Py_ssize_t NRSQLScanner_oracle_quoted(NRSQLScanner *self,
+        Py_ssize_t i)
+{
+    /*
+     * q'\[.*?(?:\]'|$) and the equivalents for the other delimiters,
+     * with the same treatment of newlines as for dollar quotes.
+     */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p;
+
+    NRChar close;
+    NRChar c;
+
+    if (i + 2 >= n || NR_CHAR(self, i + 1) != '\'')
+        return -1;
+
+    switch (NR_CHAR(self, i + 2)) {
+        case '[':
+            close = ']';
+            break;
+        case '{':
+            close = '}';
+            break;
+        case '<':
+            close = '>';
+            break;
+        case '(':
+            close = ')';
+            break;
+        default:
+            return -1;
+    }
+
+    for (p = i + 3; p < n; p++) {
+        c = NR_CHAR(self, p);
+
+        if (c == close && p + 1 < n && NR_CHAR(self, p + 1) == '\'')
+            return p + 2;
+
+        if (c == '\n')
+            return p == n - 1 ? p : -1;
+    }
+
+    return n;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int NRSQLScanner_is_word(NRSQLScanner *self, Py_ssize_t i)
+{
+    NRChar c;
+
+    /*
+     * Whether the character at this position is a word character once
+     * quoted strings are replaced. Only an oracle quoted string starts
+     * with a word character.
+     */
+
+    if (i >= self->length)
+        return 0;
+
+    c = NR_CHAR(self, i);
+
+    if (c == 'q' && self->style == NR_QUOTES_SINGLE_ORACLE &&
+            NRSQLScanner_oracle_quoted(self, i) >= 0) {
+        return 0;
+    }
+
+    return NRChar_is_word(c);
+}
+
+static Py_ssize_t NRSQLScanner_uuid(NRSQLScanner *self, Py_ssize_t i)
+{
+    /* \{?(?:[0-9a-f]\-?){32}\}? */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p = i;
+
+    int count;
+
+    if (NR_CHAR(self, p) == '{')
+        p++;
+
+    for (count = 0; count < 32; count++) {
+        if (p >= n || !NRChar_is_hex(NR_CHAR(self, p)))
+            return -1;
+
+        p++;
+
+        if (p < n && NR_CHAR(self, p) == '-')
+            p++;
+    }
+
+    if (p < n && NR_CHAR(self, p) == '}')
+        p++;
+
+    return p;
+}
+
+static Py_ssize_t NRSQLScanner_hex(NRSQLScanner *self, Py_ssize_t i)
+{
+    /* 0x[0-9a-f]+ */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p = i + 2;
+
+    if (p >= n || NRChar_lower(NR_CHAR(self, i + 1)) != 'x' ||
+            !NRChar_is_hex(NR_CHAR(self, p))) {
+        return -1;
+    }
+
+    while (p < n && NRChar_is_hex(NR_CHAR(self, p)))
+        p++;
+
+    return p;
+}
+
+static Py_ssize_t NRSQLScanner_number(NRSQLScanner *self, Py_ssize_t i,
+        NRChar previous)
+{
+    /* (?<!:)-?\b(?:[0-9]+\.)?[0-9]+(e[+-]?[0-9]+)? */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p = i;
+    Py_ssize_t q;
+
+    if (previous == ':')
+        return -1;
+
+    if (NR_CHAR(self, p) == '-') {
+        p++;
+
+        if (p >= n || !NRChar_is_digit(NR_CHAR(self, p)))
+            return -1;
+    }
+    else if (NRChar_is_word(previous))
+        return -1;
+
+    while (p < n && NRChar_is_digit(NR_CHAR(self, p)))
+        p++;
+
+    if (p + 1 < n && NR_CHAR(self, p) == '.' &&
+            NRChar_is_digit(NR_CHAR(self, p + 1))) {
+        p += 2;
+
+        while (p < n && NRChar_is_digit(NR_CHAR(self, p)))
+            p++;
+    }
+
+    if (p < n && NRChar_lower(NR_CHAR(self, p)) == 'e') {
+        q = p + 1;
+
+        if (q < n && (NR_CHAR(self, q) == '+' || NR_CHAR(self, q) == '-'))
+            q++;
+
+        if (q < n && NRChar_is_digit(NR_CHAR(self, q))) {
+            while (q < n && NRChar_is_digit(NR_CHAR(self, q)))
+                q++;
+
+            p = q;
+        }
+    }
+
+    return p;
+}
+
+static Py_ssize_t NRSQLScanner_boolean(NRSQLScanner *self, Py_ssize_t i,
+        NRChar previous)
+{
+    /* \b(?:true|false|null)\b */
+
+    const char *word;
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p;
+
+    if (NRChar_is_word(previous))
+        return -1;
+
+    switch (NRChar_lower(NR_CHAR(self, i))) {
+        case 't':
+            word = "true";
+            break;
+        case 'f':
+            word = "false";
+            break;
+        case 'n':
+            word = "null";
+            break;
+        default:
+            return -1;
+    }
+
+    for (p = i + 1, word++; *word; p++, word++) {
+        if (p >= n || NRChar_lower(NR_CHAR(self, p)) != (NRChar)*word)
+            return -1;
+    }
+
+    if (NRSQLScanner_is_word(self, p))
+        return -1;
+
+    return p;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static Py_ssize_t NRSQLScanner_obfuscate(NRSQLScanner *self, NRChar *output)
+{
+    Py_ssize_t n = self->length;
+    Py_ssize_t i = 0;
+    Py_ssize_t j = 0;
+    Py_ssize_t end;
+
+    NRChar previous = 0;
+    NRChar c;
+
+    int style = self->style;
+    int dollars = 0;
+
+    while (i < n) {
+        c = NR_CHAR(self, i);
+        end = -1;
+
+        /* Quoted strings. */
+
+        if (c == '\'' || (c == '"' && style == NR_QUOTES_SINGLE_DOUBLE)) {
+            end = NRSQLScanner_quoted(self, i, c);
+
+            if (end < 0)
+                return -1;
+        }
+        else if (c == '$' && style == NR_QUOTES_SINGLE_DOLLAR)
+            end = NRSQLScanner_dollar_quoted(self, i);
+        else if (c == 'q' && style == NR_QUOTES_SINGLE_ORACLE)
+            end = NRSQLScanner_oracle_quoted(self, i);
+
+        if (end >= 0) {
+            output[j++] = '?';
+            previous = '?';
+            i = end;
+            continue;
+        }
+
+        /* Literals, tried in the same order as the alternation. */
+
+        if (c == '{' || NRChar_is_hex(c))
+            end = NRSQLScanner_uuid(self, i);
+
+        if (end < 0 && c == '0')
+            end = NRSQLScanner_hex(self, i);
+
+        if (end < 0 && (c == '-' || NRChar_is_digit(c)))
+            end = NRSQLScanner_number(self, i, previous);
+
+        if (end < 0 && NRChar_is_word(c))
+            end = NRSQLScanner_boolean(self, i, previous);
+
+        if (end >= 0) {
+            output[j++] = '?';
+            previous = NR_CHAR(self, end - 1);
+            i = end;
+            continue;
+        }
+
+        if (c == '$')
+            dollars = 1;
+
+        output[j++] = c;
+        previous = c;
+        i++;
+    }
+
+    /*
+     * A dollar sign which did not start a quoted string shows that the
+     * SQL was malformed, unless now followed by '?', as for a '$1' style
+     * positional parameter.
+     */
+
+    if (dollars && style == NR_QUOTES_SINGLE_DOLLAR) {
+        for (i = 0; i < j; i++) {
+            if (output[i] == '$' && (i + 1 == j || output[i + 1] != '?'))
+                return -1;
+        }
+    }
+
+    return j;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static Py_ssize_t NRSQLScanner_block_comment(NRSQLScanner *self, Py_ssize_t i)
+{
+    /*
+     * \/\*(?:[^\/]|\/[^*])*?(?:\*\/|\/\*.*) where '.' also matches a
+     * newline. A nested comment start comments out the rest of the
+     * string.
+     */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p = i + 2;
+
+    NRChar c;
+
+    while (p < n) {
+        c = NR_CHAR(self, p);
+
+        if (c == '*' && p + 1 < n && NR_CHAR(self, p + 1) == '/')
+            return p + 2;
+
+        if (c == '/') {
+            if (p + 1 >= n)
+                return -1;
+
+            if (NR_CHAR(self, p + 1) == '*')
+                return n;
+
+            p += 2;
+        }
+        else
+            p++;
+    }
+
+    return -1;
+}
+
+static Py_ssize_t NRSQLScanner_uncomment(NRSQLScanner *self, NRChar *output)
+{
+    Py_ssize_t n = self->length;
+    Py_ssize_t i = 0;
+    Py_ssize_t j = 0;
+    Py_ssize_t end;
+
+    NRChar c;
+
+    while (i < n) {
+        c = NR_CHAR(self, i);
+
+        /* (?:#|--).*?(?=\r|\n|$) */
+
+        if (c == '#' || (c == '-' && i + 1 < n && NR_CHAR(self, i + 1) == '-')) {
+            i += c == '#' ? 1 : 2;
+
+            while (i < n) {
+                c = NR_CHAR(self, i);
+
+                if (c == '\r' || c == '\n')
+                    break;
+
+                i++;
+            }
+
+            continue;
+        }
+
+        if (c == '/' && i + 1 < n && NR_CHAR(self, i + 1) == '*') {
+            end = NRSQLScanner_block_comment(self, i);
+
+            if (end >= 0) {
+                i = end;
+                continue;
+            }
+        }
+
+        output[j++] = c;
+        i++;
+    }
+
+    return j;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Normalization is done as the same series of substitutions as the
+ * regular expressions, as each depends on the result of the one before.
+ * Replacing the '%s' and ':name' param styles is combined into one pass
+ * as neither can match any part of the other.
+ */
+
+static Py_ssize_t NRSQLScanner_normalize_named_params(NRSQLScanner *self,
+        NRChar *output)
+{
+    /* %\([^)]*\)s */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t i = 0;
+    Py_ssize_t j = 0;
+    Py_ssize_t close = -1;
+
+    NRChar c;
+
+    while (i < n) {
+        c = NR_CHAR(self, i);
+
+        if (c == '%' && i + 1 < n && NR_CHAR(self, i + 1) == '(') {
+            if (close < i + 2) {
+                close = i + 2;
+
+                while (close < n && NR_CHAR(self, close) != ')')
+                    close++;
+            }
+
+            if (close + 1 < n && NR_CHAR(self, close + 1) == 's') {
+                output[j++] = '?';
+                i = close + 2;
+                continue;
+            }
+        }
+
+        output[j++] = c;
+        i++;
+    }
+
+    return j;
+}
+
+static Py_ssize_t NRSQLScanner_normalize_values(NRSQLScanner *self,
+        NRChar *output)
+{
+    /* \([^)]+\) */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t i = 0;
+    Py_ssize_t j = 0;
+    Py_ssize_t close = -1;
+
+    NRChar c;
+
+    while (i < n) {
+        c = NR_CHAR(self, i);
+
+        if (c == '(') {
+            if (close < i + 1) {
+                close = i + 1;
+
+                while (close < n && NR_CHAR(self, close) != ')')
+                    close++;
+            }
+
+            if (close < n && close > i + 1) {
+                output[j++] = '(';
+                output[j++] = '?';
+                output[j++] = ')';
+                i = close + 1;
+                continue;
+            }
+        }
+
+        output[j++] = c;
+        i++;
+    }
+
+    return j;
+}
+
+static Py_ssize_t NRSQLScanner_normalize_params(NRSQLScanner *self,
+        NRChar *output)
+{
+    /* %s and :\w+ */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t i = 0;
+    Py_ssize_t j = 0;
+
+    NRChar c;
+
+    while (i < n) {
+        c = NR_CHAR(self, i);
+
+        if (c == '%' && i + 1 < n && NR_CHAR(self, i + 1) == 's') {
+            output[j++] = '?';
+            i += 2;
+            continue;
+        }
+
+        if (c == ':' && i + 1 < n && NRChar_is_word(NR_CHAR(self, i + 1))) {
+            i += 2;
+
+            while (i < n && NRChar_is_word(NR_CHAR(self, i)))
+                i++;
+
+            output[j++] = '?';
+            continue;
+        }
+
+        output[j++] = c;
+        i++;
+    }
+
+    return j;
+}
+
+static Py_ssize_t NRSQLScanner_normalize_whitespace(NRSQLScanner *self,
+        NRChar *output)
+{
+    /*
+     * Strips the string, collapses each run of white space to a single
+     * space, and then drops that space unless it is between two word
+     * characters.
+     */
+
+    Py_ssize_t start = 0;
+    Py_ssize_t end = self->length;
+    Py_ssize_t i;
+    Py_ssize_t j = 0;
+
+    NRChar c;
+
+    while (start < end && NRChar_is_strip_space(NR_CHAR(self, start)))
+        start++;
+
+    while (end > start && NRChar_is_strip_space(NR_CHAR(self, end - 1)))
+        end--;
+
+    i = start;
+
+    while (i < end) {
+        c = NR_CHAR(self, i);
+
+        if (NRChar_is_space(c)) {
+            while (i < end && NRChar_is_space(NR_CHAR(self, i)))
+                i++;
+
+            if (j > 0 && NRChar_is_word(output[j - 1]) && i < end &&
+                    NRChar_is_word(NR_CHAR(self, i))) {
+                output[j++] = ' ';
+            }
+
+            continue;
+        }
+
+        output[j++] = c;
+        i++;
+    }
+
+    return j;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Parsing of the target follows the regular expressions for the specific
+ * operation, which search for a keyword followed by an identifier in one
+ * of the forms given by _parse_identifier_p. The identifier is made up of
+ * up to two parts, which are joined with a '.'.
+ */
+
+typedef struct {
+    Py_ssize_t start[2];
+    Py_ssize_t length[2];
+    int count;
+} NRSQLIdentifier;
+
+static Py_ssize_t NRSQLScanner_quoted_name(NRSQLScanner *self, Py_ssize_t i,
+        NRChar quote)
+{
+    /*
+     * "((?:[^"]|"")+)" and the equivalents for other quotes. Where the
+     * end of the string is reached, the last doubled quote is instead
+     * taken as the closing quote, provided the name is not empty.
+     */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p = i + 1;
+    Py_ssize_t pair = -1;
+
+    NRChar c;
+
+    while (p < n) {
+        c = NR_CHAR(self, p);
+
+        if (c != quote)
+            p++;
+        else if (p + 1 < n && NR_CHAR(self, p + 1) == quote) {
+            pair = p;
+            p += 2;
+        }
+        else
+            break;
+    }
+
+    if (p == n)
+        p = pair;
+
+    return p > i + 1 ? p + 1 : -1;
+}
+
+static Py_ssize_t NRSQLScanner_bracketed_name(NRSQLScanner *self,
+        Py_ssize_t i, NRChar close)
+{
+    /*
+     * \[\s*(\S+)\s*\] and the equivalents for other brackets. Returns
+     * the end of the name rather than the end of the match.
+     */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t p = i + 1;
+    Py_ssize_t r;
+    Py_ssize_t k;
+
+    while (p < n && NRChar_is_space(NR_CHAR(self, p)))
+        p++;
+
+    r = p;
+
+    while (r < n && !NRChar_is_space(NR_CHAR(self, r)))
+        r++;
+
+    if (r == p)
+        return -1;
+
+    k = r;
+
+    while (k < n && NRChar_is_space(NR_CHAR(self, k)))
+        k++;
+
+    if (k < n && NR_CHAR(self, k) == close)
+        return r;
+
+    for (k = r - 1; k > p; k--) {
+        if (NR_CHAR(self, k) == close)
+            return k;
+    }
+
+    return -1;
+}
+
+static int NRSQLScanner_identifier(NRSQLScanner *self, Py_ssize_t i,
+        NRSQLIdentifier *identifier)
+{
+    Py_ssize_t n = self->length;
+    Py_ssize_t p;
+    Py_ssize_t end;
+
+    NRChar c;
+    NRChar close;
+
+    if (i >= n)
+        return 0;
+
+    c = NR_CHAR(self, i);
+
+    identifier->count = 1;
+    identifier->start[0] = i + 1;
+
+    if (c == '"' || c == '\'' || c == '`') {
+        end = NRSQLScanner_quoted_name(self, i, c);
+
+        if (end >= 0) {
+            identifier->length[0] = end - i - 2;
+
+            if (end + 1 < n && NR_CHAR(self, end) == '.' &&
+                    NR_CHAR(self, end + 1) == c) {
+                p = NRSQLScanner_quoted_name(self, end + 1, c);
+
+                if (p >= 0) {
+                    identifier->count = 2;
+                    identifier->start[1] = end + 2;
+                    identifier->length[1] = p - end - 3;
+                }
+            }
+
+            return 1;
+        }
+    }
+    else if (c == '[' || c == '(' || c == '{') {
+        close = c == '[' ? ']' : c == '(' ? ')' : '}';
+
+        end = NRSQLScanner_bracketed_name(self, i, close);
+
+        if (end >= 0) {
+            p = i + 1;
+
+            while (NRChar_is_space(NR_CHAR(self, p)))
+                p++;
+
+            identifier->start[0] = p;
+            identifier->length[0] = end - p;
+
+            return 1;
+        }
+
+        if (c != '{')
+            return 0;
+    }
+
+    /* ([^\s\(\)\[\],]+) */
+
+    p = i;
+
+    while (p < n) {
+        c = NR_CHAR(self, p);
+
+        if (NRChar_is_space(c) || c == '(' || c == ')' || c == '[' ||
+                c == ']' || c == ',') {
+            break;
+        }
+
+        p++;
+    }
+
+    if (p == i)
+        return 0;
+
+    identifier->start[0] = i;
+    identifier->length[0] = p - i;
+
+    return 1;
+}
+
+static int NRSQLScanner_keyword(NRSQLScanner *self, Py_ssize_t i,
+        const char *keyword)
+{
+    /* Case insensitive match of a lower case keyword. */
+
+    for (; *keyword; i++, keyword++) {
+        if (i >= self->length ||
+                NRChar_lower(NR_CHAR(self, i)) != (NRChar)*keyword) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int NRSQLScanner_target(NRSQLScanner *self, const char *keyword,
+        int leading_space, NRSQLIdentifier *identifier)
+{
+    /*
+     * \s+KEYWORD\s+ followed by an identifier, or \s*KEYWORD\s+ where
+     * no leading white space is required. Each occurrence of the keyword
+     * is tried in turn, as the leftmost match is the one used.
+     */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t length = strlen(keyword);
+    Py_ssize_t i;
+    Py_ssize_t p;
+
+    for (i = 0; i + length < n; i++) {
+        if (!NRSQLScanner_keyword(self, i, keyword))
+            continue;
+
+        if (leading_space && (i == 0 ||
+                !NRChar_is_space(NR_CHAR(self, i - 1)))) {
+            continue;
+        }
+
+        p = i + length;
+
+        if (!NRChar_is_space(NR_CHAR(self, p)))
+            continue;
+
+        while (p < n && NRChar_is_space(NR_CHAR(self, p)))
+            p++;
+
+        if (NRSQLScanner_identifier(self, p, identifier))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int NRSQLScanner_call_target(NRSQLScanner *self,
+        NRSQLIdentifier *identifier)
+{
+    /* \s*CALL\s+(?!\()(\w+(\.\w+)*) */
+
+    Py_ssize_t n = self->length;
+    Py_ssize_t i;
+    Py_ssize_t p;
+    Py_ssize_t start;
+
+    for (i = 0; i + 4 < n; i++) {
+        if (!NRSQLScanner_keyword(self, i, "call"))
+            continue;
+
+        p = i + 4;
+
+        if (!NRChar_is_space(NR_CHAR(self, p)))
+            continue;
+
+        while (p < n && NRChar_is_space(NR_CHAR(self, p)))
+            p++;
+
+        if (p == n || !NRChar_is_word(NR_CHAR(self, p)))
+            continue;
+
+        start = p;
+
+        while (p < n && NRChar_is_word(NR_CHAR(self, p)))
+            p++;
+
+        while (p + 1 < n && NR_CHAR(self, p) == '.' &&
+                NRChar_is_word(NR_CHAR(self, p + 1))) {
+            p += 2;
+
+            while (p < n && NRChar_is_word(NR_CHAR(self, p)))
+                p++;
+        }
+
+        identifier->count = 1;
+        identifier->start[0] = start;
+        identifier->length[0] = p - start;
+
+        return 1;
+    }
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static int NRName_lookup(PyObject *name, PyObject **names, int count)
+{
+    int i;
+    int result;
+
+    for (i = 0; i < count; i++) {
+        result = PyObject_RichCompareBool(name, names[i], Py_EQ);
+
+        if (result < 0) {
+            PyErr_Clear();
+            break;
+        }
+
+        if (result)
+            return i;
+    }
+
+    return -1;
+}
+
+static int NRSQLScanner_init(NRSQLScanner *self, PyObject *sql)
+{
+#if PY_MAJOR_VERSION >= 3
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(sql) < 0)
+        return -1;
+#endif
+
+    self->kind = PyUnicode_KIND(sql);
+    self->data = PyUnicode_DATA(sql);
+    self->length = PyUnicode_GET_LENGTH(sql);
+#else
+    self->data = PyUnicode_AS_UNICODE(sql);
+    self->length = PyUnicode_GET_SIZE(sql);
+#endif
+
+    self->style = NR_QUOTES_SINGLE;
+
+    return 0;
+}
+
+static void NRSQLScanner_init_buffer(NRSQLScanner *self,
+        const NRChar *buffer, Py_ssize_t length)
+{
+#if PY_MAJOR_VERSION >= 3
+    self->kind = PyUnicode_4BYTE_KIND;
+#endif
+
+    self->data = buffer;
+    self->length = length;
+    self->style = NR_QUOTES_SINGLE;
+}
+
+static PyObject *NRString_FromBuffer(const NRChar *buffer, Py_ssize_t length)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromKindAndData(PyUnicode_4BYTE_KIND, buffer, length);
+#else
+    return PyUnicode_FromUnicode(buffer, length);
+#endif
+}
+
+static PyObject *NRSQLScanner_substring(NRSQLScanner *self, Py_ssize_t start,
+        Py_ssize_t length)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_FromKindAndData(self->kind,
+            (const char *)self->data + start * self->kind, length);
+#else
+    return PyUnicode_FromUnicode(self->data + start, length);
+#endif
+}
+
+static NRChar *NRChar_buffer(Py_ssize_t length)
+{
+    NRChar *buffer;
+
+    buffer = PyMem_New(NRChar, length ? length : 1);
+
+    if (!buffer)
+        PyErr_NoMemory();
+
+    return buffer;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *obfuscate_sql(PyObject *self, PyObject *args)
+{
+    PyObject *sql = NULL;
+    PyObject *quoting_style = NULL;
+
+    PyObject *result = NULL;
+
+    NRSQLScanner scanner;
+    NRChar *output;
+
+    Py_ssize_t length;
+
+    if (!PyArg_ParseTuple(args, "O!O:obfuscate_sql", &PyUnicode_Type, &sql,
+            &quoting_style)) {
+        return NULL;
+    }
+
+    if (NRSQLScanner_init(&scanner, sql) < 0)
+        return NULL;
+
+    scanner.style = NRName_lookup(quoting_style, quoting_styles,
+            NR_QUOTES_COUNT);
+
+    if (scanner.style < 0)
+        scanner.style = NR_QUOTES_SINGLE;
+
+    output = NRChar_buffer(scanner.length);
+
+    if (!output)
+        return NULL;
+
+    length = NRSQLScanner_obfuscate(&scanner, output);
+
+    if (length < 0) {
+        Py_INCREF(obfuscated_malformed);
+        result = obfuscated_malformed;
+    }
+    else
+        result = NRString_FromBuffer(output, length);
+
+    PyMem_Free(output);
+
+    return result;
+}
+
+static PyObject *uncomment_sql(PyObject *self, PyObject *args)
+{
+    PyObject *sql = NULL;
+
+    PyObject *result = NULL;
+
+    NRSQLScanner scanner;
+    NRChar *output;
+
+    if (!PyArg_ParseTuple(args, "O!:uncomment_sql", &PyUnicode_Type, &sql))
+        return NULL;
+
+    if (NRSQLScanner_init(&scanner, sql) < 0)
+        return NULL;
+
+    output = NRChar_buffer(scanner.length);
+
+    if (!output)
+        return NULL;
+
+    result = NRString_FromBuffer(output,
+            NRSQLScanner_uncomment(&scanner, output));
+
+    PyMem_Free(output);
+
+    return result;
+}
+
+static PyObject *normalize_sql(PyObject *self, PyObject *args)
+{
+    PyObject *sql = NULL;
+
+    PyObject *result = NULL;
+
+    NRSQLScanner scanner;
+    NRChar *first;
+    NRChar *second;
+
+    Py_ssize_t length;
+
+    if (!PyArg_ParseTuple(args, "O!:normalize_sql", &PyUnicode_Type, &sql))
+        return NULL;
+
+    if (NRSQLScanner_init(&scanner, sql) < 0)
+        return NULL;
+
+    first = NRChar_buffer(scanner.length);
+
+    if (!first)
+        return NULL;
+
+    second = NRChar_buffer(scanner.length);
+
+    if (!second) {
+        PyMem_Free(first);
+        return NULL;
+    }
+
+    /* None of the substitutions make the string any longer. */
+
+    length = NRSQLScanner_normalize_named_params(&scanner, first);
+
+    NRSQLScanner_init_buffer(&scanner, first, length);
+    length = NRSQLScanner_normalize_values(&scanner, second);
+
+    NRSQLScanner_init_buffer(&scanner, second, length);
+    length = NRSQLScanner_normalize_params(&scanner, first);
+
+    NRSQLScanner_init_buffer(&scanner, first, length);
+    length = NRSQLScanner_normalize_whitespace(&scanner, second);
+
+    result = NRString_FromBuffer(second, length);
+
+    PyMem_Free(first);
+    PyMem_Free(second);
+
+    return result;
+}
+
+static PyObject *parse_operation(PyObject *self, PyObject *args)
+{
+    PyObject *sql = NULL;
+
+    NRSQLScanner scanner;
+
+    Py_ssize_t i = 0;
+    Py_ssize_t start;
+
+    /*
+     * Returns the first word as is. Converting it to lower case and
+     * checking it is a known operation is left to the caller.
+     */
+
+    if (!PyArg_ParseTuple(args, "O!:parse_operation", &PyUnicode_Type, &sql))
+        return NULL;
+
+    if (NRSQLScanner_init(&scanner, sql) < 0)
+        return NULL;
+
+    while (i < scanner.length && !NRChar_is_word(NR_CHAR(&scanner, i)))
+        i++;
+
+    start = i;
+
+    while (i < scanner.length && NRChar_is_word(NR_CHAR(&scanner, i)))
+        i++;
+
+    return NRSQLScanner_substring(&scanner, start, i - start);
+}
+
+static PyObject *parse_target(PyObject *self, PyObject *args)
+{
+    PyObject *sql = NULL;
+    PyObject *operation = NULL;
+
+    PyObject *result = NULL;
+
+    NRSQLScanner scanner;
+    NRSQLIdentifier identifier;
+    NRChar *output;
+
+    Py_ssize_t i;
+    Py_ssize_t j;
+    Py_ssize_t length;
+
+    int found = 0;
+
+    /*
+     * Returns the target as is. Converting it to lower case is left to
+     * the caller.
+     */
+
+    if (!PyArg_ParseTuple(args, "O!O:parse_target", &PyUnicode_Type, &sql,
+            &operation)) {
+        return NULL;
+    }
+
+    if (NRSQLScanner_init(&scanner, sql) < 0)
+        return NULL;
+
+    /* Equivalent of sql.rstrip(';'). */
+
+    while (scanner.length && NR_CHAR(&scanner, scanner.length - 1) == ';')
+        scanner.length--;
+
+    switch (NRName_lookup(operation, operations, NR_OPERATION_COUNT)) {
+        case NR_OPERATION_SELECT:
+        case NR_OPERATION_DELETE:
+            found = NRSQLScanner_target(&scanner, "from", 1, &identifier);
+            break;
+        case NR_OPERATION_INSERT:
+            found = NRSQLScanner_target(&scanner, "into", 1, &identifier);
+            break;
+        case NR_OPERATION_UPDATE:
+            found = NRSQLScanner_target(&scanner, "update", 0, &identifier);
+            break;
+        case NR_OPERATION_CALL:
+            found = NRSQLScanner_call_target(&scanner, &identifier);
+            break;
+    }
+
+    if (!found)
+        return NRString_FromBuffer(NULL, 0);
+
+    if (identifier.count == 1) {
+        return NRSQLScanner_substring(&scanner, identifier.start[0],
+                identifier.length[0]);
+    }
+
+    length = identifier.length[0] + 1 + identifier.length[1];
+
+    output = NRChar_buffer(length);
+
+    if (!output)
+        return NULL;
+
+    j = 0;
+
+    for (i = 0; i < identifier.length[0]; i++)
+        output[j++] = NR_CHAR(&scanner, identifier.start[0] + i);
+
+    output[j++] = '.';
+
+    for (i = 0; i < identifier.length[1]; i++)
+        output[j++] = NR_CHAR(&scanner, identifier.start[1] + i);
+
+    result = NRString_FromBuffer(output, length);
+
+    PyMem_Free(output);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyMethodDef database_utils_methods[] = {
+    { "obfuscate_sql",      obfuscate_sql,
+                            METH_VARARGS, 0 },
+    { "uncomment_sql",      uncomment_sql,
+                            METH_VARARGS, 0 },
+    { "normalize_sql",      normalize_sql,
+                            METH_VARARGS, 0 },
+    { "parse_operation",    parse_operation,
+                            METH_VARARGS, 0 },
+    { "parse_target",       parse_target,
+                            METH_VARARGS, 0 },
+    { NULL, NULL }
+};
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_database_utils",      /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    database_utils_methods, /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+    int i;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_database_utils", database_utils_methods, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    for (i = 0; i < NR_QUOTES_COUNT; i++) {
+#if PY_MAJOR_VERSION >= 3
+        quoting_styles[i] = PyUnicode_InternFromString(
+                quoting_style_names[i]);
+#else
+        quoting_styles[i] = PyString_InternFromString(
+                quoting_style_names[i]);
+#endif
+
+        if (!quoting_styles[i])
+            return NULL;
+    }
+
+    for (i = 0; i < NR_OPERATION_COUNT; i++) {
+#if PY_MAJOR_VERSION >= 3
+        operations[i] = PyUnicode_InternFromString(operation_names[i]);
+#else
+        operations[i] = PyString_InternFromString(operation_names[i]);
+#endif
+
+        if (!operations[i])
+            return NULL;
+    }
+
+    obfuscated_malformed = PyUnicode_FromString("?");
+
+    if (!obfuscated_malformed)
+        return NULL;
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_database_utils(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__database_utils(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
@@ -0,0 +1,1649 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native implementation of the sampling of stack traces by the thread
+ * profiler in profile_sessions.py. The frames of all threads are first
+ * walked in one pass, recording just the code object and line number of
+ * each, without any Python code being run which could allow other threads
+ * to change their stacks part way through. The stack traces are only then
+ * merged into the call trees of the profile session, giving the same call
+ * trees as format_stack_trace() and update_call_tree() do.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+#include <frameobject.h>
+
+#include <string.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *str_AGENT;
+static PyObject *str_call_count;
+static PyObject *str_children;
+static PyObject *str_depth;
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * From Python 3.9 the frame and code objects are accessed through the
+ * functions provided, as the frame structure is no longer public from
+ * Python 3.11. Both return a new reference.
+ */
+
+static PyObject *NRFrame_GetCode(PyObject *frame)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    return (PyObject *)PyFrame_GetCode((PyFrameObject *)frame);
+#else
+    PyObject *code = (PyObject *)((PyFrameObject *)frame)->f_code;
+
+    Py_INCREF(code);
+
+    return code;
+#endif
+}
+
+static PyObject *NRFrame_GetBack(PyObject *frame)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    return (PyObject *)PyFrame_GetBack((PyFrameObject *)frame);
+#else
+    PyObject *back = (PyObject *)((PyFrameObject *)frame)->f_back;
+
+    Py_XINCREF(back);
+
+    return back;
+#endif
+}
+
+static int NRString_StartsWith(PyObject *value, PyObject *prefix)
+{
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(value) && PyString_Check(prefix)) {
+        Py_ssize_t length = PyString_GET_SIZE(prefix);
+
+        return PyString_GET_SIZE(value) >= length &&
+                !memcmp(PyString_AS_STRING(value),
+                PyString_AS_STRING(prefix), length);
+    }
+#endif
+
+    return PyUnicode_Tailmatch(value, prefix, 0, PY_SSIZE_T_MAX, -1);
+}
+
+static PyObject *NRInt_FromSsize_t(Py_ssize_t value)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyLong_FromSsize_t(value);
+#else
+    return PyInt_FromSsize_t(value);
+#endif
+}
+
+static PyObject *NRLine_FromInt(int line)
+{
+    /* The line number of a frame is None where it is not known. */
+
+    if (line < 0) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    return NRInt_FromSsize_t(line);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * The frames of the stack traces of all threads, each as the code object
+ * and the line being executed, in order from the innermost frame out. The
+ * frames of each thread follow those of the thread before it.
+ */
+
+typedef struct {
+    PyCodeObject *code;
+    int line;
+} NRSampleFrame;
+
+typedef struct {
+    PyObject *category;
+    Py_ssize_t start;
+    Py_ssize_t end;
+} NRSampleThread;
+
+typedef struct {
+    NRSampleFrame *frames;
+    Py_ssize_t frames_size;
+    Py_ssize_t frames_allocated;
+
+    NRSampleThread *threads;
+    Py_ssize_t threads_size;
+} NRSample;
+
+static int NRSample_append(NRSample *self, PyObject *code, int line)
+{
+    if (self->frames_size == self->frames_allocated) {
+        Py_ssize_t allocated;
+        NRSampleFrame *frames;
+
+        allocated = self->frames_allocated ? self->frames_allocated * 2 : 256;
+
+        frames = PyMem_Realloc(self->frames, allocated *
+                sizeof(NRSampleFrame));
+
+        if (!frames) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        self->frames = frames;
+        self->frames_allocated = allocated;
+    }
+
+    Py_INCREF(code);
+
+    self->frames[self->frames_size].code = (PyCodeObject *)code;
+    self->frames[self->frames_size].line = line;
+
+    self->frames_size++;
+
+    return 0;
+}
+
+/*
+ * Walks the frames of a thread out from the innermost frame. Unless it is
+ * a thread of the agent itself, frames for code of the agent are skipped,
+ * so that the instrumentation does not show up in the call trees.
+ */
+
+static int NRSample_walk(NRSample *self, PyObject *category, PyObject *frame,
+        PyObject *agent_directory)
+{
+    int agent_thread;
+
+    agent_thread = PyObject_RichCompareBool(category, str_AGENT, Py_EQ);
+
+    if (agent_thread < 0)
+        return -1;
+
+    Py_INCREF(frame);
+
+    while (frame) {
+        PyObject *code;
+        PyObject *back;
+
+        int line;
+        int skip = 0;
+
+        code = NRFrame_GetCode(frame);
+
+        if (!code) {
+            Py_DECREF(frame);
+            return -1;
+        }
+
+        line = PyFrame_GetLineNumber((PyFrameObject *)frame);
+
+        if (!agent_thread) {
+            skip = NRString_StartsWith(((PyCodeObject *)code)->co_filename,
+                    agent_directory);
+        }
+
+        if (skip < 0 || (!skip && NRSample_append(self, code, line) < 0)) {
+            Py_DECREF(code);
+            Py_DECREF(frame);
+            return -1;
+        }
+
+        Py_DECREF(code);
+
+        back = NRFrame_GetBack(frame);
+
+        Py_DECREF(frame);
+
+        frame = back;
+    }
+
+    if (PyErr_Occurred())
+        return -1;
+
+    return 0;
+}
+
+static void NRSample_free(NRSample *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->frames_size; i++)
+        Py_DECREF(self->frames[i].code);
+
+    for (i = 0; i < self->threads_size; i++)
+        Py_DECREF(self->threads[i].category);
+
+    PyMem_Free(self->frames);
+    PyMem_Free(self->threads);
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * The call trees of a profile session. Each distinct method, being the
+ * (filename, func_name, first_line, real_line) tuple used as the key of a
+ * node by CallTree, is given an integer id. The nodes of the call trees
+ * are held in one array, in the order they were added, each with the id
+ * of its method, its call count, and the indices of its parent, its first
+ * and last child and its next sibling. The roots of the call tree for each
+ * category have a parent of -1 less the index of the category.
+ *
+ * Two hash tables avoid creating any Python objects for stack traces
+ * already seen. One maps the code object and line numbers of a frame to
+ * the id of its method, holding a reference to the code object so that it
+ * cannot be reused for another. The other maps the parent and method id of
+ * a node to the index of the node.
+ */
+
+typedef struct {
+    PyCodeObject *code;
+    int first_line;
+    int real_line;
+    int method;
+} NRMethodEntry;
+
+typedef struct {
+    int parent;
+    int method;
+    int node;
+} NRChildEntry;
+
+typedef struct {
+    int method;
+    int parent;
+    int first_child;
+    int last_child;
+    int next_sibling;
+    int depth;
+    Py_ssize_t call_count;
+} NRCallNode;
+
+typedef struct {
+    int first;
+    int last;
+} NRCallRoots;
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject *categories;
+    PyObject *methods;
+    PyObject *method_list;
+
+    NRMethodEntry *method_table;
+    Py_ssize_t method_table_size;
+
+    NRChildEntry *child_table;
+    Py_ssize_t child_table_size;
+
+    NRCallNode *nodes;
+    Py_ssize_t nodes_size;
+    Py_ssize_t nodes_allocated;
+
+    NRCallRoots *roots;
+} NRCallTreesObject;
+
+extern PyTypeObject NRCallTrees_Type;
+
+/* ------------------------------------------------------------------------- */
+
+static size_t NRHash_combine(size_t hash, size_t value)
+{
+    return hash ^ (value + 0x9e3779b9 + (hash << 6) + (hash >> 2));
+}
+
+static size_t NRMethodEntry_hash(PyCodeObject *code, int first_line,
+        int real_line)
+{
+    size_t hash = (size_t)code >> 4;
+
+    hash = NRHash_combine(hash, (size_t)first_line);
+
+    return NRHash_combine(hash, (size_t)real_line);
+}
+
+static size_t NRChildEntry_hash(int parent, int method)
+{
+    return NRHash_combine((size_t)parent, (size_t)method);
+}
+
+/*
+ * The tables use open addressing with linear probing, their size always
+ * being a power of two, and are grown before they are two thirds full.
+ */
+
+static int NRMethodTable_grow(NRCallTreesObject *self)
+{
+    NRMethodEntry *table;
+    Py_ssize_t size;
+    Py_ssize_t i;
+
+    size = self->method_table_size ? self->method_table_size * 2 : 1024;
+
+    table = PyMem_New(NRMethodEntry, size);
+
+    if (!table) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(table, 0, sizeof(NRMethodEntry) * size);
+
+    for (i = 0; i < self->method_table_size; i++) {
+        NRMethodEntry *entry = &self->method_table[i];
+        size_t j;
+
+        if (!entry->code)
+            continue;
+
+        j = NRMethodEntry_hash(entry->code, entry->first_line,
+                entry->real_line) & (size - 1);
+
+        while (table[j].code)
+            j = (j + 1) & (size - 1);
+
+        table[j] = *entry;
+    }
+
+    PyMem_Free(self->method_table);
+
+    self->method_table = table;
+    self->method_table_size = size;
+
+    return 0;
+}
+
+static int NRChildTable_grow(NRCallTreesObject *self)
+{
+    NRChildEntry *table;
+    Py_ssize_t size;
+    Py_ssize_t i;
+
+    size = self->child_table_size ? self->child_table_size * 2 : 1024;
+
+    table = PyMem_New(NRChildEntry, size);
+
+    if (!table) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i = 0; i < size; i++)
+        table[i].node = -1;
+
+    for (i = 0; i < self->child_table_size; i++) {
+        NRChildEntry *entry = &self->child_table[i];
+        size_t j;
+
+        if (entry->node < 0)
+            continue;
+
+        j = NRChildEntry_hash(entry->parent, entry->method) & (size - 1);
+
+        while (table[j].node >= 0)
+            j = (j + 1) & (size - 1);
+
+        table[j] = *entry;
+    }
+
+    PyMem_Free(self->child_table);
+
+    self->child_table = table;
+    self->child_table_size = size;
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Returns the id of the method for a frame, adding the method where it has
+ * not been seen before. Methods for different code objects with the same
+ * key share the same id, as they do the same node in CallTree.
+ */
+
+static int NRCallTrees_method(NRCallTreesObject *self, PyCodeObject *code,
+        int first_line, int real_line)
+{
+    NRMethodEntry *entry;
+
+    PyObject *filename = NULL;
+    PyObject *name = NULL;
+    PyObject *first = NULL;
+    PyObject *real = NULL;
+    PyObject *method = NULL;
+    PyObject *index = NULL;
+
+    Py_ssize_t used;
+    size_t i;
+
+    int result = -1;
+
+    if (self->method_table_size) {
+        i = NRMethodEntry_hash(code, first_line, real_line) &
+                (self->method_table_size - 1);
+
+        while (self->method_table[i].code) {
+            entry = &self->method_table[i];
+
+            if (entry->code == code && entry->first_line == first_line &&
+                    entry->real_line == real_line) {
+                return entry->method;
+            }
+
+            i = (i + 1) & (self->method_table_size - 1);
+        }
+    }
+
+    filename = code->co_filename;
+    name = code->co_name;
+
+    Py_INCREF(filename);
+    Py_INCREF(name);
+
+#if PY_MAJOR_VERSION >= 3
+    if (PyUnicode_CheckExact(filename))
+        PyUnicode_InternInPlace(&filename);
+    if (PyUnicode_CheckExact(name))
+        PyUnicode_InternInPlace(&name);
+#else
+    if (PyString_CheckExact(filename))
+        PyString_InternInPlace(&filename);
+    if (PyString_CheckExact(name))
+        PyString_InternInPlace(&name);
+#endif
+
+    first = NRLine_FromInt(first_line);
+    real = NRLine_FromInt(real_line);
+
+    if (!first || !real)
+        goto done;
+
+    method = PyTuple_Pack(4, filename, name, first, real);
+
+    if (!method)
+        goto done;
+
+    index = PyDict_GetItem(self->methods, method);
+
+    if (index) {
+        Py_INCREF(index);
+    }
+    else {
+        if (PyList_GET_SIZE(self->method_list) >= INT_MAX) {
+            PyErr_SetString(PyExc_OverflowError, "too many methods");
+            goto done;
+        }
+
+        index = NRInt_FromSsize_t(PyList_GET_SIZE(self->method_list));
+
+        if (!index || PyList_Append(self->method_list, method) < 0 ||
+                PyDict_SetItem(self->methods, method, index) < 0) {
+            goto done;
+        }
+    }
+
+    result = (int)PyLong_AsLong(index);
+
+    if (result < 0)
+        goto done;
+
+    used = PyDict_Size(self->methods) + 1;
+
+    if (used * 3 >= self->method_table_size * 2) {
+        if (NRMethodTable_grow(self) < 0) {
+            result = -1;
+            goto done;
+        }
+    }
+
+    i = NRMethodEntry_hash(code, first_line, real_line) &
+            (self->method_table_size - 1);
+
+    while (self->method_table[i].code)
+        i = (i + 1) & (self->method_table_size - 1);
+
+    Py_INCREF(code);
+
+    self->method_table[i].code = code;
+    self->method_table[i].first_line = first_line;
+    self->method_table[i].real_line = real_line;
+    self->method_table[i].method = result;
+
+done:
+    Py_XDECREF(filename);
+    Py_XDECREF(name);
+    Py_XDECREF(first);
+    Py_XDECREF(real);
+    Py_XDECREF(method);
+    Py_XDECREF(index);
+
+    return result;
+}
+
+/*
+ * Returns the index of the child of the parent for the method, adding a
+ * new node where there is not one already, with its call count incremented.
+ */
+
+static int NRCallTrees_visit(NRCallTreesObject *self, int parent,
+        int method, int depth)
+{
+    NRCallNode *node;
+    size_t i;
+
+    if (self->child_table_size) {
+        i = NRChildEntry_hash(parent, method) &
+                (self->child_table_size - 1);
+
+        while (self->child_table[i].node >= 0) {
+            NRChildEntry *entry = &self->child_table[i];
+
+            if (entry->parent == parent && entry->method == method) {
+                self->nodes[entry->node].call_count++;
+                return entry->node;
+            }
+
+            i = (i + 1) & (self->child_table_size - 1);
+        }
+    }
+
+    if (self->nodes_size >= INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "too many call tree nodes");
+        return -1;
+    }
+
+    if (self->nodes_size == self->nodes_allocated) {
+        Py_ssize_t allocated;
+        NRCallNode *nodes;
+
+        allocated = self->nodes_allocated ? self->nodes_allocated * 2 : 256;
+
+        nodes = PyMem_Realloc(self->nodes, allocated * sizeof(NRCallNode));
+
+        if (!nodes) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        self->nodes = nodes;
+        self->nodes_allocated = allocated;
+    }
+
+    if ((self->nodes_size + 1) * 3 >= self->child_table_size * 2) {
+        if (NRChildTable_grow(self) < 0)
+            return -1;
+    }
+
+    i = NRChildEntry_hash(parent, method) & (self->child_table_size - 1);
+
+    while (self->child_table[i].node >= 0)
+        i = (i + 1) & (self->child_table_size - 1);
+
+    self->child_table[i].parent = parent;
+    self->child_table[i].method = method;
+    self->child_table[i].node = (int)self->nodes_size;
+
+    node = &self->nodes[self->nodes_size];
+
+    node->method = method;
+    node->parent = parent;
+    node->first_child = -1;
+    node->last_child = -1;
+    node->next_sibling = -1;
+    node->depth = depth;
+    node->call_count = 1;
+
+    if (parent < 0) {
+        NRCallRoots *roots = &self->roots[-1 - parent];
+
+        if (roots->last >= 0)
+            self->nodes[roots->last].next_sibling = (int)self->nodes_size;
+        else
+            roots->first = (int)self->nodes_size;
+
+        roots->last = (int)self->nodes_size;
+    }
+    else {
+        NRCallNode *owner = &self->nodes[parent];
+
+        if (owner->last_child >= 0)
+            self->nodes[owner->last_child].next_sibling = (int)self->nodes_size;
+        else
+            owner->first_child = (int)self->nodes_size;
+
+        owner->last_child = (int)self->nodes_size;
+    }
+
+    return (int)self->nodes_size++;
+}
+
+/*
+ * Adds the stack trace of a thread to the call tree for the category of
+ * the thread. The stack trace runs from the outermost frame in, with a
+ * node for each frame, followed by a node for the line being executed in
+ * the innermost frame.
+ */
+
+static int NRCallTrees_add(NRCallTreesObject *self, NRSample *sample,
+        NRSampleThread *thread)
+{
+    NRSampleFrame *frame;
+
+    Py_ssize_t category;
+    Py_ssize_t i;
+
+    int parent = -1;
+    int depth = 1;
+    int method;
+
+    for (category = 0; category < PyTuple_GET_SIZE(self->categories);
+            category++) {
+        int equal;
+
+        equal = PyObject_RichCompareBool(thread->category,
+                PyTuple_GET_ITEM(self->categories, category), Py_EQ);
+
+        if (equal < 0)
+            return -1;
+
+        if (equal)
+            break;
+
+        parent--;
+    }
+
+    if (category == PyTuple_GET_SIZE(self->categories))
+        return 0;
+
+    for (i = thread->end - 1; i >= thread->start; i--) {
+        frame = &sample->frames[i];
+
+        method = NRCallTrees_method(self, frame->code,
+                frame->code->co_firstlineno, frame->line);
+
+        if (method < 0)
+            return -1;
+
+        parent = NRCallTrees_visit(self, parent, method, depth++);
+
+        if (parent < 0)
+            return -1;
+    }
+
+    frame = &sample->frames[thread->start];
+
+    method = NRCallTrees_method(self, frame->code, frame->line, frame->line);
+
+    if (method < 0)
+        return -1;
+
+    if (NRCallTrees_visit(self, parent, method, depth) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRCallTrees_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    NRCallTreesObject *self;
+
+    self = (NRCallTreesObject *)type->tp_alloc(type, 0);
+
+    if (!self)
+        return NULL;
+
+    self->categories = NULL;
+    self->methods = NULL;
+    self->method_list = NULL;
+
+    self->method_table = NULL;
+    self->method_table_size = 0;
+
+    self->child_table = NULL;
+    self->child_table_size = 0;
+
+    self->nodes = NULL;
+    self->nodes_size = 0;
+    self->nodes_allocated = 0;
+
+    self->roots = NULL;
+
+    return (PyObject *)self;
+}
+
+static int NRCallTrees_init(NRCallTreesObject *self,
+        PyObject *args, PyObject *kwds)
+{
+    PyObject *categories;
+
+    Py_ssize_t i;
+
+    static char *kwlist[] = { "categories", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O:CallTrees",
+            kwlist, &categories)) {
+        return -1;
+    }
+
+    if (self->categories) {
+        PyErr_SetString(PyExc_TypeError,
+                "call trees are already initialized");
+        return -1;
+    }
+
+    self->categories = PySequence_Tuple(categories);
+    self->methods = PyDict_New();
+    self->method_list = PyList_New(0);
+
+    if (!self->categories || !self->methods || !self->method_list)
+        return -1;
+
+    self->roots = PyMem_New(NRCallRoots,
+            PyTuple_GET_SIZE(self->categories) + 1);
+
+    if (!self->roots) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    for (i = 0; i <= PyTuple_GET_SIZE(self->categories); i++) {
+        self->roots[i].first = -1;
+        self->roots[i].last = -1;
+    }
+
+    return 0;
+}
+
+static void NRCallTrees_dealloc(NRCallTreesObject *self)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->method_table_size; i++)
+        Py_XDECREF(self->method_table[i].code);
+
+    PyMem_Free(self->method_table);
+    PyMem_Free(self->child_table);
+    PyMem_Free(self->nodes);
+    PyMem_Free(self->roots);
+
+    Py_XDECREF(self->categories);
+    Py_XDECREF(self->methods);
+    Py_XDECREF(self->method_list);
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t NRCallTrees_length(NRCallTreesObject *self)
+{
+    return self->nodes_size;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Takes a sample of the stack traces for a sequence of (category, frame)
+ * pairs and adds those which are not empty to the call trees. Returns the
+ * number of stack traces which were not empty.
+ */
+
+static PyObject *NRCallTrees_sample(NRCallTreesObject *self,
+        PyObject *args)
+{
+    PyObject *threads = NULL;
+    PyObject *agent_directory = NULL;
+
+    PyObject *items = NULL;
+
+    NRSample sample = { NULL, 0, 0, NULL, 0 };
+
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "OO:sample", &threads, &agent_directory))
+        return NULL;
+
+    if (!self->categories) {
+        PyErr_SetString(PyExc_TypeError, "call trees are not initialized");
+        return NULL;
+    }
+
+    items = PySequence_Fast(threads, "threads must be iterable");
+
+    if (!items)
+        return NULL;
+
+    sample.threads = PyMem_New(NRSampleThread,
+            PySequence_Fast_GET_SIZE(items) + 1);
+
+    if (!sample.threads) {
+        Py_DECREF(items);
+        return PyErr_NoMemory();
+    }
+
+    for (i = 0; i < PySequence_Fast_GET_SIZE(items); i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(items, i);
+
+        PyObject *category;
+        PyObject *frame;
+
+        Py_ssize_t start = sample.frames_size;
+
+        if (!PyArg_ParseTuple(item, "OO!:sample", &category,
+                &PyFrame_Type, &frame)) {
+            goto error;
+        }
+
+        if (NRSample_walk(&sample, category, frame, agent_directory) < 0)
+            goto error;
+
+        /* Empty stack traces are not added to the call trees. */
+
+        if (sample.frames_size == start)
+            continue;
+
+        Py_INCREF(category);
+
+        sample.threads[sample.threads_size].category = category;
+        sample.threads[sample.threads_size].start = start;
+        sample.threads[sample.threads_size].end = sample.frames_size;
+
+        sample.threads_size++;
+    }
+
+    for (i = 0; i < sample.threads_size; i++) {
+        if (NRCallTrees_add(self, &sample, &sample.threads[i]) < 0)
+            goto error;
+    }
+
+    NRSample_free(&sample);
+    Py_DECREF(items);
+
+    return NRInt_FromSsize_t(i);
+
+error:
+    NRSample_free(&sample);
+    Py_DECREF(items);
+
+    return NULL;
+}
+
+/*
+ * Merges the call trees into nested dictionaries of CallTree objects, as
+ * built by ProfileSession.update_call_tree(). As nodes were added after
+ * their parent, and after any sibling added to the call trees before them,
+ * merging them in order gives the same order of children.
+ */
+
+static PyObject *NRCallTrees_merge(NRCallTreesObject *self,
+        PyObject *args)
+{
+    PyObject *call_buckets = NULL;
+    PyObject *node_list = NULL;
+    PyObject *call_tree_type = NULL;
+
+    PyObject **objects = NULL;
+
+    Py_ssize_t i;
+
+    if (!PyArg_ParseTuple(args, "O!O!O:merge", &PyDict_Type, &call_buckets,
+            &PyList_Type, &node_list, &call_tree_type)) {
+        return NULL;
+    }
+
+    if (!self->nodes_size)
+        Py_RETURN_NONE;
+
+    objects = PyMem_New(PyObject *, self->nodes_size);
+
+    if (!objects)
+        return PyErr_NoMemory();
+
+    memset(objects, 0, sizeof(PyObject *) * self->nodes_size);
+
+    for (i = 0; i < self->nodes_size; i++) {
+        NRCallNode *node = &self->nodes[i];
+
+        PyObject *bucket;
+        PyObject *method;
+        PyObject *call_tree;
+        PyObject *value;
+        PyObject *call_count;
+        PyObject *increment;
+
+        int result;
+
+        if (node->parent < 0) {
+            bucket = PyDict_GetItem(call_buckets, PyTuple_GET_ITEM(
+                    self->categories, -1 - node->parent));
+            Py_XINCREF(bucket);
+        }
+        else if (objects[node->parent]) {
+            bucket = PyObject_GetAttr(objects[node->parent], str_children);
+
+            if (!bucket)
+                goto error;
+        }
+        else
+            bucket = NULL;
+
+        /* Nodes under a category not in the call buckets are dropped. */
+
+        if (!bucket)
+            continue;
+
+        if (!PyDict_Check(bucket)) {
+            Py_DECREF(bucket);
+            PyErr_SetString(PyExc_TypeError,
+                    "children of call tree must be a dict");
+            goto error;
+        }
+
+        method = PyList_GET_ITEM(self->method_list, node->method);
+
+        call_tree = PyDict_GetItem(bucket, method);
+
+        if (call_tree) {
+            Py_INCREF(call_tree);
+        }
+        else {
+            PyObject *call_args;
+            PyObject *kwargs;
+
+            value = NRInt_FromSsize_t(node->depth);
+            call_args = PyTuple_Pack(1, method);
+            kwargs = PyDict_New();
+
+            if (value && call_args && kwargs &&
+                    PyDict_SetItem(kwargs, str_depth, value) == 0) {
+                call_tree = PyObject_Call(call_tree_type, call_args, kwargs);
+            }
+
+            Py_XDECREF(value);
+            Py_XDECREF(call_args);
+            Py_XDECREF(kwargs);
+
+            if (!call_tree || PyList_Append(node_list, call_tree) < 0 ||
+                    PyDict_SetItem(bucket, method, call_tree) < 0) {
+                Py_XDECREF(call_tree);
+                Py_DECREF(bucket);
+                goto error;
+            }
+        }
+
+        Py_DECREF(bucket);
+
+        objects[i] = call_tree;
+
+        call_count = PyObject_GetAttr(call_tree, str_call_count);
+
+        if (!call_count)
+            goto error;
+
+        increment = NRInt_FromSsize_t(node->call_count);
+
+        if (!increment) {
+            Py_DECREF(call_count);
+            goto error;
+        }
+
+        value = PyNumber_Add(call_count, increment);
+
+        Py_DECREF(call_count);
+        Py_DECREF(increment);
+
+        if (!value)
+            goto error;
+
+        result = PyObject_SetAttr(call_tree, str_call_count, value);
+
+        Py_DECREF(value);
+
+        if (result < 0)
+            goto error;
+    }
+
+    for (i = 0; i < self->nodes_size; i++)
+        Py_XDECREF(objects[i]);
+
+    PyMem_Free(objects);
+
+    Py_RETURN_NONE;
+
+error:
+    for (i = 0; i < self->nodes_size; i++)
+        Py_XDECREF(objects[i]);
+
+    PyMem_Free(objects);
+
+    return NULL;
+}
+
+/* ------------------------------------------------------------------------- */
+
+/*
+ * Pruning keeps the nodes ranked highest by call count, and then by lesser
+ * depth, ignoring the rest. Ties are ranked in the order nodes were added,
+ * as the stable sort of the node list by ProfileSession._prune_call_trees()
+ * does. Only the nodes kept need to be found, not their order, so they are
+ * selected with a quickselect rather than sorting all nodes.
+ */
+
+static int NRCallNode_ranks_before(NRCallNode *nodes, int a, int b)
+{
+    if (nodes[a].call_count != nodes[b].call_count)
+        return nodes[a].call_count > nodes[b].call_count;
+
+    if (nodes[a].depth != nodes[b].depth)
+        return nodes[a].depth < nodes[b].depth;
+
+    return a < b;
+}
+
+static void NRCallTrees_select(NRCallNode *nodes, int *order,
+        Py_ssize_t size, Py_ssize_t k)
+{
+    Py_ssize_t left = 0;
+    Py_ssize_t right = size - 1;
+
+    int pivot;
+    int swap;
+
+#define NR_SWAP(x, y) \
+    do { swap = order[x]; order[x] = order[y]; order[y] = swap; } while (0)
+
+    while (left < right) {
+        Py_ssize_t middle = left + (right - left) / 2;
+        Py_ssize_t i = left;
+        Py_ssize_t j = right;
+
+        if (NRCallNode_ranks_before(nodes, order[middle], order[left]))
+            NR_SWAP(middle, left);
+        if (NRCallNode_ranks_before(nodes, order[right], order[left]))
+            NR_SWAP(right, left);
+        if (NRCallNode_ranks_before(nodes, order[right], order[middle]))
+            NR_SWAP(right, middle);
+
+        pivot = order[middle];
+
+        while (i <= j) {
+            while (NRCallNode_ranks_before(nodes, order[i], pivot))
+                i++;
+            while (NRCallNode_ranks_before(nodes, pivot, order[j]))
+                j--;
+
+            if (i <= j) {
+                NR_SWAP(i, j);
+                i++;
+                j--;
+            }
+        }
+
+        if (k <= j)
+            right = j;
+        else if (k >= i)
+            left = i;
+        else
+            break;
+    }
+
+#undef NR_SWAP
+}
+
+/*
+ * Returns an array flagging the nodes to be ignored where there are more
+ * nodes than the limit, or NULL with no exception set where there are not.
+ */
+
+static char *NRCallTrees_prune(NRCallTreesObject *self, Py_ssize_t limit)
+{
+    char *ignore;
+    int *order;
+
+    Py_ssize_t i;
+
+    if (self->nodes_size <= limit)
+        return NULL;
+
+    if (limit < 0)
+        limit = 0;
+
+    ignore = PyMem_Malloc(self->nodes_size);
+    order = PyMem_New(int, self->nodes_size);
+
+    if (!ignore || !order) {
+        PyMem_Free(ignore);
+        PyMem_Free(order);
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (i = 0; i < self->nodes_size; i++)
+        order[i] = (int)i;
+
+    NRCallTrees_select(self->nodes, order, self->nodes_size, limit);
+
+    memset(ignore, 0, self->nodes_size);
+
+    for (i = limit; i < self->nodes_size; i++)
+        ignore[order[i]] = 1;
+
+    PyMem_Free(order);
+
+    return ignore;
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    char *data;
+    Py_ssize_t size;
+    Py_ssize_t allocated;
+} NRBuffer;
+
+static int NRBuffer_write(NRBuffer *buffer, const char *data,
+        Py_ssize_t size)
+{
+    if (buffer->size + size > buffer->allocated) {
+        Py_ssize_t allocated;
+        char *resized;
+
+        allocated = buffer->allocated ? buffer->allocated : 4096;
+
+        while (allocated < buffer->size + size)
+            allocated *= 2;
+
+        resized = PyMem_Realloc(buffer->data, allocated);
+
+        if (!resized) {
+            PyErr_NoMemory();
+            return -1;
+        }
+
+        buffer->data = resized;
+        buffer->allocated = allocated;
+    }
+
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+
+    return 0;
+}
+
+static int NRBuffer_puts(NRBuffer *buffer, const char *data)
+{
+    return NRBuffer_write(buffer, data, strlen(data));
+}
+
+/*
+ * Writes the characters of a string as json.dumps() does by default, with
+ * all but printable ASCII characters escaped. For Python 2, byte strings
+ * are treated as Latin-1, as json_encode() does.
+ */
+
+static int NRBuffer_write_char(NRBuffer *buffer, unsigned long c)
+{
+    char escaped[16];
+
+    switch (c) {
+        case '"':
+            return NRBuffer_write(buffer, "\\\"", 2);
+        case '\\':
+            return NRBuffer_write(buffer, "\\\\", 2);
+        case '\n':
+            return NRBuffer_write(buffer, "\\n", 2);
+        case '\r':
+            return NRBuffer_write(buffer, "\\r", 2);
+        case '\t':
+            return NRBuffer_write(buffer, "\\t", 2);
+        case '\b':
+            return NRBuffer_write(buffer, "\\b", 2);
+        case '\f':
+            return NRBuffer_write(buffer, "\\f", 2);
+    }
+
+    if (c >= 0x20 && c < 0x7f) {
+        escaped[0] = (char)c;
+        return NRBuffer_write(buffer, escaped, 1);
+    }
+
+    if (c > 0xffff) {
+        c -= 0x10000;
+
+        PyOS_snprintf(escaped, sizeof(escaped), "\\u%04lx\\u%04lx",
+                0xd800 | (c >> 10), 0xdc00 | (c & 0x3ff));
+
+        return NRBuffer_write(buffer, escaped, 12);
+    }
+
+    PyOS_snprintf(escaped, sizeof(escaped), "\\u%04lx", c);
+
+    return NRBuffer_write(buffer, escaped, 6);
+}
+
+static int NRBuffer_write_chars(NRBuffer *buffer, PyObject *value)
+{
+    Py_ssize_t i;
+
+#if PY_VERSION_HEX >= 0x03030000
+    if (PyUnicode_Check(value)) {
+        int kind;
+        void *data;
+
+        if (PyUnicode_READY(value) < 0)
+            return -1;
+
+        kind = PyUnicode_KIND(value);
+        data = PyUnicode_DATA(value);
+
+        for (i = 0; i < PyUnicode_GET_LENGTH(value); i++) {
+            if (NRBuffer_write_char(buffer,
+                    PyUnicode_READ(kind, data, i)) < 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+#else
+    if (PyUnicode_Check(value)) {
+        Py_UNICODE *data = PyUnicode_AS_UNICODE(value);
+
+        for (i = 0; i < PyUnicode_GET_SIZE(value); i++) {
+            if (NRBuffer_write_char(buffer, data[i]) < 0)
+                return -1;
+        }
+
+        return 0;
+    }
+#endif
+
+#if PY_MAJOR_VERSION < 3
+    if (PyString_Check(value)) {
+        unsigned char *data = (unsigned char *)PyString_AS_STRING(value);
+
+        for (i = 0; i < PyString_GET_SIZE(value); i++) {
+            if (NRBuffer_write_char(buffer, data[i]) < 0)
+                return -1;
+        }
+
+        return 0;
+    }
+#endif
+
+    PyErr_Format(PyExc_TypeError, "expected string, not %.200s",
+            Py_TYPE(value)->tp_name);
+
+    return -1;
+}
+
+static int NRBuffer_write_line(NRBuffer *buffer, PyObject *line,
+        const char *none)
+{
+    char digits[32];
+    long value;
+
+    if (line == Py_None)
+        return NRBuffer_puts(buffer, none);
+
+    value = PyLong_AsLong(line);
+
+    if (value == -1 && PyErr_Occurred())
+        return -1;
+
+    PyOS_snprintf(digits, sizeof(digits), "%ld", value);
+
+    return NRBuffer_puts(buffer, digits);
+}
+
+/*
+ * Writes the start of the node as CallTree.flatten() would return it, up
+ * to the list of its children.
+ */
+
+static int NRCallTrees_write_node(NRCallTreesObject *self,
+        NRBuffer *buffer, NRCallNode *node)
+{
+    PyObject *method = PyList_GET_ITEM(self->method_list, node->method);
+
+    PyObject *filename = PyTuple_GET_ITEM(method, 0);
+    PyObject *name = PyTuple_GET_ITEM(method, 1);
+    PyObject *first = PyTuple_GET_ITEM(method, 2);
+    PyObject *real = PyTuple_GET_ITEM(method, 3);
+
+    char digits[32];
+    int leaf;
+
+    leaf = PyObject_RichCompareBool(first, real, Py_EQ);
+
+    if (leaf < 0)
+        return -1;
+
+    if (NRBuffer_puts(buffer, "[[\"") < 0 ||
+            NRBuffer_write_chars(buffer, filename) < 0 ||
+            NRBuffer_puts(buffer, leaf ? "\",\"@" : "\",\"") < 0 ||
+            NRBuffer_write_chars(buffer, name) < 0 ||
+            NRBuffer_puts(buffer, "#") < 0 ||
+            NRBuffer_write_line(buffer, first, "None") < 0 ||
+            NRBuffer_puts(buffer, "\",") < 0 ||
+            NRBuffer_write_line(buffer, real, "null") < 0) {
+        return -1;
+    }
+
+    PyOS_snprintf(digits, sizeof(digits), "],%ld,0,[",
+            (long)node->call_count);
+
+    return NRBuffer_puts(buffer, digits);
+}
+
+/*
+ * Writes the call tree below a root, skipping any child nodes which are
+ * ignored. The parent and sibling indices of the nodes are followed rather
+ * than recursing, as the depth of the call tree is that of the stack.
+ */
+
+static int NRCallTrees_write_tree(NRCallTreesObject *self,
+        NRBuffer *buffer, int root, char *ignore)
+{
+    NRCallNode *nodes = self->nodes;
+
+    int index = root;
+
+    while (1) {
+        int child;
+
+        if (NRCallTrees_write_node(self, buffer, &nodes[index]) < 0)
+            return -1;
+
+        child = nodes[index].first_child;
+
+        while (child >= 0 && ignore && ignore[child])
+            child = nodes[child].next_sibling;
+
+        if (child >= 0) {
+            index = child;
+            continue;
+        }
+
+        if (NRBuffer_puts(buffer, "]]") < 0)
+            return -1;
+
+        while (index != root) {
+            int sibling = nodes[index].next_sibling;
+
+            while (sibling >= 0 && ignore && ignore[sibling])
+                sibling = nodes[sibling].next_sibling;
+
+            if (sibling >= 0) {
+                if (NRBuffer_puts(buffer, ",") < 0)
+                    return -1;
+
+                index = sibling;
+                break;
+            }
+
+            index = nodes[index].parent;
+
+            if (NRBuffer_puts(buffer, "]]") < 0)
+                return -1;
+        }
+
+        if (index == root)
+            return 0;
+    }
+}
+
+/*
+ * Returns the call trees as the JSON encoded byte string of the dictionary
+ * of flattened call trees for each category which is not empty, as built
+ * by ProfileSession.profile_data(), along with the number of root nodes.
+ * As there, the call trees are first pruned to the limit given, although
+ * root nodes are never dropped.
+ */
+
+static PyObject *NRCallTrees_profile_data(NRCallTreesObject *self,
+        PyObject *args)
+{
+    NRBuffer buffer = { NULL, 0, 0 };
+
+    char *ignore = NULL;
+
+    Py_ssize_t limit = 0;
+    Py_ssize_t thread_count = 0;
+    Py_ssize_t category;
+
+    PyObject *data = NULL;
+    PyObject *result = NULL;
+
+    int separator = 0;
+
+    if (!PyArg_ParseTuple(args, "n:profile_data", &limit))
+        return NULL;
+
+    if (!self->categories) {
+        PyErr_SetString(PyExc_TypeError, "call trees are not initialized");
+        return NULL;
+    }
+
+    ignore = NRCallTrees_prune(self, limit);
+
+    if (!ignore && PyErr_Occurred())
+        return NULL;
+
+    if (NRBuffer_puts(&buffer, "{") < 0)
+        goto done;
+
+    for (category = 0; category < PyTuple_GET_SIZE(self->categories);
+            category++) {
+        int root = self->roots[category].first;
+
+        if (root < 0)
+            continue;
+
+        if (NRBuffer_puts(&buffer, separator ? ",\"" : "\"") < 0 ||
+                NRBuffer_write_chars(&buffer, PyTuple_GET_ITEM(
+                self->categories, category)) < 0 ||
+                NRBuffer_puts(&buffer, "\":[") < 0) {
+            goto done;
+        }
+
+        separator = 1;
+
+        for (; root >= 0; root = self->nodes[root].next_sibling) {
+            if (root != self->roots[category].first) {
+                if (NRBuffer_puts(&buffer, ",") < 0)
+                    goto done;
+            }
+
+            if (NRCallTrees_write_tree(self, &buffer, root, ignore) < 0)
+                goto done;
+
+            thread_count++;
+        }
+
+        if (NRBuffer_puts(&buffer, "]") < 0)
+            goto done;
+    }
+
+    if (NRBuffer_puts(&buffer, "}") < 0)
+        goto done;
+
+    data = PyBytes_FromStringAndSize(buffer.data, buffer.size);
+
+    if (data)
+        result = Py_BuildValue("(On)", data, thread_count);
+
+done:
+    Py_XDECREF(data);
+
+    PyMem_Free(buffer.data);
+    PyMem_Free(ignore);
+
+    return result;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PySequenceMethods NRCallTrees_as_sequence = {
+    (lenfunc)NRCallTrees_length, /*sq_length*/
+    0,                      /*sq_concat*/
+    0,                      /*sq_repeat*/
+    0,                      /*sq_item*/
+    0,                      /*sq_slice*/
+    0,                      /*sq_ass_item*/
+    0,                      /*sq_ass_slice*/
+    0,                      /*sq_contains*/
+};
+
+static PyMethodDef NRCallTrees_methods[] = {
+    { "sample",             (PyCFunction)NRCallTrees_sample,
+                            METH_VARARGS, 0 },
+    { "merge",              (PyCFunction)NRCallTrees_merge,
+                            METH_VARARGS, 0 },
+    { "profile_data",       (PyCFunction)NRCallTrees_profile_data,
+                            METH_VARARGS, 0 },
+    { NULL, NULL }
+};
+
+PyTypeObject NRCallTrees_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_profile_sessions.CallTrees", /*tp_name*/
+    sizeof(NRCallTreesObject), /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)NRCallTrees_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    &NRCallTrees_as_sequence, /*tp_as_sequence*/
+    0,                      /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,     /*tp_flags*/
+    0,                      /*tp_doc*/
+    0,                      /*tp_traverse*/
+    0,                      /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    0,                      /*tp_iter*/
+    0,                      /*tp_iternext*/
+    NRCallTrees_methods,    /*tp_methods*/
+    0,                      /*tp_members*/
+    0,                      /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    (initproc)NRCallTrees_init, /*tp_init*/
+    0,                      /*tp_alloc*/
+    NRCallTrees_new,        /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------- */
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_profile_sessions",    /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    NULL,                   /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *NRString_Intern(const char *value)
+{
+#if PY_MAJOR_VERSION >= 3
+    return PyUnicode_InternFromString(value);
+#else
+    return PyString_InternFromString(value);
+#endif
+}
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_profile_sessions", NULL, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    str_AGENT = NRString_Intern("AGENT");
+    str_call_count = NRString_Intern("call_count");
+    str_children = NRString_Intern("children");
+    str_depth = NRString_Intern("depth");
+
+    if (!str_AGENT || !str_call_count || !str_children || !str_depth)
+        return NULL;
+
+    if (PyType_Ready(&NRCallTrees_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&NRCallTrees_Type);
+    PyModule_AddObject(module, "CallTrees", (PyObject *)&NRCallTrees_Type);
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_profile_sessions(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__profile_sessions(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
@@ -0,0 +1,483 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bounded queue used to hand completed transactions from the threads
+ * handling requests to the background transaction recorder. Items are
+ * held in a fixed size ring buffer. Adding an item never blocks, with
+ * either the new item or the oldest item being dropped when the queue
+ * is full. All access to the ring buffer happens with the GIL held, so
+ * no separate mutex is needed. There is a single consumer, which only
+ * releases the GIL while waiting on a lock for an item to be added. The
+ * lock is only released by a producer if the consumer is waiting, so
+ * the common case of adding an item costs no more than storing it.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#include <pythread.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject **items;
+    Py_ssize_t maxlen;
+    Py_ssize_t head;
+    Py_ssize_t length;
+
+    Py_ssize_t seen;
+    Py_ssize_t dropped;
+
+    int drop_oldest;
+    int shutdown;
+
+    /*
+     * The wakeup lock is held except between a producer releasing it
+     * to wake a waiting consumer and the consumer acquiring it again.
+     */
+
+    PyThread_type_lock wakeup;
+    int locked;
+    int waiting;
+} NRRecordingQueueObject;
+
+extern PyTypeObject NRRecordingQueue_Type;
+
+/* ------------------------------------------------------------------------- */
+
+static void NRRecordingQueue_wake(NRRecordingQueueObject *self)
+{
+    if (self->waiting && self->locked) {
+        self->waiting = 0;
+        self->locked = 0;
+        PyThread_release_lock(self->wakeup);
+    }
+}
+
+static PyObject *NRRecordingQueue_pop(NRRecordingQueueObject *self)
+{
+    PyObject *item;
+
+    item = self->items[self->head];
+    self->items[self->head] = NULL;
+
+    self->head = (self->head + 1) % self->maxlen;
+    self->length--;
+
+    return item;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRRecordingQueue_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    NRRecordingQueueObject *self;
+
+    self = (NRRecordingQueueObject *)type->tp_alloc(type, 0);
+
+    if (!self)
+        return NULL;
+
+    self->items = NULL;
+    self->maxlen = 0;
+    self->head = 0;
+    self->length = 0;
+
+    self->seen = 0;
+    self->dropped = 0;
+
+    self->drop_oldest = 0;
+    self->shutdown = 0;
+
+    self->wakeup = NULL;
+    self->locked = 0;
+    self->waiting = 0;
+
+    return (PyObject *)self;
+}
+
+static int NRRecordingQueue_init(NRRecordingQueueObject *self,
+        PyObject *args, PyObject *kwds)
+{
+    Py_ssize_t maxlen;
+    PyObject *drop_oldest = Py_False;
+
+    static char *kwlist[] = { "maxlen", "drop_oldest", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "n|O:RecordingQueue",
+            kwlist, &maxlen, &drop_oldest)) {
+        return -1;
+    }
+
+    if (self->items) {
+        PyErr_SetString(PyExc_TypeError, "queue is already initialized");
+        return -1;
+    }
+
+    if (maxlen <= 0) {
+        PyErr_SetString(PyExc_ValueError, "maxlen must be positive");
+        return -1;
+    }
+
+    self->drop_oldest = PyObject_IsTrue(drop_oldest);
+
+    if (self->drop_oldest < 0)
+        return -1;
+
+    self->items = PyMem_New(PyObject *, maxlen);
+
+    if (!self->items) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(self->items, 0, sizeof(PyObject *) * maxlen);
+
+    self->maxlen = maxlen;
+
+    self->wakeup = PyThread_allocate_lock();
+
+    if (!self->wakeup) {
+        PyErr_SetString(PyExc_MemoryError, "unable to allocate lock");
+        return -1;
+    }
+
+    PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+
+    self->locked = 1;
+
+    return 0;
+}
+
+static int NRRecordingQueue_clear(NRRecordingQueueObject *self)
+{
+    PyObject *item;
+
+    while (self->length) {
+        item = NRRecordingQueue_pop(self);
+        Py_DECREF(item);
+    }
+
+    return 0;
+}
+
+static int NRRecordingQueue_traverse(NRRecordingQueueObject *self,
+        visitproc visit, void *arg)
+{
+    Py_ssize_t i;
+
+    for (i = 0; i < self->length; i++)
+        Py_VISIT(self->items[(self->head + i) % self->maxlen]);
+
+    return 0;
+}
+
+static void NRRecordingQueue_dealloc(NRRecordingQueueObject *self)
+{
+    PyObject_GC_UnTrack(self);
+
+    if (self->items) {
+        NRRecordingQueue_clear(self);
+        PyMem_Free(self->items);
+    }
+
+    if (self->wakeup) {
+        if (self->locked)
+            PyThread_release_lock(self->wakeup);
+
+        PyThread_free_lock(self->wakeup);
+    }
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t NRRecordingQueue_length(NRRecordingQueueObject *self)
+{
+    return self->length;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRRecordingQueue_put(NRRecordingQueueObject *self,
+        PyObject *item)
+{
+    PyObject *oldest;
+
+    if (!self->items) {
+        PyErr_SetString(PyExc_TypeError, "queue is not initialized");
+        return NULL;
+    }
+
+    if (self->shutdown)
+        Py_RETURN_FALSE;
+
+    self->seen++;
+
+    if (self->length == self->maxlen) {
+        self->dropped++;
+
+        if (!self->drop_oldest)
+            Py_RETURN_FALSE;
+
+        oldest = NRRecordingQueue_pop(self);
+        Py_DECREF(oldest);
+    }
+
+    Py_INCREF(item);
+    self->items[(self->head + self->length) % self->maxlen] = item;
+    self->length++;
+
+    NRRecordingQueue_wake(self);
+
+    Py_RETURN_TRUE;
+}
+
+static PyObject *NRRecordingQueue_get(NRRecordingQueueObject *self,
+        PyObject *args, PyObject *kwds)
+{
+    PyObject *timeout = Py_None;
+    double seconds = -1.0;
+    int acquired;
+
+#if PY_MAJOR_VERSION >= 3
+    PY_TIMEOUT_T microseconds = -1;
+#endif
+
+    static char *kwlist[] = { "timeout", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:get",
+            kwlist, &timeout)) {
+        return NULL;
+    }
+
+    if (!self->items) {
+        PyErr_SetString(PyExc_TypeError, "queue is not initialized");
+        return NULL;
+    }
+
+    if (timeout != Py_None) {
+        seconds = PyFloat_AsDouble(timeout);
+
+        if (seconds == -1.0 && PyErr_Occurred())
+            return NULL;
+
+        if (seconds < 0.0)
+            seconds = 0.0;
+
+#if PY_MAJOR_VERSION >= 3
+        if (seconds * 1e6 < (double)PY_TIMEOUT_MAX)
+            microseconds = (PY_TIMEOUT_T)(seconds * 1e6);
+#endif
+    }
+
+    /*
+     * Items still queued are returned even after the queue is shutdown
+     * so that it can be drained. Returns None if the queue is empty and
+     * is shutdown, or if no item was added before the timeout expired.
+     * With Python 2 there is no timed wait on a lock, so any timeout
+     * other than zero waits until an item is added or the queue is
+     * shutdown.
+     *
+     * A timeout of zero never touches the waiting flag or the lock, as
+     * it may come from a thread other than the consumer, such as when
+     * the queue is flushed. Clearing the flag would otherwise leave the
+     * consumer waiting on the lock with no producer to release it.
+     */
+
+    if (!self->length && !self->shutdown && seconds != 0.0) {
+        self->waiting = 1;
+
+#if PY_MAJOR_VERSION >= 3
+        Py_BEGIN_ALLOW_THREADS
+        acquired = PyThread_acquire_lock_timed(self->wakeup,
+                microseconds, 0) == PY_LOCK_ACQUIRED;
+        Py_END_ALLOW_THREADS
+#else
+        Py_BEGIN_ALLOW_THREADS
+        acquired = PyThread_acquire_lock(self->wakeup, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+#endif
+
+        if (acquired)
+            self->locked = 1;
+
+        self->waiting = 0;
+    }
+
+    if (!self->length)
+        Py_RETURN_NONE;
+
+    return NRRecordingQueue_pop(self);
+}
+
+static PyObject *NRRecordingQueue_stats(NRRecordingQueueObject *self,
+        PyObject *args)
+{
+    PyObject *result;
+
+    result = Py_BuildValue("(nn)", self->seen, self->dropped);
+
+    if (result) {
+        self->seen = 0;
+        self->dropped = 0;
+    }
+
+    return result;
+}
+
+static PyObject *NRRecordingQueue_shutdown(NRRecordingQueueObject *self,
+        PyObject *args)
+{
+    self->shutdown = 1;
+
+    if (self->items)
+        NRRecordingQueue_wake(self);
+
+    Py_RETURN_NONE;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PySequenceMethods NRRecordingQueue_as_sequence = {
+    (lenfunc)NRRecordingQueue_length, /*sq_length*/
+    0,                      /*sq_concat*/
+    0,                      /*sq_repeat*/
+    0,                      /*sq_item*/
+    0,                      /*sq_slice*/
+    0,                      /*sq_ass_item*/
+    0,                      /*sq_ass_slice*/
+    0,                      /*sq_contains*/
+};
+
+static PyMethodDef NRRecordingQueue_methods[] = {
+    { "put",                (PyCFunction)NRRecordingQueue_put,
+                            METH_O, 0 },
+    { "get",                (PyCFunction)(void(*)(void))NRRecordingQueue_get,
+                            METH_VARARGS|METH_KEYWORDS, 0 },
+    { "stats",              (PyCFunction)NRRecordingQueue_stats,
+                            METH_NOARGS, 0 },
+    { "shutdown",           (PyCFunction)NRRecordingQueue_shutdown,
+                            METH_NOARGS, 0 },
+    { NULL, NULL }
+};
+
+PyTypeObject NRRecordingQueue_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_recording_queue.RecordingQueue", /*tp_name*/
+    sizeof(NRRecordingQueueObject), /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)NRRecordingQueue_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    &NRRecordingQueue_as_sequence, /*tp_as_sequence*/
+    0,                      /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,     /*tp_flags*/
+    0,                      /*tp_doc*/
+    (traverseproc)NRRecordingQueue_traverse, /*tp_traverse*/
+    (inquiry)NRRecordingQueue_clear, /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    0,                      /*tp_iter*/
+    0,                      /*tp_iternext*/
+    NRRecordingQueue_methods, /*tp_methods*/
+    0,                      /*tp_members*/
+    0,                      /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    (initproc)NRRecordingQueue_init, /*tp_init*/
+    0,                      /*tp_alloc*/
+    NRRecordingQueue_new,   /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------- */
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_recording_queue",     /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    NULL,                   /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_recording_queue", NULL, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    if (PyType_Ready(&NRRecordingQueue_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&NRRecordingQueue_Type);
+    PyModule_AddObject(module, "RecordingQueue",
+            (PyObject *)&NRRecordingQueue_Type);
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_recording_queue(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__recording_queue(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Table of the unique strings in a transaction trace, each of which is
+ * referred to in the trace by a token of the form '`N', where N is the
+ * index of the string in the table. Tokens are the same for every table,
+ * so those for the first NR_TOKEN_POOL_SIZE strings are created once and
+ * shared by all tables.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+#define NR_TOKEN_POOL_SIZE 2048
+
+static PyObject *token_pool[NR_TOKEN_POOL_SIZE];
+
+static PyObject *NRToken_get(Py_ssize_t index)
+{
+    PyObject *token;
+
+    if (index < NR_TOKEN_POOL_SIZE && token_pool[index]) {
+        Py_INCREF(token_pool[index]);
+        return token_pool[index];
+    }
+
+#if PY_MAJOR_VERSION >= 3
+    token = PyUnicode_FromFormat("`%zd", index);
+#else
+    token = PyString_FromFormat("`%zd", index);
+#endif
+
+    if (token && index < NR_TOKEN_POOL_SIZE) {
+        Py_INCREF(token);
+        token_pool[index] = token;
+    }
+
+    return token;
+}
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject *mapping;
+    PyObject *values;
+} NRStringTableObject;
+
+extern PyTypeObject NRStringTable_Type;
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRStringTable_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    NRStringTableObject *self;
+
+    self = (NRStringTableObject *)type->tp_alloc(type, 0);
+
+    if (!self)
+        return NULL;
+
+    self->mapping = PyDict_New();
+    self->values = PyList_New(0);
+
+    if (!self->mapping || !self->values) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+static int NRStringTable_clear(NRStringTableObject *self)
+{
+    Py_CLEAR(self->mapping);
+    Py_CLEAR(self->values);
+
+    return 0;
+}
+
+static int NRStringTable_traverse(NRStringTableObject *self,
+        visitproc visit, void *arg)
+{
+    Py_VISIT(self->mapping);
+    Py_VISIT(self->values);
+
+    return 0;
+}
+
+static void NRStringTable_dealloc(NRStringTableObject *self)
+{
+    PyObject_GC_UnTrack(self);
+
+    NRStringTable_clear(self);
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRStringTable_cache(NRStringTableObject *self,
+        PyObject *value)
+{
+    PyObject *token;
+
+#if PY_MAJOR_VERSION >= 3
+    token = PyDict_GetItemWithError(self->mapping, value);
+
+    if (!token && PyErr_Occurred())
+        return NULL;
+#else
+    token = PyDict_GetItem(self->mapping, value);
+#endif
+
+    if (token) {
+        Py_INCREF(token);
+        return token;
+    }
+
+    token = NRToken_get(PyList_GET_SIZE(self->values));
+
+    if (!token)
+        return NULL;
+
+    if (PyDict_SetItem(self->mapping, value, token) < 0) {
+        Py_DECREF(token);
+        return NULL;
+    }
+
+    if (PyList_Append(self->values, value) < 0) {
+        PyDict_DelItem(self->mapping, value);
+        Py_DECREF(token);
+        return NULL;
+    }
+
+    return token;
+}
+
+static PyObject *NRStringTable_values(NRStringTableObject *self,
+        PyObject *args)
+{
+    Py_INCREF(self->values);
+    return self->values;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyMethodDef NRStringTable_methods[] = {
+    { "cache",              (PyCFunction)NRStringTable_cache,
+                            METH_O, 0 },
+    { "values",             (PyCFunction)NRStringTable_values,
+                            METH_NOARGS, 0 },
+    { NULL, NULL }
+};
+
+PyTypeObject NRStringTable_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_string_table.StringTable", /*tp_name*/
+    sizeof(NRStringTableObject), /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)NRStringTable_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    0,                      /*tp_as_sequence*/
+    0,                      /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_HAVE_GC,     /*tp_flags*/
+    0,                      /*tp_doc*/
+    (traverseproc)NRStringTable_traverse, /*tp_traverse*/
+    (inquiry)NRStringTable_clear, /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    0,                      /*tp_iter*/
+    0,                      /*tp_iternext*/
+    NRStringTable_methods,  /*tp_methods*/
+    0,                      /*tp_members*/
+    0,                      /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    0,                      /*tp_init*/
+    0,                      /*tp_alloc*/
+    NRStringTable_new,      /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------- */
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_string_table",        /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    NULL,                   /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_string_table", NULL, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    if (PyType_Ready(&NRStringTable_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&NRStringTable_Type);
+    PyModule_AddObject(module, "StringTable",
+            (PyObject *)&NRStringTable_Type);
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_string_table(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__string_table(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
@@ -0,0 +1,1096 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native base type for TimeTrace. The timing, counting and state fields
+ * of a trace are held in a fixed layout rather than the instance
+ * dictionary, the attribute dictionaries, children list and guid are
+ * only created when first used, and the context manager protocol is run
+ * in C. Derived classes such as FunctionTrace and DatabaseTrace are still
+ * written in Python and keep their own instance dictionary for any
+ * additional attributes.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#include <structmember.h>
+
+#include <stddef.h>
+#include <time.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define NR_INTERN(s) PyUnicode_InternFromString(s)
+#else
+#define NR_INTERN(s) PyString_InternFromString(s)
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    PyObject_HEAD
+
+    PyObject *parent;
+    PyObject *root;
+    PyObject *children;
+    PyObject *thread_id;
+    PyObject *exc_data;
+    PyObject *guid;
+    PyObject *agent_attributes;
+    PyObject *user_attributes;
+
+    Py_ssize_t child_count;
+
+    double start_time;
+    double end_time;
+    double duration;
+    double exclusive;
+    double min_child_start_time;
+
+    char activated;
+    char exited;
+    char is_async;
+    char has_async_children;
+    char should_record_segment_params;
+} NRTimeTraceObject;
+
+extern PyTypeObject NRTimeTrace_Type;
+
+static PyObject *empty_exc_data = NULL;
+
+static PyObject *trace_cache_function = NULL;
+static PyObject *exit_before_enter_function = NULL;
+static PyObject *generate_span_id_function = NULL;
+static PyObject *time_module = NULL;
+static PyObject *time_function = NULL;
+
+static PyObject *exited_str = NULL;
+static PyObject *root_str = NULL;
+static PyObject *transaction_str = NULL;
+static PyObject *stopped_str = NULL;
+static PyObject *enabled_str = NULL;
+static PyObject *end_time_str = NULL;
+static PyObject *should_record_segment_params_str = NULL;
+static PyObject *terminal_node_str = NULL;
+static PyObject *increment_child_count_str = NULL;
+static PyObject *current_trace_str = NULL;
+static PyObject *current_thread_id_str = NULL;
+static PyObject *save_trace_str = NULL;
+static PyObject *pop_current_str = NULL;
+static PyObject *complete_trace_str = NULL;
+static PyObject *time_str = NULL;
+
+/* ------------------------------------------------------------------------- */
+
+static double NRTimeTrace_now(void)
+{
+    /*
+     * Equivalent to time.time(). As with the Python implementation, the
+     * function is looked up on each call so that replacing it, such as in
+     * tests, still takes effect. Where it has not been replaced the
+     * realtime clock is read directly.
+     */
+
+    PyObject *function;
+    PyObject *result;
+    double now;
+
+    function = PyObject_GetAttr(time_module, time_str);
+
+    if (!function)
+        return -1.0;
+
+#if defined(CLOCK_REALTIME) && !defined(_WIN32)
+    if (function == time_function) {
+        struct timespec ts;
+
+        if (clock_gettime(CLOCK_REALTIME, &ts) == 0) {
+            Py_DECREF(function);
+            return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+        }
+    }
+#endif
+
+    result = PyObject_CallObject(function, NULL);
+
+    Py_DECREF(function);
+
+    if (!result)
+        return -1.0;
+
+    now = PyFloat_AsDouble(result);
+
+    Py_DECREF(result);
+
+    return now;
+}
+
+static PyObject *NRTimeTrace_trace_cache(void)
+{
+    /*
+     * The trace cache module is imported on first use rather than when
+     * this module is loaded, to avoid a circular import, and the trace
+     * cache instance is looked up on each call as the backend can be
+     * replaced when the agent is initialized.
+     */
+
+    if (!trace_cache_function) {
+        PyObject *module;
+
+        module = PyImport_ImportModule("newrelic.core.trace_cache");
+
+        if (!module)
+            return NULL;
+
+        trace_cache_function = PyObject_GetAttrString(module, "trace_cache");
+
+        Py_DECREF(module);
+
+        if (!trace_cache_function)
+            return NULL;
+    }
+
+    return PyObject_CallObject(trace_cache_function, NULL);
+}
+
+static int NRTimeTrace_is_true_attr(PyObject *object, PyObject *name)
+{
+    PyObject *value;
+    int result;
+
+    value = PyObject_GetAttr(object, name);
+
+    if (!value)
+        return -1;
+
+    result = PyObject_IsTrue(value);
+
+    Py_DECREF(value);
+
+    return result;
+}
+
+static void NRTimeTrace_set_parent(NRTimeTraceObject *self, PyObject *parent)
+{
+    PyObject *old = self->parent;
+
+    Py_XINCREF(parent);
+    self->parent = parent;
+
+    Py_XDECREF(old);
+}
+
+static Py_ssize_t NRTimeTrace_outstanding(NRTimeTraceObject *self)
+{
+    Py_ssize_t completed = 0;
+
+    if (self->children && PyList_Check(self->children))
+        completed = PyList_GET_SIZE(self->children);
+    else if (self->children) {
+        completed = PyObject_Length(self->children);
+
+        if (completed < 0)
+            return -1;
+    }
+
+    return self->child_count - completed;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static void NRTimeTrace_reset(NRTimeTraceObject *self)
+{
+    self->child_count = 0;
+
+    self->start_time = 0.0;
+    self->end_time = 0.0;
+    self->duration = 0.0;
+    self->exclusive = 0.0;
+    self->min_child_start_time = Py_HUGE_VAL;
+
+    self->activated = 0;
+    self->exited = 0;
+    self->is_async = 0;
+    self->has_async_children = 0;
+    self->should_record_segment_params = 0;
+}
+
+static PyObject *NRTimeTrace_new(PyTypeObject *type, PyObject *args,
+                                 PyObject *kwds)
+{
+    NRTimeTraceObject *self;
+
+    self = (NRTimeTraceObject *)type->tp_alloc(type, 0);
+
+    if (!self)
+        return NULL;
+
+    NRTimeTrace_reset(self);
+
+    return (PyObject *)self;
+}
+
+static int NRTimeTrace_clear(NRTimeTraceObject *self)
+{
+    Py_CLEAR(self->parent);
+    Py_CLEAR(self->root);
+    Py_CLEAR(self->children);
+    Py_CLEAR(self->thread_id);
+    Py_CLEAR(self->exc_data);
+    Py_CLEAR(self->guid);
+    Py_CLEAR(self->agent_attributes);
+    Py_CLEAR(self->user_attributes);
+
+    return 0;
+}
+
+static int NRTimeTrace_init(NRTimeTraceObject *self, PyObject *args,
+                            PyObject *kwds)
+{
+    PyObject *parent = Py_None;
+
+    static char *kwlist[] = { "parent", NULL };
+
+    /*
+     * Derived classes almost always pass the parent positionally, so
+     * avoid the cost of keyword argument parsing in that case.
+     */
+
+    if (!kwds && PyTuple_GET_SIZE(args) <= 1) {
+        if (PyTuple_GET_SIZE(args) == 1)
+            parent = PyTuple_GET_ITEM(args, 0);
+    }
+    else if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O:TimeTrace",
+                                          kwlist, &parent)) {
+        return -1;
+    }
+
+    NRTimeTrace_clear(self);
+    NRTimeTrace_reset(self);
+
+    if (parent != Py_None)
+        NRTimeTrace_set_parent(self, parent);
+
+    return 0;
+}
+
+static void NRTimeTrace_dealloc(NRTimeTraceObject *self)
+{
+    PyObject_GC_UnTrack(self);
+
+    NRTimeTrace_clear(self);
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static int NRTimeTrace_traverse(NRTimeTraceObject *self, visitproc visit,
+                                void *arg)
+{
+    Py_VISIT(self->parent);
+    Py_VISIT(self->root);
+    Py_VISIT(self->children);
+    Py_VISIT(self->thread_id);
+    Py_VISIT(self->exc_data);
+    Py_VISIT(self->agent_attributes);
+    Py_VISIT(self->user_attributes);
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRTimeTrace_enter(NRTimeTraceObject *self,
+                                   PyObject *unused)
+{
+    PyObject *parent = NULL;
+    PyObject *root = NULL;
+    PyObject *transaction = NULL;
+    PyObject *cache = NULL;
+    PyObject *thread_id = NULL;
+    PyObject *result = NULL;
+
+    int truth;
+
+    truth = self->parent ? PyObject_IsTrue(self->parent) : 0;
+
+    if (truth < 0)
+        return NULL;
+
+    if (truth) {
+        parent = self->parent;
+        Py_INCREF(parent);
+    }
+    else {
+        cache = NRTimeTrace_trace_cache();
+
+        if (!cache)
+            return NULL;
+
+        parent = PyObject_CallMethodObjArgs(cache, current_trace_str, NULL);
+
+        Py_CLEAR(cache);
+
+        if (!parent)
+            return NULL;
+
+        NRTimeTrace_set_parent(self, parent);
+
+        truth = PyObject_IsTrue(parent);
+
+        if (truth < 0)
+            goto done;
+
+        if (!truth) {
+            Py_INCREF(self);
+            result = (PyObject *)self;
+            goto done;
+        }
+    }
+
+    /*
+     * The parent may be exited if the stack is not consistent. This
+     * can occur when using ensure_future to schedule coroutines
+     * instead of using async/await keywords. In those cases, we
+     * must not trace. Don't do any tracing if parent is designated
+     * as a terminal node.
+     */
+
+    truth = NRTimeTrace_is_true_attr(parent, exited_str);
+
+    if (truth < 0)
+        goto done;
+
+    if (!truth) {
+        PyObject *terminal;
+
+        terminal = PyObject_CallMethodObjArgs(parent, terminal_node_str,
+                                              NULL);
+
+        if (!terminal)
+            goto done;
+
+        truth = PyObject_IsTrue(terminal);
+
+        Py_DECREF(terminal);
+
+        if (truth < 0)
+            goto done;
+    }
+
+    if (truth) {
+        Py_CLEAR(self->parent);
+        Py_INCREF(parent);
+        result = parent;
+        goto done;
+    }
+
+    root = PyObject_GetAttr(parent, root_str);
+
+    if (!root)
+        goto done;
+
+    transaction = PyObject_GetAttr(root, transaction_str);
+
+    if (!transaction)
+        goto done;
+
+    /*
+     * Don't do further tracing of transaction if it has been
+     * explicitly stopped.
+     */
+
+    truth = NRTimeTrace_is_true_attr(transaction, stopped_str);
+
+    if (truth < 0)
+        goto done;
+
+    if (!truth) {
+        truth = NRTimeTrace_is_true_attr(transaction, enabled_str);
+
+        if (truth < 0)
+            goto done;
+
+        truth = !truth;
+    }
+
+    if (truth) {
+        Py_CLEAR(self->parent);
+        Py_INCREF(self);
+        result = (PyObject *)self;
+        goto done;
+    }
+
+    result = PyObject_CallMethodObjArgs(parent, increment_child_count_str,
+                                        NULL);
+
+    if (!result)
+        goto done;
+
+    Py_CLEAR(result);
+
+    Py_INCREF(root);
+    Py_XDECREF(self->root);
+    self->root = root;
+
+    truth = NRTimeTrace_is_true_attr(transaction,
+                                     should_record_segment_params_str);
+
+    if (truth < 0)
+        goto done;
+
+    self->should_record_segment_params = (char)truth;
+
+    /* Record start time. */
+
+    self->start_time = NRTimeTrace_now();
+
+    if (self->start_time == -1.0 && PyErr_Occurred())
+        goto done;
+
+    cache = NRTimeTrace_trace_cache();
+
+    if (!cache)
+        goto done;
+
+    thread_id = PyObject_CallMethodObjArgs(cache, current_thread_id_str,
+                                           NULL);
+
+    if (!thread_id)
+        goto done;
+
+    Py_XDECREF(self->thread_id);
+    self->thread_id = thread_id;
+
+    /* Push ourselves as the current node and store parent. */
+
+    result = PyObject_CallMethodObjArgs(cache, save_trace_str, self, NULL);
+
+    if (!result) {
+        Py_CLEAR(self->parent);
+        goto done;
+    }
+
+    Py_CLEAR(result);
+
+    self->activated = 1;
+
+    Py_INCREF(self);
+    result = (PyObject *)self;
+
+done:
+    Py_XDECREF(parent);
+    Py_XDECREF(root);
+    Py_XDECREF(transaction);
+    Py_XDECREF(cache);
+
+    return result;
+}
+
+static PyObject *NRTimeTrace_exit(NRTimeTraceObject *self, PyObject *args)
+{
+    PyObject *exc = NULL;
+    PyObject *value = NULL;
+    PyObject *tb = NULL;
+
+    PyObject *transaction = NULL;
+    PyObject *exc_data = NULL;
+    PyObject *result = NULL;
+
+    Py_ssize_t outstanding;
+    int truth;
+
+    if (!PyArg_UnpackTuple(args, "__exit__", 3, 3, &exc, &value, &tb))
+        return NULL;
+
+    truth = self->parent ? PyObject_IsTrue(self->parent) : 0;
+
+    if (truth <= 0)
+        return truth < 0 ? NULL : (Py_INCREF(Py_None), Py_None);
+
+    /*
+     * Check for violation of context manager protocol where
+     * __exit__() is called before __enter__().
+     */
+
+    if (!self->activated) {
+        if (!exit_before_enter_function) {
+            PyObject *module;
+
+            module = PyImport_ImportModule("newrelic.api.time_trace");
+
+            if (!module)
+                return NULL;
+
+            exit_before_enter_function = PyObject_GetAttrString(module,
+                    "_log_exit_before_enter");
+
+            Py_DECREF(module);
+
+            if (!exit_before_enter_function)
+                return NULL;
+        }
+
+        return PyObject_CallFunctionObjArgs(exit_before_enter_function,
+                                            self, NULL);
+    }
+
+    transaction = PyObject_GetAttr(self->root ? self->root : Py_None,
+                                   transaction_str);
+
+    if (!transaction)
+        return NULL;
+
+    /*
+     * If the transaction has gone out of scope (recorded), there's not
+     * much we can do at this point.
+     */
+
+    truth = PyObject_IsTrue(transaction);
+
+    if (truth <= 0) {
+        if (!truth) {
+            Py_INCREF(Py_None);
+            result = Py_None;
+        }
+
+        goto done;
+    }
+
+    /*
+     * If recording of time for transaction has already been stopped,
+     * then that time has to be used.
+     */
+
+    truth = NRTimeTrace_is_true_attr(transaction, stopped_str);
+
+    if (truth < 0)
+        goto done;
+
+    if (truth) {
+        PyObject *end_time;
+
+        end_time = PyObject_GetAttr(transaction, end_time_str);
+
+        if (!end_time)
+            goto done;
+
+        self->end_time = PyFloat_AsDouble(end_time);
+
+        Py_DECREF(end_time);
+    }
+    else
+        self->end_time = NRTimeTrace_now();
+
+    if (self->end_time == -1.0 && PyErr_Occurred())
+        goto done;
+
+    /*
+     * Ensure end time is greater. Should be unless the system clock
+     * has been updated.
+     */
+
+    if (self->end_time < self->start_time)
+        self->end_time = self->start_time;
+
+    /*
+     * Up till now the exclusive time value had been used to accumulate
+     * duration from child nodes as negative value, so just add duration
+     * to that to get our own exclusive time.
+     */
+
+    self->duration = self->end_time - self->start_time;
+
+    self->exclusive += self->duration;
+
+    if (self->exclusive < 0)
+        self->exclusive = 0;
+
+    self->exited = 1;
+
+    exc_data = PyTuple_Pack(3, exc, value, tb);
+
+    if (!exc_data)
+        goto done;
+
+    Py_XDECREF(self->exc_data);
+    self->exc_data = exc_data;
+
+    /*
+     * In all cases except async, the children will have exited so this
+     * will create the node. Since we're exited we can't possibly
+     * schedule more children, but we may have children still running
+     * if we're async.
+     */
+
+    outstanding = NRTimeTrace_outstanding(self);
+
+    if (outstanding < 0)
+        goto done;
+
+    if (!outstanding) {
+        result = PyObject_CallMethodObjArgs((PyObject *)self,
+                                            complete_trace_str, NULL);
+    }
+    else {
+        PyObject *cache;
+
+        cache = NRTimeTrace_trace_cache();
+
+        if (!cache)
+            goto done;
+
+        result = PyObject_CallMethodObjArgs(cache, pop_current_str,
+                                            self, NULL);
+
+        Py_DECREF(cache);
+    }
+
+    if (result) {
+        Py_DECREF(result);
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+
+done:
+    Py_XDECREF(transaction);
+
+    return result;
+}
+
+static PyObject *NRTimeTrace_has_outstanding_children(
+        NRTimeTraceObject *self, PyObject *unused)
+{
+    Py_ssize_t outstanding;
+
+    outstanding = NRTimeTrace_outstanding(self);
+
+    if (outstanding < 0)
+        return NULL;
+
+    return PyBool_FromLong(outstanding != 0);
+}
+
+static PyObject *NRTimeTrace_ready_to_complete(NRTimeTraceObject *self,
+                                               PyObject *unused)
+{
+    Py_ssize_t outstanding;
+
+    /* We shouldn't continue if we're still running. */
+
+    if (!self->exited)
+        Py_RETURN_FALSE;
+
+    /* Defer node completion until all children have exited. */
+
+    outstanding = NRTimeTrace_outstanding(self);
+
+    if (outstanding < 0)
+        return NULL;
+
+    return PyBool_FromLong(outstanding == 0);
+}
+
+static PyObject *NRTimeTrace_increment_child_count(NRTimeTraceObject *self,
+                                                   PyObject *unused)
+{
+    Py_ssize_t outstanding;
+
+    self->child_count += 1;
+
+    /*
+     * If there's more than 1 child node outstanding then the children
+     * are async w.r.t each other, else the current trace that's being
+     * scheduled is not going to be async. Note that this implies that
+     * all previous traces have completed.
+     */
+
+    outstanding = NRTimeTrace_outstanding(self);
+
+    if (outstanding < 0)
+        return NULL;
+
+    self->has_async_children = outstanding > 1;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRTimeTrace_get_children(NRTimeTraceObject *self,
+                                          void *closure)
+{
+    if (!self->children) {
+        self->children = PyList_New(0);
+
+        if (!self->children)
+            return NULL;
+    }
+
+    Py_INCREF(self->children);
+    return self->children;
+}
+
+static PyObject *NRTimeTrace_get_dict_field(NRTimeTraceObject *self,
+                                            void *closure)
+{
+    PyObject **slot;
+
+    slot = (PyObject **)((char *)self + (size_t)closure);
+
+    if (!*slot) {
+        *slot = PyDict_New();
+
+        if (!*slot)
+            return NULL;
+    }
+
+    Py_INCREF(*slot);
+    return *slot;
+}
+
+static int NRTimeTrace_set_object_field(NRTimeTraceObject *self,
+                                        PyObject *value, void *closure)
+{
+    PyObject **slot;
+    PyObject *old;
+
+    slot = (PyObject **)((char *)self + (size_t)closure);
+
+    old = *slot;
+
+    Py_XINCREF(value);
+    *slot = value;
+
+    Py_XDECREF(old);
+
+    return 0;
+}
+
+static PyObject *NRTimeTrace_get_exc_data(NRTimeTraceObject *self,
+                                          void *closure)
+{
+    PyObject *exc_data;
+
+    exc_data = self->exc_data ? self->exc_data : empty_exc_data;
+
+    Py_INCREF(exc_data);
+    return exc_data;
+}
+
+static PyObject *NRTimeTrace_get_guid(NRTimeTraceObject *self,
+                                      void *closure)
+{
+    /*
+     * 16-digit random hex. Padded with zeros in the front. Only
+     * generated when first needed, as most traces never have the
+     * guid read.
+     */
+
+    if (!self->guid) {
+        self->guid = PyObject_CallObject(generate_span_id_function, NULL);
+
+        if (!self->guid)
+            return NULL;
+    }
+
+    Py_INCREF(self->guid);
+    return self->guid;
+}
+
+static PyObject *NRTimeTrace_get_guid_if_set(NRTimeTraceObject *self,
+                                             void *closure)
+{
+    PyObject *guid;
+
+    /*
+     * Returns the guid without generating it, so that a node can be
+     * created without forcing a guid which may never be used.
+     */
+
+    guid = self->guid ? self->guid : Py_None;
+
+    Py_INCREF(guid);
+    return guid;
+}
+
+static PyObject *NRTimeTrace_get_flag(NRTimeTraceObject *self,
+                                      void *closure)
+{
+    return PyBool_FromLong(*((char *)self + (size_t)closure));
+}
+
+static int NRTimeTrace_set_flag(NRTimeTraceObject *self, PyObject *value,
+                                void *closure)
+{
+    int truth;
+
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "can't delete attribute");
+        return -1;
+    }
+
+    truth = PyObject_IsTrue(value);
+
+    if (truth < 0)
+        return -1;
+
+    *((char *)self + (size_t)closure) = (char)truth;
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+#define NR_FIELD(name) (void *)offsetof(NRTimeTraceObject, name)
+
+static PyMethodDef NRTimeTrace_methods[] = {
+    { "__enter__",          (PyCFunction)NRTimeTrace_enter,
+                            METH_NOARGS, 0 },
+    { "__exit__",           (PyCFunction)NRTimeTrace_exit,
+                            METH_VARARGS, 0 },
+    { "has_outstanding_children",
+                            (PyCFunction)NRTimeTrace_has_outstanding_children,
+                            METH_NOARGS, 0 },
+    { "_ready_to_complete", (PyCFunction)NRTimeTrace_ready_to_complete,
+                            METH_NOARGS, 0 },
+    { "increment_child_count",
+                            (PyCFunction)NRTimeTrace_increment_child_count,
+                            METH_NOARGS, 0 },
+    { NULL, NULL }
+};
+
+static PyMemberDef NRTimeTrace_members[] = {
+    { "parent",             T_OBJECT,
+                            offsetof(NRTimeTraceObject, parent), 0, 0 },
+    { "root",               T_OBJECT,
+                            offsetof(NRTimeTraceObject, root), 0, 0 },
+    { "thread_id",          T_OBJECT,
+                            offsetof(NRTimeTraceObject, thread_id), 0, 0 },
+    { "child_count",        T_PYSSIZET,
+                            offsetof(NRTimeTraceObject, child_count), 0, 0 },
+    { "start_time",         T_DOUBLE,
+                            offsetof(NRTimeTraceObject, start_time), 0, 0 },
+    { "end_time",           T_DOUBLE,
+                            offsetof(NRTimeTraceObject, end_time), 0, 0 },
+    { "duration",           T_DOUBLE,
+                            offsetof(NRTimeTraceObject, duration), 0, 0 },
+    { "exclusive",          T_DOUBLE,
+                            offsetof(NRTimeTraceObject, exclusive), 0, 0 },
+    { "min_child_start_time", T_DOUBLE,
+                            offsetof(NRTimeTraceObject, min_child_start_time),
+                            0, 0 },
+    { NULL },
+};
+
+static PyGetSetDef NRTimeTrace_getset[] = {
+    { "children",           (getter)NRTimeTrace_get_children,
+                            (setter)NRTimeTrace_set_object_field, 0,
+                            NR_FIELD(children) },
+    { "agent_attributes",   (getter)NRTimeTrace_get_dict_field,
+                            (setter)NRTimeTrace_set_object_field, 0,
+                            NR_FIELD(agent_attributes) },
+    { "user_attributes",    (getter)NRTimeTrace_get_dict_field,
+                            (setter)NRTimeTrace_set_object_field, 0,
+                            NR_FIELD(user_attributes) },
+    { "exc_data",           (getter)NRTimeTrace_get_exc_data,
+                            (setter)NRTimeTrace_set_object_field, 0,
+                            NR_FIELD(exc_data) },
+    { "guid",               (getter)NRTimeTrace_get_guid,
+                            (setter)NRTimeTrace_set_object_field, 0,
+                            NR_FIELD(guid) },
+    { "_guid",              (getter)NRTimeTrace_get_guid_if_set,
+                            NULL, 0, NULL },
+    { "activated",          (getter)NRTimeTrace_get_flag,
+                            (setter)NRTimeTrace_set_flag, 0,
+                            NR_FIELD(activated) },
+    { "exited",             (getter)NRTimeTrace_get_flag,
+                            (setter)NRTimeTrace_set_flag, 0,
+                            NR_FIELD(exited) },
+    { "is_async",           (getter)NRTimeTrace_get_flag,
+                            (setter)NRTimeTrace_set_flag, 0,
+                            NR_FIELD(is_async) },
+    { "has_async_children", (getter)NRTimeTrace_get_flag,
+                            (setter)NRTimeTrace_set_flag, 0,
+                            NR_FIELD(has_async_children) },
+    { "should_record_segment_params",
+                            (getter)NRTimeTrace_get_flag,
+                            (setter)NRTimeTrace_set_flag, 0,
+                            NR_FIELD(should_record_segment_params) },
+    { NULL },
+};
+
+#undef NR_FIELD
+
+PyTypeObject NRTimeTrace_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_time_trace.TimeTrace", /*tp_name*/
+    sizeof(NRTimeTraceObject), /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)NRTimeTrace_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    0,                      /*tp_as_sequence*/
+    0,                      /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_BASETYPE |
+    Py_TPFLAGS_HAVE_GC,     /*tp_flags*/
+    0,                      /*tp_doc*/
+    (traverseproc)NRTimeTrace_traverse, /*tp_traverse*/
+    (inquiry)NRTimeTrace_clear, /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    0,                      /*tp_iter*/
+    0,                      /*tp_iternext*/
+    NRTimeTrace_methods,    /*tp_methods*/
+    NRTimeTrace_members,    /*tp_members*/
+    NRTimeTrace_getset,     /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    (initproc)NRTimeTrace_init, /*tp_init*/
+    0,                      /*tp_alloc*/
+    NRTimeTrace_new,        /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------- */
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_time_trace",          /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    NULL,                   /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+    PyObject *encoding_module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_time_trace", NULL, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    exited_str = NR_INTERN("exited");
+    root_str = NR_INTERN("root");
+    transaction_str = NR_INTERN("transaction");
+    stopped_str = NR_INTERN("stopped");
+    enabled_str = NR_INTERN("enabled");
+    end_time_str = NR_INTERN("end_time");
+    should_record_segment_params_str = NR_INTERN(
+            "should_record_segment_params");
+    terminal_node_str = NR_INTERN("terminal_node");
+    increment_child_count_str = NR_INTERN("increment_child_count");
+    current_trace_str = NR_INTERN("current_trace");
+    current_thread_id_str = NR_INTERN("current_thread_id");
+    save_trace_str = NR_INTERN("save_trace");
+    pop_current_str = NR_INTERN("pop_current");
+    complete_trace_str = NR_INTERN("_complete_trace");
+    time_str = NR_INTERN("time");
+
+    if (!exited_str || !root_str || !transaction_str || !stopped_str ||
+            !enabled_str || !end_time_str ||
+            !should_record_segment_params_str || !terminal_node_str ||
+            !increment_child_count_str || !current_trace_str ||
+            !current_thread_id_str || !save_trace_str ||
+            !pop_current_str || !complete_trace_str || !time_str) {
+        return NULL;
+    }
+
+    empty_exc_data = PyTuple_Pack(3, Py_None, Py_None, Py_None);
+
+    if (!empty_exc_data)
+        return NULL;
+
+    encoding_module = PyImport_ImportModule(
+            "newrelic.common.encoding_utils");
+
+    if (!encoding_module)
+        return NULL;
+
+    generate_span_id_function = PyObject_GetAttrString(encoding_module,
+                                                       "generate_span_id");
+
+    Py_DECREF(encoding_module);
+
+    if (!generate_span_id_function)
+        return NULL;
+
+    time_module = PyImport_ImportModule("time");
+
+    if (!time_module)
+        return NULL;
+
+    time_function = PyObject_GetAttr(time_module, time_str);
+
+    if (!time_function)
+        return NULL;
+
+    if (PyType_Ready(&NRTimeTrace_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&NRTimeTrace_Type);
+    PyModule_AddObject(module, "TimeTrace", (PyObject *)&NRTimeTrace_Type);
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_time_trace(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__time_trace(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
@@ -0,0 +1,1469 @@
+/*
+ * Copyright 2010 New Relic, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Native implementation of the hot paths of the trace cache. Traces are
+ * held in a weak valued open addressing hash table keyed directly on the
+ * numeric identifier of the execution context (thread, greenlet or
+ * asyncio task). Looking up the current trace therefore requires no
+ * Python integer to be created for the key, no dictionary hashing and
+ * no weak reference objects to be allocated in the steady state.
+ */
+
+/* ------------------------------------------------------------------------- */
+
+#include <Python.h>
+
+#include <pythread.h>
+
+#ifndef PyVarObject_HEAD_INIT
+#define PyVarObject_HEAD_INIT(type, size) PyObject_HEAD_INIT(type) size,
+#endif
+
+#if PY_MAJOR_VERSION >= 3
+#define NR_INTERN(s) PyUnicode_InternFromString(s)
+#else
+#define NR_INTERN(s) PyString_InternFromString(s)
+#endif
+
+/* ------------------------------------------------------------------------- */
+
+#define ENTRY_EMPTY 0
+#define ENTRY_USED 1
+#define ENTRY_DELETED 2
+
+#define MINIMUM_TABLE_SIZE 8
+
+typedef unsigned long long context_id_t;
+
+typedef struct {
+    context_id_t key;
+    PyObject *ref;
+    int state;
+} NRTraceCacheEntry;
+
+typedef struct {
+    PyObject_HEAD
+
+    NRTraceCacheEntry *entries;
+    size_t mask;
+    size_t used;
+    size_t fill;
+} NRTraceCacheMapObject;
+
+extern PyTypeObject NRTraceCacheMap_Type;
+
+/* ------------------------------------------------------------------------- */
+
+static size_t hash_context_id(context_id_t key)
+{
+    /*
+     * Thread identifiers and object addresses are aligned and so the
+     * low order bits are poorly distributed. Use the splitmix64
+     * finaliser to spread them before masking.
+     */
+
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+
+    return (size_t)key;
+}
+
+static int context_id_from_object(PyObject *object, context_id_t *key)
+{
+#if PY_MAJOR_VERSION < 3
+    if (PyInt_Check(object)) {
+        *key = (context_id_t)PyInt_AS_LONG(object);
+        return 0;
+    }
+#endif
+
+    if (PyLong_Check(object)) {
+        *key = (context_id_t)PyLong_AsUnsignedLongLongMask(object);
+
+        if (*key == (context_id_t)-1 && PyErr_Occurred())
+            return -1;
+
+        return 0;
+    }
+
+    PyErr_Format(PyExc_TypeError, "trace cache keys must be integers, "
+            "not %.200s", Py_TYPE(object)->tp_name);
+
+    return -1;
+}
+
+static PyObject *context_id_to_object(context_id_t key)
+{
+    return PyLong_FromUnsignedLongLong(key);
+}
+
+/* ------------------------------------------------------------------------- */
+
+static Py_ssize_t NRTraceCacheMap_find(NRTraceCacheMapObject *self,
+        context_id_t key)
+{
+    size_t i;
+    NRTraceCacheEntry *entry;
+
+    i = hash_context_id(key) & self->mask;
+
+    while (1) {
+        entry = &self->entries[i];
+
+        if (entry->state == ENTRY_EMPTY)
+            return -1;
+
+        if (entry->state == ENTRY_USED && entry->key == key)
+            return (Py_ssize_t)i;
+
+        i = (i + 1) & self->mask;
+    }
+}
+
+static void NRTraceCacheMap_remove_entry(NRTraceCacheMapObject *self,
+        Py_ssize_t i)
+{
+    PyObject *ref;
+
+    ref = self->entries[i].ref;
+
+    self->entries[i].ref = NULL;
+    self->entries[i].state = ENTRY_DELETED;
+    self->used--;
+
+    Py_DECREF(ref);
+}
+
+/*
+ * Returns a borrowed reference to the live trace stored against the key,
+ * or NULL if there is none. Entries whose trace has since been destroyed
+ * are discarded as they are encountered.
+ */
+
+static PyObject *NRTraceCacheMap_lookup(NRTraceCacheMapObject *self,
+        context_id_t key)
+{
+    Py_ssize_t i;
+    PyObject *object;
+
+    i = NRTraceCacheMap_find(self, key);
+
+    if (i < 0)
+        return NULL;
+
+    object = PyWeakref_GET_OBJECT(self->entries[i].ref);
+
+    if (object == Py_None) {
+        NRTraceCacheMap_remove_entry(self, i);
+        return NULL;
+    }
+
+    return object;
+}
+
+static int NRTraceCacheMap_resize(NRTraceCacheMapObject *self)
+{
+    size_t i;
+    size_t j;
+    size_t size;
+    size_t old_size;
+
+    NRTraceCacheEntry *entries;
+    NRTraceCacheEntry *old_entries;
+
+    /*
+     * Drop any entries for traces which no longer exist before sizing
+     * the new table so that the table only grows with live contexts.
+     */
+
+    old_entries = self->entries;
+    old_size = self->mask + 1;
+
+    for (i = 0; i < old_size; i++) {
+        if (old_entries[i].state == ENTRY_USED &&
+                PyWeakref_GET_OBJECT(old_entries[i].ref) == Py_None) {
+            NRTraceCacheMap_remove_entry(self, i);
+        }
+    }
+
+    size = MINIMUM_TABLE_SIZE;
+
+    while (size < (self->used + 1) * 4)
+        size <<= 1;
+
+    entries = PyMem_New(NRTraceCacheEntry, size);
+
+    if (!entries) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    memset(entries, 0, sizeof(NRTraceCacheEntry) * size);
+
+    for (i = 0; i < old_size; i++) {
+        if (old_entries[i].state != ENTRY_USED)
+            continue;
+
+        j = hash_context_id(old_entries[i].key) & (size - 1);
+
+        while (entries[j].state != ENTRY_EMPTY)
+            j = (j + 1) & (size - 1);
+
+        entries[j] = old_entries[i];
+    }
+
+    PyMem_Free(old_entries);
+
+    self->entries = entries;
+    self->mask = size - 1;
+    self->fill = self->used;
+
+    return 0;
+}
+
+static int NRTraceCacheMap_store(NRTraceCacheMapObject *self,
+        context_id_t key, PyObject *value)
+{
+    size_t i;
+    Py_ssize_t existing;
+
+    PyObject *ref;
+    PyObject *old_ref;
+
+    /*
+     * Where the trace already has a basic weak reference, as it will
+     * when it was previously stored in the cache, that weak reference
+     * is reused rather than a new one being allocated.
+     */
+
+    ref = PyWeakref_NewRef(value, NULL);
+
+    if (!ref)
+        return -1;
+
+    existing = NRTraceCacheMap_find(self, key);
+
+    if (existing >= 0) {
+        old_ref = self->entries[existing].ref;
+        self->entries[existing].ref = ref;
+        Py_DECREF(old_ref);
+        return 0;
+    }
+
+    if ((self->fill + 1) * 3 >= (self->mask + 1) * 2) {
+        if (NRTraceCacheMap_resize(self) < 0) {
+            Py_DECREF(ref);
+            return -1;
+        }
+    }
+
+    i = hash_context_id(key) & self->mask;
+
+    while (self->entries[i].state == ENTRY_USED)
+        i = (i + 1) & self->mask;
+
+    if (self->entries[i].state == ENTRY_EMPTY)
+        self->fill++;
+
+    self->entries[i].key = key;
+    self->entries[i].ref = ref;
+    self->entries[i].state = ENTRY_USED;
+
+    self->used++;
+
+    return 0;
+}
+
+static void NRTraceCacheMap_clear_entries(NRTraceCacheMapObject *self)
+{
+    size_t i;
+
+    for (i = 0; i <= self->mask; i++) {
+        if (self->entries[i].state == ENTRY_USED)
+            Py_DECREF(self->entries[i].ref);
+
+        self->entries[i].ref = NULL;
+        self->entries[i].state = ENTRY_EMPTY;
+    }
+
+    self->used = 0;
+    self->fill = 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRTraceCacheMap_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    NRTraceCacheMapObject *self;
+
+    self = (NRTraceCacheMapObject *)type->tp_alloc(type, 0);
+
+    if (!self)
+        return NULL;
+
+    self->entries = PyMem_New(NRTraceCacheEntry, MINIMUM_TABLE_SIZE);
+
+    if (!self->entries) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+
+    memset(self->entries, 0, sizeof(NRTraceCacheEntry) * MINIMUM_TABLE_SIZE);
+
+    self->mask = MINIMUM_TABLE_SIZE - 1;
+    self->used = 0;
+    self->fill = 0;
+
+    return (PyObject *)self;
+}
+
+static void NRTraceCacheMap_dealloc(NRTraceCacheMapObject *self)
+{
+    if (self->entries) {
+        NRTraceCacheMap_clear_entries(self);
+        PyMem_Free(self->entries);
+    }
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static Py_ssize_t NRTraceCacheMap_length(NRTraceCacheMapObject *self)
+{
+    size_t i;
+    Py_ssize_t count = 0;
+
+    for (i = 0; i <= self->mask; i++) {
+        if (self->entries[i].state == ENTRY_USED &&
+                PyWeakref_GET_OBJECT(self->entries[i].ref) != Py_None) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static PyObject *NRTraceCacheMap_subscript(NRTraceCacheMapObject *self,
+        PyObject *key)
+{
+    context_id_t context_id;
+    PyObject *object;
+
+    if (context_id_from_object(key, &context_id) < 0)
+        return NULL;
+
+    object = NRTraceCacheMap_lookup(self, context_id);
+
+    if (!object) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return NULL;
+    }
+
+    Py_INCREF(object);
+
+    return object;
+}
+
+static int NRTraceCacheMap_ass_subscript(NRTraceCacheMapObject *self,
+        PyObject *key, PyObject *value)
+{
+    context_id_t context_id;
+
+    if (context_id_from_object(key, &context_id) < 0)
+        return -1;
+
+    if (value)
+        return NRTraceCacheMap_store(self, context_id, value);
+
+    if (!NRTraceCacheMap_lookup(self, context_id)) {
+        PyErr_SetObject(PyExc_KeyError, key);
+        return -1;
+    }
+
+    NRTraceCacheMap_remove_entry(self,
+            NRTraceCacheMap_find(self, context_id));
+
+    return 0;
+}
+
+static int NRTraceCacheMap_contains(NRTraceCacheMapObject *self,
+        PyObject *key)
+{
+    context_id_t context_id;
+
+    if (context_id_from_object(key, &context_id) < 0) {
+        PyErr_Clear();
+        return 0;
+    }
+
+    return NRTraceCacheMap_lookup(self, context_id) != NULL;
+}
+
+static PyObject *NRTraceCacheMap_get(NRTraceCacheMapObject *self,
+        PyObject *args)
+{
+    PyObject *key = NULL;
+    PyObject *failobj = Py_None;
+    PyObject *object = NULL;
+
+    context_id_t context_id;
+
+    if (!PyArg_UnpackTuple(args, "get", 1, 2, &key, &failobj))
+        return NULL;
+
+    if (context_id_from_object(key, &context_id) < 0)
+        PyErr_Clear();
+    else
+        object = NRTraceCacheMap_lookup(self, context_id);
+
+    if (!object)
+        object = failobj;
+
+    Py_INCREF(object);
+
+    return object;
+}
+
+static PyObject *NRTraceCacheMap_pop(NRTraceCacheMapObject *self,
+        PyObject *args)
+{
+    PyObject *key = NULL;
+    PyObject *failobj = NULL;
+    PyObject *object = NULL;
+
+    context_id_t context_id;
+
+    if (!PyArg_UnpackTuple(args, "pop", 1, 2, &key, &failobj))
+        return NULL;
+
+    if (context_id_from_object(key, &context_id) < 0)
+        PyErr_Clear();
+    else
+        object = NRTraceCacheMap_lookup(self, context_id);
+
+    if (!object) {
+        if (!failobj) {
+            PyErr_SetObject(PyExc_KeyError, key);
+            return NULL;
+        }
+
+        Py_INCREF(failobj);
+
+        return failobj;
+    }
+
+    Py_INCREF(object);
+
+    NRTraceCacheMap_remove_entry(self,
+            NRTraceCacheMap_find(self, context_id));
+
+    return object;
+}
+
+#define NR_ITEMS_KEYS 0
+#define NR_ITEMS_VALUES 1
+#define NR_ITEMS_ITEMS 2
+
+static PyObject *NRTraceCacheMap_listing(NRTraceCacheMapObject *self,
+        int kind)
+{
+    size_t i;
+
+    PyObject *result;
+    PyObject *object;
+    PyObject *item;
+    PyObject *key;
+
+    result = PyList_New(0);
+
+    if (!result)
+        return NULL;
+
+    for (i = 0; i <= self->mask; i++) {
+        if (self->entries[i].state != ENTRY_USED)
+            continue;
+
+        object = PyWeakref_GET_OBJECT(self->entries[i].ref);
+
+        if (object == Py_None)
+            continue;
+
+        if (kind == NR_ITEMS_VALUES) {
+            Py_INCREF(object);
+            item = object;
+        }
+        else {
+            key = context_id_to_object(self->entries[i].key);
+
+            if (!key) {
+                Py_DECREF(result);
+                return NULL;
+            }
+
+            if (kind == NR_ITEMS_KEYS)
+                item = key;
+            else {
+                item = PyTuple_Pack(2, key, object);
+                Py_DECREF(key);
+            }
+        }
+
+        if (!item || PyList_Append(result, item) < 0) {
+            Py_XDECREF(item);
+            Py_DECREF(result);
+            return NULL;
+        }
+
+        Py_DECREF(item);
+    }
+
+    return result;
+}
+
+static PyObject *NRTraceCacheMap_keys(NRTraceCacheMapObject *self,
+        PyObject *args)
+{
+    return NRTraceCacheMap_listing(self, NR_ITEMS_KEYS);
+}
+
+static PyObject *NRTraceCacheMap_values(NRTraceCacheMapObject *self,
+        PyObject *args)
+{
+    return NRTraceCacheMap_listing(self, NR_ITEMS_VALUES);
+}
+
+static PyObject *NRTraceCacheMap_items(NRTraceCacheMapObject *self,
+        PyObject *args)
+{
+    return NRTraceCacheMap_listing(self, NR_ITEMS_ITEMS);
+}
+
+static PyObject *NRTraceCacheMap_clear(NRTraceCacheMapObject *self,
+        PyObject *args)
+{
+    NRTraceCacheMap_clear_entries(self);
+
+    Py_INCREF(Py_None);
+
+    return Py_None;
+}
+
+static PyObject *NRTraceCacheMap_iter(NRTraceCacheMapObject *self)
+{
+    PyObject *keys;
+    PyObject *iterator;
+
+    keys = NRTraceCacheMap_listing(self, NR_ITEMS_KEYS);
+
+    if (!keys)
+        return NULL;
+
+    iterator = PyObject_GetIter(keys);
+
+    Py_DECREF(keys);
+
+    return iterator;
+}
+
+static PyMethodDef NRTraceCacheMap_methods[] = {
+    { "get",                (PyCFunction)NRTraceCacheMap_get,
+                            METH_VARARGS, 0 },
+    { "pop",                (PyCFunction)NRTraceCacheMap_pop,
+                            METH_VARARGS, 0 },
+    { "keys",               (PyCFunction)NRTraceCacheMap_keys,
+                            METH_NOARGS, 0 },
+    { "values",             (PyCFunction)NRTraceCacheMap_values,
+                            METH_NOARGS, 0 },
+    { "items",              (PyCFunction)NRTraceCacheMap_items,
+                            METH_NOARGS, 0 },
+    { "clear",              (PyCFunction)NRTraceCacheMap_clear,
+                            METH_NOARGS, 0 },
+    { NULL, NULL }
+};
+
+static PySequenceMethods NRTraceCacheMap_as_sequence = {
+    0,                      /*sq_length*/
+    0,                      /*sq_concat*/
+    0,                      /*sq_repeat*/
+    0,                      /*sq_item*/
+    0,                      /*sq_slice*/
+    0,                      /*sq_ass_item*/
+    0,                      /*sq_ass_slice*/
+    (objobjproc)NRTraceCacheMap_contains, /*sq_contains*/
+};
+
+static PyMappingMethods NRTraceCacheMap_as_mapping = {
+    (lenfunc)NRTraceCacheMap_length, /*mp_length*/
+    (binaryfunc)NRTraceCacheMap_subscript, /*mp_subscript*/
+    (objobjargproc)NRTraceCacheMap_ass_subscript, /*mp_ass_subscript*/
+};
+
+PyTypeObject NRTraceCacheMap_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_trace_cache.TraceCacheMap", /*tp_name*/
+    sizeof(NRTraceCacheMapObject), /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)NRTraceCacheMap_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    &NRTraceCacheMap_as_sequence, /*tp_as_sequence*/
+    &NRTraceCacheMap_as_mapping, /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT,     /*tp_flags*/
+    0,                      /*tp_doc*/
+    0,                      /*tp_traverse*/
+    0,                      /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    (getiterfunc)NRTraceCacheMap_iter, /*tp_iter*/
+    0,                      /*tp_iternext*/
+    NRTraceCacheMap_methods, /*tp_methods*/
+    0,                      /*tp_members*/
+    0,                      /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    0,                      /*tp_init*/
+    0,                      /*tp_alloc*/
+    NRTraceCacheMap_new,    /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------- */
+
+typedef struct {
+    PyObject_HEAD
+
+    NRTraceCacheMapObject *cache;
+
+    PyObject *greenlet;
+    PyObject *greenlet_getcurrent;
+
+    PyObject *asyncio;
+    PyObject *asyncio_get_running_loop;
+    PyObject *asyncio_current_task;
+} NRTraceCacheObject;
+
+extern PyTypeObject NRTraceCache_Type;
+
+static PyObject *greenlet_str = NULL;
+static PyObject *asyncio_str = NULL;
+static PyObject *parent_str = NULL;
+static PyObject *transaction_str = NULL;
+static PyObject *task_str = NULL;
+static PyObject *thread_id_str = NULL;
+static PyObject *root_str = NULL;
+static PyObject *exited_str = NULL;
+static PyObject *greenlet_attr_str = NULL;
+
+static PyObject *active_trace_error_function = NULL;
+
+/* ------------------------------------------------------------------------- */
+
+static void NRTraceCache_resolve_greenlet(NRTraceCacheObject *self)
+{
+    Py_CLEAR(self->greenlet_getcurrent);
+
+    if (!self->greenlet || !PyModule_Check(self->greenlet))
+        return;
+
+    self->greenlet_getcurrent = PyObject_GetAttrString(self->greenlet,
+            "getcurrent");
+
+    if (!self->greenlet_getcurrent)
+        PyErr_Clear();
+}
+
+static void NRTraceCache_resolve_asyncio(NRTraceCacheObject *self)
+{
+    PyObject *task_type = NULL;
+
+    Py_CLEAR(self->asyncio_get_running_loop);
+    Py_CLEAR(self->asyncio_current_task);
+
+    if (!self->asyncio || !PyModule_Check(self->asyncio))
+        return;
+
+    /*
+     * Python 3.7+ provides asyncio.current_task(), with older versions
+     * only having the class method on Task. Where _get_running_loop()
+     * is available we use it to avoid the cost of current_task()
+     * raising an exception when no event loop is running.
+     */
+
+    self->asyncio_current_task = PyObject_GetAttrString(self->asyncio,
+            "current_task");
+
+    if (!self->asyncio_current_task) {
+        PyErr_Clear();
+
+        task_type = PyObject_GetAttrString(self->asyncio, "Task");
+
+        if (task_type) {
+            self->asyncio_current_task = PyObject_GetAttrString(task_type,
+                    "current_task");
+            Py_DECREF(task_type);
+        }
+
+        if (!self->asyncio_current_task)
+            PyErr_Clear();
+    }
+
+    self->asyncio_get_running_loop = PyObject_GetAttrString(self->asyncio,
+            "_get_running_loop");
+
+    if (!self->asyncio_get_running_loop)
+        PyErr_Clear();
+}
+
+/*
+ * Mirrors the lazy module lookup of the pure Python cached_module
+ * descriptor. Returns a borrowed reference to the module, or NULL where
+ * the module has not yet been imported.
+ */
+
+static PyObject *NRTraceCache_module(NRTraceCacheObject *self,
+        PyObject **slot, PyObject *name)
+{
+    PyObject *module;
+
+    if (*slot)
+        return *slot;
+
+    module = PyDict_GetItem(PyImport_GetModuleDict(), name);
+
+    if (!module || !PyObject_IsTrue(module))
+        return NULL;
+
+    Py_INCREF(module);
+    *slot = module;
+
+    if (slot == &self->greenlet)
+        NRTraceCache_resolve_greenlet(self);
+    else
+        NRTraceCache_resolve_asyncio(self);
+
+    return module;
+}
+
+static PyObject *NRTraceCache_current_task(NRTraceCacheObject *self)
+{
+    PyObject *loop;
+    PyObject *task;
+
+    if (!NRTraceCache_module(self, &self->asyncio, asyncio_str))
+        return NULL;
+
+    if (!self->asyncio_current_task)
+        return NULL;
+
+    if (self->asyncio_get_running_loop) {
+        loop = PyObject_CallObject(self->asyncio_get_running_loop, NULL);
+
+        if (!loop) {
+            PyErr_Clear();
+            return NULL;
+        }
+
+        if (loop == Py_None) {
+            Py_DECREF(loop);
+            return NULL;
+        }
+
+        task = PyObject_CallFunctionObjArgs(self->asyncio_current_task,
+                loop, NULL);
+
+        Py_DECREF(loop);
+    }
+    else
+        task = PyObject_CallObject(self->asyncio_current_task, NULL);
+
+    if (!task) {
+        PyErr_Clear();
+        return NULL;
+    }
+
+    if (task == Py_None) {
+        Py_DECREF(task);
+        return NULL;
+    }
+
+    return task;
+}
+
+static int NRTraceCache_context_id(NRTraceCacheObject *self,
+        context_id_t *context_id)
+{
+    PyObject *current;
+    PyObject *parent;
+    PyObject *task;
+
+    int running = 0;
+
+    /*
+     * The root greenlet, which has no parent, corresponds to the
+     * original thread and is never reported as a greenlet context. See
+     * the pure Python TraceCache.current_thread_id() for details.
+     */
+
+    if (NRTraceCache_module(self, &self->greenlet, greenlet_str) &&
+            self->greenlet_getcurrent) {
+        current = PyObject_CallObject(self->greenlet_getcurrent, NULL);
+
+        if (!current)
+            return -1;
+
+        if (current != Py_None) {
+            parent = PyObject_GetAttr(current, parent_str);
+
+            if (!parent) {
+                Py_DECREF(current);
+                return -1;
+            }
+
+            running = PyObject_IsTrue(parent);
+
+            Py_DECREF(parent);
+        }
+
+        if (running > 0)
+            *context_id = (context_id_t)(Py_uintptr_t)current;
+
+        Py_DECREF(current);
+
+        if (running < 0)
+            return -1;
+
+        if (running)
+            return 0;
+    }
+
+    task = NRTraceCache_current_task(self);
+
+    if (task) {
+        *context_id = (context_id_t)(Py_uintptr_t)task;
+        Py_DECREF(task);
+        return 0;
+    }
+
+    *context_id = (context_id_t)PyThread_get_thread_ident();
+
+    return 0;
+}
+
+/* ------------------------------------------------------------------------- */
+
+static PyObject *NRTraceCache_new(PyTypeObject *type,
+        PyObject *args, PyObject *kwds)
+{
+    NRTraceCacheObject *self;
+
+    self = (NRTraceCacheObject *)type->tp_alloc(type, 0);
+
+    if (!self)
+        return NULL;
+
+    self->cache = (NRTraceCacheMapObject *)NRTraceCacheMap_new(
+            &NRTraceCacheMap_Type, NULL, NULL);
+
+    if (!self->cache) {
+        Py_DECREF(self);
+        return NULL;
+    }
+
+    return (PyObject *)self;
+}
+
+static void NRTraceCache_dealloc(NRTraceCacheObject *self)
+{
+    Py_XDECREF(self->cache);
+
+    Py_XDECREF(self->greenlet);
+    Py_XDECREF(self->greenlet_getcurrent);
+
+    Py_XDECREF(self->asyncio);
+    Py_XDECREF(self->asyncio_get_running_loop);
+    Py_XDECREF(self->asyncio_current_task);
+
+    Py_TYPE(self)->tp_free(self);
+}
+
+static PyObject *NRTraceCache_current_thread_id(NRTraceCacheObject *self,
+        PyObject *args)
+{
+    context_id_t context_id;
+
+    if (NRTraceCache_context_id(self, &context_id) < 0)
+        return NULL;
+
+    return context_id_to_object(context_id);
+}
+
+static PyObject *NRTraceCache_current_trace(NRTraceCacheObject *self,
+        PyObject *args)
+{
+    context_id_t context_id;
+    PyObject *trace;
+
+    if (NRTraceCache_context_id(self, &context_id) < 0)
+        return NULL;
+
+    trace = NRTraceCacheMap_lookup(self->cache, context_id);
+
+    if (!trace)
+        trace = Py_None;
+
+    Py_INCREF(trace);
+
+    return trace;
+}
+
+static PyObject *NRTraceCache_current_transaction(NRTraceCacheObject *self,
+        PyObject *args)
+{
+    context_id_t context_id;
+    PyObject *trace;
+
+    int truth;
+
+    if (NRTraceCache_context_id(self, &context_id) < 0)
+        return NULL;
+
+    trace = NRTraceCacheMap_lookup(self->cache, context_id);
+
+    if (!trace) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    truth = PyObject_IsTrue(trace);
+
+    if (truth < 0)
+        return NULL;
+
+    if (!truth) {
+        Py_INCREF(trace);
+        return trace;
+    }
+
+    return PyObject_GetAttr(trace, transaction_str);
+}
+
+static PyObject *NRTraceCache_pop_current(NRTraceCacheObject *self,
+        PyObject *trace)
+{
+    PyObject *thread_id;
+    PyObject *parent;
+
+    int result;
+
+    if (PyObject_HasAttr(trace, task_str)) {
+        if (PyObject_DelAttr(trace, task_str) < 0)
+            return NULL;
+    }
+
+    thread_id = PyObject_GetAttr(trace, thread_id_str);
+
+    if (!thread_id)
+        return NULL;
+
+    parent = PyObject_GetAttr(trace, parent_str);
+
+    if (!parent) {
+        Py_DECREF(thread_id);
+        return NULL;
+    }
+
+    result = NRTraceCacheMap_ass_subscript(self->cache, thread_id, parent);
+
+    Py_DECREF(parent);
+    Py_DECREF(thread_id);
+
+    if (result < 0)
+        return NULL;
+
+    Py_INCREF(Py_None);
+
+    return Py_None;
+}
+
+static int NRTraceCache_thread_exists(context_id_t context_id)
+{
+    PyObject *function;
+    PyObject *frames;
+    PyObject *key;
+
+    int result;
+
+    /*
+     * Same as the pure Python implementation, which checks whether the
+     * identifier is a key in the result of sys._current_frames(). The
+     * list of thread states can't be walked directly as it is guarded
+     * by a lock internal to the interpreter and not by the GIL.
+     */
+
+    function = PySys_GetObject("_current_frames");
+
+    if (!function) {
+        PyErr_SetString(PyExc_RuntimeError, "lost sys._current_frames");
+        return -1;
+    }
+
+    frames = PyObject_CallObject(function, NULL);
+
+    if (!frames)
+        return -1;
+
+    key = context_id_to_object(context_id);
+
+    if (!key) {
+        Py_DECREF(frames);
+        return -1;
+    }
+
+    result = PySequence_Contains(frames, key);
+
+    Py_DECREF(key);
+    Py_DECREF(frames);
+
+    return result;
+}
+
+static PyObject *NRTraceCache_is_thread(NRTraceCacheObject *self,
+        PyObject *object)
+{
+    context_id_t context_id;
+
+    int result;
+
+    if (context_id_from_object(object, &context_id) < 0) {
+        PyErr_Clear();
+        Py_INCREF(Py_False);
+        return Py_False;
+    }
+
+    result = NRTraceCache_thread_exists(context_id);
+
+    if (result < 0)
+        return NULL;
+
+    return PyBool_FromLong(result);
+}
+
+static PyObject *NRTraceCache_active_trace_error(void)
+{
+    PyObject *module;
+
+    /*
+     * Logging of the error and the exception type are left to the
+     * Python module, which always raises an exception.
+     */
+
+    if (!active_trace_error_function) {
+        module = PyImport_ImportModule("newrelic.core.trace_cache");
+
+        if (!module)
+            return NULL;
+
+        active_trace_error_function = PyObject_GetAttrString(module,
+                "_raise_active_trace_error");
+
+        Py_DECREF(module);
+
+        if (!active_trace_error_function)
+            return NULL;
+    }
+
+    return PyObject_CallObject(active_trace_error_function, NULL);
+}
+
+static int NRTraceCache_check_active_root(PyObject *current,
+        PyObject *trace)
+{
+    PyObject *cache_root;
+    PyObject *root = NULL;
+    PyObject *result;
+
+    int truth;
+
+    cache_root = PyObject_GetAttr(current, root_str);
+
+    if (!cache_root)
+        return -1;
+
+    truth = PyObject_IsTrue(cache_root);
+
+    if (truth > 0) {
+        root = PyObject_GetAttr(trace, root_str);
+
+        if (!root)
+            truth = -1;
+        else if (root == cache_root)
+            truth = 0;
+    }
+
+    if (truth > 0) {
+        result = PyObject_GetAttr(cache_root, exited_str);
+
+        if (!result)
+            truth = -1;
+        else {
+            truth = PyObject_IsTrue(result);
+
+            if (truth >= 0)
+                truth = !truth;
+
+            Py_DECREF(result);
+        }
+    }
+
+    Py_XDECREF(root);
+    Py_DECREF(cache_root);
+
+    if (truth > 0) {
+        /* Cached trace exists and has a valid root still. */
+
+        result = NRTraceCache_active_trace_error();
+
+        Py_XDECREF(result);
+
+        return -1;
+    }
+
+    return truth;
+}
+
+static PyObject *NRTraceCache_save_trace(NRTraceCacheObject *self,
+        PyObject *trace)
+{
+    PyObject *thread_id;
+    PyObject *current;
+    PyObject *module;
+    PyObject *value;
+
+    context_id_t context_id;
+
+    int truth;
+    int result;
+
+    thread_id = PyObject_GetAttr(trace, thread_id_str);
+
+    if (!thread_id)
+        return NULL;
+
+    result = context_id_from_object(thread_id, &context_id);
+
+    Py_DECREF(thread_id);
+
+    if (result < 0)
+        return NULL;
+
+    current = NRTraceCacheMap_lookup(self->cache, context_id);
+
+    if (current) {
+        Py_INCREF(current);
+
+        result = NRTraceCache_check_active_root(current, trace);
+
+        Py_DECREF(current);
+
+        if (result < 0)
+            return NULL;
+    }
+
+    if (NRTraceCacheMap_store(self->cache, context_id, trace) < 0)
+        return NULL;
+
+    if (PyObject_SetAttr(trace, greenlet_attr_str, Py_None) < 0)
+        return NULL;
+
+    /*
+     * We judge whether we are actually running in a coroutine by
+     * whether the identifier is that of an executing thread. See the
+     * pure Python implementation for details.
+     */
+
+    result = NRTraceCache_thread_exists(context_id);
+
+    if (result < 0)
+        return NULL;
+
+    if (result) {
+        Py_INCREF(Py_None);
+        return Py_None;
+    }
+
+    module = NRTraceCache_module(self, &self->greenlet, greenlet_str);
+
+    truth = module ? PyObject_IsTrue(module) : 0;
+
+    if (truth < 0)
+        return NULL;
+
+    if (truth && self->greenlet_getcurrent) {
+        current = PyObject_CallObject(self->greenlet_getcurrent, NULL);
+
+        if (!current)
+            return NULL;
+
+        value = PyWeakref_NewRef(current, NULL);
+
+        Py_DECREF(current);
+
+        if (!value)
+            return NULL;
+
+        result = PyObject_SetAttr(trace, greenlet_attr_str, value);
+
+        Py_DECREF(value);
+
+        if (result < 0)
+            return NULL;
+    }
+
+    module = NRTraceCache_module(self, &self->asyncio, asyncio_str);
+
+    truth = module ? PyObject_IsTrue(module) : 0;
+
+    if (truth < 0)
+        return NULL;
+
+    if (truth && !PyObject_HasAttr(trace, task_str)) {
+        value = NRTraceCache_current_task(self);
+
+        result = PyObject_SetAttr(trace, task_str,
+                value ? value : Py_None);
+
+        Py_XDECREF(value);
+
+        if (result < 0)
+            return NULL;
+    }
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject *NRTraceCache_get_cache(NRTraceCacheObject *self,
+        void *closure)
+{
+    Py_INCREF(self->cache);
+
+    return (PyObject *)self->cache;
+}
+
+static PyObject *NRTraceCache_get_module(NRTraceCacheObject *self,
+        void *closure)
+{
+    PyObject *module;
+
+    if (closure)
+        module = NRTraceCache_module(self, &self->asyncio, asyncio_str);
+    else
+        module = NRTraceCache_module(self, &self->greenlet, greenlet_str);
+
+    if (!module)
+        module = Py_None;
+
+    Py_INCREF(module);
+
+    return module;
+}
+
+static int NRTraceCache_set_module(NRTraceCacheObject *self,
+        PyObject *value, void *closure)
+{
+    PyObject **slot;
+
+    slot = closure ? &self->asyncio : &self->greenlet;
+
+    Py_XINCREF(value);
+    Py_XDECREF(*slot);
+
+    *slot = value;
+
+    if (closure)
+        NRTraceCache_resolve_asyncio(self);
+    else
+        NRTraceCache_resolve_greenlet(self);
+
+    return 0;
+}
+
+static PyMethodDef NRTraceCache_methods[] = {
+    { "current_thread_id",  (PyCFunction)NRTraceCache_current_thread_id,
+                            METH_NOARGS, 0 },
+    { "current_trace",      (PyCFunction)NRTraceCache_current_trace,
+                            METH_NOARGS, 0 },
+    { "current_transaction", (PyCFunction)NRTraceCache_current_transaction,
+                            METH_NOARGS, 0 },
+    { "save_trace",         (PyCFunction)NRTraceCache_save_trace,
+                            METH_O, 0 },
+    { "pop_current",        (PyCFunction)NRTraceCache_pop_current,
+                            METH_O, 0 },
+    { "is_thread",          (PyCFunction)NRTraceCache_is_thread,
+                            METH_O, 0 },
+    { NULL, NULL }
+};
+
+static PyGetSetDef NRTraceCache_getset[] = {
+    { "_cache",             (getter)NRTraceCache_get_cache,
+                            NULL, 0 },
+    { "greenlet",           (getter)NRTraceCache_get_module,
+                            (setter)NRTraceCache_set_module, 0, NULL },
+    { "asyncio",            (getter)NRTraceCache_get_module,
+                            (setter)NRTraceCache_set_module, 0, (void *)1 },
+    { NULL },
+};
+
+PyTypeObject NRTraceCache_Type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    "_trace_cache.TraceCache", /*tp_name*/
+    sizeof(NRTraceCacheObject), /*tp_basicsize*/
+    0,                      /*tp_itemsize*/
+    /* methods */
+    (destructor)NRTraceCache_dealloc, /*tp_dealloc*/
+    0,                      /*tp_print*/
+    0,                      /*tp_getattr*/
+    0,                      /*tp_setattr*/
+    0,                      /*tp_compare*/
+    0,                      /*tp_repr*/
+    0,                      /*tp_as_number*/
+    0,                      /*tp_as_sequence*/
+    0,                      /*tp_as_mapping*/
+    0,                      /*tp_hash*/
+    0,                      /*tp_call*/
+    0,                      /*tp_str*/
+    0,                      /*tp_getattro*/
+    0,                      /*tp_setattro*/
+    0,                      /*tp_as_buffer*/
+    Py_TPFLAGS_DEFAULT |
+    Py_TPFLAGS_BASETYPE,    /*tp_flags*/
+    0,                      /*tp_doc*/
+    0,                      /*tp_traverse*/
+    0,                      /*tp_clear*/
+    0,                      /*tp_richcompare*/
+    0,                      /*tp_weaklistoffset*/
+    0,                      /*tp_iter*/
+    0,                      /*tp_iternext*/
+    NRTraceCache_methods,   /*tp_methods*/
+    0,                      /*tp_members*/
+    NRTraceCache_getset,    /*tp_getset*/
+    0,                      /*tp_base*/
+    0,                      /*tp_dict*/
+    0,                      /*tp_descr_get*/
+    0,                      /*tp_descr_set*/
+    0,                      /*tp_dictoffset*/
+    0,                      /*tp_init*/
+    0,                      /*tp_alloc*/
+    NRTraceCache_new,       /*tp_new*/
+    0,                      /*tp_free*/
+    0,                      /*tp_is_gc*/
+};
+
+/* ------------------------------------------------------------------------- */
+
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef moduledef = {
+    PyModuleDef_HEAD_INIT,
+    "_trace_cache",         /* m_name */
+    NULL,                   /* m_doc */
+    -1,                     /* m_size */
+    NULL,                   /* m_methods */
+    NULL,                   /* m_reload */
+    NULL,                   /* m_traverse */
+    NULL,                   /* m_clear */
+    NULL,                   /* m_free */
+};
+#endif
+
+static PyObject *
+moduleinit(void)
+{
+    PyObject *module;
+
+#if PY_MAJOR_VERSION >= 3
+    module = PyModule_Create(&moduledef);
+#else
+    module = Py_InitModule3("_trace_cache", NULL, NULL);
+#endif
+
+    if (module == NULL)
+        return NULL;
+
+    greenlet_str = NR_INTERN("greenlet");
+    asyncio_str = NR_INTERN("asyncio");
+    parent_str = NR_INTERN("parent");
+    transaction_str = NR_INTERN("transaction");
+    task_str = NR_INTERN("_task");
+    thread_id_str = NR_INTERN("thread_id");
+    root_str = NR_INTERN("root");
+    exited_str = NR_INTERN("exited");
+    greenlet_attr_str = NR_INTERN("_greenlet");
+
+    if (!greenlet_str || !asyncio_str || !parent_str || !transaction_str ||
+            !task_str || !thread_id_str || !root_str || !exited_str ||
+            !greenlet_attr_str) {
+        return NULL;
+    }
+
+    if (PyType_Ready(&NRTraceCacheMap_Type) < 0)
+        return NULL;
+
+    if (PyType_Ready(&NRTraceCache_Type) < 0)
+        return NULL;
+
+    Py_INCREF(&NRTraceCacheMap_Type);
+    PyModule_AddObject(module, "TraceCacheMap",
+            (PyObject *)&NRTraceCacheMap_Type);
+
+    Py_INCREF(&NRTraceCache_Type);
+    PyModule_AddObject(module, "TraceCache",
+            (PyObject *)&NRTraceCache_Type);
+
+    return module;
+}
+
+#if PY_MAJOR_VERSION < 3
+PyMODINIT_FUNC init_trace_cache(void)
+{
+    moduleinit();
+}
+#else
+PyMODINIT_FUNC PyInit__trace_cache(void)
+{
+    return moduleinit();
+}
+#endif
+
+/* ------------------------------------------------------------------------- */
@@ -262,7 +262,7 @@ class AgentProtocol(object):
         params["method"] = method
         if self._run_token:
             params["run_id"] = self._run_token
-        return params, self._headers, json_encode(payload).encode("utf-8")
+        return params, self._headers, self.client.encode_payload(payload)
 
     @staticmethod
     def _connect_payload(app_name, linked_applications, environment, settings):
@@ -25,15 +25,29 @@ except ImportError:
 _logger = logging.getLogger(__name__)
 
 
+def _encode_varint(value):
+    result = bytearray()
+    while value > 0x7F:
+        result.append((value & 0x7F) | 0x80)
+        value >>= 7
+    result.append(value)
+    return bytes(result)
+
+
 class StreamingRpc(object):
     """Streaming Remote Procedure Call
 
     This class keeps a stream_stream RPC alive, retrying after a timeout when
     errors are encountered. If grpc.StatusCode.UNIMPLEMENTED is encountered, a
     retry will not occur.
+
+    When batching is enabled, spans are sent as SpanBatch messages of up to
+    batch_size spans. If the trace observer does not implement batches, the
+    stream is reestablished sending a Span message per span instead.
     """
 
     PATH = "/com.newrelic.trace.v1.IngestService/RecordSpan"
+    PATH_BATCH = "/com.newrelic.trace.v1.IngestService/RecordSpanBatch"
     RETRY_POLICY = (
         (15, False),
         (15, False),
@@ -44,11 +58,23 @@ class StreamingRpc(object):
     )
     OPTIONS = [("grpc.enable_retries", 0)]
 
-    def __init__(self, endpoint, stream_buffer, metadata, record_metric, ssl=True):
+    def __init__(
+        self,
+        endpoint,
+        stream_buffer,
+        metadata,
+        record_metric,
+        ssl=True,
+        batching=False,
+        batch_size=100,
+        batch_latency=0.01,
+    ):
         self._endpoint = endpoint
         self._ssl = ssl
         self.metadata = metadata
         self.request_iterator = stream_buffer
+        self.batch_iterator = stream_buffer.batches(batch_size, batch_latency)
+        self.batching = batching
         self.response_processing_thread = threading.Thread(
             target=self.process_responses, name="NR-StreamingRpc-process-responses"
         )
@@ -66,7 +92,30 @@ class StreamingRpc(object):
         else:
             self.channel = grpc.insecure_channel(self._endpoint, options=self.OPTIONS)
 
-        self.rpc = self.channel.stream_stream(self.PATH, Span.SerializeToString, RecordStatus.FromString)
+        if self.batching:
+            self.rpc = self.channel.stream_stream(self.PATH_BATCH, self.serialize_batch, RecordStatus.FromString)
+        else:
+            self.rpc = self.channel.stream_stream(self.PATH, self.serialize, RecordStatus.FromString)
+
+    @staticmethod
+    def serialize(span):
+        # Spans encoded natively are put on the stream already serialized.
+        if isinstance(span, bytes):
+            return span
+
+        return Span.SerializeToString(span)
+
+    @classmethod
+    def serialize_batch(cls, spans):
+        # The spans of a SpanBatch are a repeated message field, written
+        # as the field tag and length of each serialized span before it.
+        chunks = []
+        for span in spans:
+            span = cls.serialize(span)
+            chunks.append(b"\n" + _encode_varint(len(span)))
+            chunks.append(span)
+
+        return b"".join(chunks)
 
     @staticmethod
     def condition(*args, **kwargs):
@@ -120,6 +169,25 @@ class StreamingRpc(object):
                             {"count": 1},
                         )
 
+                        if code is grpc.StatusCode.UNIMPLEMENTED and self.batching:
+                            _logger.warning(
+                                "Streaming RPC received "
+                                "UNIMPLEMENTED response code for span "
+                                "batches. The agent will reestablish the "
+                                "stream sending spans individually."
+                            )
+
+                            # The spans of the batch which was rejected are
+                            # sent again individually.
+
+                            self.channel.close()
+                            self.batching = False
+                            self.batch_iterator.requeue()
+                            self.create_channel()
+
+                            response_iterator = None
+                            continue
+
                         if code is grpc.StatusCode.UNIMPLEMENTED:
                             _logger.error(
                                 "Streaming RPC received "
@@ -164,7 +232,12 @@ class StreamingRpc(object):
                 if self.closed:
                     break
 
-                response_iterator = self.rpc(self.request_iterator, metadata=self.metadata)
+                if self.batching:
+                    request_iterator = self.batch_iterator
+                else:
+                    request_iterator = self.request_iterator
+
+                response_iterator = self.rpc(request_iterator, metadata=self.metadata)
                 _logger.info("Streaming RPC connect completed.")
 
             try:
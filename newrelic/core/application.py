@@ -32,7 +32,7 @@ from newrelic.core.adaptive_sampler import AdaptiveSampler
 from newrelic.core.config import global_settings
 from newrelic.core.custom_event import create_custom_event
 from newrelic.core.data_collector import create_session
-from newrelic.core.database_utils import SQLConnections
+from newrelic.core.database_utils import SQLConnections, sql_statement_cache
 from newrelic.core.environment import environment_settings
 from newrelic.core.internal_metrics import (
     InternalTrace,
@@ -42,7 +42,8 @@ from newrelic.core.internal_metrics import (
 )
 from newrelic.core.profile_sessions import profile_session_manager
 from newrelic.core.rules_engine import RulesEngine, SegmentCollapseEngine
-from newrelic.core.stats_engine import CustomMetrics, StatsEngine
+from newrelic.core.stats_engine import CustomMetrics, StatsEngine, StatsShard
+from newrelic.core.transaction_recorder import TransactionRecorder
 from newrelic.network.exceptions import (
     DiscardDataForRequest,
     ForceAgentDisconnect,
@@ -106,6 +107,25 @@ class Application(object):
         self._stats_custom_lock = threading.RLock()
         self._stats_custom_engine = StatsEngine()
 
+        # When sharded recording of transactions is enabled, each thread
+        # merges the transactions it records into its own stats shard,
+        # which are only merged into the main stats engine at harvest.
+
+        self._stats_shards = []
+        self._stats_shards_lock = threading.Lock()
+        self._stats_shard_local = threading.local()
+
+        # When asynchronous recording of transactions is enabled, they
+        # are recorded from a background thread of the recorder.
+
+        self._transaction_recorder = None
+
+        # The cache of SQL statements is shared by all applications, so
+        # each records the counts of the cache when last harvested and
+        # reports the difference, rather than resetting them.
+
+        self._sql_statement_cache_stats = sql_statement_cache().stats()
+
         self._agent_commands_lock = threading.Lock()
         self._data_samplers_lock = threading.Lock()
         self._data_samplers_started = False
@@ -498,6 +518,7 @@ class Application(object):
 
         with self._stats_lock:
             self._stats_engine.reset_stats(configuration, reset_stream=True)
+            self._reset_stats_shards()
 
             if configuration.serverless_mode.enabled:
                 sampling_target_period = 60.0
@@ -510,6 +531,33 @@ class Application(object):
         with self._stats_custom_lock:
             self._stats_custom_engine.reset_stats(configuration)
 
+        # Any transactions still queued by a recorder from a prior agent
+        # run would be discarded anyway, so they are not waited on.
+
+        if self._transaction_recorder:
+            self._transaction_recorder.shutdown(timeout=0.0)
+            self._transaction_recorder = None
+
+        transaction_recording = configuration.transaction_recording
+
+        if transaction_recording.asynchronous and not configuration.serverless_mode.enabled:
+            # The queue is only created on the first transaction, where a
+            # bad size would fail every transaction rather than just the
+            # one setting, so recording is left synchronous instead.
+
+            if transaction_recording.queue_size <= 0:
+                _logger.warning(
+                    "Invalid transaction_recording.queue_size of %r. It "
+                    "must be greater than zero. Transactions will be "
+                    "recorded synchronously.",
+                    transaction_recording.queue_size,
+                )
+
+            else:
+                self._transaction_recorder = TransactionRecorder(
+                    self._record_transaction, transaction_recording.queue_size, transaction_recording.drop_policy
+                )
+
         # Record an initial start time for the reporting period and
         # clear record of last transaction processed.
 
@@ -837,8 +885,24 @@ class Application(object):
                 self._stats_engine.record_custom_event(event)
 
     def record_transaction(self, data):
-        """Record a single transaction against this application."""
+        """Record a single transaction against this application. Where
+        asynchronous recording of transactions is enabled, it is queued
+        to be recorded by the background recorder thread.
+
+        """
 
+        if not self._active_session:
+            return
+
+        transaction_recorder = self._transaction_recorder
+
+        if transaction_recorder is not None:
+            transaction_recorder.put(data)
+            return
+
+        self._record_transaction(data)
+
+    def _record_transaction(self, data):
         if not self._active_session:
             return
 
@@ -893,6 +957,10 @@ class Application(object):
                     if settings.debug.record_transaction_failure:
                         raise
 
+            if settings.transaction_recording.sharded_stats:
+                self._record_into_stats_shard(data, stats, internal_metrics)
+                return
+
             with self._stats_lock:
                 try:
                     self._transaction_count += 1
@@ -920,6 +988,124 @@ class Application(object):
                     if settings.debug.record_transaction_failure:
                         raise
 
+    def _stats_shard(self):
+        """Returns the stats shard for the current thread, creating it if
+        this thread has not recorded a transaction before.
+
+        """
+
+        try:
+            return self._stats_shard_local.shard
+        except AttributeError:
+            pass
+
+        shard = StatsShard()
+
+        with self._stats_shards_lock:
+            self._stats_shards.append(shard)
+
+        self._stats_shard_local.shard = shard
+
+        return shard
+
+    def _record_into_stats_shard(self, data, stats, internal_metrics):
+        """Merges the stats for a single transaction into the stats shard
+        for the current thread. The shard lock is only ever contended by
+        the harvest.
+
+        """
+
+        shard = self._stats_shard()
+
+        while True:
+            shard.lock.acquire()
+
+            if shard.stats is not None:
+                break
+
+            shard.lock.release()
+
+            # Shards are emptied at each harvest. The stats engine for
+            # the new harvest period is created under the main lock so
+            # it copies the slow transaction history as updated by the
+            # last harvest. The harvest acquires the shard lock while
+            # holding the main lock, so the shard lock must not be held
+            # at the same time here.
+
+            with self._stats_lock:
+                shard_stats = self._stats_engine.create_shard()
+
+            with shard.lock:
+                if shard.stats is None:
+                    shard.stats = shard_stats
+
+        try:
+            shard.transaction_count += 1
+            self._last_transaction = data.end_time
+
+            shard.stats.merge(stats)
+            shard.stats.merge_custom_metrics(internal_metrics.metrics())
+
+        except Exception:
+            _logger.exception(
+                "The merging of transaction data has "
+                "failed. This would indicate some sort of "
+                "internal implementation issue with the agent. "
+                "Please report this problem to New Relic support "
+                "for further investigation."
+            )
+
+            if stats.settings.debug.record_transaction_failure:
+                raise
+
+        finally:
+            shard.lock.release()
+
+    def _merge_stats_shards(self):
+        """Merges the data from all stats shards into the main stats
+        engine, returning the number of transactions they recorded. Must
+        be called with the stats lock held.
+
+        """
+
+        with self._stats_shards_lock:
+            shards = list(self._stats_shards)
+
+        transaction_count = 0
+
+        for shard in shards:
+            with shard.lock:
+                stats = shard.stats
+                shard.stats = None
+
+                transaction_count += shard.transaction_count
+                shard.transaction_count = 0
+
+            if stats is not None:
+                self._stats_engine.merge_shard(stats)
+
+            # Stop tracking shards for threads which have since exited.
+
+            elif not shard.thread_alive():
+                with self._stats_shards_lock:
+                    self._stats_shards.remove(shard)
+
+        return transaction_count
+
+    def _reset_stats_shards(self):
+        """Discards the data from all stats shards. Must be called with
+        the stats lock held.
+
+        """
+
+        with self._stats_shards_lock:
+            shards = list(self._stats_shards)
+
+        for shard in shards:
+            with shard.lock:
+                shard.stats = None
+                shard.transaction_count = 0
+
     def cmd_start_profiler(self, command_id=0, **kwargs):
         """Triggered by the start_profiler agent command to start a
         thread profiling session.
@@ -1063,15 +1249,53 @@ class Application(object):
                 _logger.debug("Snapshotting for harvest[%s] of %r.", call_metric, self._app_name)
 
                 configuration = self._active_session.configuration
+
+                # Record any transactions still queued for recording when
+                # shutting down, so they are included in the final harvest.
+
+                transaction_recorder = self._transaction_recorder
+
+                if shutdown and transaction_recorder:
+                    transaction_recorder.flush()
+
                 transaction_count = self._transaction_count
 
                 with self._stats_lock:
+                    transaction_count += self._merge_stats_shards()
+
                     self._transaction_count = 0
 
                     self._last_transaction = 0.0
 
                     stats = self._stats_engine.harvest_snapshot(flexible)
 
+                if transaction_recorder and not flexible:
+                    transactions_seen, transactions_dropped = transaction_recorder.stats()
+
+                    internal_count_metric("Supportability/Python/TransactionRecording/Seen", transactions_seen)
+                    internal_count_metric("Supportability/Python/TransactionRecording/Dropped", transactions_dropped)
+
+                if not flexible:
+                    filter_hits, filter_misses = configuration.attribute_filter.stats()
+
+                    if filter_hits or filter_misses:
+                        internal_count_metric("Supportability/Python/AttributeFilter/Cache/Hit", filter_hits)
+                        internal_count_metric("Supportability/Python/AttributeFilter/Cache/Miss", filter_misses)
+
+                    cache_stats = sql_statement_cache().stats()
+
+                    cache_hits, cache_misses, cache_evictions = [
+                        current - previous for current, previous in zip(cache_stats, self._sql_statement_cache_stats)
+                    ]
+
+                    self._sql_statement_cache_stats = cache_stats
+
+                    if cache_hits or cache_misses:
+                        internal_count_metric("Supportability/Python/SQLStatementCache/Hit", cache_hits)
+                        internal_count_metric("Supportability/Python/SQLStatementCache/Miss", cache_misses)
+                    if cache_evictions:
+                        internal_count_metric("Supportability/Python/SQLStatementCache/Evicted", cache_evictions)
+
                 if not flexible:
                     with self._stats_custom_lock:
                         global_events_account = self._global_events_account
@@ -1436,7 +1660,8 @@ class Application(object):
                     internal_metric("Supportability/Python/Harvest/Exception/%s" % callable_name(exc_type), 1)
 
                     if self._period_start != period_end:
-                        self._stats_engine.rollback(stats)
+                        with self._stats_lock:
+                            self._stats_engine.rollback(stats)
 
                 except DiscardDataForRequest:
                     # An issue must have occurred in reporting the data
@@ -1517,6 +1742,12 @@ class Application(object):
 
         self.stop_data_samplers()
 
+        # Stop the background recorder thread if there is one.
+
+        if self._transaction_recorder:
+            self._transaction_recorder.shutdown()
+            self._transaction_recorder = None
+
         # Now shutdown the actual agent session.
 
         try:
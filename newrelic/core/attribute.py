@@ -12,6 +12,7 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
+import functools
 import logging
 
 from collections import namedtuple
@@ -22,6 +23,15 @@ from newrelic.core.attribute_filter import (DST_ALL, DST_ERROR_COLLECTOR,
         DST_TRANSACTION_TRACER, DST_TRANSACTION_EVENTS, DST_SPAN_EVENTS,
         DST_TRANSACTION_SEGMENTS)
 
+try:
+    from newrelic.core._attribute import (
+            process_user_attributes as _native_process_user_attributes,
+            resolve_attributes as _native_resolve_attributes,
+            truncate_unicode as _native_truncate_unicode)
+except ImportError:
+    _native_process_user_attributes = None
+    _native_resolve_attributes = None
+    _native_truncate_unicode = None
 
 _logger = logging.getLogger(__name__)
 
@@ -138,6 +148,10 @@ def create_agent_attributes(attr_dict, attribute_filter):
 
 def resolve_user_attributes(
             attr_dict, attribute_filter, target_destination, attr_class=dict):
+    if _native_resolve_attributes is not None and type(attr_dict) is dict:
+        return _native_resolve_attributes(attr_dict, attribute_filter.apply,
+                DST_ALL, None, None, target_destination, attr_class())
+
     u_attrs = attr_class()
 
     for attr_name, attr_value in attr_dict.items():
@@ -154,6 +168,11 @@ def resolve_user_attributes(
 
 def resolve_agent_attributes(
             attr_dict, attribute_filter, target_destination, attr_class=dict):
+    if _native_resolve_attributes is not None and type(attr_dict) is dict:
+        return _native_resolve_attributes(attr_dict, attribute_filter.apply,
+                _DESTINATIONS, _TRANSACTION_EVENT_DEFAULT_ATTRIBUTES,
+                _DESTINATIONS_WITH_EVENTS, target_destination, attr_class())
+
     a_attrs = attr_class()
 
     for attr_name, attr_value in attr_dict.items():
@@ -198,6 +217,10 @@ def truncate(
 
 
 def _truncate_unicode(u, maxsize, encoding='utf-8'):
+    if (_native_truncate_unicode is not None and encoding == 'utf-8' and
+            maxsize >= 0):
+        return _native_truncate_unicode(u, maxsize)
+
     encoded = u.encode(encoding)[:maxsize]
     return encoded.decode(encoding, 'ignore')
 
@@ -281,6 +304,36 @@ def process_user_attribute(
         return (name, value)
 
 
+def process_user_attributes(
+        attr_dict, max_length=MAX_ATTRIBUTE_LENGTH, ending=None):
+
+    # Perform all necessary checks on a dictionary of potential attributes.
+    #
+    # Returns a dictionary of the attributes which are OK, as returned by
+    # process_user_attribute(). Attributes which aren't are dropped.
+
+    if (_native_process_user_attributes is not None and
+            type(attr_dict) is dict):
+        if max_length == MAX_ATTRIBUTE_LENGTH and ending is None:
+            process = process_user_attribute
+        else:
+            process = functools.partial(process_user_attribute,
+                    max_length=max_length, ending=ending)
+
+        return _native_process_user_attributes(attr_dict,
+                MAX_ATTRIBUTE_LENGTH, max_length, process)
+
+    attributes = {}
+
+    for k, v in attr_dict.items():
+        k, v = process_user_attribute(k, v, max_length, ending)
+
+        if k is not None:
+            attributes[k] = v
+
+    return attributes
+
+
 def sanitize(value):
 
     # Return value unchanged, if it's a valid type that is supported by
@@ -57,12 +57,27 @@ class AttributeFilter(object):
     #      the bitfield.
     #
     #   4. Return the resulting bitfield after all rules have been applied.
+    #
+    # As the rules which match an attribute name are the wildcard rules for
+    # prefixes of the name and the exact rules for the name, and as the
+    # sort order applies them from the shortest prefix to the name itself,
+    # the rules are compiled into lookup tables of prefix and name. Each
+    # entry holds the combined effect of the rules for that prefix or
+    # name as a pair of bitfields (keep, add), applied as
+    # (destinations & keep) | add. Combined results for each attribute
+    # name are cached, up to maximum_entries names, after which the cache
+    # is cleared.
+
+    maximum_entries = 1000
 
     def __init__(self, flattened_settings):
 
         self.enabled_destinations = self._set_enabled_destinations(flattened_settings)
         self.rules = self._build_rules(flattened_settings)
+        self._compile_rules()
         self.cache = {}
+        self.hits = 0
+        self.misses = 0
 
     def __repr__(self):
         return "<AttributeFilter: destinations: %s, rules: %s>" % (
@@ -135,27 +150,84 @@ class AttributeFilter(object):
 
         return tuple(rules)
 
+    def _compile_rules(self):
+        self.wildcard_rules = {}
+        self.exact_rules = {}
+
+        for rule in self.rules:
+            if rule.is_wildcard:
+                table = self.wildcard_rules
+            else:
+                table = self.exact_rules
+
+            keep, add = table.get(rule.name, (DST_ALL, DST_NONE))
+
+            if rule.is_include:
+                inc_dest = rule.destinations & self.enabled_destinations
+                add |= inc_dest
+            else:
+                keep &= ~rule.destinations
+                add &= ~rule.destinations
+
+            table[rule.name] = (keep, add)
+
+        self.wildcard_lengths = tuple(sorted(
+                set(len(name) for name in self.wildcard_rules)))
+
+    def _resolve(self, name):
+        keep, add = DST_ALL, DST_NONE
+
+        for length in self.wildcard_lengths:
+            if length > len(name):
+                break
+
+            entry = self.wildcard_rules.get(name[:length])
+
+            if entry is not None:
+                keep, add = keep & entry[0], (add & entry[0]) | entry[1]
+
+        entry = self.exact_rules.get(name)
+
+        if entry is not None:
+            keep, add = keep & entry[0], (add & entry[0]) | entry[1]
+
+        return keep, add
+
     def apply(self, name, default_destinations):
         if self.enabled_destinations == DST_NONE:
             return DST_NONE
 
-        cache_index = (name, default_destinations)
+        cache = self.cache
 
-        if cache_index in self.cache:
-            return self.cache[cache_index]
+        result = cache.get(name)
 
-        destinations = self.enabled_destinations & default_destinations
+        if result is None:
+            self.misses += 1
 
-        for rule in self.rules:
-            if rule.name_match(name):
-                if rule.is_include:
-                    inc_dest = rule.destinations & self.enabled_destinations
-                    destinations |= inc_dest
-                else:
-                    destinations &= ~rule.destinations
-
-        self.cache[cache_index] = destinations
-        return destinations
+            result = self._resolve(name)
+
+            if len(cache) >= self.maximum_entries:
+                cache.clear()
+
+            cache[name] = result
+
+        else:
+            self.hits += 1
+
+        keep, add = result
+
+        return (self.enabled_destinations & default_destinations & keep) | add
+
+    def stats(self):
+        """Returns the number of cache hits and misses since the last
+        call.
+
+        """
+
+        result = (self.hits, self.misses)
+        self.hits, self.misses = 0, 0
+
+        return result
 
 class AttributeFilterRule(object):
 
@@ -255,6 +255,14 @@ class EventLoopVisibilitySettings(Settings):
     pass
 
 
+class TraceCacheSettings(Settings):
+    pass
+
+
+class TransactionRecordingSettings(Settings):
+    pass
+
+
 class InfiniteTracingSettings(Settings):
     _trace_observer_host = None
 
@@ -345,6 +353,8 @@ _settings.browser_monitoring.attributes = BrowserMonitorAttributesSettings()
 _settings.transaction_name = TransactionNameSettings()
 _settings.transaction_metrics = TransactionMetricsSettings()
 _settings.event_loop_visibility = EventLoopVisibilitySettings()
+_settings.trace_cache = TraceCacheSettings()
+_settings.transaction_recording = TransactionRecordingSettings()
 _settings.rum = RumSettings()
 _settings.slow_sql = SlowSqlSettings()
 _settings.agent_limits = AgentLimitsSettings()
@@ -692,6 +702,8 @@ _settings.agent_limits.max_sql_connections = 4
 _settings.agent_limits.sql_explain_plans = 30
 _settings.agent_limits.sql_explain_plans_per_harvest = 60
 _settings.agent_limits.slow_sql_data = 10
+_settings.agent_limits.sql_statement_cache_entries = 1000
+_settings.agent_limits.sql_statement_cache_size = 1024 * 1024
 _settings.agent_limits.merge_stats_maximum = None
 _settings.agent_limits.errors_per_transaction = 5
 _settings.agent_limits.errors_per_harvest = 20
@@ -706,6 +718,9 @@ _settings.infinite_tracing.trace_observer_host = os.environ.get("NEW_RELIC_INFIN
 _settings.infinite_tracing.trace_observer_port = _environ_as_int("NEW_RELIC_INFINITE_TRACING_TRACE_OBSERVER_PORT", 443)
 _settings.infinite_tracing.ssl = True
 _settings.infinite_tracing.span_queue_size = _environ_as_int("NEW_RELIC_INFINITE_TRACING_SPAN_QUEUE_SIZE", 10000)
+_settings.infinite_tracing.batching = _environ_as_bool("NEW_RELIC_INFINITE_TRACING_BATCHING", False)
+_settings.infinite_tracing.span_batch_size = _environ_as_int("NEW_RELIC_INFINITE_TRACING_SPAN_BATCH_SIZE", 100)
+_settings.infinite_tracing.span_batch_latency = _environ_as_float("NEW_RELIC_INFINITE_TRACING_SPAN_BATCH_LATENCY", 0.01)
 
 _settings.event_harvest_config.harvest_limits.analytic_event_data = _environ_as_int(
     "NEW_RELIC_ANALYTICS_EVENTS_MAX_SAMPLES_STORED", DEFAULT_RESERVOIR_SIZE
@@ -779,6 +794,13 @@ _settings.aws_lambda_metadata = {}
 _settings.event_loop_visibility.enabled = True
 _settings.event_loop_visibility.blocking_threshold = 0.1
 
+_settings.trace_cache.backend = os.environ.get("NEW_RELIC_TRACE_CACHE_BACKEND", "context_id")
+
+_settings.transaction_recording.sharded_stats = _environ_as_bool("NEW_RELIC_TRANSACTION_RECORDING_SHARDED_STATS", False)
+_settings.transaction_recording.asynchronous = _environ_as_bool("NEW_RELIC_TRANSACTION_RECORDING_ASYNCHRONOUS", False)
+_settings.transaction_recording.queue_size = _environ_as_int("NEW_RELIC_TRANSACTION_RECORDING_QUEUE_SIZE", 1000)
+_settings.transaction_recording.drop_policy = os.environ.get("NEW_RELIC_TRANSACTION_RECORDING_DROP_POLICY", "drop_newest")
+
 
 def global_settings():
     """This returns the default global settings. Generally only used
@@ -59,8 +59,9 @@ class Session(object):
             if not host:
                 return
 
-            port = self.configuration.infinite_tracing.trace_observer_port
-            ssl = self.configuration.infinite_tracing.ssl
+            infinite_tracing = self.configuration.infinite_tracing
+            port = infinite_tracing.trace_observer_port
+            ssl = infinite_tracing.ssl
             endpoint = "{}:{}".format(host, port)
 
             if (
@@ -75,7 +76,14 @@ class Session(object):
                 )
 
                 rpc = self._rpc = StreamingRpc(
-                    endpoint, span_iterator, metadata, record_metric, ssl=ssl
+                    endpoint,
+                    span_iterator,
+                    metadata,
+                    record_metric,
+                    ssl=ssl,
+                    batching=infinite_tracing.batching,
+                    batch_size=infinite_tracing.span_batch_size,
+                    batch_latency=infinite_tracing.span_batch_latency,
                 )
                 rpc.connect()
                 return rpc
@@ -19,13 +19,28 @@ explain plans for SQL etc.
 
 import logging
 import re
-import weakref
+import threading
+import zlib
 
 import newrelic.packages.six as six
 
 from newrelic.core.internal_metrics import internal_metric
 from newrelic.core.config import global_settings
 
+try:
+    from newrelic.core._database_utils import (
+            obfuscate_sql as _native_obfuscate_sql,
+            uncomment_sql as _native_uncomment_sql,
+            normalize_sql as _native_normalize_sql,
+            parse_operation as _native_parse_operation,
+            parse_target as _native_parse_target)
+except ImportError:
+    _native_obfuscate_sql = None
+    _native_uncomment_sql = None
+    _native_normalize_sql = None
+    _native_parse_operation = None
+    _native_parse_target = None
+
 _logger = logging.getLogger(__name__)
 
 # Obfuscation of SQL is done when reporting SQL statements back to the
@@ -98,6 +113,12 @@ _quotes_table = {
 
 
 def _obfuscate_sql(sql, database):
+    # Use the native implementation where available. It gives the same
+    # result as the regular expressions below, but in a single scan.
+
+    if _native_obfuscate_sql is not None and isinstance(sql, six.text_type):
+        return _native_obfuscate_sql(sql, database.quoting_style)
+
     quotes_re, quotes_cleanup_re = _quotes_table.get(database.quoting_style,
             (_single_quotes_re, _single_quotes_cleanup_re))
 
@@ -155,6 +176,9 @@ _normalize_whitespace_3_re = re.compile(_normalize_whitespace_3_p)
 
 
 def _normalize_sql(sql):
+    if _native_normalize_sql is not None and isinstance(sql, six.text_type):
+        return _native_normalize_sql(sql)
+
     # Note we that do this as a series of regular expressions as
     # using '|' in regular expressions is more expensive.
 
@@ -213,6 +237,9 @@ _uncomment_sql_re = re.compile(_uncomment_sql_x, re.DOTALL)
 
 
 def _uncomment_sql(sql):
+    if _native_uncomment_sql is not None and isinstance(sql, six.text_type):
+        return _native_uncomment_sql(sql)
+
     return _uncomment_sql_re.sub('', sql)
 
 # Parser routines for the different SQL statement operation types.
@@ -411,12 +438,19 @@ _parse_operation_re = re.compile(_parse_operation_p)
 
 
 def _parse_operation(sql):
+    if _native_parse_operation is not None and isinstance(sql, six.text_type):
+        operation = _native_parse_operation(sql).lower()
+        return operation if operation in _operation_table else ''
+
     match = _parse_operation_re.search(sql)
     operation = match and match.group(1).lower() or ''
     return operation if operation in _operation_table else ''
 
 
 def _parse_target(sql, operation):
+    if _native_parse_target is not None and isinstance(sql, six.text_type):
+        return _native_parse_target(sql, operation).lower()
+
     sql = sql.rstrip(';')
     parse = _operation_table.get(operation, None)
     return parse and parse(sql) or ''
@@ -873,8 +907,14 @@ class SQLStatement(object):
 
     @property
     def identifier(self):
+        # Unlike hash(), which for strings differs between processes,
+        # this gives the same identifier for the same normalized SQL in
+        # every process, so slow SQL from different processes of the
+        # one application is grouped together.
+
         if self._identifier is None:
-            self._identifier = hash(self.normalized)
+            self._identifier = zlib.crc32(self.normalized.encode(
+                    'utf-8', 'surrogatepass')) & 0xffffffff
         return self._identifier
 
     def formatted(self, sql_format):
@@ -888,13 +928,167 @@ class SQLStatement(object):
             return self.obfuscated
 
 
-_sql_statements = weakref.WeakValueDictionary()
+class _SQLStatementCacheEntry(object):
+
+    __slots__ = ('key', 'statement', 'size', 'referenced')
+
+    def __init__(self, key, statement, size):
+        self.key = key
+        self.statement = statement
+        self.size = size
+        self.referenced = False
+
+
+class SQLStatementCache(object):
+
+    """Process wide cache of SQL statements, so that the results of
+    parsing and obfuscating a statement are reused across calls. The
+    cache is bounded by both the number of statements and their total
+    length, with the CLOCK algorithm used to approximate least recently
+    used eviction. A lookup does not take the lock, with a hit only
+    marking the entry as referenced. The counts of hits, misses and
+    evictions are not updated under the lock and so may be approximate.
+
+    Statements are cached against the database module they were
+    executed with as well as the SQL, rather than just the quoting style
+    used to obfuscate them, as the cached statement holds the database
+    which is later used to name the metrics and run explain plans.
+
+    """
+
+    def __init__(self, maximum_entries, maximum_size):
+        self.maximum_entries = maximum_entries
+        self.maximum_size = maximum_size
+
+        self._lock = threading.Lock()
+        self._entries = {}
+        self._slots = [None] * max(maximum_entries, 0)
+        self._hand = 0
+        self._size = 0
+
+        self.hits = 0
+        self.misses = 0
+        self.evictions = 0
+
+    def __len__(self):
+        return len(self._entries)
+
+    def get(self, key):
+        entry = self._entries.get(key)
+
+        if entry is None:
+            self.misses += 1
+            return None
+
+        self.hits += 1
+        entry.referenced = True
+
+        return entry.statement
+
+    def add(self, key, statement, size):
+        """Adds the statement to the cache, returning the statement
+        which is cached for the key, which may have been added by
+        another thread. A statement larger than the maximum size is
+        returned without being cached.
+
+        """
+
+        if not self._slots or size > self.maximum_size:
+            return statement
+
+        with self._lock:
+            entry = self._entries.get(key)
+
+            if entry is not None:
+                return entry.statement
+
+            while self._size + size > self.maximum_size:
+                self._evict(self._next_victim())
+
+            index = self._next_victim()
+
+            if self._slots[index] is not None:
+                self._evict(index)
+
+            entry = _SQLStatementCacheEntry(key, statement, size)
+
+            self._slots[index] = entry
+            self._entries[key] = entry
+            self._size += size
+
+            self._hand = (index + 1) % len(self._slots)
+
+        return statement
+
+    def _next_victim(self):
+        # Sweep from the hand for an empty slot or an entry which has
+        # not been referenced since the hand last passed it, clearing
+        # the referenced flag of entries passed over. Must be called
+        # with the lock held.
+
+        slots = self._slots
+
+        while True:
+            entry = slots[self._hand]
+
+            if entry is None or not entry.referenced:
+                return self._hand
+
+            entry.referenced = False
+
+            self._hand = (self._hand + 1) % len(slots)
+
+    def _evict(self, index):
+        entry = self._slots[index]
+
+        if entry is None:
+            # Only reached when evicting to make space and the hand has
+            # stopped at an empty slot, so move on to the next.
+
+            self._hand = (index + 1) % len(self._slots)
+            return
+
+        self._slots[index] = None
+        del self._entries[entry.key]
+        self._size -= entry.size
+
+        self.evictions += 1
+
+    def stats(self):
+        """Returns the total number of hits, misses and evictions. The
+        counts are never reset, as the cache is shared by all
+        applications, each of which reports the counts since it last
+        harvested.
+
+        """
+
+        return (self.hits, self.misses, self.evictions)
+
+
+_sql_statement_cache = None
+_sql_statement_cache_lock = threading.Lock()
+
+
+def sql_statement_cache():
+    global _sql_statement_cache
+
+    if _sql_statement_cache is None:
+        with _sql_statement_cache_lock:
+            if _sql_statement_cache is None:
+                limits = global_settings().agent_limits
+                _sql_statement_cache = SQLStatementCache(
+                        limits.sql_statement_cache_entries,
+                        limits.sql_statement_cache_size)
+
+    return _sql_statement_cache
 
 
 def sql_statement(sql, dbapi2_module):
     key = (sql, dbapi2_module)
 
-    result = _sql_statements.get(key, None)
+    cache = sql_statement_cache()
+
+    result = cache.get(key)
 
     if result is not None:
         return result
@@ -902,6 +1096,4 @@ def sql_statement(sql, dbapi2_module):
     database = SQLDatabase(dbapi2_module)
     result = SQLStatement(sql, database)
 
-    _sql_statements[key] = result
-
-    return result
+    return cache.add(key, result, len(sql))
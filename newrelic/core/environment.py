@@ -36,6 +36,56 @@ try:
 except ImportError:
     pass
 
+try:
+    import newrelic.core._trace_cache
+except ImportError:
+    pass
+
+try:
+    import newrelic.core._time_trace
+except ImportError:
+    pass
+
+try:
+    import newrelic.common._id_generator
+except ImportError:
+    pass
+
+try:
+    import newrelic.core._recording_queue
+except ImportError:
+    pass
+
+try:
+    import newrelic.core._database_utils
+except ImportError:
+    pass
+
+try:
+    import newrelic.core._attribute
+except ImportError:
+    pass
+
+try:
+    import newrelic.core._string_table
+except ImportError:
+    pass
+
+try:
+    import newrelic.common._encoding_utils
+except ImportError:
+    pass
+
+try:
+    import newrelic.common._streaming_utils
+except ImportError:
+    pass
+
+try:
+    import newrelic.core._profile_sessions
+except ImportError:
+    pass
+
 
 def environment_settings():
     """Returns an array of arrays of environment settings
@@ -98,6 +148,36 @@ def environment_settings():
     if 'newrelic.core._thread_utilization' in sys.modules:
         extensions.append('newrelic.core._thread_utilization')
 
+    if 'newrelic.core._trace_cache' in sys.modules:
+        extensions.append('newrelic.core._trace_cache')
+
+    if 'newrelic.core._time_trace' in sys.modules:
+        extensions.append('newrelic.core._time_trace')
+
+    if 'newrelic.common._id_generator' in sys.modules:
+        extensions.append('newrelic.common._id_generator')
+
+    if 'newrelic.core._recording_queue' in sys.modules:
+        extensions.append('newrelic.core._recording_queue')
+
+    if 'newrelic.core._database_utils' in sys.modules:
+        extensions.append('newrelic.core._database_utils')
+
+    if 'newrelic.core._attribute' in sys.modules:
+        extensions.append('newrelic.core._attribute')
+
+    if 'newrelic.core._string_table' in sys.modules:
+        extensions.append('newrelic.core._string_table')
+
+    if 'newrelic.common._encoding_utils' in sys.modules:
+        extensions.append('newrelic.common._encoding_utils')
+
+    if 'newrelic.common._streaming_utils' in sys.modules:
+        extensions.append('newrelic.common._streaming_utils')
+
+    if 'newrelic.core._profile_sessions' in sys.modules:
+        extensions.append('newrelic.core._profile_sessions')
+
     env.append(('Compiled Extensions', ', '.join(extensions)))
 
     # Dispatcher information.
@@ -14,21 +14,35 @@
 
 import newrelic.core.attribute as attribute
 
+from newrelic.common.encoding_utils import generate_span_id
+
 from newrelic.core.attribute_filter import (DST_SPAN_EVENTS,
         DST_TRANSACTION_SEGMENTS)
 
 
 class GenericNodeMixin(object):
+    @property
+    def span_guid(self):
+        # Traces only pass a guid to the node if one was needed while the
+        # trace was running. Otherwise it is generated here, so that it
+        # is only created if a span event is actually recorded.
+        if self.guid is not None:
+            return self.guid
+
+        if hasattr(self, '_span_guid'):
+            return self._span_guid
+
+        self._span_guid = guid = generate_span_id()
+        return guid
+
     @property
     def processed_user_attributes(self):
         if hasattr(self, '_processed_user_attributes'):
             return self._processed_user_attributes
 
-        self._processed_user_attributes = u_attrs = {}
-        user_attributes = getattr(self, 'user_attributes', u_attrs)
-        for k, v in user_attributes.items():
-            k, v = attribute.process_user_attribute(k, v)
-            u_attrs[k] = v
+        user_attributes = getattr(self, 'user_attributes', {})
+        self._processed_user_attributes = u_attrs = \
+                attribute.process_user_attributes(user_attributes)
         return u_attrs
 
     def get_trace_segment_params(self, settings, params=None):
@@ -57,7 +71,7 @@ class GenericNodeMixin(object):
         i_attrs = base_attrs and base_attrs.copy() or attr_class()
         i_attrs['type'] = 'Span'
         i_attrs['name'] = self.name
-        i_attrs['guid'] = self.guid
+        i_attrs['guid'] = self.span_guid
         i_attrs['timestamp'] = int(self.start_time * 1000)
         i_attrs['duration'] = self.duration
         i_attrs['category'] = 'generic'
@@ -93,10 +107,22 @@ class GenericNodeMixin(object):
             for event in child.span_events(
                     settings,
                     base_attrs=base_attrs,
-                    parent_guid=self.guid,
+                    parent_guid=self.span_guid,
                     attr_class=attr_class):
                 yield event
 
+    def emit_span_events(self, settings, emit,
+            base_attrs=None, parent_guid=None, attr_class=dict):
+        # Passes each of the span events which span_events() would yield
+        # to emit as soon as it is created.
+
+        for event in self.span_events(
+                settings,
+                base_attrs=base_attrs,
+                parent_guid=parent_guid,
+                attr_class=attr_class):
+            emit(event)
+
 
 class DatastoreNodeMixin(GenericNodeMixin):
 
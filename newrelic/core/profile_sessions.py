@@ -31,6 +31,15 @@ try:
 except ImportError:
     pass
 
+# The optional C extension takes samples of the stack traces of all threads
+# and holds the call trees of a profile session as arrays, encoding them for
+# the profile data without creating CallTree objects.
+
+try:
+    from newrelic.core._profile_sessions import CallTrees as _NativeCallTrees
+except ImportError:
+    _NativeCallTrees = None
+
 _logger = logging.getLogger(__name__)
 
 AGENT_PACKAGE_DIRECTORY = os.path.dirname(newrelic.__file__) + "/"
@@ -245,13 +254,13 @@ class ProfileSessionManager(object):
 
         while True:
 
-            for category, stack in collect_stack_traces(self.profile_agent_code):
+            # Merge the stack traces to the call tree only for
+            # full_profile_session.
 
-                # Merge the stack_trace to the call tree only for
-                # full_profile_session.
+            session = self.full_profile_session
 
-                if self.full_profile_session:
-                    self.full_profile_session.update_call_tree(category, stack)
+            if session:
+                session.sample_call_trees(self.profile_agent_code)
 
             self.update_profile_sessions()
 
@@ -298,10 +307,42 @@ class ProfileSession(object):
     def reset_profile_data(self):
         self.call_buckets = {"REQUEST": {}, "AGENT": {}, "BACKGROUND": {}, "OTHER": {}}
         self._node_list = []
+        self._call_trees = _NativeCallTrees and _NativeCallTrees(self.call_buckets)
         self.start_time_s = time.time()
         self.sample_count = 0
         self.transaction_count = 0
 
+    def sample_call_trees(self, include_nr_threads=False):
+        """Takes a sample of the stack traces of all the python threads
+        and merges them into the call trees.
+
+        """
+
+        if self._call_trees is not None:
+            threads = [
+                (category, frame)
+                for _, _, category, frame in trace_cache().active_threads()
+                if category != "AGENT" or include_nr_threads
+            ]
+
+            self.transaction_count += self._call_trees.sample(threads, AGENT_PACKAGE_DIRECTORY)
+
+            return
+
+        for category, stack in collect_stack_traces(include_nr_threads):
+            self.update_call_tree(category, stack)
+
+    def merge_call_trees(self):
+        """Merges the call trees held by the C extension into the call
+        buckets, as if each stack trace had been passed to
+        update_call_tree().
+
+        """
+
+        if self._call_trees:
+            self._call_trees.merge(self.call_buckets, self._node_list, CallTree)
+            self._call_trees = _NativeCallTrees(self.call_buckets)
+
     def update_call_tree(self, bucket_type, stack_trace):
         """Merge a single call stack trace into a call tree bucket. If
         no appropriate call tree is found then create a new call tree.
@@ -388,33 +429,45 @@ class ProfileSession(object):
         # and get rejected by the data collector.
 
         settings = global_settings()
-        self._prune_call_trees(settings.agent_limits.thread_profiler_nodes)
+        limit = settings.agent_limits.thread_profiler_nodes
+
+        # Construct the actual final data for sending. The actual call
+        # data is turned into JSON, compressed and then base64 encoded at
+        # this point to cut its size. Where the call trees are held by the
+        # C extension, it prunes them and encodes them as JSON itself,
+        # without creating CallTree objects.
 
-        flat_tree = {}
-        thread_count = 0
+        if self._call_trees is not None and not self._node_list:
+            json_call_tree, thread_count = self._call_trees.profile_data(limit)
 
-        for category, bucket in six.iteritems(self.call_buckets):
+            if settings.debug.log_thread_profile_payload:
+                _logger.debug("Encoding thread profile data where payload=%r.", json_call_tree)
 
-            # Only flatten buckets that have data in them. No need to send
-            # empty buckets.
+        else:
+            self.merge_call_trees()
+            self._prune_call_trees(limit)
 
-            if bucket:
-                flat_tree[category] = [x.flatten() for x in bucket.values()]
-                thread_count += len(bucket)
+            flat_tree = {}
+            thread_count = 0
 
-        # Construct the actual final data for sending. The actual call
-        # data is turned into JSON, compressed and then base64 encoded at
-        # this point to cut its size.
+            for category, bucket in six.iteritems(self.call_buckets):
+
+                # Only flatten buckets that have data in them. No need to
+                # send empty buckets.
+
+                if bucket:
+                    flat_tree[category] = [x.flatten() for x in bucket.values()]
+                    thread_count += len(bucket)
 
-        if settings.debug.log_thread_profile_payload:
-            _logger.debug("Encoding thread profile data where payload=%r.", flat_tree)
+            if settings.debug.log_thread_profile_payload:
+                _logger.debug("Encoding thread profile data where payload=%r.", flat_tree)
 
-        json_call_tree = json_encode(flat_tree)
+            json_call_tree = six.b(json_encode(flat_tree))
 
         level = settings.agent_limits.data_compression_level
         level = level or zlib.Z_DEFAULT_COMPRESSION
 
-        encoded_tree = base64.standard_b64encode(zlib.compress(six.b(json_call_tree), level))
+        encoded_tree = base64.standard_b64encode(zlib.compress(json_call_tree, level))
 
         if six.PY3:
             encoded_tree = encoded_tree.decode("Latin-1")
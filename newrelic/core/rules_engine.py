@@ -37,7 +37,18 @@ class NormalizationRule(_NormalizationRule):
 
 class RulesEngine(object):
 
-    def __init__(self, rules):
+    """Applies the normalization rules supplied by the data collector.
+    The rules are compiled once, in evaluation order, into a sequence of
+    bound substitution functions, and the results of normalizing a name
+    are cached, as the same URLs and metric names are normalized over
+    and over. The cache is cleared when it reaches maximum_entries, so
+    names of high cardinality cannot cause it to grow without bound.
+
+    """
+
+    maximum_entries = 1000
+
+    def __init__(self, rules, maximum_entries=None):
         self.__rules = []
 
         for rule in rules:
@@ -49,6 +60,16 @@ class RulesEngine(object):
 
         self.__rules = sorted(self.__rules, key=lambda rule: rule.eval_order)
 
+        self.__compiled = tuple((rule.match_expression_re.subn,
+                rule.replacement, 0 if rule.replace_all else 1,
+                rule.each_segment, rule.ignore, rule.terminate_chain)
+                for rule in self.__rules)
+
+        if maximum_entries is not None:
+            self.maximum_entries = maximum_entries
+
+        self.__cache = {}
+
     @property
     def rules(self):
         return self.__rules
@@ -66,10 +87,36 @@ class RulesEngine(object):
         if isinstance(string, bytes):
             string = string.decode('Latin-1')
 
+        if not self.__compiled:
+            return (string, False)
+
+        # The cache is only ever added to or cleared as a whole, and the
+        # results are immutable, so it is safe to share between threads
+        # without a lock. If two threads normalize the same name at the
+        # same time, both will compute the same result.
+
+        cache = self.__cache
+
+        result = cache.get(string)
+
+        if result is not None:
+            return result
+
+        result = self._normalize(string)
+
+        if len(cache) >= self.maximum_entries:
+            cache.clear()
+
+        cache[string] = result
+
+        return result
+
+    def _normalize(self, string):
         final_string = string
         ignore = False
-        for rule in self.__rules:
-            if rule.each_segment:
+        for (subn, replacement, count, each_segment, rule_ignore,
+                terminate_chain) in self.__compiled:
+            if each_segment:
                 matched = False
 
                 segments = final_string.split('/')
@@ -88,21 +135,21 @@ class RulesEngine(object):
                     rule_segments = []
 
                 for segment in segments:
-                    rule_segment, match_count = rule.apply(segment)
+                    rule_segment, match_count = subn(replacement, segment, count)
                     matched = matched or (match_count > 0)
                     rule_segments.append(rule_segment)
 
                 if matched:
                     final_string = '/'.join(rule_segments)
             else:
-                rule_string, match_count = rule.apply(final_string)
+                rule_string, match_count = subn(replacement, final_string, count)
                 matched = match_count > 0
                 final_string = rule_string
 
             if matched:
-                ignore = ignore or rule.ignore
+                ignore = ignore or rule_ignore
 
-            if matched and rule.terminate_chain:
+            if matched and terminate_chain:
                 break
 
         return (final_string, ignore)
@@ -122,6 +169,12 @@ class SegmentCollapseEngine(object):
     def __init__(self, rules):
         self.rules = {}
 
+        # Lookup table from prefix to the set of whitelist terms, and
+        # whether the terms allow the segments to be collapsed in a
+        # single pass. See _collapse() below.
+
+        self.terms = {}
+
         prefixes = []
 
         for rule in rules:
@@ -141,6 +194,12 @@ class SegmentCollapseEngine(object):
                 self.rules[prefix] = rule['terms']
                 prefixes.append(prefix)
 
+                terms = frozenset(rule['terms'])
+                single_pass = not any(term.startswith('*') and term != '*'
+                        for term in terms)
+
+                self.terms[prefix] = (terms, single_pass)
+
         # Construct a regular expression which can efficiently pre match
         # any transaction name so we can avoid needing to split the
         # transaction name into segments.
@@ -176,6 +235,35 @@ class SegmentCollapseEngine(object):
         if not self.rules:
             return txn_name, False
 
+        # As prefixes always have exactly two segments, the prefix can
+        # be found by splitting off the first two segments of the name
+        # and looking it up, rather than matching against a regular
+        # expression built from all the prefixes. The regular expression
+        # does not match a remainder containing a newline, so such names
+        # are still handled by it.
+
+        if '\n' not in txn_name:
+            segments = txn_name.split('/', 2)
+
+            if len(segments) != 3 or not segments[2]:
+                return txn_name, False
+
+            prefix = '/'.join(segments[:2])
+
+            entry = self.terms.get(prefix)
+
+            if entry is None:
+                return txn_name, False
+
+            whitelist_terms, single_pass = entry
+
+            if single_pass:
+                return '/'.join((prefix, self._collapse(segments[2],
+                        whitelist_terms))), False
+
+            return '/'.join((prefix, self._collapse_re(segments[2],
+                    whitelist_terms))), False
+
         # Use our regular expression to perform a pre match so can avoid
         # needing to split the name into segments. This also gives us the
         # prefix which matched so we can check if we did in fact have
@@ -202,12 +290,37 @@ class SegmentCollapseEngine(object):
         # to a Unicode string as no coercion will occur.
 
         remainder = match.group(2)
-        segments = remainder.split('/')
 
+        return '/'.join((prefix, self._collapse_re(remainder,
+                whitelist_terms))), False
+
+    def _collapse(self, remainder, whitelist_terms):
+        # Replace non-whitelist terms with '*' and collapse any adjacent
+        # '*' segments to a single '*' in the one pass. This gives the
+        # same result as _collapse_re() only when no whitelist term
+        # other than '*' itself starts with '*', as the regular
+        # expression will also merge a '*' segment with a following
+        # segment starting with '*'.
+
+        result = []
+        star = False
+
+        for segment in remainder.split('/'):
+            if segment in whitelist_terms and segment != '*':
+                result.append(segment)
+                star = False
+            elif not star:
+                result.append('*')
+                star = True
+
+        return '/'.join(result)
+
+    def _collapse_re(self, remainder, whitelist_terms):
         # Replace non-whitelist terms with '*' and then collapse any
         # adjacent '*' segments to a single '*'.
 
+        segments = remainder.split('/')
+
         result = [x if x in whitelist_terms else '*' for x in segments]
-        result = self.COLLAPSE_STAR_RE.sub('\\1', '/'.join(result))
 
-        return '/'.join((prefix, result)), False
+        return self.COLLAPSE_STAR_RE.sub('\\1', '/'.join(result))
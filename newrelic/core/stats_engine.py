@@ -21,12 +21,15 @@ data whereby it is sent to the core application.
 
 import base64
 import copy
+import functools
 import logging
 import operator
 import random
 import sys
+import threading
 import time
 import warnings
+import weakref
 import zlib
 from heapq import heapify, heapreplace
 
@@ -979,8 +982,9 @@ class StatsEngine(object):
                 for event in transaction.span_protos(settings):
                     self._span_stream.put(event)
             elif transaction.sampled:
-                for event in transaction.span_events(self.__settings):
-                    self._span_events.add(event, priority=transaction.priority)
+                transaction.emit_span_events(
+                    self.__settings, functools.partial(self._span_events.add, priority=transaction.priority)
+                )
 
     def metric_data(self, normalizer=None):
         """Returns a list containing the low level metric data for
@@ -1485,6 +1489,20 @@ class StatsEngine(object):
 
         return stats
 
+    def create_shard(self):
+        """Creates and returns a new empty stats engine object into which
+        a single thread records many transactions, before it is merged
+        back into the parent at harvest time using merge_shard(). The
+        history of prior slow transactions is copied so that the shard
+        selects the same slow transaction candidate as the parent would.
+
+        """
+
+        stats = self.create_workarea()
+        stats.__slow_transaction_map = dict(self.__slow_transaction_map)
+
+        return stats
+
     def merge(self, snapshot):
         """Merges data from a single transaction. Snapshot is an instance of
         StatsEngine that contains stats for the single transaction.
@@ -1507,6 +1525,12 @@ class StatsEngine(object):
         """Performs a "rollback" merge after a failed harvest. Snapshot is a
         copy of the main StatsEngine data that we attempted to harvest, but
         failed. Not all types of data get merged during a rollback.
+
+        Typically little data has been recorded since the snapshot was
+        taken, so rather than adding everything in the snapshot back one
+        item at a time, the tables and reservoirs of the snapshot are kept
+        where they are larger, and only the data recorded since is merged
+        into them.
         """
 
         if not self.__settings:
@@ -1518,12 +1542,68 @@ class StatsEngine(object):
             "will be preserved and rolled into next harvest"
         )
 
+        # Merging metric stats gives the same result whichever way around
+        # it is done, so merge the smaller stats table into the larger. The
+        # snapshot is discarded after a rollback so its table can be kept.
+
+        if len(snapshot.__stats_table) > len(self.__stats_table):
+            self.__stats_table, snapshot.__stats_table = (snapshot.__stats_table, self.__stats_table)
+
         self.merge_metric_stats(snapshot)
-        self._merge_transaction_events(snapshot, rollback=True)
+
+        self._transaction_events = self._rollback_data_set(self._transaction_events, snapshot.transaction_events)
         self._merge_synthetics_events(snapshot, rollback=True)
-        self._merge_error_events(snapshot)
-        self._merge_custom_events(snapshot, rollback=True)
-        self._merge_span_events(snapshot, rollback=True)
+        self._error_events = self._rollback_data_set(self._error_events, snapshot.error_events)
+        self._custom_events = self._rollback_data_set(self._custom_events, snapshot.custom_events)
+        self._span_events = self._rollback_data_set(self._span_events, snapshot.span_events)
+
+    @staticmethod
+    def _rollback_data_set(data_set, other_data_set):
+        # The same applies to the sampled data sets, provided both have the
+        # same capacity, as the merged reservoir keeps the samples with the
+        # highest priority from either. Returns the data set merged into.
+        # Data sets already sent are reset to None in the snapshot.
+
+        if not other_data_set:
+            return data_set
+
+        if (
+            other_data_set.num_samples > data_set.num_samples
+            and other_data_set.capacity == data_set.capacity
+        ):
+            data_set, other_data_set = other_data_set, data_set
+
+        data_set.merge(other_data_set)
+
+        return data_set
+
+    def merge_shard(self, shard):
+        """Merges data from a shard created by create_shard(). Unlike with
+        merge(), the shard can hold data for many transactions, so all
+        samples are merged back into the reservoirs, which gives the same
+        result as if they had been recorded here directly.
+        """
+
+        if not self.__settings:
+            return
+
+        self.merge_metric_stats(shard)
+        self._merge_transaction_events(shard, rollback=True)
+        self._merge_synthetics_events(shard)
+        self._merge_error_events(shard)
+        self._merge_custom_events(shard)
+        self._merge_span_events(shard)
+        self._merge_sql(shard)
+        self._merge_traces(shard)
+
+        # Errors in each shard are in time order, but shards overlap in
+        # time, so sort them again before trimming so that it is still
+        # the earliest errors in the harvest period which are retained.
+
+        maximum = self.__settings.agent_limits.errors_per_harvest
+        transaction_errors = self.__transaction_errors + shard.__transaction_errors
+        transaction_errors.sort(key=lambda error: error.start_time)
+        self.__transaction_errors = transaction_errors[:maximum]
 
     def merge_metric_stats(self, snapshot):
         """Merges metric data from a snapshot. This is used both when merging
@@ -1681,3 +1761,23 @@ class StatsEngineSnapshot(StatsEngine):
 
     def reset_error_events(self):
         self._error_events = None
+
+
+class StatsShard(object):
+
+    """Holds the stats recorded by a single thread when sharded recording
+    of transactions is enabled. The stats engine is created on first use
+    in a harvest period and is taken by the harvest to merge into the
+    main stats engine. The lock is only needed to exclude the harvest.
+
+    """
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.stats = None
+        self.transaction_count = 0
+        self._thread = weakref.ref(threading.current_thread())
+
+    def thread_alive(self):
+        thread = self._thread()
+        return thread is not None and thread.is_alive()
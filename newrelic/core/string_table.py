@@ -12,18 +12,39 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-class StringTable(object):
+# Tokens are the same for every string table, so those for the first
+# strings added to a table are created once and shared by all tables.
+
+_TOKEN_POOL = tuple('`%d' % i for i in range(2048))
+
+
+class _StringTable(object):
 
     def __init__(self):
         self.__values = []
         self.__mapping = {}
 
     def cache(self, value):
-        if not value in self.__mapping:
-            token = '`%d' % len(self.__values)
+        token = self.__mapping.get(value)
+
+        if token is None:
+            index = len(self.__values)
+
+            if index < len(_TOKEN_POOL):
+                token = _TOKEN_POOL[index]
+            else:
+                token = '`%d' % index
+
             self.__mapping[value] = token
             self.__values.append(value)
-        return self.__mapping[value]
+
+        return token
 
     def values(self):
         return self.__values
+
+
+try:
+    from newrelic.core._string_table import StringTable
+except ImportError:
+    StringTable = _StringTable
@@ -17,7 +17,6 @@
 """
 
 import logging
-import random
 import sys
 import threading
 import traceback
@@ -28,6 +27,12 @@ try:
 except ImportError:
     import _thread as thread
 
+try:
+    import contextvars
+except ImportError:
+    contextvars = None
+
+from newrelic.common.encoding_utils import generate_span_id
 from newrelic.core.config import global_settings
 from newrelic.core.loop_node import LoopNode
 
@@ -92,16 +97,30 @@ class TraceCacheActiveTraceError(RuntimeError):
     pass
 
 
-class TraceCache(object):
+def _raise_active_trace_error():
+    _logger.error(
+        "Runtime instrumentation error. Attempt to "
+        "save a trace from an inactive transaction. "
+        "Report this issue to New Relic support.\n%s",
+        "".join(traceback.format_stack()[:-1]),
+    )
+
+    raise TraceCacheActiveTraceError("transaction already active")
+
+
+class _TraceCacheBase(object):
+    """Pure Python implementation of the parts of the trace cache which
+    are executed for every trace and so are also provided by the optional
+    C extension.
+
+    """
+
     asyncio = cached_module("asyncio")
     greenlet = cached_module("greenlet")
 
     def __init__(self):
         self._cache = weakref.WeakValueDictionary()
 
-    def __repr__(self):
-        return "<%s object at 0x%x %s>" % (self.__class__.__name__, id(self), str(dict(self._cache.items())))
-
     def current_thread_id(self):
         """Returns the thread ID for the caller.
 
@@ -132,6 +151,86 @@ class TraceCache(object):
 
         return thread.get_ident()
 
+    def current_transaction(self):
+        """Return the transaction object if one exists for the currently
+        executing thread.
+
+        """
+
+        trace = self._cache.get(self.current_thread_id())
+        return trace and trace.transaction
+
+    def current_trace(self):
+        return self._cache.get(self.current_thread_id())
+
+    def save_trace(self, trace):
+        """Saves the specified trace away under the thread ID of
+        the current executing thread. Will also cache a reference to the
+        greenlet if using coroutines. This is so we can later determine
+        the stack trace for a transaction when using greenlets.
+
+        """
+
+        thread_id = trace.thread_id
+
+        if thread_id in self._cache:
+            cache_root = self._cache[thread_id].root
+            if cache_root and cache_root is not trace.root and not cache_root.exited:
+                # Cached trace exists and has a valid root still
+                _raise_active_trace_error()
+
+        self._cache[thread_id] = trace
+
+        # We judge whether we are actually running in a coroutine by
+        # seeing if the current thread ID is actually listed in the set
+        # of all current frames for executing threads. If we are
+        # executing within a greenlet, then thread.get_ident() will
+        # return the greenlet identifier. This will not be a key in
+        # dictionary of all current frames because that will still be
+        # the original standard thread which all greenlets are running
+        # within.
+
+        trace._greenlet = None
+
+        if hasattr(sys, "_current_frames"):
+            if not self.is_thread(thread_id):
+                if self.greenlet:
+                    trace._greenlet = weakref.ref(self.greenlet.getcurrent())
+
+                if self.asyncio and not hasattr(trace, "_task"):
+                    task = current_task(self.asyncio)
+                    trace._task = task
+
+    def pop_current(self, trace):
+        """Restore the trace's parent under the thread ID of the current
+        executing thread."""
+
+        if hasattr(trace, "_task"):
+            delattr(trace, "_task")
+
+        thread_id = trace.thread_id
+        parent = trace.parent
+        self._cache[thread_id] = parent
+
+    def is_thread(self, thread_id):
+        """Returns whether the ID corresponds to a real Python thread
+        rather than a greenlet or asyncio task.
+
+        """
+
+        return thread_id in sys._current_frames()
+
+
+try:
+    from newrelic.core._trace_cache import TraceCache as TraceCacheBase
+except ImportError:
+    TraceCacheBase = _TraceCacheBase
+
+
+class TraceCache(TraceCacheBase):
+    def __repr__(self):
+        return "<%s object at 0x%x %s>" % (self.__class__.__name__, id(self), str(dict(self._cache.items())))
+
     def task_start(self, task):
         trace = self.current_trace()
         if trace:
@@ -140,17 +239,24 @@ class TraceCache(object):
     def task_stop(self, task):
         self._cache.pop(id(task), None)
 
-    def current_transaction(self):
-        """Return the transaction object if one exists for the currently
-        executing thread.
+    def set_current_trace(self, thread_id, trace):
+        """Makes the trace the active trace for the context identified by
+        the thread ID, removing any active trace when trace is None.
 
         """
 
-        trace = self._cache.get(self.current_thread_id())
-        return trace and trace.transaction
+        if trace is None:
+            self._cache.pop(thread_id, None)
+        else:
+            self._cache[thread_id] = trace
 
-    def current_trace(self):
-        return self._cache.get(self.current_thread_id())
+    def active_traces(self):
+        """Returns all traces which are currently active in any thread,
+        greenlet or asyncio task.
+
+        """
+
+        return self._cache.values()
 
     def active_threads(self):
         """Returns an iterator over all current stack frames for all
@@ -230,62 +336,6 @@ class TraceCache(object):
 
         return trace
 
-    def save_trace(self, trace):
-        """Saves the specified trace away under the thread ID of
-        the current executing thread. Will also cache a reference to the
-        greenlet if using coroutines. This is so we can later determine
-        the stack trace for a transaction when using greenlets.
-
-        """
-
-        thread_id = trace.thread_id
-
-        if thread_id in self._cache:
-            cache_root = self._cache[thread_id].root
-            if cache_root and cache_root is not trace.root and not cache_root.exited:
-                # Cached trace exists and has a valid root still
-                _logger.error(
-                    "Runtime instrumentation error. Attempt to "
-                    "save a trace from an inactive transaction. "
-                    "Report this issue to New Relic support.\n%s",
-                    "".join(traceback.format_stack()[:-1]),
-                )
-
-                raise TraceCacheActiveTraceError("transaction already active")
-
-        self._cache[thread_id] = trace
-
-        # We judge whether we are actually running in a coroutine by
-        # seeing if the current thread ID is actually listed in the set
-        # of all current frames for executing threads. If we are
-        # executing within a greenlet, then thread.get_ident() will
-        # return the greenlet identifier. This will not be a key in
-        # dictionary of all current frames because that will still be
-        # the original standard thread which all greenlets are running
-        # within.
-
-        trace._greenlet = None
-
-        if hasattr(sys, "_current_frames"):
-            if thread_id not in sys._current_frames():
-                if self.greenlet:
-                    trace._greenlet = weakref.ref(self.greenlet.getcurrent())
-
-                if self.asyncio and not hasattr(trace, "_task"):
-                    task = current_task(self.asyncio)
-                    trace._task = task
-
-    def pop_current(self, trace):
-        """Restore the trace's parent under the thread ID of the current
-        executing thread."""
-
-        if hasattr(trace, "_task"):
-            delattr(trace, "_task")
-
-        thread_id = trace.thread_id
-        parent = trace.parent
-        self._cache[thread_id] = parent
-
     def complete_root(self, root):
         """Completes a trace specified by the given root
 
@@ -359,7 +409,7 @@ class TraceCache(object):
         task = getattr(transaction.root_span, "_task", None)
         loop = get_event_loop(task)
 
-        for trace in self._cache.values():
+        for trace in self.active_traces():
             if trace in seen:
                 continue
 
@@ -377,7 +427,7 @@ class TraceCache(object):
         seen = None
 
         for root in roots:
-            guid = "%016x" % random.getrandbits(64)
+            guid = generate_span_id()
             node = LoopNode(
                 fetch_name=fetch_name,
                 start_time=start_time,
@@ -391,6 +441,295 @@ class TraceCache(object):
             root.add_child(node)
 
 
+if contextvars:
+    _context_trace = contextvars.ContextVar("newrelic_trace", default=None)
+else:
+    _context_trace = None
+
+
+class _TraceSlot(object):
+    """Holds a weak reference to the active trace of a thread or asyncio
+    task within its context. A new slot is created each time a trace is
+    saved, so tasks which inherit the context keep the trace which was
+    active when they were created. Popping a trace restores the previous
+    slot. Where a trace is completed from a different context, the slot is
+    updated in place.
+
+    """
+
+    __slots__ = ("ref", "thread_id", "prev")
+
+    def __init__(self, trace, thread_id, prev=None):
+        self.ref = weakref.ref(trace)
+        self.thread_id = thread_id
+        self.prev = prev
+
+    def clear(self):
+        self.ref = _no_trace
+
+
+def _no_trace():
+    return None
+
+
+class ContextVarTraceCache(TraceCache):
+    """Trace cache where the active trace for asyncio tasks and threads is
+    held in a context variable. Tasks inherit the context of the code which
+    created them, so the current trace follows the task without needing to
+    be copied across when a task is created or removed when it completes.
+
+    The trace is also still recorded against the thread ID for threads, so
+    that they can be found by the thread profiler. Greenlets continue to be
+    tracked only by ID, as not all greenlet versions give each greenlet its
+    own context. Traces in asyncio tasks are registered against their root
+    so that outstanding children can be completed when the root completes,
+    without needing to scan every task on the event loop.
+
+    """
+
+    def __init__(self):
+        super(ContextVarTraceCache, self).__init__()
+        self._roots = weakref.WeakSet()
+
+    def _greenlet_id(self):
+        if self.greenlet:
+            current = self.greenlet.getcurrent()
+            if current is not None and current.parent:
+                return id(current)
+
+    def _context_trace(self):
+        slot = _context_trace.get()
+        return slot and slot.ref()
+
+    def _register_slot(self, root, thread_id, slot):
+        task_traces = getattr(root, "_task_traces", None)
+        if task_traces is None:
+            root._task_traces = task_traces = {}
+            self._roots.add(root)
+
+        task_traces[thread_id] = slot
+
+    def _set_context_trace(self, thread_id, trace):
+        slot = trace and _TraceSlot(trace, thread_id)
+        _context_trace.set(slot)
+
+        if thread_id == thread.get_ident():
+            if trace is None:
+                self._cache.pop(thread_id, None)
+            else:
+                self._cache[thread_id] = trace
+
+        elif trace is not None and trace.root is not None:
+            self._register_slot(trace.root, thread_id, slot)
+
+    def current_trace(self):
+        greenlet_id = self._greenlet_id()
+        if greenlet_id is not None:
+            return self._cache.get(greenlet_id)
+
+        slot = _context_trace.get()
+        return slot and slot.ref()
+
+    def current_transaction(self):
+        trace = self.current_trace()
+        return trace and trace.transaction
+
+    def task_start(self, task):
+        pass
+
+    def task_stop(self, task):
+        pass
+
+    def set_current_trace(self, thread_id, trace):
+        if self._greenlet_id() is not None:
+            return super(ContextVarTraceCache, self).set_current_trace(thread_id, trace)
+
+        self._set_context_trace(thread_id, trace)
+
+    def active_traces(self):
+        traces = list(self._cache.values())
+
+        for root in list(self._roots):
+            task_traces = getattr(root, "_task_traces", None)
+            if task_traces:
+                traces.extend(trace for trace in (slot.ref() for slot in task_traces.values()) if trace is not None)
+
+        return traces
+
+    def prepare_for_root(self):
+        trace = self.current_trace()
+        if not trace:
+            return None
+
+        if not hasattr(trace, "_task"):
+            return trace
+
+        task = current_task(self.asyncio)
+        if task is not None and id(trace._task) != id(task):
+            self.set_current_trace(self.current_thread_id(), None)
+            return None
+
+        if trace.root and trace.root.exited:
+            self.set_current_trace(self.current_thread_id(), None)
+            return None
+
+        return trace
+
+    def save_trace(self, trace):
+        greenlet = self.greenlet
+        if greenlet and greenlet.getcurrent().parent:
+            return super(ContextVarTraceCache, self).save_trace(trace)
+
+        prev = _context_trace.get()
+        current = prev and prev.ref()
+
+        if current is not None:
+            cache_root = current.root
+            if cache_root and cache_root is not trace.root and not cache_root.exited:
+                # Cached trace exists and has a valid root still
+                _raise_active_trace_error()
+
+        thread_id = trace.thread_id
+
+        trace._greenlet = None
+
+        slot = _TraceSlot(trace, thread_id, prev)
+        _context_trace.set(slot)
+
+        if thread_id == thread.get_ident():
+            self._cache[thread_id] = trace
+            return
+
+        if self.asyncio and not hasattr(trace, "_task"):
+            trace._task = current_task(self.asyncio)
+
+        root = trace.root
+        if root is not None:
+            self._register_slot(root, thread_id, slot)
+
+    def pop_current(self, trace):
+        greenlet = self.greenlet
+        if greenlet and greenlet.getcurrent().parent:
+            return super(ContextVarTraceCache, self).pop_current(trace)
+
+        if hasattr(trace, "_task"):
+            delattr(trace, "_task")
+
+        thread_id = trace.thread_id
+        parent = trace.parent
+
+        slot = _context_trace.get()
+
+        if slot is not None and slot.ref() is trace:
+            prev = slot.prev
+            if prev is not None and prev.ref() is not parent:
+                prev = None
+            if prev is None and parent is not None:
+                prev = _TraceSlot(parent, slot.thread_id)
+
+            _context_trace.set(prev)
+
+            thread_id = slot.thread_id
+            if thread_id == thread.get_ident():
+                if parent is None:
+                    self._cache.pop(thread_id, None)
+                else:
+                    self._cache[thread_id] = parent
+                return
+
+            # Only update the registry when the slot is still the one
+            # registered, as this may be a task which inherited the slot
+            # from the context the trace was saved in.
+
+            root = trace.root
+            task_traces = root and getattr(root, "_task_traces", None)
+            if task_traces and task_traces.get(thread_id) is slot:
+                if prev is None:
+                    del task_traces[thread_id]
+                else:
+                    task_traces[thread_id] = prev
+            return
+
+        # The trace is being completed from a different context, such as
+        # by the last of its children to exit, or when the root completes
+        # with children still outstanding. Update the context it is
+        # active in if it can be found.
+
+        if thread_id in self._cache:
+            self.set_current_trace(thread_id, parent)
+
+        root = trace.root
+        task_traces = root and getattr(root, "_task_traces", None)
+        slot = task_traces and task_traces.get(thread_id)
+
+        if slot is not None and slot.ref() is trace:
+            if parent is None:
+                slot.clear()
+            else:
+                slot.ref = weakref.ref(parent)
+
+    def complete_root(self, root):
+        task_traces = getattr(root, "_task_traces", None)
+
+        if hasattr(root, "_task"):
+            if task_traces and root.has_outstanding_children():
+                to_complete = []
+
+                for slot in list(task_traces.values()):
+                    entry = slot.ref()
+
+                    if entry and entry is not root and entry.root is root:
+                        to_complete.append(entry)
+
+                seen = set()
+
+                while to_complete:
+                    entry = to_complete.pop()
+                    if entry in seen:
+                        continue
+                    seen.add(entry)
+                    if entry.parent and entry.parent is not root:
+                        to_complete.append(entry.parent)
+                    entry.__exit__(None, None, None)
+
+            root._task = None
+
+        if task_traces is not None:
+            root._task_traces = None
+            self._roots.discard(root)
+
+        thread_id = root.thread_id
+
+        current = self._cache.get(thread_id)
+        if current is None:
+            current = self._context_trace()
+            if current is None:
+                raise TraceCacheNoActiveTraceError("no active trace")
+
+        if root is not current:
+            _logger.error(
+                "Runtime instrumentation error. Attempt to "
+                "drop the root when it is not the current "
+                "trace. Report this issue to New Relic support.\n%s",
+                "".join(traceback.format_stack()[:-1]),
+            )
+
+            raise RuntimeError("not the current trace")
+
+        self._cache.pop(thread_id, None)
+
+        if self._context_trace() is root:
+            _context_trace.set(None)
+
+        root._greenlet = None
+
+
+TRACE_CACHE_BACKENDS = {
+    "context_id": TraceCache,
+    "contextvars": ContextVarTraceCache,
+}
+
+
 _trace_cache = TraceCache()
 
 
@@ -398,6 +737,28 @@ def trace_cache():
     return _trace_cache
 
 
+def use_trace_cache_backend(backend):
+    """Replaces the global trace cache with one using the named backend.
+    This must be done before any transactions are started.
+
+    """
+
+    global _trace_cache
+
+    cls = TRACE_CACHE_BACKENDS.get(backend)
+
+    if cls is None:
+        _logger.warning("Unknown trace cache backend %r. Valid backends are %r.", backend, sorted(TRACE_CACHE_BACKENDS))
+        return
+
+    if cls is ContextVarTraceCache and not contextvars:
+        _logger.warning("The contextvars trace cache backend requires Python 3.7 or later.")
+        return
+
+    if type(_trace_cache) is not cls:
+        _trace_cache = cls()
+
+
 def greenlet_loaded(module):
     _trace_cache.greenlet = module
 
@@ -29,12 +29,7 @@ from newrelic.core.attribute import create_user_attributes
 from newrelic.core.attribute_filter import (DST_ERROR_COLLECTOR,
         DST_TRANSACTION_TRACER, DST_TRANSACTION_EVENTS)
 
-from newrelic.common.streaming_utils import SpanProtoAttrs
-
-try:
-    from newrelic.core.infinite_tracing_pb2 import Span
-except:
-    pass
+from newrelic.common.streaming_utils import span_proto
 
 _TransactionNode = namedtuple('_TransactionNode',
         ['settings', 'path', 'type', 'group', 'base_name', 'name_for_metric',
@@ -591,14 +586,15 @@ class TransactionNode(_TransactionNode):
         return intrinsics
 
     def span_protos(self, settings):
-        for i_attrs, u_attrs, a_attrs in self.span_events(
-                    settings, attr_class=SpanProtoAttrs):
-            yield Span(trace_id=self.trace_id,
-                       intrinsics=i_attrs,
-                       user_attributes=u_attrs,
-                       agent_attributes=a_attrs)
+        for i_attrs, u_attrs, a_attrs in self.span_events(settings):
+            yield span_proto(self.trace_id, i_attrs, u_attrs, a_attrs)
 
     def span_events(self, settings, attr_class=dict):
+        events = []
+        self.emit_span_events(settings, events.append, attr_class=attr_class)
+        return events
+
+    def emit_span_events(self, settings, emit, attr_class=dict):
         base_attrs = attr_class((
             ('transactionId', self.guid),
             ('traceId', self.trace_id),
@@ -606,10 +602,10 @@ class TransactionNode(_TransactionNode):
             ('priority', self.priority),
         ))
 
-        for event in self.root.span_events(
+        self.root.emit_span_events(
             settings,
+            emit,
             base_attrs,
             parent_guid=self.parent_span,
             attr_class=attr_class,
-        ):
-            yield event
+        )
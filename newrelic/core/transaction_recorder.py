@@ -0,0 +1,227 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""This module implements recording of transactions from a background
+thread. When enabled, completed transactions are placed in a bounded queue
+and the generation of metrics, events and traces from them is done by the
+recorder thread rather than by the thread which handled the request.
+
+"""
+
+import collections
+import logging
+import os
+import threading
+
+_logger = logging.getLogger(__name__)
+
+DROP_POLICIES = ("drop_newest", "drop_oldest")
+
+
+class _RecordingQueue(object):
+
+    """Pure Python implementation of the bounded queue used to pass
+    completed transactions to the recorder thread. Adding an item never
+    blocks. When the queue is full, either the new item or the oldest
+    item in the queue is dropped.
+
+    """
+
+    def __init__(self, maxlen, drop_oldest=False):
+        if maxlen <= 0:
+            raise ValueError("maxlen must be positive")
+
+        self._queue = collections.deque()
+        self._maxlen = maxlen
+        self._drop_oldest = drop_oldest
+        self._notify = threading.Condition(threading.Lock())
+        self._shutdown = False
+        self._seen = 0
+        self._dropped = 0
+
+    def __len__(self):
+        return len(self._queue)
+
+    def put(self, item):
+        with self._notify:
+            if self._shutdown:
+                return False
+
+            self._seen += 1
+
+            if len(self._queue) >= self._maxlen:
+                self._dropped += 1
+
+                if not self._drop_oldest:
+                    return False
+
+                self._queue.popleft()
+
+            self._queue.append(item)
+            self._notify.notify()
+
+            return True
+
+    def get(self, timeout=None):
+        with self._notify:
+            if not self._queue and not self._shutdown:
+                self._notify.wait(timeout)
+
+            if not self._queue:
+                return None
+
+            return self._queue.popleft()
+
+    def stats(self):
+        with self._notify:
+            seen, dropped = self._seen, self._dropped
+            self._seen, self._dropped = 0, 0
+
+        return seen, dropped
+
+    def shutdown(self):
+        with self._notify:
+            self._shutdown = True
+            self._notify.notify_all()
+
+
+try:
+    from newrelic.core._recording_queue import RecordingQueue
+except ImportError:
+    RecordingQueue = _RecordingQueue
+
+
+class TransactionRecorder(object):
+
+    """Records transactions from a background thread. The recorder thread
+    is started when the first transaction is queued, and again in a new
+    process if the process is forked, in which case any transactions
+    queued by the parent process are discarded.
+
+    """
+
+    def __init__(self, record, queue_size, drop_policy):
+        if drop_policy not in DROP_POLICIES:
+            _logger.warning(
+                "Unknown transaction recording drop policy %r. Expected "
+                "one of %r. Defaulting to %r.",
+                drop_policy,
+                DROP_POLICIES,
+                DROP_POLICIES[0],
+            )
+
+            drop_policy = DROP_POLICIES[0]
+
+        self._record = record
+        self._queue_size = queue_size
+        self._drop_oldest = drop_policy == "drop_oldest"
+
+        self._lock = threading.Lock()
+        self._queue = None
+        self._thread = None
+        self._process_id = None
+        self._shutdown = False
+
+    def _start(self):
+        with self._lock:
+            if self._shutdown or self._process_id == os.getpid():
+                return
+
+            self._queue = RecordingQueue(self._queue_size, self._drop_oldest)
+            self._process_id = os.getpid()
+
+            self._thread = threading.Thread(target=self._run, name="NR-Transaction-Recorder")
+            self._thread.daemon = True
+            self._thread.start()
+
+    def _run(self):
+        queue = self._queue
+
+        while True:
+            data = queue.get()
+
+            if data is None:
+                if self._shutdown:
+                    return
+                continue
+
+            self._record_data(data)
+
+    def _record_data(self, data):
+        try:
+            self._record(data)
+        except Exception:
+            _logger.exception(
+                "The recording of transaction data from the "
+                "background recorder thread has failed. This would "
+                "indicate some sort of internal implementation issue "
+                "with the agent. Please report this problem to New "
+                "Relic support for further investigation."
+            )
+
+    def put(self, data):
+        """Queues the transaction to be recorded. Returns False if the
+        transaction was dropped because the queue is full.
+
+        """
+
+        if self._process_id != os.getpid():
+            self._start()
+
+        if self._queue is None:
+            return False
+
+        return self._queue.put(data)
+
+    def stats(self):
+        """Returns the number of transactions queued and the number of
+        transactions dropped since the last call.
+
+        """
+
+        if self._queue is None or self._process_id != os.getpid():
+            return 0, 0
+
+        return self._queue.stats()
+
+    def flush(self):
+        """Records any transactions still queued from the calling thread."""
+
+        if self._queue is None or self._process_id != os.getpid():
+            return
+
+        while True:
+            data = self._queue.get(timeout=0)
+
+            if data is None:
+                return
+
+            self._record_data(data)
+
+    def shutdown(self, timeout=1.0):
+        """Stops the recorder thread. Transactions still queued which the
+        recorder thread does not get to within the timeout are discarded.
+
+        """
+
+        with self._lock:
+            self._shutdown = True
+
+        if self._queue is None or self._process_id != os.getpid():
+            return
+
+        self._queue.shutdown()
+
+        if self._thread is not None:
+            self._thread.join(timeout)
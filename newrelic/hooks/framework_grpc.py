@@ -12,13 +12,13 @@
 # See the License for the specific language governing permissions and
 # limitations under the License.
 
-import random
 import time
 
 from newrelic.api.external_trace import ExternalTrace
 from newrelic.api.web_transaction import WebTransactionWrapper
 from newrelic.api.transaction import current_transaction
 from newrelic.api.time_trace import notice_error
+from newrelic.common.encoding_utils import generate_span_id
 from newrelic.common.object_wrapper import wrap_function_wrapper
 from newrelic.common.object_names import callable_name
 
@@ -70,7 +70,7 @@ def wrap_future(module, object_path, prepare):
         if transaction is None:
             return wrapped(*args, **kwargs)
 
-        guid = '%016x' % random.getrandbits(64)
+        guid = generate_span_id()
         uri, method = _get_uri_method(instance)
 
         args, kwargs = prepare(transaction, guid, *args, **kwargs)
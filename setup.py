@@ -194,6 +194,16 @@ def run_setup(with_extensions):
                     "newrelic.common._monotonic", ["newrelic/common/_monotonic.c"], libraries=monotonic_libraries
                 ),
                 Extension("newrelic.core._thread_utilization", ["newrelic/core/_thread_utilization.c"]),
+                Extension("newrelic.core._trace_cache", ["newrelic/core/_trace_cache.c"]),
+                Extension("newrelic.core._time_trace", ["newrelic/core/_time_trace.c"]),
+                Extension("newrelic.common._id_generator", ["newrelic/common/_id_generator.c"]),
+                Extension("newrelic.core._recording_queue", ["newrelic/core/_recording_queue.c"]),
+                Extension("newrelic.core._database_utils", ["newrelic/core/_database_utils.c"]),
+                Extension("newrelic.core._attribute", ["newrelic/core/_attribute.c"]),
+                Extension("newrelic.core._string_table", ["newrelic/core/_string_table.c"]),
+                Extension("newrelic.common._encoding_utils", ["newrelic/common/_encoding_utils.c"]),
+                Extension("newrelic.common._streaming_utils", ["newrelic/common/_streaming_utils.c"]),
+                Extension("newrelic.core._profile_sessions", ["newrelic/core/_profile_sessions.c"]),
             ]
             kwargs_tmp["cmdclass"] = dict(build_ext=optional_build_ext)
 
@@ -13,6 +13,7 @@
 # limitations under the License.
 
 import logging
+import time
 
 from testing_support.fixtures import validate_transaction_metrics
 
@@ -34,3 +35,21 @@ def test_trace_after_end_of_transaction(caplog):
 
     error_messages = [record for record in caplog.records if record.levelno >= logging.ERROR]
     assert not error_messages
+
+
+@background_task(name="test_trace_uses_time_function")
+def test_trace_uses_time_function():
+    # Replacing time.time() applies to the start and end times of traces,
+    # whether or not the C extension is used.
+
+    now = time.time()
+    original = time.time
+    time.time = lambda: now
+
+    try:
+        with FunctionTrace("foobar") as trace:
+            pass
+    finally:
+        time.time = original
+
+    assert trace.start_time == trace.end_time == now
@@ -15,33 +15,58 @@
 from concurrent import futures
 
 import grpc
-from newrelic.core.infinite_tracing_pb2 import RecordStatus, Span
+from newrelic.core.infinite_tracing_pb2 import RecordStatus, Span, SpanBatch
 
 
-def record_span(request, context):
+def check_metadata(context):
     metadata = dict(context.invocation_metadata())
     assert 'agent_run_token' in metadata
     assert 'license_key' in metadata
 
+
+def end_stream(span, context):
+    status_code = span.intrinsics.get('status_code', None)
+    status_code = status_code and getattr(
+        grpc.StatusCode, status_code.string_value)
+    if status_code is grpc.StatusCode.OK:
+        return True
+    elif status_code:
+        context.abort(status_code, "Abort triggered by client")
+
+
+def record_span(request, context):
+    check_metadata(context)
+
     for span in request:
-        status_code = span.intrinsics.get('status_code', None)
-        status_code = status_code and getattr(
-            grpc.StatusCode, status_code.string_value)
-        if status_code is grpc.StatusCode.OK:
+        if end_stream(span, context):
             break
-        elif status_code:
-            context.abort(status_code, "Abort triggered by client")
 
         yield RecordStatus(messages_seen=1)
 
 
+def record_span_batch(request, context):
+    check_metadata(context)
+
+    for span_batch in request:
+        for span in span_batch.spans:
+            if end_stream(span, context):
+                return
+
+        yield RecordStatus(messages_seen=len(span_batch.spans))
+
+
 HANDLERS = (
     grpc.method_handlers_generic_handler(
         "com.newrelic.trace.v1.IngestService",
         {
             "RecordSpan": grpc.stream_stream_rpc_method_handler(
                 record_span, Span.FromString, RecordStatus.SerializeToString
-            )
+            ),
+            "RecordSpanBatch": grpc.stream_stream_rpc_method_handler(
+                record_span_batch,
+                SpanBatch.FromString,
+                RecordStatus.SerializeToString,
+            ),
         },
     ),
 )
@@ -13,10 +13,21 @@
 # limitations under the License.
 
 import threading
+import time
+
+import grpc
+import pytest
+
+from testing_support.mock_external_grpc_server import MockExternalgRPCServer
 
 from newrelic.core.agent_streaming import StreamingRpc
 from newrelic.common.streaming_utils import StreamBuffer
-from newrelic.core.infinite_tracing_pb2 import Span, AttributeValue
+from newrelic.core.infinite_tracing_pb2 import (
+    AttributeValue,
+    RecordStatus,
+    Span,
+    SpanBatch,
+)
 
 
 CONDITION_CLS = type(threading.Condition())
@@ -104,3 +115,164 @@ def test_close_while_awaiting_reconnect(mock_grpc_server, monkeypatch):
     rpc.close()
     # Make sure the processing_thread is closed
     assert not rpc.response_processing_thread.is_alive()
+
+
+def _recording_handlers(received, batching):
+    def record(request, context):
+        for message in request:
+            received.append(message)
+            yield RecordStatus(messages_seen=1)
+
+    methods = {
+        "RecordSpan": grpc.stream_stream_rpc_method_handler(
+            record, Span.FromString, RecordStatus.SerializeToString
+        )
+    }
+
+    if batching:
+        methods["RecordSpanBatch"] = grpc.stream_stream_rpc_method_handler(
+            record, SpanBatch.FromString, RecordStatus.SerializeToString
+        )
+
+    return (grpc.method_handlers_generic_handler("com.newrelic.trace.v1.IngestService", methods),)
+
+
+def _wait_for(predicate, timeout=5):
+    deadline = time.time() + timeout
+    while not predicate() and time.time() < deadline:
+        time.sleep(0.01)
+    return predicate()
+
+
+def test_span_batches():
+    received = []
+    spans = [Span(trace_id=str(i)) for i in range(5)]
+
+    stream_buffer = StreamBuffer(10)
+    for span in spans:
+        stream_buffer.put(span)
+
+    mock_server = MockExternalgRPCServer()
+    with mock_server as server:
+        server.add_generic_rpc_handlers(_recording_handlers(received, batching=True))
+
+        rpc = StreamingRpc(
+            "localhost:%s" % mock_server.port,
+            stream_buffer,
+            DEFAULT_METADATA,
+            record_metric,
+            ssl=False,
+            batching=True,
+            batch_size=2,
+            batch_latency=0,
+        )
+
+        rpc.connect()
+        assert _wait_for(lambda: len(received) == 3)
+        rpc.close()
+
+    assert received == [
+        SpanBatch(spans=spans[0:2]),
+        SpanBatch(spans=spans[2:4]),
+        SpanBatch(spans=spans[4:5]),
+    ]
+
+
+def test_span_batches_unimplemented():
+    received = []
+    metrics = []
+
+    def record_metric(name, value):
+        metrics.append(name)
+
+    stream_buffer = StreamBuffer(10)
+
+    mock_server = MockExternalgRPCServer()
+    with mock_server as server:
+        server.add_generic_rpc_handlers(_recording_handlers(received, batching=False))
+
+        rpc = StreamingRpc(
+            "localhost:%s" % mock_server.port,
+            stream_buffer,
+            DEFAULT_METADATA,
+            record_metric,
+            ssl=False,
+            batching=True,
+            batch_latency=0,
+        )
+
+        rpc.connect()
+        assert _wait_for(lambda: not rpc.batching)
+
+        # The request thread of the call which failed may still take the
+        # first span put on the stream, so keep putting spans until they
+        # are received.
+
+        def sent():
+            stream_buffer.put(Span(trace_id="span"))
+            return received
+
+        assert _wait_for(sent)
+        rpc.close()
+
+    assert "Supportability/InfiniteTracing/Span/gRPC/UNIMPLEMENTED" in metrics
+    assert all(type(message) is Span for message in received)
+    assert not rpc.response_processing_thread.is_alive()
+
+
+def test_span_batches_unimplemented_requeued():
+    received = []
+
+    stream_buffer = StreamBuffer(10)
+
+    mock_server = MockExternalgRPCServer()
+    with mock_server as server:
+        server.add_generic_rpc_handlers(_recording_handlers(received, batching=False))
+
+        rpc = StreamingRpc(
+            "localhost:%s" % mock_server.port,
+            stream_buffer,
+            DEFAULT_METADATA,
+            record_metric,
+            ssl=False,
+            batching=True,
+            batch_size=2,
+            batch_latency=0,
+        )
+
+        # Take the batch which was in flight when the trace observer
+        # rejected batches.
+
+        stream_buffer.put(Span(trace_id="a"))
+        stream_buffer.put(Span(trace_id="b"))
+
+        assert [span.trace_id for span in next(rpc.batch_iterator)] == ["a", "b"]
+
+        rpc.connect()
+        assert _wait_for(lambda: not rpc.batching)
+
+        # The request thread of the call which failed may still take the
+        # first span put on the stream, so keep putting spans until the
+        # spans of the batch are received.
+
+        def sent():
+            stream_buffer.put(Span(trace_id="span"))
+            return len(received) >= 2
+
+        assert _wait_for(sent)
+        rpc.close()
+
+    assert [span.trace_id for span in received[:2]] == ["a", "b"]
+
+
+@pytest.mark.parametrize("spans", (
+    [],
+    [Span(trace_id="a")],
+    [Span(trace_id="a" * 200), Span(trace_id="b")],
+))
+def test_serialize_batch(spans):
+    serialized = [span.SerializeToString() for span in spans]
+    expected = SpanBatch(spans=spans).SerializeToString()
+
+    assert StreamingRpc.serialize_batch(spans) == expected
+    assert StreamingRpc.serialize_batch(serialized) == expected
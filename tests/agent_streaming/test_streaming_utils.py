@@ -0,0 +1,257 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import threading
+import time
+
+import pytest
+
+from testing_support.fixtures import native_implementation_fixture
+
+import newrelic.common.streaming_utils as streaming_utils
+
+from newrelic.core.agent_streaming import StreamingRpc
+from newrelic.core.infinite_tracing_pb2 import Span
+from newrelic.packages import six
+
+_intrinsics = {
+    u'type': u'Span',
+    u'traceId': u'0af7651916cd43dd8448eb211c80319c',
+    u'guid': u'b7ad6b7169203331',
+    u'sampled': True,
+    u'nr.entryPoint': False,
+    u'priority': 1.234567,
+    u'duration': 0.0,
+    u'timestamp': 1593110400000,
+    u'negative': -1,
+    u'zero': 0,
+    u'name': u'caf\xe9 ☃ \U0001f600',
+    u'empty': u'',
+    u'': u'empty key',
+    u'none': None,
+    u'object': object,
+}
+
+
+def _python_span(*args):
+    return streaming_utils.Span(
+            trace_id=args[0],
+            intrinsics=streaming_utils.SpanProtoAttrs(args[1]),
+            user_attributes=streaming_utils.SpanProtoAttrs(args[2]),
+            agent_attributes=streaming_utils.SpanProtoAttrs(args[3]))
+
+
+@pytest.mark.parametrize('args', [
+    (u'0af7651916cd43dd8448eb211c80319c', _intrinsics,
+            {u'user': 2 ** 63 - 1, u'bytes': b'value'},
+            {u'http.url': u'http://example.com/', u'int': -2 ** 63}),
+    (u'', {}, {}, {}),
+    (None, {u'a': 1.5}, {}, {}),
+    (u'abc', {u'timestamp': six.integer_types[-1](1600000000123)}, {}, {}),
+])
+def test_encode_span(args):
+    if streaming_utils._native_encode_span is None:
+        pytest.skip('native span encoder not available')
+
+    encoded = streaming_utils._native_encode_span(*args)
+
+    assert isinstance(encoded, bytes)
+    assert Span.FromString(encoded) == _python_span(*args)
+
+    # Integers are sent as such, including a long with Python 2.
+
+    intrinsics = Span.FromString(encoded).intrinsics
+
+    if u'timestamp' in intrinsics:
+        assert intrinsics[u'timestamp'].WhichOneof('value') == 'int_value'
+
+
+@pytest.mark.parametrize('args', [
+    (u'abc', {u'int': 2 ** 63}, {}, {}),
+    (u'abc', {}, {b'bytes key': 1}, {}),
+    (u'abc', {}, {}, {u'surrogate': u'\ud800'}),
+    (1, {}, {}, {}),
+])
+def test_encode_span_fallback(args):
+    if streaming_utils._native_encode_span is not None:
+        assert streaming_utils._native_encode_span(*args) is None
+
+    try:
+        expected = _python_span(*args)
+    except Exception as exc:
+        with pytest.raises(type(exc)):
+            streaming_utils.span_proto(*args)
+    else:
+        assert streaming_utils.span_proto(*args) == expected
+
+
+def test_streaming_rpc_serialize():
+    span = _python_span(u'abc', {u'a': 1}, {}, {})
+
+    assert StreamingRpc.serialize(span) == span.SerializeToString()
+    assert StreamingRpc.serialize(b'serialized') == b'serialized'
+
+
+stream_queue = native_implementation_fixture(streaming_utils,
+        StreamQueue=streaming_utils._StreamQueue)
+
+
+@pytest.mark.parametrize('maxlen,items,expected', [
+    (0, 3, []),
+    (1, 3, [2]),
+    (5, 3, [0, 1, 2]),
+    (5, 8, [3, 4, 5, 6, 7]),
+])
+def test_stream_queue(stream_queue, maxlen, items, expected):
+    queue = streaming_utils.StreamQueue(maxlen)
+
+    for i in range(items):
+        queue.put(i)
+
+    assert len(queue) == len(expected)
+    assert queue.drain(2) == expected[:2]
+    assert queue.drain(100) == expected[2:]
+    assert queue.drain(100) == []
+
+    assert queue.stats() == (items, items - len(expected))
+    assert queue.stats() == (0, 0)
+
+
+def test_stream_buffer_batches(stream_queue, monkeypatch):
+    monkeypatch.setattr(streaming_utils.StreamBuffer, 'BATCH_SIZE', 3)
+
+    stream_buffer = streaming_utils.StreamBuffer(10)
+
+    for i in range(5):
+        stream_buffer.put(i)
+
+    assert [next(stream_buffer) for _ in range(2)] == [0, 1]
+    assert len(stream_buffer._queue) == 2
+
+    stream_buffer.put(5)
+
+    assert [next(stream_buffer) for _ in range(4)] == [2, 3, 4, 5]
+    assert stream_buffer.stats() == (6, 0)
+
+
+def test_stream_buffer_wakes_when_empty(stream_queue):
+    stream_buffer = streaming_utils.StreamBuffer(10)
+    received = []
+
+    def consume():
+        for item in stream_buffer:
+            received.append(item)
+
+    thread = threading.Thread(target=consume)
+    thread.start()
+
+    for i in range(3):
+        stream_buffer.put(i)
+
+    # Wait until the consumer has caught up and is waiting again.
+
+    for _ in range(500):
+        if len(received) == 3 and stream_buffer._waiting:
+            break
+        thread.join(0.01)
+
+    stream_buffer.put(3)
+
+    for _ in range(500):
+        if len(received) == 4:
+            break
+        thread.join(0.01)
+
+    stream_buffer.shutdown()
+    thread.join(5)
+
+    assert not thread.is_alive()
+    assert received == [0, 1, 2, 3]
+
+
+def test_stream_buffer_next_batch(stream_queue):
+    stream_buffer = streaming_utils.StreamBuffer(10)
+
+    for i in range(5):
+        stream_buffer.put(i)
+
+    assert next(stream_buffer) == 0
+    assert stream_buffer.next_batch(3, 0) == [1, 2, 3]
+
+    start = time.time()
+    assert stream_buffer.next_batch(3, 0.05) == [4]
+    assert time.time() - start >= 0.05
+
+    stream_buffer.shutdown()
+
+    with pytest.raises(StopIteration):
+        stream_buffer.next_batch(3, 0)
+
+
+def test_stream_buffer_next_batch_filled(stream_queue):
+    stream_buffer = streaming_utils.StreamBuffer(10)
+    stream_buffer.put(0)
+
+    def fill():
+        # Wait until the consumer is lingering for the batch to fill.
+
+        for _ in range(500):
+            if stream_buffer._lingering:
+                break
+            time.sleep(0.01)
+
+        stream_buffer.put(1)
+        stream_buffer.put(2)
+
+    thread = threading.Thread(target=fill)
+    thread.start()
+
+    # A full batch is returned as soon as it is filled, rather than once
+    # the batch latency has passed.
+
+    start = time.time()
+    assert stream_buffer.next_batch(3, 5.0) == [0, 1, 2]
+    assert time.time() - start < 5.0
+
+    thread.join(5)
+
+
+def test_stream_buffer_requeue(stream_queue):
+    stream_buffer = streaming_utils.StreamBuffer(10)
+    batches = stream_buffer.batches(2, 0)
+
+    for i in range(3):
+        stream_buffer.put(i)
+
+    assert next(batches) == [0, 1]
+
+    batches.requeue()
+    batches.requeue()
+
+    assert [next(stream_buffer) for _ in range(3)] == [0, 1, 2]
+
+
+def test_stream_batch_iterator(stream_queue):
+    stream_buffer = streaming_utils.StreamBuffer(10)
+    batches = stream_buffer.batches(2, 0)
+
+    for i in range(3):
+        stream_buffer.put(i)
+
+    assert next(batches) == [0, 1]
+    assert next(batches) == [2]
+
+    stream_buffer.shutdown()
+
+    assert list(batches) == []
@@ -0,0 +1,98 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+
+from testing_support.fixtures import native_implementation_fixture
+
+import newrelic.core.attribute as attribute
+
+from newrelic.core.attribute_filter import (AttributeFilter,
+        DST_SPAN_EVENTS, DST_TRANSACTION_TRACER)
+
+_attributes = {
+    u'string': u'value',
+    u'long_string': u'x' * 300,
+    u'unicode': u'\u2603' * 100,
+    u'bytes': b'value',
+    u'int': 1,
+    u'big_int': 2 ** 64,
+    u'float': 1.5,
+    u'bool': True,
+    u'none': None,
+    u'list': [1, 2],
+    u'n' * 256: u'name too long',
+    1: u'name not a string',
+}
+
+_settings = {
+    'attributes.enabled': True,
+    'span_events.attributes.enabled': True,
+    'transaction_tracer.attributes.enabled': True,
+    'attributes.exclude': [u'int', u'request.*'],
+    'attributes.include': [u'request.method'],
+}
+
+
+implementation = native_implementation_fixture(attribute,
+        '_native_process_user_attributes', '_native_resolve_attributes',
+        '_native_truncate_unicode')
+
+
+@pytest.mark.parametrize('text,maxsize,expected', [
+    (u'', 5, u''),
+    (u'abc', 5, u'abc'),
+    (u'abcdef', 5, u'abcde'),
+    (u'\u2603\u2603', 5, u'\u2603'),
+    (u'a\xe9b', 2, u'a'),
+    (u'a\xe9b', 3, u'a\xe9'),
+])
+def test_truncate(implementation, text, maxsize, expected):
+    assert attribute.truncate(text, maxsize=maxsize) == expected
+
+
+def test_process_user_attributes(implementation):
+    expected = {
+        u'string': u'value',
+        u'long_string': u'x' * 255,
+        u'unicode': u'\u2603' * 85,
+        u'bytes': b'value',
+        u'int': 1,
+        u'float': 1.5,
+        u'bool': True,
+        u'none': u'None',
+        u'list': u'[1, 2]',
+    }
+
+    assert attribute.process_user_attributes(_attributes) == expected
+
+
+def test_resolve_attributes(implementation):
+    attribute_filter = AttributeFilter(_settings)
+
+    user_attributes = {u'string': u'value', u'int': 1, u'none': None}
+
+    assert attribute.resolve_user_attributes(user_attributes,
+            attribute_filter, DST_SPAN_EVENTS) == {u'string': u'value'}
+
+    agent_attributes = {u'request.method': u'GET',
+            u'request.headers.host': u'localhost', u'db.instance': u'db'}
+
+    assert attribute.resolve_agent_attributes(agent_attributes,
+            attribute_filter, DST_SPAN_EVENTS) == {u'request.method': u'GET',
+            u'db.instance': u'db'}
+
+    assert attribute.resolve_agent_attributes(agent_attributes,
+            attribute_filter, DST_TRANSACTION_TRACER) == {
+            u'request.method': u'GET', u'db.instance': u'db'}
@@ -0,0 +1,252 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import collections
+
+import pytest
+
+from testing_support.fixtures import native_implementation_fixture
+
+import newrelic.common.encoding_utils as encoding_utils
+
+from newrelic.core.stats_engine import TimeStats
+
+
+def _generator():
+    for i in range(3):
+        yield [i, (i, u'x')]
+
+
+_payloads = [
+    None,
+    True,
+    0,
+    -2 ** 70,
+    1.5,
+    1e16,
+    float('nan'),
+    float('-inf'),
+    u'',
+    u'quote " backslash \\ newline \n tab \t nul \x00 del \x7f',
+    u'caf\xe9 \u2603 \U0001f600',
+    b'latin-1 \xe9\xff',
+    [],
+    {},
+    [1, [2, [3, []]], (4, 5)],
+    {u'a': 1, 1: u'b', 1.5: None, True: False, None: []},
+    collections.OrderedDict([(u'z', 1), (u'a', 2)]),
+    [{u'name': u'Function/foo', u'scope': u''},
+            TimeStats([1, 2.0, 3.0, 0.5, 4.0, 9.0])],
+    set([1]),
+]
+
+
+implementation = native_implementation_fixture(encoding_utils,
+        '_native_json_encode', '_native_json_encode_chunks',
+        '_native_decode_traceparent', '_native_split_tracestate',
+        '_native_decode_nr_tracestate', '_native_format_trace_context',
+        '_native_xor_cipher_encrypt_base64',
+        '_native_xor_cipher_decrypt_base64')
+
+
+@pytest.mark.parametrize('payload', _payloads)
+def test_json_encode(implementation, payload, monkeypatch):
+    result = encoding_utils.json_encode(payload)
+
+    monkeypatch.setattr(encoding_utils, '_native_json_encode', None)
+
+    assert result == encoding_utils.json_encode(payload)
+
+
+def test_json_encode_generator(implementation):
+    assert encoding_utils.json_encode([1, _generator(), 2]) == \
+            '[1,[[0,[0,"x"]],[1,[1,"x"]],[2,[2,"x"]]],2]'
+
+
+@pytest.mark.parametrize('payload,exception', [
+    ([object()], TypeError),
+    ({(1, 2): 1}, TypeError),
+])
+def test_json_encode_errors(implementation, payload, exception):
+    with pytest.raises(exception):
+        encoding_utils.json_encode(payload)
+
+
+def test_json_encode_circular(implementation):
+    payload = []
+    payload.append(payload)
+
+    with pytest.raises(ValueError):
+        encoding_utils.json_encode(payload)
+
+
+@pytest.mark.parametrize('payload', _payloads)
+def test_json_encode_chunks(implementation, payload):
+    chunks = []
+
+    encoding_utils.json_encode_chunks(payload, chunks.append, 8)
+
+    assert b''.join(chunks) == encoding_utils.json_encode(
+            payload).encode('utf-8')
+
+
+def test_json_encode_chunks_size(implementation):
+    payload = [[i, u'x' * 10] for i in range(1000)]
+    chunks = []
+
+    encoding_utils.json_encode_chunks(payload, chunks.append, 1024)
+
+    assert b''.join(chunks) == encoding_utils.json_encode(
+            payload).encode('utf-8')
+
+    if encoding_utils._native_json_encode_chunks is not None:
+        assert len(chunks) > 1
+        assert all(len(chunk) >= 1024 for chunk in chunks[:-1])
+
+
+_TRACE_ID = u'0af7651916cd43dd8448eb211c80319c'
+_PARENT_ID = u'b7ad6b7169203331'
+
+
+@pytest.mark.parametrize('traceparent,expected', [
+    (u'00-%s-%s-01' % (_TRACE_ID, _PARENT_ID), (_TRACE_ID, _PARENT_ID)),
+    (u'cc-%s-%s-00-extra' % (_TRACE_ID, _PARENT_ID), (_TRACE_ID, _PARENT_ID)),
+    (u'cc-%s-%s-00-\xe9' % (_TRACE_ID, _PARENT_ID), (_TRACE_ID, _PARENT_ID)),
+    (u'00-%s-%s-01-extra' % (_TRACE_ID, _PARENT_ID), None),
+    (u'ff-%s-%s-01' % (_TRACE_ID, _PARENT_ID), None),
+    (u'00-%s-%s-01' % (_TRACE_ID.upper(), _PARENT_ID), None),
+    (u'00-%s-%s-01' % (u'0' * 32, _PARENT_ID), None),
+    (u'00-%s-%s-01' % (_TRACE_ID, u'0' * 16), None),
+    (u'00-%s-%s-1' % (_TRACE_ID, _PARENT_ID), None),
+    (u'00-%s-%s-01' % (_TRACE_ID, _PARENT_ID[:-1] + u'-'), None),
+    (u'', None),
+])
+def test_traceparent_decode(implementation, traceparent, expected):
+    data = encoding_utils.W3CTraceParent.decode(traceparent)
+
+    if expected is None:
+        assert data is None
+    else:
+        assert data == {u'tr': expected[0], u'id': expected[1]}
+
+
+@pytest.mark.parametrize('tracestate,expected', [
+    (u'33@nr=abc', (u'abc', u'', u'')),
+    (u'dd=1 ,\t33@nr=abc, rojo=2 ,dd=3 \n', (u'abc', u'dd,rojo', u'dd=3,rojo=2')),
+    (u'dd=1,bad,a=b=c,%s=1,x=%s' % (u'k' * 257, u'v' * 257),
+            (u'', u'dd', u'dd=1')),
+    (u',,', (u'', u'', u'')),
+    (u','.join(u'v%d=%d' % (i, i) for i in range(40)),
+            (u'', u','.join(u'v%d' % i for i in range(40)),
+            u','.join(u'v%d=%d' % (i, i) for i in range(31)))),
+    (u','.join(u'v%d=%d' % (i, i) for i in range(100)) + u',33@nr=x',
+            (u'x', u','.join(u'v%d' % i for i in range(100)),
+            u','.join(u'v%d=%d' % (i, i) for i in range(31)))),
+])
+def test_tracestate_split_entry(implementation, tracestate, expected):
+    assert encoding_utils.W3CTraceState.split_entry(
+            tracestate, u'33@nr') == expected
+
+
+@pytest.mark.parametrize('payload', [
+    u'0-0-33-5043-27ddd2d8890283b4-5569065a5b1313bd-1-1.23456-1518469636025',
+    u'0-1-33-5043---0--1518469636025',
+    u'0-2-33-5043-27ddd2d8890283b4-5569065a5b1313bd-x-x-1518469636025-extra',
+    u'0-3-33-5043-27ddd2d8890283b4-5569065a5b1313bd-1-1.2-1518469636025',
+    u'0-0-33-5043-27ddd2d8890283b4-5569065a5b1313bd-1-1.2-x',
+    u'0-0--5043-27ddd2d8890283b4-5569065a5b1313bd-1-1.2-1518469636025',
+    u'0-0-33-5043',
+])
+def test_nr_tracestate_decode(implementation, payload, monkeypatch):
+    data = encoding_utils.NrTraceState.decode(payload, u'33')
+
+    monkeypatch.setattr(encoding_utils, '_native_decode_nr_tracestate', None)
+    expected = encoding_utils.NrTraceState.decode(payload, u'33')
+
+    assert data == expected
+    assert data is None or list(data) == list(expected)
+
+
+@pytest.mark.parametrize('data,tracestate', [
+    ({u'ty': u'App', u'ac': u'33', u'ap': u'5043', u'tr': _TRACE_ID,
+            u'sa': True, u'pr': 1.234567891, u'tx': u'5569065a5b1313bd',
+            u'ti': 1518469636025, u'id': _PARENT_ID}, u''),
+    ({u'ty': u'App', u'ac': u'33', u'ap': u'5043', u'tr': u'ABC',
+            u'sa': False, u'pr': 0.5, u'tx': u'5569065a5b1313bd',
+            u'ti': 1518469636025, u'tk': u'1'}, u'dd=1,rojo=2'),
+    ({u'ac': u'33', u'ap': u'5043', u'tr': _TRACE_ID, u'ti': 1}, u''),
+    ({u'ac': u'\xe9', u'ap': u'5043', u'tr': _TRACE_ID, u'ti': 1}, u''),
+])
+def test_format_trace_context(implementation, data, tracestate, monkeypatch):
+    monkeypatch.setattr(encoding_utils, 'generate_span_id',
+            lambda: u'0123456789abcdef')
+
+    headers = encoding_utils.format_trace_context(data, tracestate)
+
+    monkeypatch.setattr(encoding_utils, '_native_format_trace_context', None)
+
+    assert headers == encoding_utils.format_trace_context(data, tracestate)
+
+
+_ENCODING_KEY = u'd67afc830dab717fd163bfcb0b8b88423e9a1a3b'
+
+
+@pytest.mark.parametrize('text', [
+    u'',
+    u'a',
+    u'ab',
+    u'abc',
+    u'["1#1","1#2"]' * 20,
+    u'caf\xe9 \u2603 \U0001f600',
+    b'latin-1 \xe9\xff',
+])
+@pytest.mark.parametrize('key', [_ENCODING_KEY, bytearray(b'k')])
+def test_obfuscate(implementation, text, key, monkeypatch):
+    obfuscated = encoding_utils.obfuscate(text, key)
+    deobfuscated = encoding_utils.deobfuscate(obfuscated, key)
+
+    monkeypatch.setattr(encoding_utils, '_native_xor_cipher_encrypt_base64',
+            None)
+    monkeypatch.setattr(encoding_utils, '_native_xor_cipher_decrypt_base64',
+            None)
+
+    assert obfuscated == encoding_utils.obfuscate(text, key)
+    assert deobfuscated == encoding_utils.deobfuscate(obfuscated, key)
+
+    if isinstance(text, bytes):
+        text = text.decode('latin-1')
+
+    assert deobfuscated == text
+
+
+@pytest.mark.parametrize('text,expected', [
+    (u'BVRU\n', u'abc'),
+    (b'BV RU', u'abc'),
+    (u'BVRU====', u'abc'),
+    (u'BVR', Exception),
+    (u'BVRU\xe9', ValueError),
+    (u'mQ==', UnicodeDecodeError),
+])
+def test_deobfuscate_fallback(implementation, text, expected):
+    if isinstance(expected, type):
+        with pytest.raises(expected):
+            encoding_utils.deobfuscate(text, _ENCODING_KEY)
+    else:
+        assert encoding_utils.deobfuscate(text, _ENCODING_KEY) == expected
+
+
+@pytest.mark.parametrize('function', ['obfuscate', 'deobfuscate'])
+def test_obfuscate_empty_key(implementation, function):
+    with pytest.raises(ZeroDivisionError):
+        getattr(encoding_utils, function)(u'BVRU', u'')
@@ -16,6 +16,7 @@ import random
 import pytest
 import six
 import tempfile
+import threading
 import time
 
 from newrelic.common.object_wrapper import (transient_function_wrapper,
@@ -30,6 +31,7 @@ from newrelic.core.stats_engine import CustomMetrics, SampledDataSet
 from newrelic.core.transaction_node import TransactionNode
 from newrelic.core.root_node import RootNode
 from newrelic.core.custom_event import create_custom_event
+from newrelic.core.database_utils import sql_statement
 from newrelic.core.error_node import ErrorNode
 from newrelic.core.function_node import FunctionNode
 
@@ -451,6 +453,211 @@ def test_transaction_count(transaction_node):
     assert app._transaction_count == 0
 
 
+def record_in_threads(app, transaction_node, num_threads, num_transactions):
+    def _record():
+        for _ in range(num_transactions):
+            app.record_transaction(transaction_node)
+
+    threads = [threading.Thread(target=_record) for _ in range(num_threads)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+
+@override_generic_settings(settings, {
+    'developer_mode': True,
+    'license_key': '**NOT A LICENSE KEY**',
+    'feature_flag': set(),
+    'transaction_recording.sharded_stats': True,
+    'distributed_tracing.enabled': True,
+    'event_harvest_config.harvest_limits.analytic_event_data': 10,
+    'event_harvest_config.harvest_limits.error_event_data': 1000,
+})
+def test_sharded_stats_merge(transaction_node):
+    app = Application('Python Agent Test (Harvest Loop)')
+    app.connect_to_data_collector(None)
+
+    record_in_threads(app, transaction_node, 4, 5)
+
+    # Transactions are only recorded in the per thread shards
+    assert len(app._stats_shards) == 4
+    assert app._transaction_count == 0
+    assert app._stats_engine.transaction_events.num_seen == 0
+
+    with app._stats_lock:
+        transaction_count = app._merge_stats_shards()
+
+    assert transaction_count == 20
+
+    stats = app._stats_engine
+
+    metrics = {(info['name'], info['scope']): values for info, values in stats.metric_data()}
+    assert metrics['OtherTransaction/Function/main', ''][0] == 20
+
+    # Reservoirs are merged in full, not limited to one event per shard
+    assert stats.transaction_events.num_seen == 20
+    assert stats.transaction_events.num_samples == 10
+    assert stats.error_events.num_seen == 20 * 101
+    assert stats.span_events.num_seen == 20 * 102
+
+    # Error traces are still limited across all shards
+    maximum = stats.settings.agent_limits.errors_per_harvest
+    assert len(stats.error_data()) == maximum
+
+
+@override_generic_settings(settings, {
+    'developer_mode': True,
+    'license_key': '**NOT A LICENSE KEY**',
+    'feature_flag': set(),
+    'transaction_recording.sharded_stats': True,
+    'collect_custom_events': False,
+})
+def test_sharded_stats_harvest(transaction_node):
+    app = Application('Python Agent Test (Harvest Loop)')
+    app.connect_to_data_collector(None)
+
+    record_in_threads(app, transaction_node, 2, 3)
+
+    harvested = []
+
+    @transient_function_wrapper('newrelic.core.stats_engine',
+            'StatsEngine.harvest_snapshot')
+    def _capture_snapshot(wrapped, instance, args, kwargs):
+        snapshot = wrapped(*args, **kwargs)
+        harvested.append(snapshot.transaction_events.num_seen)
+        return snapshot
+
+    _capture_snapshot(app.harvest)()
+
+    # The first snapshot is of the main stats engine
+    assert harvested[0] == 6
+    assert all(shard.stats is None for shard in app._stats_shards)
+
+    # Shards for threads which have exited are dropped once empty
+    app.harvest()
+    assert not app._stats_shards
+
+
+@validate_metric_payload(metrics=[
+    ('Supportability/Python/TransactionRecording/Seen', 4),
+    ('Supportability/Python/TransactionRecording/Dropped', 1),
+])
+@override_generic_settings(settings, {
+    'developer_mode': True,
+    'license_key': '**NOT A LICENSE KEY**',
+    'feature_flag': set(),
+    'transaction_recording.asynchronous': True,
+    'transaction_recording.queue_size': 2,
+    'collect_custom_events': False,
+})
+def test_asynchronous_recording(transaction_node):
+    app = Application('Python Agent Test (Harvest Loop)')
+    app.connect_to_data_collector(None)
+
+    recorder = app._transaction_recorder
+    assert recorder is not None
+
+    # Hold up the recorder thread in recording the first transaction, so
+    # that the queue fills up behind it.
+
+    recording = threading.Event()
+    release = threading.Event()
+
+    @transient_function_wrapper('newrelic.core.stats_engine',
+            'StatsEngine.record_transaction')
+    def _block_recorder(wrapped, instance, args, kwargs):
+        if threading.current_thread().name == 'NR-Transaction-Recorder':
+            recording.set()
+            release.wait(5.0)
+        return wrapped(*args, **kwargs)
+
+    harvested = []
+
+    @transient_function_wrapper('newrelic.core.stats_engine',
+            'StatsEngine.harvest_snapshot')
+    def _capture_snapshot(wrapped, instance, args, kwargs):
+        snapshot = wrapped(*args, **kwargs)
+        harvested.append(snapshot.transaction_events.num_seen)
+        release.set()
+        return snapshot
+
+    @_block_recorder
+    def _test():
+        app.record_transaction(transaction_node)
+        assert recording.wait(5.0)
+
+        for _ in range(3):
+            app.record_transaction(transaction_node)
+
+        # A harvest on shutdown records anything still queued
+
+        _capture_snapshot(app.harvest)(shutdown=True)
+
+    _test()
+
+    assert harvested[0] == 2
+
+    # The recorder is stopped when the agent shuts down
+    assert app._transaction_recorder is None
+
+
+@override_generic_settings(settings, {
+    'developer_mode': True,
+    'license_key': '**NOT A LICENSE KEY**',
+    'feature_flag': set(),
+    'transaction_recording.asynchronous': True,
+    'transaction_recording.queue_size': 0,
+})
+def test_asynchronous_recording_invalid_queue_size(transaction_node):
+    app = Application('Python Agent Test (Harvest Loop)')
+    app.connect_to_data_collector(None)
+
+    # Transactions are recorded synchronously rather than failing.
+
+    assert app._transaction_recorder is None
+
+    app.record_transaction(transaction_node)
+
+    assert app._transaction_count == 1
+
+
+@override_generic_settings(settings, {
+    'developer_mode': True,
+    'license_key': '**NOT A LICENSE KEY**',
+    'feature_flag': set(),
+})
+def test_sql_statement_cache_metrics():
+    app_a = Application('Python Agent Test (Harvest Loop A)')
+    app_a.connect_to_data_collector(None)
+
+    app_b = Application('Python Agent Test (Harvest Loop B)')
+    app_b.connect_to_data_collector(None)
+
+    sql = 'SELECT * FROM test_sql_statement_cache_metrics'
+    dbapi2_module = object()
+
+    for _ in range(3):
+        sql_statement(sql, dbapi2_module)
+
+    # The cache is shared, so each application reports its use since
+    # that application last harvested.
+
+    def _harvest(app, hits, misses):
+        @validate_metric_payload(metrics=[
+            ('Supportability/Python/SQLStatementCache/Hit', hits),
+            ('Supportability/Python/SQLStatementCache/Miss', misses),
+        ])
+        def _test():
+            app.harvest()
+
+        _test()
+
+    _harvest(app_a, 2, 1)
+    _harvest(app_b, 2, 1)
+    _harvest(app_a, None, None)
+
+
 @override_generic_settings(settings, {
     'developer_mode': True,
     'license_key': '**NOT A LICENSE KEY**',
@@ -845,6 +1052,39 @@ def test_infinite_merges():
     assert app._stats_engine.transaction_events.num_seen == 1
 
 
+@override_generic_settings(settings, {
+        'developer_mode': True,
+})
+def test_rollback_keeps_larger_data_sets():
+    app = Application('Python Agent Test (Harvest Loop)')
+    app.connect_to_data_collector(None)
+
+    stats = app._stats_engine
+
+    for i in range(50):
+        stats.span_events.add('span %d' % i, priority=i)
+        stats.record_custom_metric('Custom/Metric/%d' % i, 1)
+
+    snapshot = stats.harvest_snapshot()
+    span_events = snapshot.span_events
+
+    # Data recorded after the snapshot was taken, but before the rollback
+    stats.span_events.add('span 50', priority=50)
+    stats.record_custom_metric('Custom/Metric/0', 1)
+
+    stats.rollback(snapshot)
+
+    # The larger data set from the snapshot is kept rather than being
+    # copied into the smaller data set one sample at a time
+    assert stats.span_events is span_events
+    assert stats.span_events.num_seen == 51
+    assert stats.span_events.num_samples == 51
+
+    metrics = {(info['name'], info['scope']): values for info, values in stats.metric_data()}
+    assert len([name for name, _ in metrics if name.startswith('Custom/')]) == 50
+    assert metrics['Custom/Metric/0', ''][0] == 2
+
+
 @failing_endpoint('analytic_event_data')
 @override_generic_settings(settings, {
         'developer_mode': True,
@@ -342,6 +342,54 @@ def test_http_payload_compression(server, client_cls, method, threshold):
     assert sent_payload == payload
 
 
+@pytest.mark.parametrize("method", ("gzip", "deflate"))
+@pytest.mark.parametrize("threshold", (0, 1000, 10 ** 6))
+def test_encode_payload_compression(server, method, threshold):
+    payload = [[i, u"event", {u"value": i * 1.5}] for i in range(10000)]
+    expected = json.dumps(payload, separators=(",", ":")).encode("utf-8")
+
+    internal_metrics = CustomMetrics()
+
+    with ApplicationModeClient(
+        "localhost",
+        server.port,
+        disable_certificate_validation=True,
+        compression_method=method,
+        compression_threshold=threshold,
+    ) as client:
+        encoded = client.encode_payload(payload)
+        with InternalTraceContext(internal_metrics):
+            status, data = client.send_request(
+                payload=encoded, params={"method": "test"}
+            )
+
+    assert status == 200
+    assert len(encoded) == len(expected)
+
+    # The compressed payload may contain newlines, so is taken from the end.
+
+    sent_payload = data[-len(encoded.body):]
+    assert sent_payload == encoded.body
+
+    internal_metrics = dict(internal_metrics.metrics())
+
+    if len(expected) > threshold:
+        assert encoded.content_encoding == method
+        assert zlib.decompress(sent_payload, 31 if method == "gzip" else 15) == expected
+        assert internal_metrics["Supportability/Python/Collector/ZLIB/Bytes/test"][:2] == [1, len(expected)]
+        assert internal_metrics["Supportability/Python/Collector/ZLIB/Compress/test"][0] == 1
+    else:
+        assert encoded.content_encoding == "Identity"
+        assert sent_payload == expected
+        assert "Supportability/Python/Collector/ZLIB/Bytes/test" not in internal_metrics
+
+
+def test_encode_payload_audit_log():
+    client = HttpClient("localhost", 1000, audit_log_fp=StringIO())
+
+    assert client.encode_payload([1, u"a"]) == b'[1,"a"]'
+
+
 def test_cert_path(server):
     with HttpClient("localhost", server.port, ca_bundle_path=SERVER_CERT) as client:
         status, data = client.send_request()
@@ -0,0 +1,128 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import os
+import re
+import threading
+
+import pytest
+
+from newrelic.api.time_trace import TimeTrace, _TimeTraceBase
+from newrelic.common.encoding_utils import generate_span_id, generate_trace_id
+
+SPAN_ID_RE = re.compile(r"^[0-9a-f]{16}$")
+TRACE_ID_RE = re.compile(r"^[0-9a-f]{32}$")
+
+try:
+    from newrelic.common import _id_generator
+except ImportError:
+    _id_generator = None
+
+GENERATORS = [(generate_span_id, generate_trace_id)]
+
+if _id_generator is not None:
+    GENERATORS.append((_id_generator.span_id, _id_generator.trace_id))
+
+
+@pytest.fixture(params=GENERATORS, ids=lambda g: g[0].__module__)
+def generator(request):
+    return request.param
+
+
+def test_id_format(generator):
+    span_id, trace_id = generator
+
+    for _ in range(1000):
+        value = span_id()
+        assert isinstance(value, str)
+        assert SPAN_ID_RE.match(value)
+        assert value != "0" * 16
+
+        value = trace_id()
+        assert isinstance(value, str)
+        assert TRACE_ID_RE.match(value)
+        assert value != "0" * 32
+
+
+def test_ids_unique(generator):
+    span_id, trace_id = generator
+
+    assert len(set(span_id() for _ in range(10000))) == 10000
+    assert len(set(trace_id() for _ in range(10000))) == 10000
+
+
+def test_ids_unique_across_threads(generator):
+    span_id, _ = generator
+    results = []
+
+    def generate():
+        results.extend(span_id() for _ in range(1000))
+
+    threads = [threading.Thread(target=generate) for _ in range(4)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    assert len(set(results)) == 4000
+
+
+@pytest.mark.skipif(not hasattr(os, "fork"), reason="Requires os.fork")
+def test_ids_differ_after_fork(generator):
+    span_id, _ = generator
+
+    # Make sure the parent has seeded its generator state before forking.
+    span_id()
+
+    read_fd, write_fd = os.pipe()
+    pid = os.fork()
+
+    if pid == 0:
+        try:
+            os.close(read_fd)
+            os.write(write_fd, ",".join(span_id() for _ in range(10)).encode("ascii"))
+        finally:
+            os._exit(0)
+
+    os.close(write_fd)
+    child_ids = os.read(read_fd, 1024).decode("ascii").split(",")
+    os.close(read_fd)
+    os.waitpid(pid, 0)
+
+    parent_ids = [span_id() for _ in range(10)]
+
+    assert len(child_ids) == 10
+    assert not set(child_ids) & set(parent_ids)
+
+
+class PureTimeTrace(_TimeTraceBase):
+    pass
+
+
+@pytest.mark.parametrize("trace_type", [PureTimeTrace, TimeTrace])
+def test_trace_guid_is_lazy(trace_type):
+    trace = trace_type(None)
+
+    assert trace._guid is None
+
+    guid = trace.guid
+
+    assert SPAN_ID_RE.match(guid)
+    assert trace._guid == guid
+    assert trace.guid == guid
+
+    trace.guid = "0123456789abcdef"
+
+    assert trace._guid == "0123456789abcdef"
+    assert trace.guid == "0123456789abcdef"
@@ -24,6 +24,9 @@ INI_FILE_INFINITE_TRACING = b"""
 infinite_tracing.trace_observer_host = y
 infinite_tracing.trace_observer_port = 1234
 infinite_tracing.span_queue_size = 2000
+infinite_tracing.batching = true
+infinite_tracing.span_batch_size = 50
+infinite_tracing.span_batch_latency = 0.5
 """
 
 
@@ -80,3 +83,38 @@ def test_infinite_tracing_span_queue_size(ini, env, expected_size, global_settin
 
     settings = global_settings()
     assert settings.infinite_tracing.span_queue_size == expected_size
+
+
+# Tests for loading Infinite Tracing span batching settings
+# and testing values precedence
+@pytest.mark.parametrize(
+    "ini,env,expected",
+    (
+        (INI_FILE_EMPTY, {}, (False, 100, 0.01)),
+        (
+            INI_FILE_EMPTY,
+            {
+                "NEW_RELIC_INFINITE_TRACING_BATCHING": "true",
+                "NEW_RELIC_INFINITE_TRACING_SPAN_BATCH_SIZE": "200",
+                "NEW_RELIC_INFINITE_TRACING_SPAN_BATCH_LATENCY": "0.1",
+            },
+            (True, 200, 0.1),
+        ),
+        (
+            INI_FILE_INFINITE_TRACING,
+            {
+                "NEW_RELIC_INFINITE_TRACING_BATCHING": "false",
+                "NEW_RELIC_INFINITE_TRACING_SPAN_BATCH_SIZE": "200",
+            },
+            (True, 50, 0.5),
+        ),
+    ),
+)
+def test_infinite_tracing_span_batching(ini, env, expected, global_settings):
+
+    settings = global_settings()
+    assert (
+        settings.infinite_tracing.batching,
+        settings.infinite_tracing.span_batch_size,
+        settings.infinite_tracing.span_batch_latency,
+    ) == expected
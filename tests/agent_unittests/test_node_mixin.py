@@ -0,0 +1,112 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+
+import newrelic.common.streaming_utils as streaming_utils
+import newrelic.core.node_mixin as node_mixin
+
+from newrelic.common.streaming_utils import SpanProtoAttrs
+from newrelic.core.attribute_filter import AttributeFilter
+
+_settings = {
+    'attributes.enabled': True,
+    'span_events.attributes.enabled': True,
+    'attributes.exclude': [u'secret'],
+}
+
+
+class Settings(object):
+    attribute_filter = AttributeFilter(_settings)
+
+
+class Node(node_mixin.GenericNodeMixin):
+    def __init__(self, name, children=(), guid=None):
+        self.name = name
+        self.children = list(children)
+        self.guid = guid
+        self.start_time = 1.2345
+        self.duration = 0.5
+        self.agent_attributes = {u'http.url': name}
+        self.user_attributes = {u'user': name, u'secret': name}
+
+
+class RenamedNode(Node):
+    def span_event(self, *args, **kwargs):
+        attrs = super(RenamedNode, self).span_event(*args, **kwargs)
+        attrs[0]['name'] = u'Renamed/%s' % self.name
+        return attrs
+
+
+def _tree():
+    return Node(u'root', guid=u'0', children=[
+        Node(u'a', guid=u'1', children=[
+            RenamedNode(u'b', guid=u'2'),
+            Node(u'c', guid=u'3', children=[Node(u'd', guid=u'4')]),
+        ]),
+        Node(u'e', guid=u'5'),
+    ])
+
+
+@pytest.mark.parametrize('attr_class', [dict, SpanProtoAttrs])
+@pytest.mark.parametrize('base_attrs', [None, {u'traceId': u'abc'}])
+def test_emit_span_events(attr_class, base_attrs):
+    if attr_class is SpanProtoAttrs and streaming_utils.AttributeValue is None:
+        pytest.skip('protobuf not installed')
+
+    if base_attrs is not None:
+        base_attrs = attr_class(base_attrs)
+
+    events = []
+
+    _tree().emit_span_events(Settings(), events.append,
+            base_attrs=base_attrs, parent_guid=u'parent',
+            attr_class=attr_class)
+
+    assert events == list(_tree().span_events(Settings(),
+            base_attrs=base_attrs, parent_guid=u'parent',
+            attr_class=attr_class))
+
+    for event in events:
+        assert type(event[0]) is attr_class
+
+
+def test_emit_span_events_attributes():
+    events = []
+
+    _tree().emit_span_events(Settings(), events.append,
+            base_attrs={u'traceId': u'abc'}, parent_guid=u'parent')
+
+    assert [(i[u'name'], i[u'guid'], i[u'parentId']) for i, _, _ in
+            events] == [(u'root', u'0', u'parent'), (u'a', u'1', u'0'),
+            (u'Renamed/b', u'2', u'1'), (u'c', u'3', u'1'),
+            (u'd', u'4', u'3'), (u'e', u'5', u'0')]
+
+    intrinsics, user_attributes, agent_attributes = events[0]
+
+    assert list(intrinsics) == [u'traceId', u'type', u'name', u'guid',
+            u'timestamp', u'duration', u'category', u'parentId']
+    assert intrinsics[u'timestamp'] == 1234
+    assert type(intrinsics[u'timestamp']) is type(int(1.2345 * 1000))
+    assert user_attributes == {u'user': u'root'}
+    assert agent_attributes == {u'http.url': u'root'}
+
+
+def test_emit_span_events_no_parent():
+    events = []
+
+    Node(u'root', guid=u'0').emit_span_events(Settings(), events.append)
+
+    assert u'parentId' not in events[0][0]
+
@@ -0,0 +1,206 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import base64
+import json
+import os
+import sys
+import threading
+import zlib
+
+import pytest
+
+from testing_support.fixtures import native_implementation_fixture
+
+import newrelic.core.profile_sessions as profile_sessions
+
+from newrelic.core.config import global_settings
+from newrelic.core.profile_sessions import ProfileSession, SessionState
+
+
+def _outer(started, finished):
+    _inner(started, finished)
+
+
+def _inner(started, finished):
+    started.set()
+    finished.wait()
+
+
+# A function with a file name which has to be escaped when encoded as JSON.
+# Python 2 only accepts a byte string, which is encoded as Latin-1.
+
+if sys.version_info[0] >= 3:
+    _escaped_filename = u'"caf\xe9\t\u2603".py'
+else:
+    _escaped_filename = '"caf\xe9\t".py'
+
+_escaped = {}
+exec(compile('def _escaped_outer(started, finished):\n'
+        '    _outer(started, finished)\n', _escaped_filename, 'exec'),
+        {'_outer': _outer}, _escaped)
+
+
+class FakeTraceCache(object):
+    def __init__(self, threads):
+        self.threads = threads
+
+    def active_threads(self):
+        frames = sys._current_frames()
+        for thread, category in self.threads:
+            yield None, thread.ident, category, frames[thread.ident]
+
+
+implementation = native_implementation_fixture(profile_sessions,
+        '_NativeCallTrees')
+
+
+@pytest.fixture
+def sampled_threads(monkeypatch):
+    finished = threading.Event()
+    threads = []
+
+    for category, target in (('REQUEST', _outer), ('REQUEST', _outer),
+            ('BACKGROUND', _escaped['_escaped_outer']), ('AGENT', _outer)):
+        started = threading.Event()
+        thread = threading.Thread(target=target, args=(started, finished))
+        thread.start()
+        started.wait()
+        threads.append((thread, category))
+
+    monkeypatch.setattr(profile_sessions, 'trace_cache',
+            lambda: FakeTraceCache(threads))
+
+    yield threads
+
+    finished.set()
+
+    for thread, _ in threads:
+        thread.join()
+
+
+def _sample(include_nr_threads, samples=2):
+    session = ProfileSession(0, 0)
+
+    for _ in range(samples):
+        session.sample_call_trees(include_nr_threads)
+
+    session.merge_call_trees()
+
+    call_trees = dict((category, [node.flatten() for node in bucket.values()])
+            for category, bucket in session.call_buckets.items())
+    depths = sorted((node.depth, node.call_count) for node in
+            session._node_list)
+
+    return session.transaction_count, call_trees, depths
+
+
+def _python_sample(include_nr_threads):
+    native = profile_sessions._NativeCallTrees
+    profile_sessions._NativeCallTrees = None
+
+    try:
+        return _sample(include_nr_threads)
+    finally:
+        profile_sessions._NativeCallTrees = native
+
+
+@pytest.mark.parametrize('include_nr_threads', [False, True])
+def test_sample_call_trees(implementation, sampled_threads,
+        include_nr_threads):
+    count, call_trees, depths = _sample(include_nr_threads)
+
+    assert count == (8 if include_nr_threads else 6)
+    assert bool(call_trees['AGENT']) == include_nr_threads
+    assert not call_trees['OTHER']
+
+    # The leaf of the stack trace for the thread is a node for the line
+    # being executed, below the node for the function.
+
+    node = call_trees['BACKGROUND'][0]
+    while node[3]:
+        parent, node = node, node[3][0]
+
+    assert node[0][1].startswith('@') and not parent[0][1].startswith('@')
+    assert node[1] == 2
+
+    if implementation == 'native':
+        assert (count, call_trees, depths) == _python_sample(
+                include_nr_threads)
+
+
+def test_sample_call_trees_agent_frames(implementation, sampled_threads,
+        monkeypatch):
+    # Treat the code of this module as being that of the agent, so that
+    # those frames are dropped, except for the threads of the agent.
+
+    monkeypatch.setattr(profile_sessions, 'AGENT_PACKAGE_DIRECTORY',
+            os.path.dirname(__file__) + os.sep)
+
+    _, call_trees, _ = _sample(True, samples=1)
+
+    def functions(node):
+        names = [node[0][1].split('#')[0]]
+        for child in node[3]:
+            names.extend(functions(child))
+        return names
+
+    assert '_inner' not in functions(call_trees['REQUEST'][0])
+    assert '_inner' in functions(call_trees['AGENT'][0])
+    assert '@wait' in functions(call_trees['REQUEST'][0])
+
+
+def _profile_data():
+    session = ProfileSession(0, 0)
+
+    for include_nr_threads in (False, True, False):
+        session.sample_call_trees(include_nr_threads)
+
+    session.state = SessionState.FINISHED
+
+    profile = session.profile_data()[0]
+
+    return zlib.decompress(base64.standard_b64decode(profile[4])), profile[5]
+
+
+@pytest.mark.parametrize('limit', [10000, 20, 3, 0])
+def test_profile_data(implementation, sampled_threads, monkeypatch, limit):
+    monkeypatch.setattr(global_settings().agent_limits,
+            'thread_profiler_nodes', limit)
+
+    payload, thread_count = _profile_data()
+    call_trees = json.loads(payload.decode('latin-1'))
+
+    assert sorted(call_trees) == ['AGENT', 'BACKGROUND', 'REQUEST']
+    assert thread_count == 3
+
+    def nodes(node):
+        return 1 + sum(nodes(child) for child in node[3])
+
+    count = sum(nodes(node) for bucket in call_trees.values()
+            for node in bucket)
+
+    # Pruning never drops root nodes, but otherwise keeps at most the limit.
+
+    assert count > 20 if limit > 20 else count <= limit + 3
+    assert count >= 3
+
+    if implementation == 'native':
+        native = profile_sessions._NativeCallTrees
+        profile_sessions._NativeCallTrees = None
+
+        try:
+            assert (payload, thread_count) == _profile_data()
+        finally:
+            profile_sessions._NativeCallTrees = native
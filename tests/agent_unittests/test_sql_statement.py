@@ -0,0 +1,122 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+import zlib
+
+import newrelic.core.database_utils as database_utils
+
+from newrelic.core.database_utils import SQLStatement
+
+_native_functions = ('_native_obfuscate_sql', '_native_uncomment_sql',
+        '_native_normalize_sql', '_native_parse_operation',
+        '_native_parse_target')
+
+_statements = [
+    u'SELECT * FROM foobar WHERE x > 1',
+    u'select a, b from "schema"."table" where c = \'d\' -- comment',
+    u'/* leading */ INSERT INTO `t` (a, b) VALUES (1, 2), (3, 4)',
+    u'insert into [ t ] values (%s, %s)',
+    u'UPDATE t SET a = %(a)s, b = :b WHERE c IN (1, 2, 3);',
+    u'DELETE FROM {t} WHERE id = 0x1f # comment',
+    u'CALL pkg.proc(1)',
+    u'call (not_a_target)',
+    u'SELECT 1 /* unterminated',
+    u'rollback',
+    u'  \n\tshow tables  ',
+    u'SELECT "unterminated FROM t',
+    u'SELECT * FROM t WHERE name = \'caf\xe9\' AND \xe9 = 1',
+]
+
+
+class DummyDB(object):
+    quoting_style = 'single'
+
+
+def _properties(sql):
+    statement = SQLStatement(sql, DummyDB())
+    return (statement.uncommented, statement.operation, statement.target,
+            statement.obfuscated, statement.normalized,
+            statement.identifier)
+
+
+@pytest.mark.parametrize('sql', _statements)
+def test_native_sql_statement(sql, monkeypatch):
+    if database_utils._native_uncomment_sql is None:
+        pytest.skip('native SQL parsing not available')
+
+    native = _properties(sql)
+
+    for name in _native_functions:
+        monkeypatch.setattr(database_utils, name, None)
+
+    assert native == _properties(sql)
+
+
+def test_sql_statement_identifier_stable():
+    statement = SQLStatement(u'SELECT * FROM foobar WHERE x = 1', DummyDB())
+
+    assert statement.normalized == u'SELECT*FROM foobar WHERE x=?'
+    assert statement.identifier == zlib.crc32(
+            b'SELECT*FROM foobar WHERE x=?') & 0xffffffff
+
+
+def test_sql_statement_cache_shared():
+    cache = database_utils.SQLStatementCache(10, 1000)
+
+    statement = SQLStatement(u'SELECT 1', DummyDB())
+
+    assert cache.get(u'SELECT 1') is None
+    assert cache.add(u'SELECT 1', statement, 8) is statement
+    assert cache.add(u'SELECT 1', SQLStatement(u'SELECT 1', DummyDB()),
+            8) is statement
+    assert cache.get(u'SELECT 1') is statement
+
+    assert cache.stats() == (1, 1, 0)
+    assert cache.stats() == (1, 1, 0)
+
+
+def test_sql_statement_cache_evicts_by_entries():
+    cache = database_utils.SQLStatementCache(4, 1000)
+
+    for i in range(4):
+        cache.add(i, i, 1)
+
+    # Referenced entries are given a second chance before eviction.
+
+    cache.get(0)
+    cache.add(4, 4, 1)
+
+    assert len(cache) == 4
+    assert cache.get(0) == 0
+    assert cache.get(1) is None
+    assert cache.stats()[2] == 1
+
+
+def test_sql_statement_cache_evicts_by_size():
+    cache = database_utils.SQLStatementCache(10, 10)
+
+    for i in range(5):
+        cache.add(i, i, 4)
+
+    assert len(cache) == 2
+    assert cache._size <= 10
+    assert cache.get(3) == 3 and cache.get(4) == 4
+
+    # Statements larger than the cache are not cached.
+
+    cache.add(5, 5, 11)
+
+    assert cache.get(5) is None
+    assert len(cache) == 2
@@ -0,0 +1,37 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import pytest
+
+from newrelic.core.string_table import StringTable, _StringTable
+
+
+@pytest.mark.parametrize('string_table_type', [StringTable, _StringTable])
+def test_string_table(string_table_type):
+    string_table = string_table_type()
+
+    assert string_table.cache(u'a') == '`0'
+    assert string_table.cache(u'b') == '`1'
+    assert string_table.cache(u'a') == '`0'
+
+    for i in range(3000):
+        assert string_table.cache(u'%d' % i) == '`%d' % (i + 2)
+
+    values = string_table.values()
+
+    assert len(values) == 3002
+    assert values[:3] == [u'a', u'b', u'0']
+    assert values[-1] == u'2999'
+
+    assert string_table_type().cache(u'c') == '`0'
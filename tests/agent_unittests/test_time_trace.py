@@ -0,0 +1,130 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import gc
+import weakref
+
+import pytest
+
+from newrelic.api.time_trace import TimeTrace, TimeTraceBase, _TimeTraceBase
+
+
+class PureTimeTrace(_TimeTraceBase):
+    pass
+
+
+IMPLEMENTATIONS = [PureTimeTrace]
+
+if TimeTraceBase is not _TimeTraceBase:
+    IMPLEMENTATIONS.append(TimeTrace)
+
+
+@pytest.fixture(params=IMPLEMENTATIONS, ids=lambda cls: cls.__name__)
+def trace_type(request):
+    return request.param
+
+
+def test_defaults(trace_type):
+    trace = trace_type()
+
+    assert trace.parent is None
+    assert trace.root is None
+    assert trace.thread_id is None
+    assert trace.child_count == 0
+    assert trace.children == []
+    assert trace.start_time == trace.end_time == 0.0
+    assert trace.duration == trace.exclusive == 0.0
+    assert trace.min_child_start_time == float("inf")
+    assert trace.exc_data == (None, None, None)
+    assert trace.agent_attributes == {}
+    assert trace.user_attributes == {}
+
+    for flag in ("activated", "exited", "is_async", "has_async_children", "should_record_segment_params"):
+        assert getattr(trace, flag) is False
+
+
+def test_guid(trace_type):
+    trace = trace_type()
+
+    guid = trace.guid
+    assert len(guid) == 16
+    int(guid, 16)
+    assert trace.guid is guid
+    assert trace_type().guid != guid
+
+    trace.guid = "0123456789abcdef"
+    assert trace.guid == "0123456789abcdef"
+
+
+def test_attributes_are_per_instance(trace_type):
+    first = trace_type()
+    second = trace_type()
+
+    first.agent_attributes["key"] = "value"
+    first.user_attributes["key"] = "value"
+    first.children.append("node")
+
+    assert second.agent_attributes == {}
+    assert second.user_attributes == {}
+    assert second.children == []
+    assert first.children == ["node"]
+
+
+def test_child_count(trace_type):
+    trace = trace_type()
+
+    trace.increment_child_count()
+    assert trace.has_outstanding_children()
+    assert not trace.has_async_children
+
+    trace.increment_child_count()
+    assert trace.has_async_children
+
+    trace.children.extend(["first", "second"])
+    assert not trace.has_outstanding_children()
+
+    assert not trace._ready_to_complete()
+    trace.exited = True
+    assert trace._ready_to_complete()
+
+
+def test_enter_without_transaction(trace_type):
+    trace = trace_type()
+
+    with trace as result:
+        assert result is trace
+
+    assert not trace.activated
+    assert trace.parent is None
+
+
+def test_subclass_attributes_and_weakref(trace_type):
+    class Trace(trace_type):
+        def __init__(self, name, parent=None):
+            super(Trace, self).__init__(parent)
+            self.name = name
+
+    parent = Trace("parent")
+    trace = Trace("child", parent)
+
+    assert trace.name == "child"
+    assert trace.parent is parent
+
+    ref = weakref.ref(trace)
+    parent.children.append(trace)
+    trace.root = parent
+    del parent, trace
+    gc.collect()
+
+    assert ref() is None
@@ -0,0 +1,110 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import gc
+import threading
+
+import pytest
+
+from newrelic.core.trace_cache import TraceCache, TraceCacheBase, _TraceCacheBase
+
+
+class PureTraceCache(_TraceCacheBase):
+    pass
+
+
+IMPLEMENTATIONS = [PureTraceCache]
+
+if TraceCacheBase is not _TraceCacheBase:
+    IMPLEMENTATIONS.append(TraceCache)
+
+
+class FakeTrace(object):
+    def __init__(self, thread_id, parent=None, transaction=None):
+        self.thread_id = thread_id
+        self.parent = parent
+        self.transaction = transaction
+
+
+@pytest.fixture(params=IMPLEMENTATIONS, ids=lambda cls: cls.__name__)
+def cache(request):
+    return request.param()
+
+
+def test_current_trace(cache):
+    thread_id = cache.current_thread_id()
+    assert cache.current_trace() is None
+    assert cache.current_transaction() is None
+
+    trace = FakeTrace(thread_id, transaction="transaction")
+    cache._cache[thread_id] = trace
+
+    assert cache.current_trace() is trace
+    assert cache.current_transaction() == "transaction"
+
+
+def test_pop_current_restores_parent(cache):
+    thread_id = cache.current_thread_id()
+
+    parent = FakeTrace(thread_id)
+    child = FakeTrace(thread_id, parent=parent)
+    child._task = None
+
+    cache._cache[thread_id] = child
+    cache.pop_current(child)
+
+    assert cache.current_trace() is parent
+    assert not hasattr(child, "_task")
+
+
+def test_values_are_weak(cache):
+    trace = FakeTrace(1)
+    cache._cache[1] = trace
+
+    assert 1 in cache._cache
+    assert len(cache._cache) == 1
+
+    del trace
+    gc.collect()
+
+    assert 1 not in cache._cache
+    assert not cache._cache
+    assert cache._cache.get(1) is None
+
+
+def test_mapping_operations(cache):
+    traces = [FakeTrace(i) for i in range(100)]
+
+    for i, trace in enumerate(traces):
+        cache._cache[i] = trace
+
+    assert len(cache._cache) == 100
+    assert sorted(k for k, _ in cache._cache.items()) == list(range(100))
+    assert set(map(id, cache._cache.values())) == set(map(id, traces))
+
+    assert cache._cache.pop(50) is traces[50]
+    assert cache._cache.pop(50, None) is None
+    with pytest.raises(KeyError):
+        cache._cache.pop(50)
+
+    del cache._cache[51]
+    with pytest.raises(KeyError):
+        cache._cache[51]
+
+    assert len(cache._cache) == 98
+
+
+def test_is_thread(cache):
+    assert cache.is_thread(threading.current_thread().ident)
+    assert not cache.is_thread(id(object()))
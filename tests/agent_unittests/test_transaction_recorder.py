@@ -0,0 +1,178 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import threading
+import time
+
+import pytest
+
+import newrelic.core.transaction_recorder as transaction_recorder
+from newrelic.core.transaction_recorder import (
+    RecordingQueue,
+    TransactionRecorder,
+    _RecordingQueue,
+)
+
+IMPLEMENTATIONS = [_RecordingQueue]
+
+if RecordingQueue is not _RecordingQueue:
+    IMPLEMENTATIONS.append(RecordingQueue)
+
+
+@pytest.fixture(params=IMPLEMENTATIONS, ids=lambda cls: cls.__module__)
+def queue_type(request):
+    return request.param
+
+
+def test_queue_order(queue_type):
+    queue = queue_type(10)
+
+    for i in range(5):
+        assert queue.put(i)
+
+    assert len(queue) == 5
+    assert [queue.get(timeout=0) for _ in range(5)] == list(range(5))
+    assert queue.get(timeout=0) is None
+    assert queue.stats() == (5, 0)
+    assert queue.stats() == (0, 0)
+
+
+@pytest.mark.parametrize("drop_oldest,expected", ((False, [0, 1, 2]), (True, [2, 3, 4])))
+def test_queue_drop_policy(queue_type, drop_oldest, expected):
+    queue = queue_type(3, drop_oldest)
+
+    results = [queue.put(i) for i in range(5)]
+
+    assert results == [True, True, True, drop_oldest, drop_oldest]
+    assert [queue.get(timeout=0) for _ in range(3)] == expected
+    assert queue.stats() == (5, 2)
+
+
+def test_queue_get_timeout(queue_type):
+    queue = queue_type(3)
+
+    start = time.time()
+    assert queue.get(timeout=0.05) is None
+    assert time.time() - start >= 0.04
+
+
+def test_queue_get_wakes_on_put(queue_type):
+    queue = queue_type(3)
+    results = []
+
+    thread = threading.Thread(target=lambda: results.append(queue.get(timeout=5.0)))
+    thread.start()
+
+    time.sleep(0.05)
+    queue.put("item")
+
+    thread.join(5.0)
+    assert results == ["item"]
+
+
+def test_queue_shutdown(queue_type):
+    queue = queue_type(3)
+    queue.put("item")
+    queue.shutdown()
+
+    # Items queued before the shutdown can still be drained
+    assert queue.put("other") is False
+    assert queue.get() == "item"
+    assert queue.get() is None
+
+
+def test_recorder_records_in_background():
+    recorded = []
+    recorded_event = threading.Event()
+
+    def record(data):
+        recorded.append((data, threading.current_thread().name))
+        if len(recorded) == 3:
+            recorded_event.set()
+
+    recorder = TransactionRecorder(record, 10, "drop_newest")
+
+    for i in range(3):
+        assert recorder.put(i)
+
+    assert recorded_event.wait(5.0)
+    assert recorded == [(i, "NR-Transaction-Recorder") for i in range(3)]
+    assert recorder.stats() == (3, 0)
+
+    recorder.shutdown()
+    assert recorder.put(3) is False
+
+
+def test_recorder_flush():
+    recorded = []
+    blocked = threading.Event()
+    release = threading.Event()
+
+    def record(data):
+        if data == "first":
+            blocked.set()
+            release.wait(5.0)
+        recorded.append(data)
+
+    recorder = TransactionRecorder(record, 10, "drop_newest")
+
+    recorder.put("first")
+    assert blocked.wait(5.0)
+
+    # The recorder thread is busy, so flush records the rest here
+    recorder.put("second")
+    recorder.put("third")
+    recorder.flush()
+
+    assert recorded == ["second", "third"]
+
+    release.set()
+    recorder.shutdown()
+    assert recorded == ["second", "third", "first"]
+
+
+def test_recorder_flush_when_idle(queue_type, monkeypatch):
+    monkeypatch.setattr(transaction_recorder, "RecordingQueue", queue_type)
+
+    recorded = []
+    recorded_event = threading.Event()
+
+    def record(data):
+        recorded.append(data)
+        recorded_event.set()
+
+    recorder = TransactionRecorder(record, 10, "drop_newest")
+
+    recorder.put("first")
+    assert recorded_event.wait(5.0)
+    recorded_event.clear()
+
+    # Give the recorder thread time to wait for the next transaction. A
+    # flush finding nothing queued must not stop it from being woken.
+
+    time.sleep(0.05)
+    recorder.flush()
+
+    recorder.put("second")
+    assert recorded_event.wait(5.0)
+    assert recorded == ["first", "second"]
+
+    start = time.time()
+    recorder.shutdown()
+    assert time.time() - start < 0.5
+
+
+def test_recorder_unknown_drop_policy():
+    recorder = TransactionRecorder(lambda data: None, 10, "unknown")
+    assert recorder._drop_oldest is False
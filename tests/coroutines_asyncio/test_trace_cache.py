@@ -0,0 +1,107 @@
+# Copyright 2010 New Relic, Inc.
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+import asyncio
+
+import pytest
+
+from newrelic.core.trace_cache import ContextVarTraceCache, contextvars
+
+
+class FakeRoot(object):
+    def __init__(self, thread_id):
+        self.thread_id = thread_id
+        self.parent = None
+        self.exited = False
+
+    @property
+    def root(self):
+        return self
+
+
+class FakeChild(object):
+    def __init__(self, thread_id, parent):
+        self.thread_id = thread_id
+        self.parent = parent
+        self.exited = False
+
+    @property
+    def root(self):
+        return self.parent.root
+
+
+@pytest.fixture
+def cache():
+    if contextvars is None:
+        pytest.skip("contextvars is not available")
+
+    return ContextVarTraceCache()
+
+
+def test_contextvars_task_traces_are_isolated(cache, event_loop):
+    seen = {}
+
+    async def task(name, root):
+        child = FakeChild(cache.current_thread_id(), root)
+        cache.save_trace(child)
+        await asyncio.sleep(0)
+        seen[name] = cache.current_trace() is child
+        assert child in cache.active_traces()
+        cache.pop_current(child)
+        seen[name + "_popped"] = cache.current_trace() is root
+
+    async def main():
+        root = FakeRoot(cache.current_thread_id())
+        cache.save_trace(root)
+        await asyncio.gather(task("a", root), task("b", root))
+        assert cache.current_trace() is root
+
+    event_loop.run_until_complete(main())
+
+    assert all(seen.values()) and len(seen) == 4
+    assert cache.current_trace() is None
+
+
+def test_contextvars_pop_from_other_context(cache, event_loop):
+    result = {}
+
+    async def main():
+        root = FakeRoot(cache.current_thread_id())
+        cache.save_trace(root)
+        started = asyncio.Event()
+        resume = asyncio.Event()
+
+        async def task():
+            child = FakeChild(cache.current_thread_id(), root)
+            cache.save_trace(child)
+            result["child"] = child
+            started.set()
+            await resume.wait()
+            result["current"] = cache.current_trace()
+
+        future = asyncio.ensure_future(task())
+        await started.wait()
+
+        # Complete the child from the parent task.
+        cache.pop_current(result["child"])
+        assert cache.current_trace() is root
+
+        resume.set()
+        await future
+
+        result["root"] = root
+
+    event_loop.run_until_complete(main())
+
+    assert result["current"] is result["root"]
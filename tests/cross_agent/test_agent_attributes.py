@@ -112,3 +112,19 @@ def test_attribute_filter_rule_equality(testname, rule1, rule2):
     second = af.AttributeFilterRule(*rule2)
 
     assert first == second
+
+def test_attribute_filter_cache_bounded():
+    settings = _default_settings()
+    settings['attributes.exclude'] = ['request.*']
+
+    attribute_filter = af.AttributeFilter(settings)
+    attribute_filter.maximum_entries = 10
+
+    for i in range(100):
+        name = 'request.parameters.%d' % i
+        assert attribute_filter.apply(name, af.DST_ALL) == af.DST_NONE
+        assert attribute_filter.apply(name, af.DST_ALL) == af.DST_NONE
+
+    assert len(attribute_filter.cache) <= 10
+    assert attribute_filter.stats() == (100, 100)
+    assert attribute_filter.stats() == (0, 0)
@@ -60,9 +60,26 @@ def test_rules_engine(test_group):
 
         result, ignored = rules_engine.normalize(input_str)
 
+        # A second normalization of the same input is served from the
+        # cache and must give the same result.
+
+        assert rules_engine.normalize(input_str) == (result, ignored)
+
         # When a transaction is to be ignored, the test fixture expects that
         # "expected" is None.
         if ignored:
             assert expected == ''
         else:
             assert result == expected
+
+
+def test_rules_engine_cache_bounded():
+    rules = _prepare_rules([{'match_expression': '[0-9]+',
+            'replacement': '*', 'eval_order': 0, 'replace_all': True,
+            'ignore': False}])
+    rules_engine = RulesEngine(rules, maximum_entries=10)
+
+    for i in range(100):
+        assert rules_engine.normalize('/user/%d' % i) == ('/user/*', False)
+
+    assert len(rules_engine._RulesEngine__cache) <= 10
@@ -16,6 +16,10 @@ import json
 import os
 import pytest
 
+from testing_support.fixtures import native_implementation_fixture
+
+import newrelic.core.database_utils
+
 from newrelic.core.database_utils import SQLStatement
 
 
@@ -58,8 +62,13 @@ class DummyDB(object):
         self.quoting_style = quoting_style
 
 
+obfuscator = native_implementation_fixture(newrelic.core.database_utils,
+        '_native_obfuscate_sql')
+
+
 @pytest.mark.parametrize(_parameters, load_tests())
-def test_sql_obfuscation(obfuscated, dialects, sql, pathological):
+def test_sql_obfuscation(obfuscator, obfuscated, dialects, sql,
+        pathological):
 
     if pathological:
         pytest.skip()
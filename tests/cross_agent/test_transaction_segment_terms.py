@@ -83,3 +83,19 @@ def test_transaction_freeze_path_segments(testname, transaction_segment_terms,
                 transaction.background_task = (ttype == 'OtherTransaction')
 
             assert transaction.path == test['expected']
+
+@pytest.mark.parametrize('txn_name,expected', [
+    ('WebTransaction/Uri/a/b/c', 'WebTransaction/Uri/a/*'),
+    ('WebTransaction/Uri/x/*/*y/b', 'WebTransaction/Uri/*y/*'),
+    ('WebTransaction/Uri/a/b\n', 'WebTransaction/Uri/a/*'),
+    ('WebTransaction/Uri/a/b\nc', 'WebTransaction/Uri/a/b\nc'),
+    ('WebTransaction/Uri/', 'WebTransaction/Uri/'),
+])
+def test_transaction_segments_regex_compatible(txn_name, expected):
+    # Names which the regular expression used for matching and
+    # collapsing segments treats specially must still give the same
+    # result as it does.
+
+    engine = SegmentCollapseEngine([{'prefix': 'WebTransaction/Uri',
+            'terms': ['a', '*y']}])
+    assert engine.normalize(txn_name)[0] == expected
@@ -296,6 +296,34 @@ def collector_available_fixture(request):
     assert active
 
 
+def native_implementation_fixture(module, *names, **replacements):
+    """Returns a fixture which runs a test against both the native and the
+    pure Python implementations of a module, returning which is in use. For
+    the pure Python implementation, each of the named attributes of the
+    module is set to None, and each attribute given as a keyword argument is
+    set to the value given. The native implementation is skipped where the C
+    extension is not available.
+
+    """
+
+    @pytest.fixture(params=["native", "python"])
+    def _native_implementation_fixture(request, monkeypatch):
+        if request.param == "native":
+            if any(getattr(module, name) is None for name in names) or any(
+                getattr(module, name) is value for name, value in replacements.items()
+            ):
+                pytest.skip("native implementation not available")
+        else:
+            for name in names:
+                monkeypatch.setattr(module, name, None)
+            for name, value in replacements.items():
+                monkeypatch.setattr(module, name, value)
+
+        return request.param
+
+    return _native_implementation_fixture
+
+
 def raise_background_exceptions(timeout=5.0):
     @function_wrapper
     def _raise_background_exceptions(wrapped, instance, args, kwargs):